@@ -0,0 +1,211 @@
+#include "app_cuckoo.h"
+
+#include "string.h"
+
+// Сколько раз перекладывать отпечатки между корзинами, прежде чем признать фильтр переполненным
+#define CF_MAX_KICKS 500
+// Доля заполнения, на которую рассчитывается размер: при большей вставка часто не находит места
+#define CF_LOAD_PERCENT 95
+
+struct cf_filter_t {
+  apr_uint64_t mask;            // число корзин - 1, число корзин - степень 2
+  apr_uint64_t count;
+  apr_uint64_t rnd;             // состояние генератора для выбора вытесняемого отпечатка
+  // Отпечаток, которому не нашлось места при последней неудачной вставке. Пока он здесь,
+  // новые строки не добавляются, но поиск и удаление учитывают его, поэтому ответ "нет" остается точным
+  apr_uint64_t victim_index;
+  apr_uint16_t victim_fp;       // 0 - места хватило всем
+  apr_uint16_t pad[3];
+};
+
+// Корзины лежат сразу за заголовком
+#define BUCKETS(cf) ((apr_uint16_t *)((cf) + 1))
+#define BUCKETS_CONST(cf) ((const apr_uint16_t *)((cf) + 1))
+
+// FNV-1a с перемешиванием финализатором MurmurHash3
+static apr_uint64_t cf_hash(const char *key, apr_size_t len)
+{
+  apr_uint64_t h = 0xcbf29ce484222325ull;
+  for (apr_size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)key[i]) * 0x100000001b3ull;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+// Отпечаток 0 обозначает пустое место
+static apr_uint16_t cf_fingerprint(apr_uint64_t h)
+{
+  apr_uint16_t fp = (apr_uint16_t)(h >> 48);
+  return fp ? fp : 1;
+}
+
+// Вторая корзина вычисляется по первой и отпечатку, поэтому для перекладываемого отпечатка
+// ее можно найти, не зная исходной строки. Операция симметрична: alt(alt(i)) == i
+static apr_uint64_t cf_alt_index(const cf_filter_t *cf, apr_uint64_t index, apr_uint16_t fp)
+{
+  return (index ^ (fp * 0x5bd1e995ull)) & cf->mask;
+}
+
+apr_size_t cf_size(apr_size_t capacity)
+{
+  apr_uint64_t buckets = 1;
+  while (buckets * CF_BUCKET_SIZE * CF_LOAD_PERCENT < (apr_uint64_t)capacity * 100)
+    buckets *= 2;
+
+  return sizeof(cf_filter_t) + buckets * CF_BUCKET_SIZE * sizeof(apr_uint16_t);
+}
+
+cf_filter_t *cf_init(void *mem, apr_size_t capacity)
+{
+  apr_size_t size = cf_size(capacity);
+  cf_filter_t *cf = (cf_filter_t *)mem;
+  cf->mask = (size - sizeof(cf_filter_t)) / (CF_BUCKET_SIZE * sizeof(apr_uint16_t)) - 1;
+  cf_clear(cf);
+
+  return cf;
+}
+
+void cf_clear(cf_filter_t *cf)
+{
+  memset(BUCKETS(cf), 0, (cf->mask + 1) * CF_BUCKET_SIZE * sizeof(apr_uint16_t));
+  cf->count = 0;
+  cf->rnd = 0x9e3779b97f4a7c15ull;
+  cf->victim_index = 0;
+  cf->victim_fp = 0;
+}
+
+static int bucket_add(apr_uint16_t *bucket, apr_uint16_t fp)
+{
+  for (int i = 0; i < CF_BUCKET_SIZE; i++)
+    if (!bucket[i])
+      {
+      bucket[i] = fp;
+      return true;
+      }
+  return false;
+}
+
+static int bucket_has(const apr_uint16_t *bucket, apr_uint16_t fp)
+{
+  for (int i = 0; i < CF_BUCKET_SIZE; i++)
+    if (bucket[i] == fp)
+      return true;
+  return false;
+}
+
+static int bucket_del(apr_uint16_t *bucket, apr_uint16_t fp)
+{
+  for (int i = 0; i < CF_BUCKET_SIZE; i++)
+    if (bucket[i] == fp)
+      {
+      bucket[i] = 0;
+      return true;
+      }
+  return false;
+}
+
+int cf_insert(cf_filter_t *cf, const char *key, apr_size_t len)
+{
+  if (cf->victim_fp)
+    return false;
+
+  apr_uint64_t h = cf_hash(key, len);
+  apr_uint16_t fp = cf_fingerprint(h);
+  apr_uint64_t i1 = (h >> 16) & cf->mask;
+  apr_uint64_t i2 = cf_alt_index(cf, i1, fp);
+  apr_uint16_t *buckets = BUCKETS(cf);
+
+  cf->count++;
+  if (bucket_add(buckets + i1 * CF_BUCKET_SIZE, fp) || bucket_add(buckets + i2 * CF_BUCKET_SIZE, fp))
+    return true;
+
+  // Обе корзины заняты: вытесняем случайный отпечаток в его другую корзину, и так далее
+  apr_uint64_t index = (cf->rnd & 1) ? i1 : i2;
+  for (int kick = 0; kick < CF_MAX_KICKS; kick++)
+    {
+    cf->rnd ^= cf->rnd << 13;
+    cf->rnd ^= cf->rnd >> 7;
+    cf->rnd ^= cf->rnd << 17;
+
+    apr_uint16_t *slot = buckets + index * CF_BUCKET_SIZE + (cf->rnd >> 32) % CF_BUCKET_SIZE;
+    apr_uint16_t evicted = *slot;
+    *slot = fp;
+    fp = evicted;
+
+    index = cf_alt_index(cf, index, fp);
+    if (bucket_add(buckets + index * CF_BUCKET_SIZE, fp))
+      return true;
+    }
+
+  // Последний вытесненный отпечаток принадлежит уже добавленной строке: сохраняем его отдельно.
+  // Новая строка добавлена, но следующие вставки будут отклоняться
+  cf->victim_index = index;
+  cf->victim_fp = fp;
+  return true;
+}
+
+int cf_contains(const cf_filter_t *cf, const char *key, apr_size_t len)
+{
+  apr_uint64_t h = cf_hash(key, len);
+  apr_uint16_t fp = cf_fingerprint(h);
+  apr_uint64_t i1 = (h >> 16) & cf->mask;
+  apr_uint64_t i2 = cf_alt_index(cf, i1, fp);
+  const apr_uint16_t *buckets = BUCKETS_CONST(cf);
+
+  if (cf->victim_fp == fp && (cf->victim_index == i1 || cf->victim_index == i2))
+    return true;
+  return bucket_has(buckets + i1 * CF_BUCKET_SIZE, fp) || bucket_has(buckets + i2 * CF_BUCKET_SIZE, fp);
+}
+
+int cf_remove(cf_filter_t *cf, const char *key, apr_size_t len)
+{
+  apr_uint64_t h = cf_hash(key, len);
+  apr_uint16_t fp = cf_fingerprint(h);
+  apr_uint64_t i1 = (h >> 16) & cf->mask;
+  apr_uint64_t i2 = cf_alt_index(cf, i1, fp);
+  apr_uint16_t *buckets = BUCKETS(cf);
+
+  if (cf->victim_fp == fp && (cf->victim_index == i1 || cf->victim_index == i2))
+    cf->victim_fp = 0;
+  else if (!bucket_del(buckets + i1 * CF_BUCKET_SIZE, fp) && !bucket_del(buckets + i2 * CF_BUCKET_SIZE, fp))
+    return false;
+  cf->count--;
+
+  // Освободилось место: пробуем вернуть отложенный отпечаток в одну из его корзин
+  if (cf->victim_fp)
+    {
+    apr_uint64_t index = cf->victim_index;
+    if (bucket_add(buckets + index * CF_BUCKET_SIZE, cf->victim_fp) ||
+        bucket_add(buckets + cf_alt_index(cf, index, cf->victim_fp) * CF_BUCKET_SIZE, cf->victim_fp))
+      cf->victim_fp = 0;
+    }
+
+  return true;
+}
+
+apr_size_t cf_count(const cf_filter_t *cf)
+{
+  return cf->count;
+}
+
+apr_size_t cf_slots(const cf_filter_t *cf)
+{
+  return (cf->mask + 1) * CF_BUCKET_SIZE;
+}
+
+double cf_fp_rate(const cf_filter_t *cf)
+{
+  // Строка проверяется в 2 корзинах по CF_BUCKET_SIZE мест; каждое занятое место совпадает
+  // со случайным отпечатком с вероятностью 1 / 65535
+  double load = (double)cf->count / cf_slots(cf);
+  double per_slot = 1.0 / 65535;
+  double miss = 1.0;
+  for (int i = 0; i < 2 * CF_BUCKET_SIZE; i++)
+    miss *= 1.0 - per_slot * load;
+  return 1.0 - miss;
+}
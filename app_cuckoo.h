@@ -0,0 +1,43 @@
+#pragma once
+
+#include "apr.h"
+
+// Фильтр кукушки: компактное множество строк (логинов) с возможностью удаления.
+// Каждая строка хранится 16-битным отпечатком в одной из двух корзин по 4 отпечатка,
+// поэтому ответ "нет" всегда точен, а "есть" ошибочен с вероятностью около 8 / 65536 при полном заполнении.
+// Фильтр размещается в памяти, выделенной вызывающим (например, в разделяемой памяти), и не содержит
+// указателей, поэтому одинаково работает в любом процессе, отобразившем эту память.
+// Изменения не защищены от одновременного доступа: вызывающий должен сам исключить параллельную запись.
+
+#define CF_BUCKET_SIZE 4
+
+typedef struct cf_filter_t cf_filter_t;
+
+// Сколько байт памяти нужно фильтру не менее чем на capacity строк
+apr_size_t cf_size(apr_size_t capacity);
+
+// Размечает пустой фильтр в памяти mem размером cf_size(capacity) байт
+cf_filter_t *cf_init(void *mem, apr_size_t capacity);
+
+// Удаляет все строки
+void cf_clear(cf_filter_t *cf);
+
+// Добавляет строку. Одинаковые строки хранятся столько раз, сколько добавлены.
+// Возвращает false, если фильтр переполнен; строка при этом не добавляется
+int cf_insert(cf_filter_t *cf, const char *key, apr_size_t len);
+
+// true - строка, возможно, добавлена; false - точно не добавлена
+int cf_contains(const cf_filter_t *cf, const char *key, apr_size_t len);
+
+// Удаляет одну копию ранее добавленной строки. Удаление строки, которая не добавлялась,
+// может удалить отпечаток другой строки, поэтому вызывающий должен удалять только добавленные строки
+int cf_remove(cf_filter_t *cf, const char *key, apr_size_t len);
+
+// Количество хранимых строк
+apr_size_t cf_count(const cf_filter_t *cf);
+
+// Число мест для отпечатков
+apr_size_t cf_slots(const cf_filter_t *cf);
+
+// Оценка вероятности ложного ответа "есть" при текущем заполнении
+double cf_fp_rate(const cf_filter_t *cf);
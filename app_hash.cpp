@@ -0,0 +1,424 @@
+#include "app_hash.h"
+
+#include "apr_thread_proc.h"
+#include "string.h"
+#include "openssl/evp.h"
+#include "openssl/sha.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "immintrin.h"
+#include "cpuid.h"
+#define HASH_X86 1
+#endif
+
+#if defined(__aarch64__)
+#include "sys/auxv.h"
+#include "asm/hwcap.h"
+#endif
+
+// Алгоритм, полученный у провайдера при запуске, и ключ контекстов EVP потоков. NULL - hash_init не вызывался
+static EVP_MD *hash_md = NULL;
+static apr_threadkey_t *hash_key = NULL;
+
+static apr_status_t hash_cleanup(void *data)
+{
+  EVP_MD_free(hash_md);
+  hash_md = NULL;
+  hash_key = NULL;
+
+  return APR_SUCCESS;
+}
+
+// Освобождает контекст потока при его завершении
+static void hash_ctx_free(void *data)
+{
+  EVP_MD_CTX_free((EVP_MD_CTX *)data);
+}
+
+apr_status_t hash_init(apr_pool_t *pool)
+{
+  if (hash_md)
+    return APR_SUCCESS;
+
+  hash_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+  if (!hash_md)
+    return APR_EGENERAL;
+
+  apr_status_t rv = apr_threadkey_private_create(&hash_key, hash_ctx_free, pool);
+  if (rv != APR_SUCCESS)
+    {
+    EVP_MD_free(hash_md);
+    hash_md = NULL;
+    hash_key = NULL;
+    return rv;
+    }
+  apr_pool_cleanup_register(pool, NULL, hash_cleanup, apr_pool_cleanup_null);
+
+  return APR_SUCCESS;
+}
+
+// Контекст EVP этого потока, создается при первом хешировании в потоке
+static EVP_MD_CTX *hash_ctx(void)
+{
+  if (!hash_key)
+    return NULL;
+
+  void *ctx = NULL;
+  apr_threadkey_private_get(&ctx, hash_key);
+  if (ctx)
+    return (EVP_MD_CTX *)ctx;
+
+  ctx = EVP_MD_CTX_new();
+  if (ctx && apr_threadkey_private_set(ctx, hash_key) != APR_SUCCESS)
+    {
+    EVP_MD_CTX_free((EVP_MD_CTX *)ctx);
+    ctx = NULL;
+    }
+
+  return (EVP_MD_CTX *)ctx;
+}
+
+void hash_sha256(const void *data, apr_size_t len, unsigned char *digest)
+{
+  EVP_MD_CTX *ctx = hash_ctx();
+  unsigned int n;
+  if (!ctx || !EVP_DigestInit_ex(ctx, hash_md, NULL) || !EVP_DigestUpdate(ctx, data, len) || !EVP_DigestFinal_ex(ctx, digest, &n))
+    SHA256((const unsigned char *)data, len, digest);
+}
+
+void hash_sha256_prefixed(const void *prefix, apr_size_t prefix_len, const void *data, apr_size_t len, unsigned char *digest)
+{
+  EVP_MD_CTX *ctx = hash_ctx();
+  unsigned int n;
+  if (ctx && EVP_DigestInit_ex(ctx, hash_md, NULL) && EVP_DigestUpdate(ctx, prefix, prefix_len) && EVP_DigestUpdate(ctx, data, len) &&
+      EVP_DigestFinal_ex(ctx, digest, &n))
+    return;
+
+  // Без контекста потока - временный контекст с алгоритмом по умолчанию
+  ctx = EVP_MD_CTX_new();
+  if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) || !EVP_DigestUpdate(ctx, prefix, prefix_len) ||
+      !EVP_DigestUpdate(ctx, data, len) || !EVP_DigestFinal_ex(ctx, digest, &n))
+    memset(digest, 0, HASH_LEN);
+  EVP_MD_CTX_free(ctx);
+}
+
+static void hash_many_evp(const hash_input_t *inputs, apr_size_t count, unsigned char *digests)
+{
+  for (apr_size_t i = 0; i < count; i++)
+    hash_sha256(inputs[i].data, inputs[i].len, digests + i * HASH_LEN);
+}
+
+#ifdef HASH_X86
+
+static const apr_uint32_t K256[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const apr_uint32_t H256[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define MB_MAX_LANES 16
+
+// Сообщение одной дорожки: полные блоки читаются прямо из данных, последние 1-2 блока с дополнением - из tail
+typedef struct {
+  const unsigned char *data;
+  apr_size_t full;              // число полных блоков в данных
+  apr_size_t blocks;            // всего блоков вместе с дополнением
+  unsigned char tail[128];
+} mb_lane_t;
+
+static void mb_lane_init(mb_lane_t *lane, const hash_input_t *input)
+{
+  lane->data = (const unsigned char *)input->data;
+  lane->full = input->len / 64;
+
+  apr_size_t rest = input->len % 64;
+  memset(lane->tail, 0, sizeof(lane->tail));
+  if (rest)
+    memcpy(lane->tail, lane->data + lane->full * 64, rest);
+  lane->tail[rest] = 0x80;
+
+  // Длина сообщения в битах в конце последнего блока, старшим байтом вперед
+  apr_size_t tail_blocks = rest + 9 <= 64 ? 1 : 2;
+  apr_uint64_t bits = (apr_uint64_t)input->len * 8;
+  for (int i = 0; i < 8; i++)
+    lane->tail[tail_blocks * 64 - 1 - i] = bits >> (8 * i);
+
+  lane->blocks = lane->full + tail_blocks;
+}
+
+// Раскладывает блок номер b каждой дорожки по словам: w[t * width + i] - слово t дорожки i.
+// У дорожек без сообщения и закончившихся сообщений слова нулевые, их результат не используется
+static void mb_load(const mb_lane_t *lanes, int count, int width, apr_size_t b, apr_uint32_t *w)
+{
+  for (int i = 0; i < width; i++)
+    {
+    if (i >= count || b >= lanes[i].blocks)
+      {
+      for (int t = 0; t < 16; t++)
+        w[t * width + i] = 0;
+      continue;
+      }
+
+    const unsigned char *p = b < lanes[i].full ? lanes[i].data + b * 64 : lanes[i].tail + (b - lanes[i].full) * 64;
+    for (int t = 0; t < 16; t++, p += 4)
+      w[t * width + i] = (apr_uint32_t)p[0] << 24 | (apr_uint32_t)p[1] << 16 | (apr_uint32_t)p[2] << 8 | p[3];
+    }
+}
+
+// Записывает хеши дорожек: state[j * width + i] - слово j состояния дорожки i
+static void mb_store(const apr_uint32_t *state, int count, int width, unsigned char *digests)
+{
+  for (int i = 0; i < count; i++)
+    for (int j = 0; j < 8; j++)
+      {
+      apr_uint32_t v = state[j * width + i];
+      unsigned char *d = digests + i * HASH_LEN + j * 4;
+      d[0] = v >> 24;
+      d[1] = v >> 16;
+      d[2] = v >> 8;
+      d[3] = v;
+      }
+}
+
+// Готовит дорожки, возвращает наибольшее число блоков
+static apr_size_t mb_prepare(const hash_input_t *inputs, int count, mb_lane_t *lanes, apr_int32_t *blocks)
+{
+  apr_size_t max_blocks = 0;
+  for (int i = 0; i < MB_MAX_LANES; i++)
+    blocks[i] = 0;
+  for (int i = 0; i < count; i++)
+    {
+    mb_lane_init(&lanes[i], &inputs[i]);
+    blocks[i] = lanes[i].blocks;
+    if (lanes[i].blocks > max_blocks)
+      max_blocks = lanes[i].blocks;
+    }
+
+  return max_blocks;
+}
+
+#define ROR256(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define XOR3_256(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+
+// До 8 сообщений, по одному в 32-битной дорожке
+__attribute__((target("avx2")))
+static void sha256_x8(const hash_input_t *inputs, int count, unsigned char *digests)
+{
+  mb_lane_t lanes[8];
+  apr_int32_t blocks[MB_MAX_LANES];
+  apr_size_t max_blocks = mb_prepare(inputs, count, lanes, blocks);
+
+  __m256i state[8];
+  for (int j = 0; j < 8; j++)
+    state[j] = _mm256_set1_epi32(H256[j]);
+  const __m256i nblocks = _mm256_loadu_si256((const __m256i *)blocks);
+
+  apr_uint32_t w[16 * 8];
+  for (apr_size_t b = 0; b < max_blocks; b++)
+    {
+    mb_load(lanes, count, 8, b, w);
+    __m256i W[16];
+    for (int t = 0; t < 16; t++)
+      W[t] = _mm256_loadu_si256((const __m256i *)(w + t * 8));
+
+    __m256i a = state[0], bb = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int t = 0; t < 64; t++)
+      {
+      if (t >= 16)
+        {
+        __m256i w15 = W[(t + 1) & 15], w2 = W[(t + 14) & 15];
+        __m256i s0 = XOR3_256(ROR256(w15, 7), ROR256(w15, 18), _mm256_srli_epi32(w15, 3));
+        __m256i s1 = XOR3_256(ROR256(w2, 17), ROR256(w2, 19), _mm256_srli_epi32(w2, 10));
+        W[t & 15] = _mm256_add_epi32(_mm256_add_epi32(W[t & 15], s0), _mm256_add_epi32(W[(t + 9) & 15], s1));
+        }
+
+      __m256i S1 = XOR3_256(ROR256(e, 6), ROR256(e, 11), ROR256(e, 25));
+      __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+      __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32(K256[t]), W[t & 15])));
+      __m256i S0 = XOR3_256(ROR256(a, 2), ROR256(a, 13), ROR256(a, 22));
+      __m256i maj = _mm256_or_si256(_mm256_and_si256(_mm256_or_si256(a, bb), c), _mm256_and_si256(a, bb));
+      __m256i t2 = _mm256_add_epi32(S0, maj);
+      h = g;
+      g = f;
+      f = e;
+      e = _mm256_add_epi32(d, t1);
+      d = c;
+      c = bb;
+      bb = a;
+      a = _mm256_add_epi32(t1, t2);
+      }
+
+    // Состояние дорожек, у которых сообщение уже закончилось, не меняется
+    __m256i active = _mm256_cmpgt_epi32(nblocks, _mm256_set1_epi32(b));
+    __m256i x[8] = {a, bb, c, d, e, f, g, h};
+    for (int j = 0; j < 8; j++)
+      state[j] = _mm256_blendv_epi8(state[j], _mm256_add_epi32(state[j], x[j]), active);
+    }
+
+  apr_uint32_t out[8 * 8];
+  for (int j = 0; j < 8; j++)
+    _mm256_storeu_si256((__m256i *)(out + j * 8), state[j]);
+  mb_store(out, count, 8, digests);
+}
+
+// vpternlogd: 0x96 - XOR трех, 0xca - выбор (Ch), 0xe8 - большинство (Maj)
+#define XOR3_512(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0x96)
+
+// До 16 сообщений, по одному в 32-битной дорожке
+__attribute__((target("avx512f")))
+static void sha256_x16(const hash_input_t *inputs, int count, unsigned char *digests)
+{
+  mb_lane_t lanes[16];
+  apr_int32_t blocks[MB_MAX_LANES];
+  apr_size_t max_blocks = mb_prepare(inputs, count, lanes, blocks);
+
+  __m512i state[8];
+  for (int j = 0; j < 8; j++)
+    state[j] = _mm512_set1_epi32(H256[j]);
+  const __m512i nblocks = _mm512_loadu_si512(blocks);
+
+  apr_uint32_t w[16 * 16];
+  for (apr_size_t b = 0; b < max_blocks; b++)
+    {
+    mb_load(lanes, count, 16, b, w);
+    __m512i W[16];
+    for (int t = 0; t < 16; t++)
+      W[t] = _mm512_loadu_si512(w + t * 16);
+
+    __m512i a = state[0], bb = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int t = 0; t < 64; t++)
+      {
+      if (t >= 16)
+        {
+        __m512i w15 = W[(t + 1) & 15], w2 = W[(t + 14) & 15];
+        __m512i s0 = XOR3_512(_mm512_ror_epi32(w15, 7), _mm512_ror_epi32(w15, 18), _mm512_srli_epi32(w15, 3));
+        __m512i s1 = XOR3_512(_mm512_ror_epi32(w2, 17), _mm512_ror_epi32(w2, 19), _mm512_srli_epi32(w2, 10));
+        W[t & 15] = _mm512_add_epi32(_mm512_add_epi32(W[t & 15], s0), _mm512_add_epi32(W[(t + 9) & 15], s1));
+        }
+
+      __m512i S1 = XOR3_512(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11), _mm512_ror_epi32(e, 25));
+      __m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xca);
+      __m512i t1 = _mm512_add_epi32(_mm512_add_epi32(h, S1), _mm512_add_epi32(ch, _mm512_add_epi32(_mm512_set1_epi32(K256[t]), W[t & 15])));
+      __m512i S0 = XOR3_512(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13), _mm512_ror_epi32(a, 22));
+      __m512i t2 = _mm512_add_epi32(S0, _mm512_ternarylogic_epi32(a, bb, c, 0xe8));
+      h = g;
+      g = f;
+      f = e;
+      e = _mm512_add_epi32(d, t1);
+      d = c;
+      c = bb;
+      bb = a;
+      a = _mm512_add_epi32(t1, t2);
+      }
+
+    __mmask16 active = _mm512_cmpgt_epi32_mask(nblocks, _mm512_set1_epi32(b));
+    __m512i x[8] = {a, bb, c, d, e, f, g, h};
+    for (int j = 0; j < 8; j++)
+      state[j] = _mm512_mask_add_epi32(state[j], active, state[j], x[j]);
+    }
+
+  apr_uint32_t out[8 * 16];
+  for (int j = 0; j < 8; j++)
+    _mm512_storeu_si512(out + j * 16, state[j]);
+  mb_store(out, count, 16, digests);
+}
+
+static void hash_many_avx2(const hash_input_t *inputs, apr_size_t count, unsigned char *digests)
+{
+  for (apr_size_t i = 0; i < count; i += 8)
+    sha256_x8(inputs + i, count - i < 8 ? count - i : 8, digests + i * HASH_LEN);
+}
+
+static void hash_many_avx512(const hash_input_t *inputs, apr_size_t count, unsigned char *digests)
+{
+  for (apr_size_t i = 0; i < count; i += 16)
+    sha256_x16(inputs + i, count - i < 16 ? count - i : 16, digests + i * HASH_LEN);
+}
+
+#endif
+
+int hash_mb_best_level(void)
+{
+#ifdef HASH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return HASH_MB_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return HASH_MB_AVX2;
+#endif
+  return HASH_MB_EVP;
+}
+
+hash_many_fn hash_mb_select(int level)
+{
+  if (level < HASH_MB_EVP || level > hash_mb_best_level())
+    return NULL;
+
+  switch (level)
+    {
+#ifdef HASH_X86
+    case HASH_MB_AVX512:
+      return hash_many_avx512;
+    case HASH_MB_AVX2:
+      return hash_many_avx2;
+#endif
+    default:
+      return hash_many_evp;
+    }
+}
+
+const char *hash_mb_level_name(int level)
+{
+  static const char *names[HASH_MB_LEVELS] = {"evp", "avx2 x8", "avx512 x16"};
+
+  return level >= 0 && level < HASH_MB_LEVELS ? names[level] : "unknown";
+}
+
+// Лучший вариант пакетного хеширования, выбирается при первом вызове
+static hash_many_fn hash_many_best = NULL;
+// 8 дорожек AVX2 обгоняют SHA-NI только на сообщениях из одного блока (до 55 байт), а AVX-512 - на любых
+static int hash_many_short_only = false;
+
+void hash_sha256_many(const hash_input_t *inputs, apr_size_t count, unsigned char *digests)
+{
+  hash_many_fn best = __atomic_load_n(&hash_many_best, __ATOMIC_ACQUIRE);
+  if (!best)
+    {
+    int level = hash_mb_best_level();
+    hash_many_short_only = level == HASH_MB_AVX2 && strcmp(hash_backend(), "sha-ni") == 0;
+    best = hash_mb_select(level);
+    __atomic_store_n(&hash_many_best, best, __ATOMIC_RELEASE);
+    }
+
+  // Одно сообщение заняло бы одну дорожку из 8-16, через EVP оно быстрее
+  if (count < 2)
+    best = hash_many_evp;
+  for (apr_size_t i = 0; hash_many_short_only && best != hash_many_evp && i < count; i++)
+    if (inputs[i].len > 55)
+      best = hash_many_evp;
+
+  best(inputs, count, digests);
+}
+
+const char *hash_backend(void)
+{
+#ifdef HASH_X86
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)))
+    return "sha-ni";
+#endif
+#if defined(__aarch64__) && defined(HWCAP_SHA2)
+  if (getauxval(AT_HWCAP) & HWCAP_SHA2)
+    return "armv8-sha2";
+#endif
+  return "generic";
+}
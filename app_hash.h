@@ -0,0 +1,51 @@
+#pragma once
+
+#include "apr_pools.h"
+
+// SHA-256 паролей. Одиночный хеш считается через EVP с алгоритмом, полученным один раз при запуске,
+// и контекстом, который создается один раз на поток: одноразовый SHA256() в OpenSSL 3 при каждом вызове
+// заново ищет реализацию у провайдера и создает контекст, и это дольше самого хеширования короткого пароля.
+// Сам OpenSSL выбирает SHA-NI на x86 и инструкции SHA2 на ARMv8, если они есть.
+// Пакет сообщений (например, пароли пакетной проверки) хешируется по несколько сразу: каждое сообщение
+// в своей дорожке вектора AVX2 (8 сообщений) или AVX-512 (16 сообщений)
+
+#define HASH_LEN 32
+
+typedef struct {
+  const void *data;
+  apr_size_t len;
+} hash_input_t;
+
+typedef void (*hash_many_fn)(const hash_input_t *inputs, apr_size_t count, unsigned char *digests);
+
+// Варианты пакетного хеширования в порядке возрастания ширины векторов
+enum {
+  HASH_MB_EVP = 0,              // по одному сообщению через EVP
+  HASH_MB_AVX2,
+  HASH_MB_AVX512,
+  HASH_MB_LEVELS
+};
+
+// Получает алгоритм SHA-256 у провайдера OpenSSL и создает ключ контекстов потоков. Вызывается до запуска потоков;
+// без этого вызова hash_sha256 работает через одноразовый SHA256()
+apr_status_t hash_init(apr_pool_t *pool);
+
+// SHA-256 от len байт data в digest (HASH_LEN байт)
+void hash_sha256(const void *data, apr_size_t len, unsigned char *digest);
+
+// SHA-256 от prefix, за которым идет data: две части хешируются в контексте потока без склейки в буфер
+void hash_sha256_prefixed(const void *prefix, apr_size_t prefix_len, const void *data, apr_size_t len, unsigned char *digest);
+
+// SHA-256 от count сообщений, хеш сообщения i записывается в digests + i * HASH_LEN. Выбирает лучший вариант
+void hash_sha256_many(const hash_input_t *inputs, apr_size_t count, unsigned char *digests);
+
+// Лучший вариант пакетного хеширования, поддерживаемый процессором
+int hash_mb_best_level(void);
+
+// Возвращает функцию пакетного хеширования указанного варианта либо NULL, если процессор его не поддерживает
+hash_many_fn hash_mb_select(int level);
+
+const char *hash_mb_level_name(int level);
+
+// Инструкции, которыми OpenSSL считает SHA-256 на этом процессоре: sha-ni, armv8-sha2 или generic
+const char *hash_backend(void);
@@ -0,0 +1,208 @@
+#include "app_kdf.h"
+
+#include "apr_general.h"
+#include "apr_strings.h"
+#include "string.h"
+#include "errno.h"
+#include "time.h"
+#include "semaphore.h"
+#include "openssl/evp.h"
+#include "openssl/crypto.h"
+
+// Пределы параметров: больше 1 ГБ на одно вычисление не выделяется
+#define KDF_MAX_LOG_N 24
+#define KDF_MAX_R 32
+#define KDF_MAX_P 16
+#define KDF_MAX_MEM (1024ull * 1024 * 1024)
+
+struct kdf_pool_t {
+  sem_t slots;                  // свободные слоты, общий для процессов
+  int workers;
+  int queue;
+  apr_uint32_t waiting;
+  apr_uint64_t admitted;
+  apr_uint64_t queued;
+  apr_uint64_t rejected;
+  apr_uint64_t timeouts;
+};
+
+static const char *kdf_check(const kdf_params_t *params)
+{
+  if (params->log_n < 1 || params->log_n > KDF_MAX_LOG_N)
+    return "scrypt log2 N must be between 1 and " APR_STRINGIFY(KDF_MAX_LOG_N);
+  if (params->r < 1 || params->r > KDF_MAX_R)
+    return "scrypt r must be between 1 and " APR_STRINGIFY(KDF_MAX_R);
+  if (params->p < 1 || params->p > KDF_MAX_P)
+    return "scrypt p must be between 1 and " APR_STRINGIFY(KDF_MAX_P);
+  if (128ull * params->r * (1ull << params->log_n) > KDF_MAX_MEM)
+    return "scrypt memory 128 * r * N must not exceed 1 GB";
+
+  return NULL;
+}
+
+const char *kdf_parse(const char *value, kdf_params_t *params)
+{
+  if (strncasecmp(value, "scrypt:", 7) != 0)
+    return "KDF must be scrypt:<log2 N>:<r>:<p>";
+
+  long v[3];
+  const char *p = value + 7;
+  for (int i = 0; i < 3; i++)
+    {
+    char *end;
+    v[i] = strtol(p, &end, 10);
+    if (end == p || *end != (i < 2 ? ':' : 0))
+      return "KDF must be scrypt:<log2 N>:<r>:<p>";
+    p = end + 1;
+    }
+
+  params->log_n = v[0];
+  params->r = v[1];
+  params->p = v[2];
+  return kdf_check(params);
+}
+
+apr_status_t kdf_derive(const kdf_params_t *params, const char *pass, apr_size_t len, const unsigned char *salt,
+                        apr_size_t salt_len, unsigned char *key, apr_size_t key_len)
+{
+  if (kdf_check(params))
+    return APR_EINVAL;
+
+  // Предел памяти OpenSSL по умолчанию 32 МБ, поэтому он задается по параметрам с запасом на служебные буферы
+  apr_uint64_t n = 1ull << params->log_n;
+  apr_uint64_t maxmem = 128ull * params->r * (n + params->p + 2) + 1024 * 1024;
+  if (!EVP_PBE_scrypt(pass, len, salt, salt_len, n, params->r, params->p, maxmem, key, key_len))
+    return APR_EGENERAL;
+
+  return APR_SUCCESS;
+}
+
+apr_status_t kdf_record(const kdf_params_t *params, const char *pass, apr_size_t len, unsigned char *record)
+{
+  record[0] = KDF_TAG_SCRYPT;
+  record[1] = params->log_n;
+  record[2] = params->r;
+  record[3] = params->p;
+
+  apr_status_t rv = apr_generate_random_bytes(record + 4, KDF_SALT_LEN);
+  if (rv != APR_SUCCESS)
+    return rv;
+
+  return kdf_derive(params, pass, len, record + 4, KDF_SALT_LEN, record + 4 + KDF_SALT_LEN, KDF_KEY_LEN);
+}
+
+static void record_params(const unsigned char *record, kdf_params_t *params)
+{
+  params->log_n = record[1];
+  params->r = record[2];
+  params->p = record[3];
+}
+
+int kdf_is_record(const unsigned char *record, apr_size_t len)
+{
+  if (len != KDF_RECORD_LEN || record[0] != KDF_TAG_SCRYPT)
+    return false;
+
+  kdf_params_t params;
+  record_params(record, &params);
+  return kdf_check(&params) == NULL;
+}
+
+int kdf_verify(const unsigned char *record, const char *pass, apr_size_t len)
+{
+  kdf_params_t params;
+  record_params(record, &params);
+
+  unsigned char key[KDF_KEY_LEN];
+  if (kdf_derive(&params, pass, len, record + 4, KDF_SALT_LEN, key, KDF_KEY_LEN) != APR_SUCCESS)
+    return false;
+
+  int match = CRYPTO_memcmp(key, record + 4 + KDF_SALT_LEN, KDF_KEY_LEN) == 0;
+  OPENSSL_cleanse(key, sizeof(key));
+  return match;
+}
+
+apr_size_t kdf_pool_size(void)
+{
+  return sizeof(kdf_pool_t);
+}
+
+kdf_pool_t *kdf_pool_init(void *mem, int workers, int queue)
+{
+  kdf_pool_t *pool = (kdf_pool_t *)mem;
+  memset(pool, 0, sizeof(kdf_pool_t));
+  if (sem_init(&pool->slots, 1, workers) != 0)
+    return NULL;
+
+  pool->workers = workers;
+  pool->queue = queue;
+  return pool;
+}
+
+apr_status_t kdf_pool_enter(kdf_pool_t *pool, apr_interval_time_t timeout)
+{
+  // Свободный слот занимается сразу, без очереди
+  if (sem_trywait(&pool->slots) == 0)
+    {
+    __atomic_fetch_add(&pool->admitted, 1, __ATOMIC_RELAXED);
+    return APR_SUCCESS;
+    }
+
+  if (__atomic_add_fetch(&pool->waiting, 1, __ATOMIC_RELAXED) > (apr_uint32_t)pool->queue)
+    {
+    __atomic_fetch_sub(&pool->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->rejected, 1, __ATOMIC_RELAXED);
+    return APR_EBUSY;
+    }
+
+  // sem_timedwait ждет до момента по часам CLOCK_REALTIME
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  apr_int64_t nsec = deadline.tv_nsec + (apr_int64_t)apr_time_usec(timeout) * 1000;
+  deadline.tv_sec += apr_time_sec(timeout) + nsec / 1000000000;
+  deadline.tv_nsec = nsec % 1000000000;
+
+  int rc;
+  while ((rc = sem_timedwait(&pool->slots, &deadline)) != 0 && errno == EINTR)
+    ;
+  __atomic_fetch_sub(&pool->waiting, 1, __ATOMIC_RELAXED);
+
+  if (rc != 0)
+    {
+    __atomic_fetch_add(&pool->timeouts, 1, __ATOMIC_RELAXED);
+    return APR_TIMEUP;
+    }
+
+  __atomic_fetch_add(&pool->admitted, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&pool->queued, 1, __ATOMIC_RELAXED);
+  return APR_SUCCESS;
+}
+
+int kdf_pool_try_enter(kdf_pool_t *pool)
+{
+  if (sem_trywait(&pool->slots) != 0)
+    return false;
+
+  __atomic_fetch_add(&pool->admitted, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+void kdf_pool_leave(kdf_pool_t *pool)
+{
+  sem_post(&pool->slots);
+}
+
+void kdf_pool_stats(kdf_pool_t *pool, kdf_pool_stats_t *stats)
+{
+  int free_slots = 0;
+  sem_getvalue(&pool->slots, &free_slots);
+
+  stats->workers = pool->workers;
+  stats->queue = pool->queue;
+  stats->running = pool->workers - (free_slots > 0 ? free_slots : 0);
+  stats->waiting = __atomic_load_n(&pool->waiting, __ATOMIC_RELAXED);
+  stats->admitted = __atomic_load_n(&pool->admitted, __ATOMIC_RELAXED);
+  stats->queued = __atomic_load_n(&pool->queued, __ATOMIC_RELAXED);
+  stats->rejected = __atomic_load_n(&pool->rejected, __ATOMIC_RELAXED);
+  stats->timeouts = __atomic_load_n(&pool->timeouts, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "apr.h"
+#include "apr_errno.h"
+#include "apr_time.h"
+
+// Медленное хеширование паролей (scrypt) и ограниченный пул вычислений.
+// Запись пароля в столбце users.password (bytea) - либо прежний SHA-256 (32 байта), либо запись scrypt:
+//   's', log2 N, r, p, соль 16 байт, ключ 32 байта
+// Параметры хранятся в самой записи, поэтому их можно усиливать, не пересчитывая старые записи.
+//
+// Пул ограничивает число одновременных вычислений scrypt всеми процессами сервера: слоты - семафор в
+// разделяемой памяти, а запросы сверх слотов ждут в очереди ограниченной длины. Если очередь полна,
+// запрос сразу получает отказ, а не занимает процессор: задержка принятых запросов остается предсказуемой
+
+#define KDF_SALT_LEN 16
+#define KDF_KEY_LEN 32
+#define KDF_RECORD_LEN (4 + KDF_SALT_LEN + KDF_KEY_LEN)
+#define KDF_TAG_SCRYPT 's'
+
+typedef struct {
+  int log_n;                    // N = 2^log_n, память на одно вычисление 128 * r * N байт
+  int r;
+  int p;
+} kdf_params_t;
+
+// Разбирает параметры вида scrypt:<log2 N>:<r>:<p>. NULL - верны, иначе текст ошибки
+const char *kdf_parse(const char *value, kdf_params_t *params);
+
+// Ключ scrypt длины key_len от пароля и соли
+apr_status_t kdf_derive(const kdf_params_t *params, const char *pass, apr_size_t len, const unsigned char *salt,
+                        apr_size_t salt_len, unsigned char *key, apr_size_t key_len);
+
+// Новая запись пароля со случайной солью, KDF_RECORD_LEN байт
+apr_status_t kdf_record(const kdf_params_t *params, const char *pass, apr_size_t len, unsigned char *record);
+
+// true - значение является записью scrypt с допустимыми параметрами
+int kdf_is_record(const unsigned char *record, apr_size_t len);
+
+// true - пароль соответствует записи. Ключи сравниваются за постоянное время
+int kdf_verify(const unsigned char *record, const char *pass, apr_size_t len);
+
+typedef struct kdf_pool_t kdf_pool_t;
+
+typedef struct {
+  int workers;                  // слотов
+  int queue;                    // мест в очереди
+  int running;                  // занято слотов
+  int waiting;                  // ждут в очереди
+  apr_uint64_t admitted;        // получили слот
+  apr_uint64_t queued;          // из них после ожидания в очереди
+  apr_uint64_t rejected;        // отказ: очередь полна
+  apr_uint64_t timeouts;        // отказ: слот не освободился за время ожидания
+} kdf_pool_stats_t;
+
+// Сколько байт памяти нужно пулу
+apr_size_t kdf_pool_size(void);
+
+// Размечает пул в памяти mem размером kdf_pool_size(): workers слотов и queue мест в очереди.
+// Память должна быть общей для всех процессов, которые пользуются пулом (например, анонимная разделяемая)
+kdf_pool_t *kdf_pool_init(void *mem, int workers, int queue);
+
+// Занимает слот. Если свободных нет, ждет в очереди не дольше timeout.
+// APR_EBUSY - очередь полна, APR_TIMEUP - слот не освободился
+apr_status_t kdf_pool_enter(kdf_pool_t *pool, apr_interval_time_t timeout);
+
+// Занимает слот, только если он свободен сейчас; для необязательной работы. true - слот занят
+int kdf_pool_try_enter(kdf_pool_t *pool);
+
+// Освобождает слот. Слот процесса, аварийно завершившегося во время вычисления, не освобождается
+void kdf_pool_leave(kdf_pool_t *pool);
+
+void kdf_pool_stats(kdf_pool_t *pool, kdf_pool_stats_t *stats);
@@ -0,0 +1,1167 @@
+#include "app_params.h"
+
+#include "apr_strings.h"
+#include "string.h"
+#include "strings.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "immintrin.h"
+#define PARAMS_X86 1
+#endif
+
+#define CONTENT_TYPE_URLENCODED "application/x-www-form-urlencoded"
+#define CONTENT_TYPE_JSON "application/json"
+#define CONTENT_TYPE_MULTIPART "multipart/form-data"
+
+// Состояния потокового разбора
+enum {
+  STREAM_NAME,                  // имя параметра
+  STREAM_VALUE,                 // значение искомого параметра
+  STREAM_SKIP,                  // значение, которое не нужно, или слишком длинное имя: пропускается до & или ;
+  STREAM_DONE                   // все нужное найдено
+};
+
+// Состояния разбора multipart
+enum {
+  MULTIPART_PREAMBLE,           // до первой границы
+  MULTIPART_BOUNDARY,           // после границы: -- или пробелы и CRLF
+  MULTIPART_CLOSE,              // второй - завершающей границы
+  MULTIPART_BOUNDARY_LF,        // LF после границы
+  MULTIPART_HEADERS,            // заголовки части
+  MULTIPART_DATA,               // содержимое части до следующей границы
+  MULTIPART_EPILOGUE,           // после завершающей границы, пропускается
+  MULTIPART_DONE                // все нужное найдено
+};
+
+// Состояния разбора JSON
+enum {
+  JSON_VALUE,                   // значение
+  JSON_VALUE_FIRST,             // первый элемент массива или ]
+  JSON_NAME_FIRST,              // первое имя члена объекта или }
+  JSON_NAME,                    // имя члена после запятой
+  JSON_COLON,
+  JSON_AFTER,                   // после значения: запятая или закрывающая скобка
+  JSON_STRING,
+  JSON_ESCAPE,                  // после обратной косой черты в строке
+  JSON_UNICODE,                 // цифры \uXXXX
+  JSON_LITERAL,                 // число, true, false или null
+  JSON_END,                     // документ закончен, дальше допустимы только пробелы
+  JSON_DONE                     // все нужное найдено
+};
+
+static int hex_value(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Декодирует len байт src (%XX и +) в dst, возвращает длину результата. dst может совпадать с src
+static apr_size_t url_decode(char *dst, const char *src, apr_size_t len)
+{
+  char *out = dst;
+  for (apr_size_t i = 0; i < len; i++)
+    {
+    char c = src[i];
+    if (c == '+')
+      c = ' ';
+    else if (c == '%' && i + 2 < len)
+      {
+      int hi = hex_value((unsigned char)src[i + 1]), lo = hex_value((unsigned char)src[i + 2]);
+      if (hi >= 0 && lo >= 0)
+        {
+        c = hi << 4 | lo;
+        i += 2;
+        }
+      }
+    *out++ = c;
+    }
+
+  return out - dst;
+}
+
+// Индекс искомого имени, совпадающего с декодированным именем name длины len, -1 - имя не искомое.
+// Имена сравниваются без учета регистра, как в apr_table_get
+static int param_index(const param_spec_t *spec, const char *name, apr_size_t len)
+{
+  for (int k = 0; k < spec->count; k++)
+    {
+    if (strlen(spec->names[k]) == len && strncasecmp(spec->names[k], name, len) == 0)
+      return k;
+    }
+
+  return -1;
+}
+
+// Индекс искомого имени, совпадающего с закодированным именем src длины len, -1 - имя не искомое
+static int param_key(const param_spec_t *spec, const char *src, apr_size_t len)
+{
+  // Имена почти никогда не кодируются, и тогда они сравниваются прямо в исходной строке
+  char buf[PARAM_NAME_MAX];
+  if (memchr(src, '%', len) || memchr(src, '+', len))
+    {
+    if (len > PARAM_NAME_MAX)
+      return -1;
+    len = url_decode(buf, src, len);
+    src = buf;
+    }
+
+  return param_index(spec, src, len);
+}
+
+static int param_found(const param_spec_t *spec, int key, const char *value, apr_size_t len)
+{
+  if (spec->fn)
+    return spec->fn(spec, key, value, len);
+
+  if (!spec->values[key])
+    spec->values[key] = value;
+  return params_complete(spec);
+}
+
+int params_complete(const param_spec_t *spec)
+{
+  for (int k = 0; k < spec->count; k++)
+    {
+    if (!spec->values[k])
+      return false;
+    }
+
+  return true;
+}
+
+void params_pairs_init(param_pairs_t *pp, apr_pool_t *pool, int max)
+{
+  memset(pp, 0, sizeof(param_pairs_t));
+  pp->pairs = apr_array_make(pool, 16, sizeof(param_pair_t));
+  pp->max = max;
+}
+
+int params_pairs_fn(const param_spec_t *spec, int key, const char *value, apr_size_t len)
+{
+  param_pairs_t *pp = (param_pairs_t *)spec->ctx;
+  if (key == PARAM_RECORD_END)
+    {
+    // Значения следующей записи с этой не связываются
+    pp->last = NULL;
+    pp->second = NULL;
+    }
+  else if (key == 0)
+    {
+    if (pp->pairs->nelts == pp->max)
+      {
+      pp->too_many = true;
+      return true;
+      }
+    pp->last = (param_pair_t *)apr_array_push(pp->pairs);
+    pp->last->first = value;
+    pp->last->second = pp->second;
+    pp->second = NULL;
+    }
+  else if (pp->last)
+    {
+    if (!pp->last->second)
+      pp->last->second = value;
+    }
+  else if (!pp->second)
+    pp->second = value;
+
+  return false;
+}
+
+int params_put(const param_spec_t *spec, const char *name, apr_size_t name_len, const char *value, apr_size_t len)
+{
+  int key = param_index(spec, name, name_len);
+  return key >= 0 && param_found(spec, key, value, len);
+}
+
+int params_query(apr_pool_t *pool, const char *args, const param_spec_t *spec)
+{
+  const char *p = args;
+  while (*p)
+    {
+    apr_size_t pair = strcspn(p, "&;");
+    const char *eq = (const char *)memchr(p, '=', pair);
+    apr_size_t name_len = eq ? eq - p : pair;
+
+    int key = name_len ? param_key(spec, p, name_len) : -1;
+    if (key >= 0)
+      {
+      // Параметр без = получает пустое значение
+      const char *src = eq ? eq + 1 : p + pair;
+      apr_size_t src_len = p + pair - src;
+      char *value = (char *)apr_palloc(pool, src_len + 1);
+      apr_size_t len = url_decode(value, src, src_len);
+      value[len] = 0;
+      if (param_found(spec, key, value, len))
+        return true;
+      }
+
+    p += pair;
+    if (*p)
+      p++;
+    }
+
+  return false;
+}
+
+// Конец пары имя=значение в [p, end): первый & или ;, иначе end
+static const char *pair_end(const char *p, const char *end)
+{
+  const char *amp = (const char *)memchr(p, '&', end - p);
+  const char *semi = (const char *)memchr(p, ';', (amp ? amp : end) - p);
+  return semi ? semi : amp ? amp : end;
+}
+
+void params_stream_init(params_stream_t *ps, apr_pool_t *pool, const param_spec_t *spec, apr_size_t value_max)
+{
+  memset(ps, 0, sizeof(params_stream_t));
+  ps->pool = pool;
+  ps->spec = spec;
+  ps->value_max = value_max;
+  ps->state = STREAM_NAME;
+}
+
+// Дописывает n байт к значению; буфер растет вдвое, но не дальше max
+static apr_status_t value_append(apr_pool_t *pool, apr_size_t max, param_value_t *value, const char *data, apr_size_t n)
+{
+  if (value->len + n > max)
+    return APR_ENOSPC;
+
+  if (value->len + n + 1 > value->size)
+    {
+    apr_size_t size = value->size ? value->size * 2 : 64;
+    if (size < value->len + n + 1)
+      size = value->len + n + 1;
+    if (size > max + 1)
+      size = max + 1;
+
+    char *grown = (char *)apr_palloc(pool, size);
+    if (value->len)
+      memcpy(grown, value->data, value->len);
+    value->data = grown;
+    value->size = size;
+    }
+
+  memcpy(value->data + value->len, data, n);
+  value->len += n;
+  return APR_SUCCESS;
+}
+
+// Забирает собранное значение (место под завершающий 0 в нем есть) и начинает новое
+static char *value_take(apr_pool_t *pool, param_value_t *value)
+{
+  char *data = value->data ? value->data : (char *)apr_palloc(pool, 1);
+  memset(value, 0, sizeof(param_value_t));
+  return data;
+}
+
+// Передает собранное значение: декодирует его на месте, и дальше оно принадлежит вызывающему
+static int stream_value(params_stream_t *ps, int key)
+{
+  apr_size_t len = ps->value.len;
+  char *value = value_take(ps->pool, &ps->value);
+  len = url_decode(value, value, len);
+  value[len] = 0;
+
+  return param_found(ps->spec, key, value, len);
+}
+
+apr_status_t params_stream_feed(params_stream_t *ps, const char *data, apr_size_t len)
+{
+  const char *p = data, *end = data + len;
+  while (p < end && ps->state != STREAM_DONE)
+    {
+    if (ps->state == STREAM_SKIP)
+      {
+      p = pair_end(p, end);
+      if (p < end)
+        {
+        p++;
+        ps->state = STREAM_NAME;
+        }
+      continue;
+      }
+
+    const char *stop = pair_end(p, end);
+    if (ps->state == STREAM_VALUE)
+      {
+      apr_status_t rv = value_append(ps->pool, ps->value_max, &ps->value, p, stop - p);
+      if (rv != APR_SUCCESS)
+        return rv;
+      p = stop;
+      if (p == end)
+        break;
+
+      p++;
+      ps->state = stream_value(ps, ps->key) ? STREAM_DONE : STREAM_NAME;
+      continue;
+      }
+
+    // Имя заканчивается на =, а параметр без = - на & или ;
+    const char *eq = (const char *)memchr(p, '=', stop - p);
+    const char *name_end = eq ? eq : stop;
+    apr_size_t n = name_end - p;
+    if (ps->name_len + n > PARAM_NAME_MAX)
+      {
+      ps->name_len = 0;
+      ps->state = STREAM_SKIP;
+      continue;
+      }
+    memcpy(ps->name + ps->name_len, p, n);
+    ps->name_len += n;
+    p = name_end;
+    if (p == end)
+      break;
+
+    int key = ps->name_len ? param_key(ps->spec, ps->name, ps->name_len) : -1;
+    ps->name_len = 0;
+    p++;
+    if (eq)
+      {
+      ps->key = key;
+      ps->state = key >= 0 ? STREAM_VALUE : STREAM_SKIP;
+      }
+    else if (key >= 0 && stream_value(ps, key))
+      ps->state = STREAM_DONE;
+    }
+
+  return ps->state == STREAM_DONE ? APR_EOF : APR_SUCCESS;
+}
+
+apr_status_t params_stream_end(params_stream_t *ps)
+{
+  if (ps->state == STREAM_VALUE)
+    ps->state = stream_value(ps, ps->key) ? STREAM_DONE : STREAM_NAME;
+  else if (ps->state == STREAM_NAME && ps->name_len)
+    {
+    int key = param_key(ps->spec, ps->name, ps->name_len);
+    ps->name_len = 0;
+    if (key >= 0 && stream_value(ps, key))
+      ps->state = STREAM_DONE;
+    }
+
+  return ps->state == STREAM_DONE ? APR_EOF : APR_SUCCESS;
+}
+
+void params_json_init(params_json_t *pj, apr_pool_t *pool, const param_spec_t *spec, apr_size_t value_max)
+{
+  memset(pj, 0, sizeof(params_json_t));
+  pj->pool = pool;
+  pj->spec = spec;
+  pj->value_max = value_max;
+  pj->state = JSON_VALUE;
+  pj->key = -1;
+}
+
+// Дописывает декодированные байты строки к имени члена или к значению искомого члена
+static apr_status_t json_put(params_json_t *pj, const char *data, apr_size_t n)
+{
+  if (pj->in_name)
+    {
+    if (pj->name_len + n > PARAM_NAME_MAX)
+      pj->name_long = true;
+    else
+      {
+      memcpy(pj->name + pj->name_len, data, n);
+      pj->name_len += n;
+      }
+    return APR_SUCCESS;
+    }
+
+  if (pj->key < 0)
+    return APR_SUCCESS;
+  if (pj->spec->chunk)
+    {
+    pj->spec->chunk(pj->spec, pj->name, pj->name_len, data, n, false);
+    return APR_SUCCESS;
+    }
+  return value_append(pj->pool, pj->value_max, &pj->value, data, n);
+}
+
+// Символ с кодом code в UTF-8
+static apr_status_t json_put_code(params_json_t *pj, unsigned code)
+{
+  char utf8[4];
+  apr_size_t n;
+  if (code < 0x80)
+    {
+    utf8[0] = code;
+    n = 1;
+    }
+  else if (code < 0x800)
+    {
+    utf8[0] = 0xc0 | code >> 6;
+    utf8[1] = 0x80 | (code & 0x3f);
+    n = 2;
+    }
+  else if (code < 0x10000)
+    {
+    utf8[0] = 0xe0 | code >> 12;
+    utf8[1] = 0x80 | (code >> 6 & 0x3f);
+    utf8[2] = 0x80 | (code & 0x3f);
+    n = 3;
+    }
+  else
+    {
+    utf8[0] = 0xf0 | code >> 18;
+    utf8[1] = 0x80 | (code >> 12 & 0x3f);
+    utf8[2] = 0x80 | (code >> 6 & 0x3f);
+    utf8[3] = 0x80 | (code & 0x3f);
+    n = 4;
+    }
+
+  return json_put(pj, utf8, n);
+}
+
+// Старшая половина суррогатной пары без младшей заменяется символом U+FFFD
+static apr_status_t json_flush_high(params_json_t *pj)
+{
+  if (!pj->high)
+    return APR_SUCCESS;
+
+  pj->high = 0;
+  return json_put_code(pj, 0xfffd);
+}
+
+// true - члены текущего объекта могут быть искомыми параметрами
+static int json_record(const params_json_t *pj)
+{
+  if (pj->depth == 1)
+    return !(pj->arrays & 1);
+  return pj->depth == 2 && (pj->arrays & 1) && !(pj->arrays & 2);
+}
+
+// Значение закончено. Значение искомого члена передается вызывающему
+static void json_value_done(params_json_t *pj, int deliver)
+{
+  pj->state = pj->depth ? JSON_AFTER : JSON_END;
+
+  int key = pj->key;
+  pj->key = -1;
+  if (key < 0)
+    return;
+
+  if (pj->spec->chunk)
+    {
+    if (pj->spec->chunk(pj->spec, pj->name, pj->name_len, NULL, 0, true))
+      pj->state = JSON_DONE;
+    return;
+    }
+
+  apr_size_t len = pj->value.len;
+  char *value = value_take(pj->pool, &pj->value);
+  value[len] = 0;
+  if (deliver && param_found(pj->spec, key, value, len))
+    pj->state = JSON_DONE;
+}
+
+static apr_status_t json_push(params_json_t *pj, int array)
+{
+  if (pj->depth == PARAMS_JSON_DEPTH)
+    return APR_EINVAL;
+
+  if (array)
+    pj->arrays |= (apr_uint64_t)1 << pj->depth;
+  else
+    pj->arrays &= ~((apr_uint64_t)1 << pj->depth);
+  pj->depth++;
+  // Значение-контейнер не передается, даже если член искомый
+  pj->key = -1;
+  pj->state = array ? JSON_VALUE_FIRST : JSON_NAME_FIRST;
+  return APR_SUCCESS;
+}
+
+static void json_pop(params_json_t *pj)
+{
+  // Конец объекта-записи сообщается вызывающему, чтобы значения разных записей не смешивались
+  int record = pj->spec->fn && json_record(pj);
+  pj->depth--;
+  json_value_done(pj, false);
+  if (record && pj->state != JSON_DONE && pj->spec->fn(pj->spec, PARAM_RECORD_END, NULL, 0))
+    pj->state = JSON_DONE;
+}
+
+// Первый символ значения
+static apr_status_t json_value_start(params_json_t *pj, char c)
+{
+  switch (c)
+    {
+    case '{':
+      return json_push(pj, false);
+    case '[':
+      return json_push(pj, true);
+    case '"':
+      // Значения передаются по частям на любой глубине
+      if (pj->spec->chunk)
+        pj->key = 0;
+      pj->in_name = false;
+      pj->state = JSON_STRING;
+      return APR_SUCCESS;
+    case 't':
+      pj->literal = "true";
+      break;
+    case 'f':
+      pj->literal = "false";
+      break;
+    case 'n':
+      pj->literal = "null";
+      break;
+    default:
+      if (c != '-' && (c < '0' || c > '9'))
+        return APR_EINVAL;
+      pj->literal = NULL;
+    }
+
+  if (pj->spec->chunk)
+    pj->key = 0;
+  pj->literal_pos = 1;
+  pj->in_name = false;
+  pj->state = JSON_LITERAL;
+  return json_put(pj, &c, 1);
+}
+
+static int json_number_char(char c)
+{
+  return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+// Литерал закончен символом, который к нему не относится
+static apr_status_t json_literal_end(params_json_t *pj)
+{
+  if (pj->literal && pj->literal[pj->literal_pos])
+    return APR_EINVAL;
+
+  json_value_done(pj, !pj->literal || strcmp(pj->literal, "null") != 0);
+  return APR_SUCCESS;
+}
+
+// Первый символ строки, который не передается участком: кавычка, обратная косая черта или управляющий символ.
+// Длинные строки, в том числе пропускаемые, просматриваются по 16 байт
+static const char *json_string_stop(const char *p, const char *end)
+{
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), control = _mm_set1_epi8(0x1f);
+  for (; end - p >= 16; p += 16)
+    {
+    __m128i b = _mm_loadu_si128((const __m128i *)p);
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, quote), _mm_cmpeq_epi8(b, backslash)),
+                               _mm_cmpeq_epi8(_mm_min_epu8(b, control), b));
+    int mask = _mm_movemask_epi8(hit);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    }
+#endif
+
+  while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+    p++;
+  return p;
+}
+
+static int json_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+apr_status_t params_json_feed(params_json_t *pj, const char *data, apr_size_t len)
+{
+  const char *p = data, *end = data + len;
+  apr_status_t rv = APR_SUCCESS;
+  while (p < end && pj->state != JSON_DONE && rv == APR_SUCCESS)
+    {
+    char c = *p;
+    switch (pj->state)
+      {
+      case JSON_STRING:
+        {
+        // Обычные символы строки передаются целыми участками
+        const char *run = p;
+        p = json_string_stop(p, end);
+        if (p > run)
+          {
+          rv = json_flush_high(pj);
+          if (rv == APR_SUCCESS)
+            rv = json_put(pj, run, p - run);
+          }
+        if (p == end || rv != APR_SUCCESS)
+          continue;
+
+        c = *p++;
+        if (c == '\\')
+          pj->state = JSON_ESCAPE;
+        else if (c != '"')
+          rv = APR_EINVAL;
+        else if ((rv = json_flush_high(pj)) != APR_SUCCESS)
+          continue;
+        else if (pj->in_name)
+          {
+          pj->in_name = false;
+          pj->key = !pj->name_long && json_record(pj) ? param_index(pj->spec, pj->name, pj->name_len) : -1;
+          pj->state = JSON_COLON;
+          }
+        else
+          json_value_done(pj, true);
+        continue;
+        }
+
+      case JSON_ESCAPE:
+        p++;
+        if (c == 'u')
+          {
+          pj->code = 0;
+          pj->hex_left = 4;
+          pj->state = JSON_UNICODE;
+          continue;
+          }
+
+        rv = json_flush_high(pj);
+        if (rv != APR_SUCCESS)
+          continue;
+        switch (c)
+          {
+          case 'b':
+            c = '\b';
+            break;
+          case 'f':
+            c = '\f';
+            break;
+          case 'n':
+            c = '\n';
+            break;
+          case 'r':
+            c = '\r';
+            break;
+          case 't':
+            c = '\t';
+            break;
+          case '"':
+          case '\\':
+          case '/':
+            break;
+          default:
+            rv = APR_EINVAL;
+            continue;
+          }
+        pj->state = JSON_STRING;
+        rv = json_put(pj, &c, 1);
+        continue;
+
+      case JSON_UNICODE:
+        {
+        p++;
+        int v = hex_value((unsigned char)c);
+        if (v < 0)
+          {
+          rv = APR_EINVAL;
+          continue;
+          }
+        pj->code = pj->code << 4 | v;
+        if (--pj->hex_left)
+          continue;
+
+        pj->state = JSON_STRING;
+        unsigned code = pj->code;
+        if (code >= 0xd800 && code <= 0xdbff)
+          {
+          rv = json_flush_high(pj);
+          pj->high = code;
+          continue;
+          }
+        if (code >= 0xdc00 && code <= 0xdfff)
+          {
+          code = pj->high ? 0x10000 + ((pj->high - 0xd800) << 10) + (code - 0xdc00) : 0xfffd;
+          pj->high = 0;
+          }
+        else
+          rv = json_flush_high(pj);
+        if (rv == APR_SUCCESS)
+          rv = json_put_code(pj, code);
+        continue;
+        }
+
+      case JSON_LITERAL:
+        if (pj->literal ? pj->literal[pj->literal_pos] == c : json_number_char(c))
+          {
+          p++;
+          pj->literal_pos++;
+          rv = json_put(pj, &c, 1);
+          }
+        else
+          rv = json_literal_end(pj);
+        continue;
+      }
+
+    // Между лексемами пробелы пропускаются
+    p++;
+    if (json_space(c))
+      continue;
+
+    switch (pj->state)
+      {
+      case JSON_VALUE_FIRST:
+        if (c == ']')
+          {
+          json_pop(pj);
+          break;
+          }
+        rv = json_value_start(pj, c);
+        break;
+
+      case JSON_VALUE:
+        rv = json_value_start(pj, c);
+        break;
+
+      case JSON_NAME_FIRST:
+      case JSON_NAME:
+        if (c == '}' && pj->state == JSON_NAME_FIRST)
+          json_pop(pj);
+        else if (c == '"')
+          {
+          pj->in_name = true;
+          pj->name_len = 0;
+          pj->name_long = false;
+          pj->state = JSON_STRING;
+          }
+        else
+          rv = APR_EINVAL;
+        break;
+
+      case JSON_COLON:
+        if (c == ':')
+          pj->state = JSON_VALUE;
+        else
+          rv = APR_EINVAL;
+        break;
+
+      case JSON_AFTER:
+        {
+        int array = pj->arrays >> (pj->depth - 1) & 1;
+        if (c == ',')
+          pj->state = array ? JSON_VALUE : JSON_NAME;
+        else if (c == (array ? ']' : '}'))
+          json_pop(pj);
+        else
+          rv = APR_EINVAL;
+        break;
+        }
+
+      default:
+        rv = APR_EINVAL;
+      }
+    }
+
+  if (rv != APR_SUCCESS)
+    return rv;
+  return pj->state == JSON_DONE ? APR_EOF : APR_SUCCESS;
+}
+
+apr_status_t params_json_end(params_json_t *pj)
+{
+  if (pj->state == JSON_LITERAL && json_literal_end(pj) != APR_SUCCESS)
+    return APR_EINVAL;
+
+  if (pj->state == JSON_DONE)
+    return APR_EOF;
+  return pj->state == JSON_END ? APR_SUCCESS : APR_EINVAL;
+}
+
+// Очередной параметр заголовка вида ; attr=value или ; attr="value" в [*p, end). Значение возвращается без кавычек,
+// у параметра без = оно пустое. false - параметров больше нет или кавычка не закрыта (строка заголовка обрезана)
+static int header_param(const char **p, const char *end, const char **attr, apr_size_t *attr_len, const char **value,
+                        apr_size_t *value_len)
+{
+  const char *c = *p;
+  while (c < end && (*c == ' ' || *c == '\t' || *c == ';'))
+    c++;
+  if (c == end)
+    return false;
+
+  *attr = c;
+  while (c < end && *c != '=' && *c != ';')
+    c++;
+  const char *attr_end = c;
+  while (attr_end > *attr && (attr_end[-1] == ' ' || attr_end[-1] == '\t'))
+    attr_end--;
+  *attr_len = attr_end - *attr;
+
+  *value = c;
+  *value_len = 0;
+  if (c < end && *c == '=')
+    {
+    c++;
+    while (c < end && (*c == ' ' || *c == '\t'))
+      c++;
+    if (c < end && *c == '"')
+      {
+      const char *quote = (const char *)memchr(c + 1, '"', end - c - 1);
+      if (!quote)
+        return false;
+      *value = c + 1;
+      *value_len = quote - c - 1;
+      c = quote + 1;
+      }
+    else
+      {
+      *value = c;
+      while (c < end && *c != ';')
+        c++;
+      const char *value_end = c;
+      while (value_end > *value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+        value_end--;
+      *value_len = value_end - *value;
+      }
+    }
+
+  // Остаток значения без кавычек до ; не относится к параметру
+  while (c < end && *c != ';')
+    c++;
+  *p = c;
+  return true;
+}
+
+const char *params_multipart_boundary(apr_pool_t *pool, const char *content_type)
+{
+  const char *p = strchr(content_type, ';'), *attr, *value;
+  apr_size_t attr_len, value_len;
+  if (!p)
+    return NULL;
+
+  const char *end = p + strlen(p);
+  while (header_param(&p, end, &attr, &attr_len, &value, &value_len))
+    {
+    if (attr_len != 8 || strncasecmp(attr, "boundary", 8) != 0)
+      continue;
+    // Граница с CR или LF не может быть найдена в теле, а длинная не помещается в params_multipart_t
+    if (!value_len || value_len > PARAMS_BOUNDARY_MAX || memchr(value, '\r', value_len) || memchr(value, '\n', value_len))
+      return NULL;
+    return apr_pstrmemdup(pool, value, value_len);
+    }
+
+  return NULL;
+}
+
+void params_multipart_init(params_multipart_t *pm, apr_pool_t *pool, const param_spec_t *spec, apr_size_t value_max,
+                           const char *boundary)
+{
+  memset(pm, 0, sizeof(params_multipart_t));
+  pm->pool = pool;
+  pm->spec = spec;
+  pm->value_max = value_max;
+  pm->state = MULTIPART_PREAMBLE;
+  pm->key = -1;
+
+  apr_size_t len = strlen(boundary);
+  if (len > PARAMS_BOUNDARY_MAX)
+    len = PARAMS_BOUNDARY_MAX;
+  memcpy(pm->delimiter, "\r\n--", 4);
+  memcpy(pm->delimiter + 4, boundary, len);
+  pm->delimiter_len = len + 4;
+  // Первая граница может стоять в самом начале тела, без CRLF перед ней: считаем, что CRLF уже совпал
+  pm->match = 2;
+}
+
+// Начало разделителя delim длины n в [p, end): полное совпадение или, если его нет, начало разделителя, которое
+// может продолжиться в следующей порции; end - разделителя нет. CR в разделителе встречается только первым байтом
+// (в границе его нет), поэтому после несовпадения поиск продолжается с того же байта, без возврата назад
+#ifdef PARAMS_X86
+// Кандидаты разделителя по 64 позиции за шаг (см. multipart_find). Возвращает найденный разделитель или первую
+// непросмотренную позицию
+__attribute__((target("avx2")))
+static const char *multipart_find_avx2(const char *p, const char *end, const char *delim, apr_size_t n)
+{
+  const __m256i first = _mm256_set1_epi8(delim[0]), last = _mm256_set1_epi8(delim[n - 1]);
+  for (; end - p >= (apr_ssize_t)(n - 1 + 64); p += 64)
+    {
+    __m256i lo = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), first),
+                                  _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + n - 1)), last));
+    __m256i hi = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), first),
+                                  _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32 + n - 1)), last));
+    __m256i any = _mm256_or_si256(lo, hi);
+    if (_mm256_testz_si256(any, any))
+      continue;
+
+    apr_uint64_t mask = (unsigned)_mm256_movemask_epi8(lo) | (apr_uint64_t)(unsigned)_mm256_movemask_epi8(hi) << 32;
+    while (mask)
+      {
+      int i = __builtin_ctzll(mask);
+      if (memcmp(p + i + 1, delim + 1, n - 2) == 0)
+        return p + i;
+      mask &= mask - 1;
+      }
+    }
+
+  return p;
+}
+
+static int params_avx2()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static const char *multipart_find(const char *p, const char *end, const char *delim, apr_size_t n)
+{
+#ifdef PARAMS_X86
+  static const int avx2 = params_avx2();
+  if (avx2)
+    p = multipart_find_avx2(p, end, delim, n);
+#endif
+
+#ifdef __SSE2__
+  // Кандидаты - позиции, где совпадают первый и последний байты разделителя, сразу по 16 позиций; остальные байты
+  // сравниваются только у кандидатов. В данных без CR кандидатов нет, и содержимое части пропускается за один проход
+  const __m128i first = _mm_set1_epi8(delim[0]), last = _mm_set1_epi8(delim[n - 1]);
+  for (; end - p >= (apr_ssize_t)(n - 1 + 16); p += 16)
+    {
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + n - 1));
+    int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask)
+      {
+      int i = __builtin_ctz(mask);
+      if (memcmp(p + i + 1, delim + 1, n - 2) == 0)
+        return p + i;
+      mask &= mask - 1;
+      }
+    }
+#endif
+
+  for (; p < end && (p = (const char *)memchr(p, delim[0], end - p)) != NULL; p++)
+    {
+    apr_size_t avail = (apr_size_t)(end - p) < n ? end - p : n;
+    if (memcmp(p, delim, avail) == 0)
+      return p;
+    }
+
+  return end;
+}
+
+// Содержимое текущей части: значение искомого поля собирается, остальное пропускается без копирования
+static apr_status_t multipart_data(params_multipart_t *pm, const char *data, apr_size_t n)
+{
+  if (pm->state != MULTIPART_DATA || pm->key < 0 || !n)
+    return APR_SUCCESS;
+  if (pm->spec->chunk)
+    {
+    pm->spec->chunk(pm->spec, pm->name, pm->name_len, data, n, false);
+    return APR_SUCCESS;
+    }
+  return value_append(pm->pool, pm->value_max, &pm->value, data, n);
+}
+
+// Разделитель найден: значение искомого поля передается вызывающему
+static void multipart_delimiter(params_multipart_t *pm)
+{
+  int done = false;
+  if (pm->state == MULTIPART_DATA && pm->key >= 0 && pm->spec->chunk)
+    done = pm->spec->chunk(pm->spec, pm->name, pm->name_len, NULL, 0, true);
+  else if (pm->state == MULTIPART_DATA && pm->key >= 0)
+    {
+    apr_size_t len = pm->value.len;
+    char *value = value_take(pm->pool, &pm->value);
+    value[len] = 0;
+    done = param_found(pm->spec, pm->key, value, len);
+    }
+
+  pm->state = done ? MULTIPART_DONE : MULTIPART_BOUNDARY;
+}
+
+// Строка заголовка части закончена. Из Content-Disposition: form-data; name="..." берется имя поля; части
+// с filename - файлы, их значения не нужны
+static void multipart_header(params_multipart_t *pm)
+{
+  static const char disposition[] = "Content-Disposition:";
+  apr_size_t prefix = sizeof(disposition) - 1;
+  if (pm->line_len < prefix || strncasecmp(pm->line, disposition, prefix) != 0)
+    return;
+
+  const char *p = pm->line + prefix, *end = pm->line + pm->line_len, *attr, *value;
+  apr_size_t attr_len, value_len;
+  int key = -1, file = false;
+  while (header_param(&p, end, &attr, &attr_len, &value, &value_len))
+    {
+    if (attr_len == 4 && strncasecmp(attr, "name", 4) == 0)
+      {
+      key = param_index(pm->spec, value, value_len);
+      pm->name_len = value_len < PARAM_NAME_MAX ? value_len : PARAM_NAME_MAX;
+      memcpy(pm->name, value, pm->name_len);
+      }
+    else if (attr_len >= 8 && strncasecmp(attr, "filename", 8) == 0)
+      file = true;
+    }
+
+  // Для spec->chunk передаются все поля, кроме файлов
+  pm->key = file ? -1 : pm->spec->chunk ? 0 : key;
+}
+
+apr_status_t params_multipart_feed(params_multipart_t *pm, const char *data, apr_size_t len)
+{
+  const char *p = data, *end = data + len;
+  apr_status_t rv = APR_SUCCESS;
+  while (p < end && pm->state != MULTIPART_DONE && pm->state != MULTIPART_EPILOGUE && rv == APR_SUCCESS)
+    {
+    switch (pm->state)
+      {
+      case MULTIPART_PREAMBLE:
+      case MULTIPART_DATA:
+        {
+        // Продолжение разделителя, начало которого пришло в конце предыдущей порции
+        if (pm->match)
+          {
+          apr_size_t n = pm->delimiter_len - pm->match;
+          if (n > (apr_size_t)(end - p))
+            n = end - p;
+          if (memcmp(p, pm->delimiter + pm->match, n) == 0)
+            {
+            p += n;
+            pm->match += n;
+            if (pm->match == pm->delimiter_len)
+              {
+              pm->match = 0;
+              multipart_delimiter(pm);
+              }
+            continue;
+            }
+
+          // Совпавшее начало оказалось содержимым части
+          rv = multipart_data(pm, pm->delimiter, pm->match);
+          pm->match = 0;
+          continue;
+          }
+
+        const char *found = multipart_find(p, end, pm->delimiter, pm->delimiter_len);
+        rv = multipart_data(pm, p, found - p);
+        if (rv != APR_SUCCESS)
+          continue;
+        if ((apr_size_t)(end - found) >= pm->delimiter_len)
+          {
+          p = found + pm->delimiter_len;
+          multipart_delimiter(pm);
+          }
+        else
+          {
+          pm->match = end - found;
+          p = end;
+          }
+        continue;
+        }
+
+      case MULTIPART_BOUNDARY:
+        {
+        // После границы допустимы пробелы перед CRLF
+        char c = *p++;
+        if (c == '-')
+          pm->state = MULTIPART_CLOSE;
+        else if (c == '\r')
+          pm->state = MULTIPART_BOUNDARY_LF;
+        else if (c != ' ' && c != '\t')
+          rv = APR_EINVAL;
+        continue;
+        }
+
+      case MULTIPART_CLOSE:
+        if (*p++ == '-')
+          pm->state = MULTIPART_EPILOGUE;
+        else
+          rv = APR_EINVAL;
+        continue;
+
+      case MULTIPART_BOUNDARY_LF:
+        if (*p++ != '\n')
+          {
+          rv = APR_EINVAL;
+          continue;
+          }
+        pm->state = MULTIPART_HEADERS;
+        pm->key = -1;
+        pm->name_len = 0;
+        pm->line_len = 0;
+        continue;
+
+      case MULTIPART_HEADERS:
+        {
+        // Строка заголовка длиннее PARAMS_HEADER_MAX хранится только началом
+        const char *lf = (const char *)memchr(p, '\n', end - p);
+        const char *line_end = lf ? lf : end;
+        apr_size_t n = line_end - p;
+        if (n > PARAMS_HEADER_MAX - pm->line_len)
+          n = PARAMS_HEADER_MAX - pm->line_len;
+        memcpy(pm->line + pm->line_len, p, n);
+        pm->line_len += n;
+        p = line_end;
+        if (!lf)
+          continue;
+
+        p++;
+        if (pm->line_len && pm->line[pm->line_len - 1] == '\r')
+          pm->line_len--;
+        // Пустая строка заканчивает заголовки
+        if (!pm->line_len)
+          pm->state = MULTIPART_DATA;
+        else
+          multipart_header(pm);
+        pm->line_len = 0;
+        continue;
+        }
+      }
+    }
+
+  if (rv != APR_SUCCESS)
+    return rv;
+  return pm->state == MULTIPART_DONE ? APR_EOF : APR_SUCCESS;
+}
+
+apr_status_t params_multipart_end(params_multipart_t *pm)
+{
+  if (pm->state == MULTIPART_DONE)
+    return APR_EOF;
+  return pm->state == MULTIPART_EPILOGUE ? APR_SUCCESS : APR_EINVAL;
+}
+
+int params_body_format(const char *content_type)
+{
+  if (!content_type)
+    return -1;
+  if (strncasecmp(content_type, CONTENT_TYPE_URLENCODED, strlen(CONTENT_TYPE_URLENCODED)) == 0)
+    return PARAMS_URLENCODED;
+  if (strncasecmp(content_type, CONTENT_TYPE_JSON, strlen(CONTENT_TYPE_JSON)) == 0)
+    return PARAMS_JSON;
+  if (strncasecmp(content_type, CONTENT_TYPE_MULTIPART, strlen(CONTENT_TYPE_MULTIPART)) == 0)
+    return PARAMS_MULTIPART;
+  return -1;
+}
+
+void params_body_init(params_body_t *pb, int format, apr_pool_t *pool, const param_spec_t *spec, apr_size_t value_max,
+                      const char *boundary)
+{
+  pb->format = format;
+  if (format == PARAMS_JSON)
+    params_json_init(&pb->u.json, pool, spec, value_max);
+  else if (format == PARAMS_MULTIPART)
+    params_multipart_init(&pb->u.multipart, pool, spec, value_max, boundary);
+  else
+    params_stream_init(&pb->u.urlencoded, pool, spec, value_max);
+}
+
+apr_status_t params_body_feed(params_body_t *pb, const char *data, apr_size_t len)
+{
+  if (pb->format == PARAMS_JSON)
+    return params_json_feed(&pb->u.json, data, len);
+  if (pb->format == PARAMS_MULTIPART)
+    return params_multipart_feed(&pb->u.multipart, data, len);
+  return params_stream_feed(&pb->u.urlencoded, data, len);
+}
+
+apr_status_t params_body_end(params_body_t *pb)
+{
+  if (pb->format == PARAMS_JSON)
+    return params_json_end(&pb->u.json);
+  if (pb->format == PARAMS_MULTIPART)
+    return params_multipart_end(&pb->u.multipart);
+  return params_stream_end(&pb->u.urlencoded);
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "apr_pools.h"
+#include "apr_errno.h"
+#include "apr_tables.h"
+
+// Разбор параметров запроса без промежуточных таблиц: строка проходится один раз, имена сравниваются с искомыми
+// прямо в исходной строке, а в память пула декодируются только значения искомых параметров.
+// Разбор прекращается, как только найдено все, что нужно обработчику
+
+// Имена длиннее не декодируются: искомые имена короткие
+#define PARAM_NAME_MAX 256
+
+typedef struct param_spec_t param_spec_t;
+
+// Вызывается для каждого найденного параметра: key - индекс имени в spec->names (без учета регистра), value - декодированное
+// значение длины len в памяти пула, за ним 0. true - нужные параметры уже найдены, разбор можно прекратить.
+// Для тела, состоящего из записей (объекты JSON в массиве), после каждой записи вызывается с key == PARAM_RECORD_END
+// и value == NULL
+typedef int (*param_fn)(const param_spec_t *spec, int key, const char *value, apr_size_t len);
+
+#define PARAM_RECORD_END -1
+
+// Передача значений всех параметров по частям, без накопления в памяти (JSON и multipart/form-data): вызывается
+// для каждой декодированной порции значения, а в конце значения - с last и пустой порцией. name - декодированное
+// имя длины name_len (длинное имя обрезано до PARAM_NAME_MAX), у элементов массива JSON - имя ближайшего члена.
+// true в конце значения - разбор можно прекратить
+typedef int (*param_chunk_fn)(const param_spec_t *spec, const char *name, apr_size_t name_len, const char *data,
+                              apr_size_t len, int last);
+
+struct param_spec_t {
+  const char *const *names;     // искомые имена
+  int count;
+  param_fn fn;                  // NULL - в values[key] запоминается первое значение каждого имени
+  const char **values;          // count значений для fn == NULL, ненайденные остаются NULL
+  void *ctx;                    // данные fn и chunk
+  param_chunk_fn chunk;         // не NULL - все значения передаются по частям, names и fn не используются
+};
+
+// Разбирает строку параметров URL (r->args): пары имя=значение через & или ;, %XX и + в именах и значениях.
+// Неверная последовательность %XX остается как есть. true - разбор прекращен досрочно по ответу spec->fn
+int params_query(apr_pool_t *pool, const char *args, const param_spec_t *spec);
+
+// Передает параметр, имя и значение которого уже декодированы другим парсером; value - в памяти пула, за ним 0.
+// true - разбор можно прекратить
+int params_put(const param_spec_t *spec, const char *name, apr_size_t name_len, const char *value, apr_size_t len);
+
+// true - найдены значения всех имен spec (для fn == NULL)
+int params_complete(const param_spec_t *spec);
+
+// Пары значений имен spec->names[0] и spec->names[1] (user и pass) в порядке параметров
+typedef struct {
+  const char *first;
+  const char *second;           // NULL - второе значение для пары не передано
+} param_pair_t;
+
+// Сбор пар функцией params_pairs_fn (spec->ctx). Второе значение относится к ближайшему предыдущему первому, а в записи
+// JSON - к первому значению той же записи, в каком бы порядке ни шли члены объекта
+typedef struct {
+  apr_array_header_t *pairs;    // param_pair_t
+  int max;                      // наибольшее число пар
+  int too_many;                 // пар больше max, разбор прекращен
+  param_pair_t *last;           // пара последнего первого значения, в JSON - только в текущей записи
+  const char *second;           // второе значение текущей записи, пришедшее раньше первого
+} param_pairs_t;
+
+void params_pairs_init(param_pairs_t *pp, apr_pool_t *pool, int max);
+
+int params_pairs_fn(const param_spec_t *spec, int key, const char *value, apr_size_t len);
+
+// Значение искомого параметра, собираемое из нескольких порций тела, в памяти пула
+typedef struct {
+  char *data;
+  apr_size_t len;
+  apr_size_t size;
+} param_value_t;
+
+// Потоковый разбор тела application/x-www-form-urlencoded, которое приходит порциями произвольной длины.
+// В памяти держится только имя текущего параметра и значение искомого; значения остальных пропускаются
+typedef struct {
+  apr_pool_t *pool;
+  const param_spec_t *spec;
+  apr_size_t value_max;         // наибольшая длина значения искомого параметра до декодирования
+  int state;
+  int key;                      // индекс имени, значение которого сейчас собирается
+  apr_size_t name_len;
+  char name[PARAM_NAME_MAX];    // имя текущего параметра до декодирования
+  param_value_t value;          // значение искомого параметра до декодирования
+} params_stream_t;
+
+void params_stream_init(params_stream_t *ps, apr_pool_t *pool, const param_spec_t *spec, apr_size_t value_max);
+
+// Разбирает очередную порцию тела. APR_SUCCESS - нужны следующие порции, APR_EOF - все нужное найдено и дальше
+// тело можно не читать, APR_ENOSPC - значение искомого параметра длиннее value_max
+apr_status_t params_stream_feed(params_stream_t *ps, const char *data, apr_size_t len);
+
+// Конец тела: передает последний параметр. APR_SUCCESS или APR_EOF, как params_stream_feed
+apr_status_t params_stream_end(params_stream_t *ps);
+
+// Наибольшая вложенность JSON: уровень хранится битом в apr_uint64_t
+#define PARAMS_JSON_DEPTH 64
+
+// Потоковый SAX-разбор тела application/json без построения дерева. Искомые параметры - члены объекта верхнего
+// уровня или объектов - элементов массива верхнего уровня: {"user":..,"pass":..} или [{"user":..,"pass":..},..].
+// Значение члена - строка, число, true или false (null - как отсутствующий член). Все остальное пропускается,
+// и память выделяется только под значения искомых членов
+typedef struct {
+  apr_pool_t *pool;
+  const param_spec_t *spec;
+  apr_size_t value_max;         // наибольшая длина значения искомого члена после декодирования
+  int state;
+  int depth;
+  apr_uint64_t arrays;          // бит i - уровень вложенности i является массивом
+  int key;                      // индекс искомого имени, значение которого сейчас разбирается, -1 - значение не нужно
+  int in_name;                  // разбирается строка - имя члена
+  int name_long;                // имя длиннее PARAM_NAME_MAX и искомым быть не может
+  apr_size_t name_len;
+  char name[PARAM_NAME_MAX];    // декодированное имя члена
+  const char *literal;          // разбираемый литерал true, false или null, NULL - число
+  int literal_pos;
+  unsigned code;                // код символа \uXXXX
+  int hex_left;                 // сколько цифр \uXXXX осталось
+  unsigned high;                // старшая половина суррогатной пары, ожидающая младшую
+  param_value_t value;          // значение искомого члена
+} params_json_t;
+
+void params_json_init(params_json_t *pj, apr_pool_t *pool, const param_spec_t *spec, apr_size_t value_max);
+
+// Разбирает очередную порцию тела. APR_SUCCESS - нужны следующие порции, APR_EOF - все нужное найдено и дальше
+// тело можно не читать, APR_ENOSPC - значение искомого члена длиннее value_max, APR_EINVAL - тело не является JSON
+apr_status_t params_json_feed(params_json_t *pj, const char *data, apr_size_t len);
+
+// Конец тела. APR_SUCCESS или APR_EOF, как params_json_feed; APR_EINVAL - документ не закончен
+apr_status_t params_json_end(params_json_t *pj);
+
+// Наибольшая длина границы multipart (RFC 2046)
+#define PARAMS_BOUNDARY_MAX 70
+// Сколько байт строки заголовка части multipart хранится: Content-Disposition с именем поля короче
+#define PARAMS_HEADER_MAX 1024
+
+// Потоковый разбор тела multipart/form-data. Граница ищется сразу в порциях тела, части не копируются и не пишутся
+// во временные файлы: в памяти собираются только значения искомых текстовых полей, а файлы (части с filename)
+// и остальные поля пропускаются
+typedef struct {
+  apr_pool_t *pool;
+  const param_spec_t *spec;
+  apr_size_t value_max;         // наибольшая длина значения искомого поля
+  int state;
+  char delimiter[PARAMS_BOUNDARY_MAX + 4];  // CRLF--граница
+  apr_size_t delimiter_len;
+  apr_size_t match;             // сколько байт разделителя совпало в конце предыдущей порции
+  int key;                      // индекс искомого имени текущей части, -1 - часть пропускается
+  apr_size_t name_len;
+  char name[PARAM_NAME_MAX];    // имя поля текущей части для spec->chunk
+  apr_size_t line_len;
+  char line[PARAMS_HEADER_MAX]; // начало текущей строки заголовка части
+  param_value_t value;          // значение искомого поля
+} params_multipart_t;
+
+// Граница из заголовка Content-Type: multipart/form-data; boundary=..., в памяти пула. NULL - границы нет
+// или она недопустима
+const char *params_multipart_boundary(apr_pool_t *pool, const char *content_type);
+
+void params_multipart_init(params_multipart_t *pm, apr_pool_t *pool, const param_spec_t *spec, apr_size_t value_max,
+                           const char *boundary);
+
+// Разбирает очередную порцию тела. APR_SUCCESS - нужны следующие порции, APR_EOF - все нужное найдено и дальше
+// тело можно не читать, APR_ENOSPC - значение искомого поля длиннее value_max, APR_EINVAL - нарушен формат частей
+apr_status_t params_multipart_feed(params_multipart_t *pm, const char *data, apr_size_t len);
+
+// Конец тела. APR_SUCCESS или APR_EOF, как params_multipart_feed; APR_EINVAL - нет завершающей границы
+apr_status_t params_multipart_end(params_multipart_t *pm);
+
+// Форматы тела запроса
+enum {
+  PARAMS_URLENCODED,
+  PARAMS_JSON,
+  PARAMS_MULTIPART
+};
+
+// Формат тела по заголовку Content-Type, -1 - тело не разбирается
+int params_body_format(const char *content_type);
+
+// Потоковый разбор тела в одном из форматов PARAMS_*
+typedef struct {
+  int format;
+  union {
+    params_stream_t urlencoded;
+    params_json_t json;
+    params_multipart_t multipart;
+  } u;
+} params_body_t;
+
+// boundary - граница для PARAMS_MULTIPART (см. params_multipart_boundary)
+void params_body_init(params_body_t *pb, int format, apr_pool_t *pool, const param_spec_t *spec, apr_size_t value_max,
+                      const char *boundary = NULL);
+
+// Результаты - как у params_stream_feed, params_json_feed и params_multipart_feed
+apr_status_t params_body_feed(params_body_t *pb, const char *data, apr_size_t len);
+
+apr_status_t params_body_end(params_body_t *pb);
@@ -0,0 +1,240 @@
+#include "app_session.h"
+
+#include "apr_strings.h"
+#include "string.h"
+#include "openssl/crypto.h"
+
+#define SHA256_BLOCK 64
+
+static const char b64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// base64url без дополнения '='
+static char *b64url_encode(apr_pool_t *pool, const unsigned char *data, apr_size_t len)
+{
+  char *out = (char *)apr_palloc(pool, (len + 2) / 3 * 4 + 1);
+  char *dst = out;
+  apr_size_t i = 0;
+  for (; i + 2 < len; i += 3)
+    {
+    apr_uint32_t v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+    *dst++ = b64url[v >> 18];
+    *dst++ = b64url[(v >> 12) & 63];
+    *dst++ = b64url[(v >> 6) & 63];
+    *dst++ = b64url[v & 63];
+    }
+  if (i < len)
+    {
+    apr_uint32_t v = data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0);
+    *dst++ = b64url[v >> 18];
+    *dst++ = b64url[(v >> 12) & 63];
+    if (i + 1 < len)
+      *dst++ = b64url[(v >> 6) & 63];
+    }
+  *dst = 0;
+
+  return out;
+}
+
+static int b64url_value(char c)
+{
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if (c == '-')
+    return 62;
+  if (c == '_')
+    return 63;
+  return -1;
+}
+
+// Раскодирует len символов base64url в out (не менее len * 3 / 4 байт). Возвращает число байт или -1
+static long b64url_decode(const char *src, apr_size_t len, unsigned char *out)
+{
+  if (len % 4 == 1)
+    return -1;
+
+  long n = 0;
+  apr_uint32_t v = 0;
+  for (apr_size_t i = 0; i < len; i++)
+    {
+    int d = b64url_value(src[i]);
+    if (d < 0)
+      return -1;
+    v = v << 6 | d;
+    if (i % 4 == 3)
+      {
+      out[n++] = v >> 16;
+      out[n++] = v >> 8;
+      out[n++] = v;
+      v = 0;
+      }
+    }
+
+  // Неполная последняя группа: 2 символа - 1 байт, 3 символа - 2 байта
+  if (len % 4 == 2)
+    out[n++] = v >> 4;
+  else if (len % 4 == 3)
+    {
+    out[n++] = v >> 10;
+    out[n++] = v >> 2;
+    }
+
+  return n;
+}
+
+// Раскодированная часть значения как строка, NULL - ошибка или байт 0 внутри
+static const char *b64url_string(apr_pool_t *pool, const char *src, apr_size_t len)
+{
+  unsigned char *out = (unsigned char *)apr_palloc(pool, len * 3 / 4 + 1);
+  long n = b64url_decode(src, len, out);
+  if (n < 0 || memchr(out, 0, n))
+    return NULL;
+
+  out[n] = 0;
+  return (const char *)out;
+}
+
+static apr_status_t session_key_cleanup(void *data)
+{
+  session_key_t *key = (session_key_t *)data;
+  EVP_MD_CTX_free(key->inner);
+  EVP_MD_CTX_free(key->outer);
+  key->inner = key->outer = NULL;
+
+  return APR_SUCCESS;
+}
+
+// Освобождает рабочий контекст потока при его завершении
+static void session_work_free(void *data)
+{
+  EVP_MD_CTX_free((EVP_MD_CTX *)data);
+}
+
+// Контекст с состоянием SHA-256 после блока key XOR pad
+static EVP_MD_CTX *session_pad_ctx(const EVP_MD *md, const unsigned char *block, unsigned char pad)
+{
+  unsigned char buf[SHA256_BLOCK];
+  for (int i = 0; i < SHA256_BLOCK; i++)
+    buf[i] = block[i] ^ pad;
+
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (ctx && (!EVP_DigestInit_ex(ctx, md, NULL) || !EVP_DigestUpdate(ctx, buf, sizeof(buf))))
+    {
+    EVP_MD_CTX_free(ctx);
+    ctx = NULL;
+    }
+
+  OPENSSL_cleanse(buf, sizeof(buf));
+  return ctx;
+}
+
+apr_status_t session_key_init(session_key_t *key, apr_pool_t *pool, const unsigned char *secret, apr_size_t len)
+{
+  memset(key, 0, sizeof(session_key_t));
+  EVP_MD *md = EVP_MD_fetch(NULL, "SHA256", NULL);
+  if (!md)
+    return APR_EGENERAL;
+
+  // Ключ длиннее блока заменяется его хешем, как требует HMAC
+  unsigned char block[SHA256_BLOCK] = {0};
+  unsigned int n;
+  int ok = true;
+  if (len > SHA256_BLOCK)
+    ok = EVP_Digest(secret, len, block, &n, md, NULL);
+  else
+    memcpy(block, secret, len);
+
+  if (ok)
+    {
+    key->inner = session_pad_ctx(md, block, 0x36);
+    key->outer = session_pad_ctx(md, block, 0x5c);
+    }
+  OPENSSL_cleanse(block, sizeof(block));
+  EVP_MD_free(md);
+  apr_pool_cleanup_register(pool, key, session_key_cleanup, apr_pool_cleanup_null);
+
+  if (!key->inner || !key->outer)
+    return APR_EGENERAL;
+  return apr_threadkey_private_create(&key->work, session_work_free, pool);
+}
+
+// Рабочий контекст этого потока, создается при первой подписи в потоке
+static EVP_MD_CTX *session_work(const session_key_t *key)
+{
+  void *ctx = NULL;
+  apr_threadkey_private_get(&ctx, key->work);
+  if (ctx)
+    return (EVP_MD_CTX *)ctx;
+
+  ctx = EVP_MD_CTX_new();
+  if (ctx && apr_threadkey_private_set(ctx, key->work) != APR_SUCCESS)
+    {
+    EVP_MD_CTX_free((EVP_MD_CTX *)ctx);
+    ctx = NULL;
+    }
+
+  return (EVP_MD_CTX *)ctx;
+}
+
+apr_status_t session_mac(const session_key_t *key, const char *data, apr_size_t len, unsigned char *mac)
+{
+  EVP_MD_CTX *ctx = key->work ? session_work(key) : NULL;
+  unsigned int n;
+  if (!ctx || !EVP_MD_CTX_copy_ex(ctx, key->inner) || !EVP_DigestUpdate(ctx, data, len) || !EVP_DigestFinal_ex(ctx, mac, &n))
+    return APR_EGENERAL;
+
+  if (!EVP_MD_CTX_copy_ex(ctx, key->outer) || !EVP_DigestUpdate(ctx, mac, SESSION_MAC_LEN) || !EVP_DigestFinal_ex(ctx, mac, &n))
+    return APR_EGENERAL;
+
+  return APR_SUCCESS;
+}
+
+const char *session_sign(apr_pool_t *pool, const session_key_t *key, apr_time_t expires, const char *login, const char *name)
+{
+  const char *payload = apr_psprintf(pool, "%" APR_TIME_T_FMT ".%s.%s", apr_time_sec(expires),
+                                     b64url_encode(pool, (const unsigned char *)login, strlen(login)),
+                                     b64url_encode(pool, (const unsigned char *)name, strlen(name)));
+
+  unsigned char mac[SESSION_MAC_LEN];
+  if (session_mac(key, payload, strlen(payload), mac) != APR_SUCCESS)
+    return NULL;
+
+  return apr_pstrcat(pool, payload, ".", b64url_encode(pool, mac, sizeof(mac)), NULL);
+}
+
+apr_status_t session_verify(apr_pool_t *pool, const session_key_t *key, const char *value, apr_time_t now,
+                            const char **login, const char **name)
+{
+  // Сначала подпись: до ее проверки содержимое значения не разбирается
+  const char *dot = strrchr(value, '.');
+  if (!dot || strlen(dot + 1) != (SESSION_MAC_LEN * 4 + 2) / 3)
+    return APR_EINVAL;
+
+  unsigned char mac[SESSION_MAC_LEN + 2], expected[SESSION_MAC_LEN];
+  if (b64url_decode(dot + 1, strlen(dot + 1), mac) != SESSION_MAC_LEN)
+    return APR_EINVAL;
+  if (session_mac(key, value, dot - value, expected) != APR_SUCCESS)
+    return APR_EINVAL;
+  if (CRYPTO_memcmp(mac, expected, SESSION_MAC_LEN) != 0)
+    return APR_EINVAL;
+
+  // Подпись верна, значит, значение выдано этим сервером: <срок>.<логин>.<имя>
+  char *end;
+  apr_int64_t expires = apr_strtoi64(value, &end, 10);
+  if (*end != '.' || now >= apr_time_from_sec(expires))
+    return APR_EINVAL;
+
+  const char *login_b64 = end + 1;
+  const char *name_b64 = strchr(login_b64, '.');
+  if (!name_b64 || name_b64 >= dot)
+    return APR_EINVAL;
+  name_b64++;
+
+  *login = b64url_string(pool, login_b64, name_b64 - 1 - login_b64);
+  *name = b64url_string(pool, name_b64, dot - name_b64);
+
+  return *login && *name ? APR_SUCCESS : APR_EINVAL;
+}
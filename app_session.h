@@ -0,0 +1,34 @@
+#pragma once
+
+#include "apr_pools.h"
+#include "apr_thread_proc.h"
+#include "openssl/evp.h"
+
+// Подписанный cookie сессии: после успешного входа клиент получает значение
+//   <срок действия>.<логин>.<имя>.<HMAC-SHA256 от первых трех частей>
+// (логин, имя и подпись в base64url), и следующие запросы проверяются только по подписи, без базы данных.
+// Ключ HMAC обрабатывается один раз: контексты EVP SHA-256 после блоков ipad и opad сохраняются, и подпись
+// копирует их в рабочий контекст своего потока, поэтому проверка подписи - два копирования и три сжатия SHA-256
+// для короткого значения, без поиска алгоритма у провайдера и без выделения памяти
+
+#define SESSION_MAC_LEN 32
+
+typedef struct {
+  EVP_MD_CTX *inner;            // состояние после ключа, объединенного XOR с ipad
+  EVP_MD_CTX *outer;            // состояние после ключа, объединенного XOR с opad
+  apr_threadkey_t *work;        // рабочий контекст EVP потока
+} session_key_t;
+
+// Подготавливает ключ HMAC-SHA256. Контексты освобождаются вместе с pool
+apr_status_t session_key_init(session_key_t *key, apr_pool_t *pool, const unsigned char *secret, apr_size_t len);
+
+// HMAC-SHA256 от data. Ошибка OpenSSL - APR_EGENERAL
+apr_status_t session_mac(const session_key_t *key, const char *data, apr_size_t len, unsigned char *mac);
+
+// Значение cookie для пользователя login с именем name, действующее до expires; NULL - ошибка OpenSSL
+const char *session_sign(apr_pool_t *pool, const session_key_t *key, apr_time_t expires, const char *login, const char *name);
+
+// Проверяет значение cookie: подпись и срок действия на момент now. При успехе возвращает логин и имя.
+// Подделанное, испорченное и просроченное значение - APR_EINVAL
+apr_status_t session_verify(apr_pool_t *pool, const session_key_t *key, const char *value, apr_time_t now,
+                            const char **login, const char **name);
@@ -0,0 +1,272 @@
+#include "app_snapshot.h"
+
+#include "apr_strings.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "openssl/crypto.h"
+
+#define SNAP_MAGIC "APPSNAP1"
+
+// Заголовок файла. Числа записаны в порядке байт той машины, на которой создан снимок
+typedef struct {
+  char magic[8];
+  apr_uint32_t count;           // число записей
+  apr_uint32_t mask;            // число мест в таблице - 1, число мест - степень 2
+  apr_uint64_t strings;         // смещение области строк от начала файла
+  apr_uint64_t size;            // размер файла
+} snap_header_t;
+
+// Место в таблице, сразу за заголовком
+typedef struct {
+  apr_uint32_t tag;             // старшие 32 бита хеша логина, 0 - место свободно
+  apr_uint32_t login;           // смещение логина в области строк
+  apr_uint32_t login_len;
+  apr_uint32_t name;            // смещение имени в области строк
+  unsigned char digest[SNAP_DIGEST_LEN];
+} snap_slot_t;
+
+struct snap_t {
+  const char *base;
+  apr_size_t size;
+  const snap_header_t *header;
+  const snap_slot_t *slots;
+  const char *strings;
+  ino_t ino;
+  dev_t dev;
+  apr_time_t mtime;
+};
+
+// FNV-1a с перемешиванием финализатором MurmurHash3
+static apr_uint64_t snap_hash(const char *key, apr_size_t len)
+{
+  apr_uint64_t h = 0xcbf29ce484222325ull;
+  for (apr_size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)key[i]) * 0x100000001b3ull;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+static apr_uint32_t snap_tag(apr_uint64_t h)
+{
+  apr_uint32_t tag = (apr_uint32_t)(h >> 32);
+  return tag ? tag : 1;
+}
+
+static apr_time_t stat_mtime(const struct stat *st)
+{
+  return apr_time_from_sec(st->st_mtim.tv_sec) + st->st_mtim.tv_nsec / 1000;
+}
+
+apr_status_t snap_write(apr_pool_t *pool, const char *path, const snap_entry_t *entries, apr_size_t count)
+{
+  // Таблица заполнена не более чем наполовину, поэтому отсутствующий логин находится за 1-2 пробы
+  apr_uint64_t slots = 2;
+  while (slots < (apr_uint64_t)count * 2)
+    slots *= 2;
+
+  apr_uint64_t strings_size = 0;
+  for (apr_size_t i = 0; i < count; i++)
+    strings_size += strlen(entries[i].login) + 1 + strlen(entries[i].name) + 1;
+  if (strings_size > 0xffffffffull || slots > 0xffffffffull)
+    return APR_EINVAL;
+
+  apr_uint64_t strings = sizeof(snap_header_t) + slots * sizeof(snap_slot_t);
+  apr_uint64_t size = strings + strings_size + 1;
+  char *buf = (char *)apr_pcalloc(pool, size);
+
+  snap_header_t *header = (snap_header_t *)buf;
+  memcpy(header->magic, SNAP_MAGIC, sizeof(header->magic));
+  header->count = count;
+  header->mask = slots - 1;
+  header->strings = strings;
+  header->size = size;
+
+  snap_slot_t *table = (snap_slot_t *)(header + 1);
+  char *str = buf + strings;
+  apr_uint32_t offset = 0;
+  for (apr_size_t i = 0; i < count; i++)
+    {
+    apr_size_t login_len = strlen(entries[i].login);
+    apr_uint64_t h = snap_hash(entries[i].login, login_len);
+    apr_uint64_t index = h & header->mask;
+    while (table[index].tag)
+      index = (index + 1) & header->mask;
+
+    snap_slot_t *slot = &table[index];
+    slot->tag = snap_tag(h);
+    slot->login = offset;
+    slot->login_len = login_len;
+    memcpy(str + offset, entries[i].login, login_len + 1);
+    offset += login_len + 1;
+
+    slot->name = offset;
+    apr_size_t name_len = strlen(entries[i].name);
+    memcpy(str + offset, entries[i].name, name_len + 1);
+    offset += name_len + 1;
+
+    memcpy(slot->digest, entries[i].digest, SNAP_DIGEST_LEN);
+    }
+
+  // Пишем во временный файл в том же каталоге и переименовываем: процессы, открывшие прежний снимок,
+  // продолжают читать его, а частично записанный файл никто не увидит
+  char *tmp = apr_pstrcat(pool, path, ".XXXXXX", NULL);
+  int fd = mkstemp(tmp);
+  if (fd < 0)
+    return APR_FROM_OS_ERROR(errno);
+
+  apr_status_t rv = APR_SUCCESS;
+  for (apr_uint64_t done = 0; done < size && rv == APR_SUCCESS; )
+    {
+    ssize_t n = write(fd, buf + done, size - done);
+    if (n < 0 && errno != EINTR)
+      rv = APR_FROM_OS_ERROR(errno);
+    else if (n > 0)
+      done += n;
+    }
+
+  if (rv == APR_SUCCESS && (fchmod(fd, 0644) != 0 || fsync(fd) != 0))
+    rv = APR_FROM_OS_ERROR(errno);
+  if (close(fd) != 0 && rv == APR_SUCCESS)
+    rv = APR_FROM_OS_ERROR(errno);
+  if (rv == APR_SUCCESS && rename(tmp, path) != 0)
+    rv = APR_FROM_OS_ERROR(errno);
+
+  if (rv != APR_SUCCESS)
+    unlink(tmp);
+  return rv;
+}
+
+static apr_status_t snap_cleanup(void *data)
+{
+  snap_t *snap = (snap_t *)data;
+  munmap((void *)snap->base, snap->size);
+
+  return APR_SUCCESS;
+}
+
+// Проверяет, что все смещения в файле указывают внутрь него, чтобы поиск не вышел за отображение
+static int snap_valid(const snap_t *snap)
+{
+  const snap_header_t *header = snap->header;
+  if (snap->size < sizeof(snap_header_t) || memcmp(header->magic, SNAP_MAGIC, sizeof(header->magic)) != 0 ||
+      header->size != snap->size || (header->mask & (header->mask + 1)) != 0)
+    return false;
+
+  apr_uint64_t slots = (apr_uint64_t)header->mask + 1;
+  if (header->strings != sizeof(snap_header_t) + slots * sizeof(snap_slot_t) || header->strings >= header->size ||
+      header->count >= slots)
+    return false;
+
+  // Последний байт файла - 0, поэтому любая строка, начинающаяся внутри области строк, завершена
+  apr_uint64_t strings_size = header->size - header->strings;
+  if (snap->strings[strings_size - 1] != 0)
+    return false;
+
+  apr_uint64_t used = 0;
+  for (apr_uint64_t i = 0; i < slots; i++)
+    {
+    const snap_slot_t *slot = &snap->slots[i];
+    if (!slot->tag)
+      continue;
+    if (slot->login >= strings_size || slot->name >= strings_size || slot->login_len >= strings_size - slot->login)
+      return false;
+    used++;
+    }
+
+  return used == header->count;
+}
+
+apr_status_t snap_open(apr_pool_t *pool, const char *path, snap_t **result)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return APR_FROM_OS_ERROR(errno);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    {
+    apr_status_t rv = APR_FROM_OS_ERROR(errno);
+    close(fd);
+    return rv;
+    }
+
+  if (st.st_size < (off_t)sizeof(snap_header_t))
+    {
+    close(fd);
+    return APR_EINVAL;
+    }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  apr_status_t rv = base == MAP_FAILED ? APR_FROM_OS_ERROR(errno) : APR_SUCCESS;
+  close(fd);
+  if (rv != APR_SUCCESS)
+    return rv;
+
+  snap_t *snap = (snap_t *)apr_pcalloc(pool, sizeof(snap_t));
+  snap->base = (const char *)base;
+  snap->size = st.st_size;
+  snap->header = (const snap_header_t *)base;
+  snap->slots = (const snap_slot_t *)(snap->header + 1);
+  snap->strings = snap->base + snap->header->strings;
+  snap->ino = st.st_ino;
+  snap->dev = st.st_dev;
+  snap->mtime = stat_mtime(&st);
+  apr_pool_cleanup_register(pool, snap, snap_cleanup, apr_pool_cleanup_null);
+
+  if (!snap_valid(snap))
+    return APR_EINVAL;
+
+  *result = snap;
+  return APR_SUCCESS;
+}
+
+const char *snap_lookup(const snap_t *snap, const char *login, const unsigned char *digest)
+{
+  apr_size_t len = strlen(login);
+  apr_uint64_t h = snap_hash(login, len);
+  apr_uint32_t tag = snap_tag(h);
+  apr_uint32_t mask = snap->header->mask;
+
+  // Логины в таблице users не уникальны, поэтому проверяем все записи с этим логином до свободного места
+  for (apr_uint64_t index = h & mask; snap->slots[index].tag; index = (index + 1) & mask)
+    {
+    const snap_slot_t *slot = &snap->slots[index];
+    // Хеш пароля сравнивается за постоянное время, чтобы по времени ответа нельзя было подбирать его по байтам
+    if (slot->tag == tag && slot->login_len == len && memcmp(snap->strings + slot->login, login, len) == 0 &&
+        CRYPTO_memcmp(slot->digest, digest, SNAP_DIGEST_LEN) == 0)
+      return snap->strings + slot->name;
+    }
+
+  return NULL;
+}
+
+int snap_changed(const snap_t *snap, const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return false;
+
+  return st.st_ino != snap->ino || st.st_dev != snap->dev || (apr_size_t)st.st_size != snap->size ||
+         stat_mtime(&st) != snap->mtime;
+}
+
+apr_size_t snap_count(const snap_t *snap)
+{
+  return snap->header->count;
+}
+
+apr_time_t snap_mtime(const snap_t *snap)
+{
+  return snap->mtime;
+}
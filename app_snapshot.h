@@ -0,0 +1,39 @@
+#pragma once
+
+#include "apr_pools.h"
+
+// Снимок таблицы users в файле: логин, SHA-256 пароля и имя пользователя для проверки входа без базы данных.
+// Файл - таблица с открытой адресацией (линейное пробирование, заполнение не более 50%) и область строк;
+// модуль отображает его в память только для чтения, поэтому все процессы делят одни страницы.
+// Файл создается программой app_snapshot_build во временном файле и переименовывается поверх прежнего,
+// так что открытый снимок не меняется, а новый виден после повторного snap_open
+
+#define SNAP_DIGEST_LEN 32
+
+typedef struct snap_t snap_t;
+
+typedef struct {
+  const char *login;
+  unsigned char digest[SNAP_DIGEST_LEN];  // SHA-256 пароля
+  const char *name;
+} snap_entry_t;
+
+// Записывает снимок из count записей в файл path: сначала во временный файл рядом, затем переименовывает
+apr_status_t snap_write(apr_pool_t *pool, const char *path, const snap_entry_t *entries, apr_size_t count);
+
+// Отображает файл снимка в память. Отображение снимается при очистке пула.
+// Поврежденный файл или файл другого формата - APR_EINVAL
+apr_status_t snap_open(apr_pool_t *pool, const char *path, snap_t **result);
+
+// Имя пользователя с логином login и SHA-256 пароля digest, NULL - такого нет.
+// Строка лежит в отображенном файле и действительна, пока жив пул снимка
+const char *snap_lookup(const snap_t *snap, const char *login, const unsigned char *digest);
+
+// true, если файл path заменен или изменен после открытия снимка
+int snap_changed(const snap_t *snap, const char *path);
+
+// Количество записей в снимке
+apr_size_t snap_count(const snap_t *snap);
+
+// Время изменения файла снимка
+apr_time_t snap_mtime(const snap_t *snap);
@@ -0,0 +1,160 @@
+// Программа построения снимка таблицы users для опции app_user_snapshot модуля app.
+// Читает из стандартного ввода вывод COPY в текстовом формате PostgreSQL со столбцами
+// login, password (SHA-256 в bytea) и name и атомарно заменяет файл снимка:
+//   psql -c "COPY (SELECT login, password, name FROM users) TO STDOUT" | app_snapshot_build /var/lib/app/users.snap
+
+#include "apr_general.h"
+#include "apr_pools.h"
+#include "apr_tables.h"
+#include "apr_strings.h"
+#include "apr_lib.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "app_snapshot.h"
+
+// Раскодирует поле формата COPY на месте: \t, \n, \\, \ooo и т.д. Возвращает NULL для \N (NULL в SQL)
+static char *copy_field(char *field)
+{
+  if (strcmp(field, "\\N") == 0)
+    return NULL;
+
+  char *dst = field;
+  for (char *src = field; *src; src++)
+    {
+    if (*src != '\\' || !src[1])
+      {
+      *dst++ = *src;
+      continue;
+      }
+
+    src++;
+    switch (*src)
+      {
+      case 'b': *dst++ = '\b'; break;
+      case 'f': *dst++ = '\f'; break;
+      case 'n': *dst++ = '\n'; break;
+      case 'r': *dst++ = '\r'; break;
+      case 't': *dst++ = '\t'; break;
+      case 'v': *dst++ = '\v'; break;
+      case 'x':
+        {
+        int c = 0, n = 0;
+        for (; n < 2 && apr_isxdigit(src[1]); n++)
+          c = c * 16 + (apr_isdigit(src[1]) ? *++src - '0' : apr_tolower(*++src) - 'a' + 10);
+        *dst++ = n ? c : 'x';
+        break;
+        }
+      default:
+        if (*src >= '0' && *src <= '7')
+          {
+          int c = *src - '0';
+          for (int n = 1; n < 3 && src[1] >= '0' && src[1] <= '7'; n++)
+            c = c * 8 + *++src - '0';
+          *dst++ = c;
+          }
+        else
+          *dst++ = *src;
+      }
+    }
+  *dst = 0;
+
+  return field;
+}
+
+// Столбец password в 32 байта SHA-256: bytea в текстовом виде \x<64 HEX-цифры> или HEX-строка из 64 символов
+static int parse_digest(const char *hex, unsigned char *digest)
+{
+  if (hex[0] == '\\' && hex[1] == 'x')
+    hex += 2;
+  if (strlen(hex) != SNAP_DIGEST_LEN * 2)
+    return false;
+
+  for (int i = 0; i < SNAP_DIGEST_LEN * 2; i++)
+    {
+    char c = apr_tolower(hex[i]);
+    int v;
+    if (c >= '0' && c <= '9')
+      v = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v = c - 'a' + 10;
+    else
+      return false;
+
+    if (i % 2)
+      digest[i / 2] |= v;
+    else
+      digest[i / 2] = v << 4;
+    }
+
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+    {
+    fprintf(stderr, "Usage: %s <snapshot file> < COPY (SELECT login, password, name FROM users) TO STDOUT\n", argv[0]);
+    return 2;
+    }
+
+  apr_initialize();
+  apr_pool_t *pool;
+  apr_pool_create(&pool, NULL);
+
+  apr_array_header_t *entries = apr_array_make(pool, 1024, sizeof(snap_entry_t));
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  long line_no = 0, skipped = 0;
+  while ((len = getline(&line, &line_size, stdin)) >= 0)
+    {
+    line_no++;
+    if (len && line[len - 1] == '\n')
+      line[--len] = 0;
+
+    char *fields[3];
+    char *p = apr_pstrmemdup(pool, line, len);
+    int n = 0;
+    for (; n < 3 && p; n++)
+      {
+      fields[n] = p;
+      p = strchr(p, '\t');
+      if (p)
+        *p++ = 0;
+      }
+
+    const char *login = n == 3 && !p ? copy_field(fields[0]) : NULL;
+    const char *password = login ? copy_field(fields[1]) : NULL;
+    const char *name = password ? copy_field(fields[2]) : NULL;
+
+    // Строки без логина или пароля не могут пройти проверку входа, поэтому в снимок не попадают
+    snap_entry_t entry;
+    if (!login || !password || !parse_digest(password, entry.digest))
+      {
+      if (n != 3 || p || (login && password))
+        fprintf(stderr, "Line %ld skipped: expected login, SHA-256 password digest and name\n", line_no);
+      skipped++;
+      continue;
+      }
+
+    entry.login = login;
+    entry.name = name ? name : "";
+    *(snap_entry_t *)apr_array_push(entries) = entry;
+    }
+  free(line);
+
+  apr_status_t rv = snap_write(pool, argv[1], (const snap_entry_t *)entries->elts, entries->nelts);
+  if (rv != APR_SUCCESS)
+    {
+    char error[256];
+    fprintf(stderr, "Failed to write %s: %s\n", argv[1], apr_strerror(rv, error, sizeof(error)));
+    return 1;
+    }
+
+  printf("%s: %d users, %ld rows skipped\n", argv[1], entries->nelts, skipped);
+
+  apr_pool_destroy(pool);
+  apr_terminate();
+  return 0;
+}
@@ -0,0 +1,270 @@
+#include "appfilter_ac.h"
+
+#include "apr_strings.h"
+#include "string.h"
+#include "appfilter_simd.h"
+
+// Если первых байтов больше, кандидаты встречаются почти в каждой позиции,
+// и предварительный поиск только добавляет вызов функции на каждый байт
+#define AC_PREFILTER_MAX_FIRST 48
+
+// Узел итогового автомата. Переходы узла лежат подряд в массивах edge_chars/edge_targets,
+// начиная с индекса first, что позволяет искать переход одним вызовом memchr.
+typedef struct {
+  apr_uint32_t first;     // индекс первого перехода узла
+  apr_uint32_t fail;      // суффиксная ссылка
+  apr_int32_t match;      // номер строки, заканчивающейся в этом узле (с учетом суффиксов), либо -1
+  apr_uint32_t count;     // количество переходов узла
+} ac_node_t;
+
+struct ac_automaton_t {
+  apr_uint32_t root[256];       // переходы из корня заданы для всех байтов, чтобы не искать их в списке
+  pf_set_t first;               // первые байты всех строк
+  pf_find_fn find;              // предварительный поиск первого байта, NULL - не используется
+  int level;                    // вариант предварительного поиска
+  ac_node_t *nodes;
+  unsigned char *edge_chars;
+  apr_uint32_t *edge_targets;
+  apr_size_t nstates;
+};
+
+// Узел и переход бора на этапе построения. Переходы узла хранятся односвязным списком
+typedef struct {
+  apr_int32_t edge;       // индекс первого перехода либо -1
+  apr_uint32_t fail;
+  apr_int32_t match;
+  apr_uint32_t count;
+} build_node_t;
+
+typedef struct {
+  apr_uint32_t target;
+  apr_int32_t next;       // следующий переход этого же узла либо -1
+  unsigned char c;
+} build_edge_t;
+
+#define BNODE(a, i) APR_ARRAY_IDX(a, i, build_node_t)
+#define BEDGE(a, i) APR_ARRAY_IDX(a, i, build_edge_t)
+
+// Ищет переход из узла s по байту c на этапе построения. Возвращает 0, если перехода нет
+static apr_uint32_t build_goto(const apr_uint32_t *root, apr_array_header_t *nodes, apr_array_header_t *edges,
+                               apr_uint32_t s, unsigned char c)
+{
+  if (s == AC_STATE_ROOT)
+    return root[c];
+
+  for (apr_int32_t e = BNODE(nodes, s).edge; e >= 0; e = BEDGE(edges, e).next)
+    if (BEDGE(edges, e).c == c)
+      return BEDGE(edges, e).target;
+
+  return 0;
+}
+
+static apr_uint32_t build_add_node(apr_array_header_t *nodes)
+{
+  build_node_t *n = (build_node_t *)apr_array_push(nodes);
+  n->edge = -1;
+  n->fail = AC_STATE_ROOT;
+  n->match = -1;
+  n->count = 0;
+
+  return nodes->nelts - 1;
+}
+
+apr_status_t ac_compile(apr_pool_t *pool, const apr_array_header_t *patterns, ac_automaton_t **result)
+{
+  if (!pool || !patterns || !result)
+    return APR_EGENERAL;
+
+  // Временные структуры бора живут в отдельном пуле и освобождаются после построения
+  apr_pool_t *tmp;
+  if (apr_pool_create(&tmp, pool) != APR_SUCCESS)
+    return APR_ENOMEM;
+
+  ac_automaton_t *ac = (ac_automaton_t *)apr_pcalloc(pool, sizeof(ac_automaton_t));
+  apr_array_header_t *nodes = apr_array_make(tmp, 256, sizeof(build_node_t));
+  apr_array_header_t *edges = apr_array_make(tmp, 256, sizeof(build_edge_t));
+
+  build_add_node(nodes); // корень
+
+  // Добавим все строки в бор
+  for (int i = 0; i < patterns->nelts; i++)
+    {
+    const unsigned char *str = APR_ARRAY_IDX(patterns, i, const unsigned char *);
+    if (!str || !str[0])
+      continue;
+
+    apr_uint32_t s = AC_STATE_ROOT;
+    for (; *str; str++)
+      {
+      apr_uint32_t t = build_goto(ac->root, nodes, edges, s, *str);
+      if (!t)
+        {
+        t = build_add_node(nodes);
+        if (s == AC_STATE_ROOT)
+          ac->root[*str] = t;
+        else
+          {
+          build_edge_t *e = (build_edge_t *)apr_array_push(edges);
+          e->target = t;
+          e->c = *str;
+          e->next = BNODE(nodes, s).edge;
+          BNODE(nodes, s).edge = edges->nelts - 1;
+          BNODE(nodes, s).count++;
+          }
+        }
+      s = t;
+      }
+
+    // При повторе строки сохраняем номер первого вхождения
+    if (BNODE(nodes, s).match < 0)
+      BNODE(nodes, s).match = i;
+    }
+
+  // Обходом в ширину вычислим суффиксные ссылки. Номер найденной строки наследуется
+  // по суффиксной ссылке, чтобы при сканировании не обходить цепочку ссылок
+  apr_uint32_t *queue = (apr_uint32_t *)apr_palloc(tmp, nodes->nelts * sizeof(apr_uint32_t));
+  int head = 0, tail = 0;
+
+  for (int c = 0; c < 256; c++)
+    if (ac->root[c])
+      queue[tail++] = ac->root[c];
+
+  while (head < tail)
+    {
+    apr_uint32_t s = queue[head++];
+    for (apr_int32_t e = BNODE(nodes, s).edge; e >= 0; e = BEDGE(edges, e).next)
+      {
+      apr_uint32_t t = BEDGE(edges, e).target;
+      unsigned char c = BEDGE(edges, e).c;
+
+      apr_uint32_t f = BNODE(nodes, s).fail;
+      apr_uint32_t g;
+      while (!(g = build_goto(ac->root, nodes, edges, f, c)) && f != AC_STATE_ROOT)
+        f = BNODE(nodes, f).fail;
+
+      BNODE(nodes, t).fail = g;
+      if (BNODE(nodes, t).match < 0)
+        BNODE(nodes, t).match = BNODE(nodes, g).match;
+
+      queue[tail++] = t;
+      }
+    }
+
+  // Переложим бор в компактные массивы: переходы каждого узла лежат подряд
+  ac->nstates = nodes->nelts;
+  ac->nodes = (ac_node_t *)apr_palloc(pool, ac->nstates * sizeof(ac_node_t));
+  ac->edge_chars = (unsigned char *)apr_palloc(pool, edges->nelts + 1);
+  ac->edge_targets = (apr_uint32_t *)apr_palloc(pool, (edges->nelts + 1) * sizeof(apr_uint32_t));
+
+  apr_uint32_t pos = 0;
+  for (apr_size_t s = 0; s < ac->nstates; s++)
+    {
+    ac_node_t *n = &ac->nodes[s];
+    n->first = pos;
+    n->count = BNODE(nodes, s).count;
+    n->fail = BNODE(nodes, s).fail;
+    n->match = BNODE(nodes, s).match;
+    for (apr_int32_t e = BNODE(nodes, s).edge; e >= 0; e = BEDGE(edges, e).next)
+      {
+      ac->edge_chars[pos] = BEDGE(edges, e).c;
+      ac->edge_targets[pos] = BEDGE(edges, e).target;
+      pos++;
+      }
+    }
+
+  apr_pool_destroy(tmp);
+
+  ac_set_prefilter(ac, pf_best_level());
+
+  *result = ac;
+  return APR_SUCCESS;
+}
+
+int ac_scan(const ac_automaton_t *ac, ac_state_t *state, const char *data, apr_size_t len)
+{
+  if (!ac || !state || !data)
+    return -1;
+
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + len;
+  ac_state_t s = *state;
+
+  while (p < end)
+    {
+    // Из корня автомат уходит только по первому байту одной из строк,
+    // поэтому участки без таких байтов пропускаем векторным поиском
+    if (s == AC_STATE_ROOT && ac->find)
+      {
+      p = ac->find(&ac->first, p, end);
+      if (p == end)
+        break;
+      }
+
+    unsigned char c = *p++;
+    // Переходим по суффиксным ссылкам, пока не найдется переход по байту c
+    for (;;)
+      {
+      if (s == AC_STATE_ROOT)
+        {
+        s = ac->root[c];
+        break;
+        }
+      const ac_node_t *n = &ac->nodes[s];
+      const unsigned char *e = (const unsigned char *)memchr(ac->edge_chars + n->first, c, n->count);
+      if (e)
+        {
+        s = ac->edge_targets[e - ac->edge_chars];
+        break;
+        }
+      s = n->fail;
+      }
+
+    if (ac->nodes[s].match >= 0)
+      {
+      *state = s;
+      return ac->nodes[s].match;
+      }
+    }
+
+  *state = s;
+  return -1;
+}
+
+apr_status_t ac_set_prefilter(ac_automaton_t *ac, int level)
+{
+  if (!ac)
+    return APR_EGENERAL;
+
+  unsigned char member[256];
+  int count = 0;
+  for (int c = 0; c < 256; c++)
+    {
+    member[c] = ac->root[c] != AC_STATE_ROOT;
+    count += member[c];
+    }
+
+  ac->level = -1;
+  ac->find = NULL;
+  if (level < 0 || count > AC_PREFILTER_MAX_FIRST)
+    return APR_SUCCESS;
+
+  pf_find_fn find = pf_select(level);
+  if (!find)
+    return APR_ENOTIMPL;
+
+  pf_init(&ac->first, member);
+  ac->find = find;
+  ac->level = level;
+
+  return APR_SUCCESS;
+}
+
+int ac_prefilter(const ac_automaton_t *ac)
+{
+  return ac ? ac->level : -1;
+}
+
+apr_size_t ac_states(const ac_automaton_t *ac)
+{
+  return ac ? ac->nstates : 0;
+}
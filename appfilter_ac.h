@@ -0,0 +1,33 @@
+#pragma once
+
+#include "apr_pools.h"
+#include "apr_tables.h"
+
+// Автомат Ахо-Корасик, построенный по всем строкам appfilter_str.
+// Строится один раз при загрузке конфигурации, после чего доступен только на чтение,
+// поэтому один и тот же автомат можно использовать из любого числа запросов.
+typedef struct ac_automaton_t ac_automaton_t;
+
+// Состояние автомата между вызовами ac_scan. 0 - корень (ничего не совпало).
+// Позволяет сканировать данные по частям, например по бакетам тела запроса.
+typedef apr_uint32_t ac_state_t;
+
+#define AC_STATE_ROOT 0
+
+// Строит автомат по массиву строк (const char *). Пустые строки пропускаются.
+apr_status_t ac_compile(apr_pool_t *pool, const apr_array_header_t *patterns, ac_automaton_t **result);
+
+// Проходит по данным один раз. Возвращает номер найденной строки в массиве patterns
+// либо -1, если совпадений нет. В *state сохраняется состояние для продолжения сканирования.
+int ac_scan(const ac_automaton_t *ac, ac_state_t *state, const char *data, apr_size_t len);
+
+// Выбирает вариант предварительного поиска первых байтов строк (PF_SCALAR...PF_AVX512 из appfilter_simd.h).
+// ac_compile сам выбирает лучший вариант для процессора; -1 отключает предварительный поиск.
+// Если первых байтов слишком много, предварительный поиск не используется.
+apr_status_t ac_set_prefilter(ac_automaton_t *ac, int level);
+
+// Используемый вариант предварительного поиска либо -1
+int ac_prefilter(const ac_automaton_t *ac);
+
+// Количество состояний автомата (для журнала и оценки занимаемой памяти)
+apr_size_t ac_states(const ac_automaton_t *ac);
@@ -0,0 +1,204 @@
+#include "appfilter_cache.h"
+
+#include "apr_general.h"
+#include "string.h"
+
+// Значение записи: поколение правил в старших 32 битах, решение в битах 8-31, признак занятой записи
+#define VC_VALID 0x80
+
+typedef struct {
+  apr_uint64_t check;           // хеш XOR значение
+  apr_uint64_t value;
+} vc_slot_t;
+
+struct vc_cache_t {
+  vc_slot_t *slots;             // корзина i занимает записи i * VC_WAYS ... i * VC_WAYS + VC_WAYS - 1
+  unsigned char *ref;           // бит обращения каждой записи
+  unsigned char *hand;          // стрелка CLOCK каждой корзины
+  apr_uint64_t mask;            // число корзин - 1
+  unsigned char key[16];
+  apr_uint64_t hits;
+  apr_uint64_t misses;
+  apr_uint64_t inserts;
+  apr_uint64_t evictions;
+};
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define COUNT(x) __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+
+#define ROTL(x, b) (apr_uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+  do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+  } while (0)
+
+static apr_uint64_t load_le64(const unsigned char *p)
+{
+  apr_uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+apr_uint64_t vc_siphash(const unsigned char *key, const char *data, apr_size_t len)
+{
+  apr_uint64_t k0 = load_le64(key), k1 = load_le64(key + 8);
+  apr_uint64_t v0 = 0x736f6d6570736575ull ^ k0;
+  apr_uint64_t v1 = 0x646f72616e646f6dull ^ k1;
+  apr_uint64_t v2 = 0x6c7967656e657261ull ^ k0;
+  apr_uint64_t v3 = 0x7465646279746573ull ^ k1;
+
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + (len & ~(apr_size_t)7);
+  for (; p < end; p += 8)
+    {
+    apr_uint64_t m;
+    memcpy(&m, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    m = __builtin_bswap64(m);
+#endif
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+    }
+
+  // Последний блок: оставшиеся байты и длина в старшем байте
+  apr_uint64_t b = (apr_uint64_t)len << 56;
+  for (int i = (len & 7) - 1; i >= 0; i--)
+    b |= (apr_uint64_t)p[i] << (8 * i);
+
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+apr_status_t vc_create(apr_pool_t *pool, apr_size_t entries, vc_cache_t **result)
+{
+  if (!pool || !result || !entries)
+    return APR_EGENERAL;
+
+  apr_uint64_t buckets = 1;
+  while (buckets * VC_WAYS < entries)
+    buckets *= 2;
+
+  vc_cache_t *cache = (vc_cache_t *)apr_pcalloc(pool, sizeof(vc_cache_t));
+  cache->slots = (vc_slot_t *)apr_pcalloc(pool, buckets * VC_WAYS * sizeof(vc_slot_t));
+  cache->ref = (unsigned char *)apr_pcalloc(pool, buckets * VC_WAYS);
+  cache->hand = (unsigned char *)apr_pcalloc(pool, buckets);
+  cache->mask = buckets - 1;
+
+  apr_status_t rv = apr_generate_random_bytes(cache->key, sizeof(cache->key));
+  if (rv != APR_SUCCESS)
+    return rv;
+
+  *result = cache;
+  return APR_SUCCESS;
+}
+
+apr_uint64_t vc_hash(const vc_cache_t *cache, apr_uint64_t tweak, const char *data, apr_size_t len)
+{
+  // tweak смешивается с ключом: одинаковые значения разных частей запроса получают разные хеши
+  unsigned char key[16];
+  memcpy(key, cache->key, sizeof(key));
+  for (int i = 0; i < 8; i++)
+    key[i] ^= (unsigned char)(tweak >> (8 * i));
+
+  return vc_siphash(key, data, len);
+}
+
+static apr_uint64_t make_value(apr_uint32_t gen, apr_uint32_t verdict)
+{
+  return (apr_uint64_t)gen << 32 | (apr_uint64_t)(verdict & 0xffffff) << 8 | VC_VALID;
+}
+
+int vc_get(vc_cache_t *cache, apr_uint64_t hash, apr_uint32_t gen, apr_uint32_t *verdict)
+{
+  apr_uint64_t bucket = hash & cache->mask;
+  vc_slot_t *slots = cache->slots + bucket * VC_WAYS;
+
+  for (int w = 0; w < VC_WAYS; w++)
+    {
+    apr_uint64_t value = LOAD(slots[w].value);
+    apr_uint64_t check = LOAD(slots[w].check);
+    if (!(value & VC_VALID) || (check ^ value) != hash)
+      continue;
+
+    // Решение, принятое по старым правилам, не используется и будет заменено
+    if ((apr_uint32_t)(value >> 32) != gen)
+      break;
+
+    STORE(cache->ref[bucket * VC_WAYS + w], 1);
+    COUNT(cache->hits);
+    *verdict = (apr_uint32_t)(value >> 8) & 0xffffff;
+    return true;
+    }
+
+  COUNT(cache->misses);
+  return false;
+}
+
+void vc_put(vc_cache_t *cache, apr_uint64_t hash, apr_uint32_t gen, apr_uint32_t verdict)
+{
+  apr_uint64_t bucket = hash & cache->mask;
+  vc_slot_t *slots = cache->slots + bucket * VC_WAYS;
+  unsigned char *ref = cache->ref + bucket * VC_WAYS;
+
+  // Запись с тем же хешем (например, от старого поколения правил) заменяется на месте
+  int victim = -1;
+  for (int w = 0; w < VC_WAYS && victim < 0; w++)
+    {
+    apr_uint64_t value = LOAD(slots[w].value);
+    if ((value & VC_VALID) && (LOAD(slots[w].check) ^ value) == hash)
+      victim = w;
+    }
+
+  // CLOCK: стрелка идет по записям корзины, сбрасывая биты обращения, до первой записи без обращения
+  if (victim < 0)
+    {
+    int hand = LOAD(cache->hand[bucket]);
+    for (int i = 0; i <= VC_WAYS; i++, hand = (hand + 1) % VC_WAYS)
+      {
+      if (!(LOAD(slots[hand].value) & VC_VALID) || !LOAD(ref[hand]))
+        break;
+      STORE(ref[hand], 0);
+      }
+    victim = hand % VC_WAYS;
+    STORE(cache->hand[bucket], (unsigned char)((victim + 1) % VC_WAYS));
+    if (LOAD(slots[victim].value) & VC_VALID)
+      COUNT(cache->evictions);
+    }
+
+  apr_uint64_t value = make_value(gen, verdict);
+  STORE(slots[victim].value, value);
+  STORE(slots[victim].check, hash ^ value);
+  STORE(ref[victim], 0);
+  COUNT(cache->inserts);
+}
+
+void vc_stats(const vc_cache_t *cache, vc_stats_t *stats)
+{
+  memset(stats, 0, sizeof(vc_stats_t));
+  if (!cache)
+    return;
+
+  stats->hits = LOAD(cache->hits);
+  stats->misses = LOAD(cache->misses);
+  stats->inserts = LOAD(cache->inserts);
+  stats->evictions = LOAD(cache->evictions);
+  stats->entries = (cache->mask + 1) * VC_WAYS;
+}
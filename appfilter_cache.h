@@ -0,0 +1,40 @@
+#pragma once
+
+#include "apr_pools.h"
+
+// Кеш решений фильтра в памяти процесса: 64-битный хеш проверяемого значения -> результат проверки.
+// Таблица фиксированного размера, 4 записи в каждой корзине, вытеснение по алгоритму CLOCK
+// (бит обращения у каждой записи). Записи читаются и пишутся без блокировок: в записи хранится
+// ключ, объединенный XOR со значением, поэтому запись, прочитанная наполовину во время изменения
+// другим потоком, просто не совпадет с ключом.
+// Хеш - SipHash-2-4 со случайным ключом, выбранным при создании кеша, поэтому подобрать значение
+// с тем же хешем, что у уже проверенного безопасного значения, нельзя.
+
+#define VC_WAYS 4
+
+typedef struct vc_cache_t vc_cache_t;
+
+typedef struct {
+  apr_uint64_t hits;
+  apr_uint64_t misses;
+  apr_uint64_t inserts;
+  apr_uint64_t evictions;       // вытеснено действительных записей
+  apr_size_t entries;           // размер таблицы
+} vc_stats_t;
+
+// Создает кеш не менее чем на entries записей (округляется вверх до степени 2)
+apr_status_t vc_create(apr_pool_t *pool, apr_size_t entries, vc_cache_t **result);
+
+// Хеш значения. tweak отделяет друг от друга части запроса и наборы правил
+apr_uint64_t vc_hash(const vc_cache_t *cache, apr_uint64_t tweak, const char *data, apr_size_t len);
+
+// Ищет решение для хеша, принятое при поколении правил gen. Возвращает true и решение в *verdict
+int vc_get(vc_cache_t *cache, apr_uint64_t hash, apr_uint32_t gen, apr_uint32_t *verdict);
+
+// Запоминает решение (младшие 24 бита verdict)
+void vc_put(vc_cache_t *cache, apr_uint64_t hash, apr_uint32_t gen, apr_uint32_t verdict);
+
+void vc_stats(const vc_cache_t *cache, vc_stats_t *stats);
+
+// SipHash-2-4 с 16-байтовым ключом
+apr_uint64_t vc_siphash(const unsigned char *key, const char *data, apr_size_t len);
@@ -0,0 +1,221 @@
+#include "appfilter_decode.h"
+
+#include "apr_strings.h"
+#include "string.h"
+
+// Размер буфера, в котором копятся нормализованные байты перед передачей приемнику
+#define NORM_BUF 256
+// Участки без спецсимволов такой длины и больше передаются приемнику напрямую, без копирования
+#define NORM_DIRECT 64
+
+typedef struct {
+  char buf[NORM_BUF];
+  apr_size_t len;
+  norm_sink_fn sink;
+  void *ctx;
+  int rc;
+} norm_out_t;
+
+// Байты, которые меняются при нормализации: начало %XX, '+', заглавные буквы и NUL
+static int is_special(unsigned char b)
+{
+  return b == '%' || b == '+' || b == 0 || (b >= 'A' && b <= 'Z');
+}
+
+static int hex_value(unsigned char b)
+{
+  if (b >= '0' && b <= '9')
+    return b - '0';
+  if (b >= 'a' && b <= 'f')
+    return b - 'a' + 10;
+  if (b >= 'A' && b <= 'F')
+    return b - 'A' + 10;
+  return -1;
+}
+
+static void out_flush(norm_out_t *out)
+{
+  if (out->len && !out->rc)
+    out->rc = out->sink(out->ctx, out->buf, out->len);
+  out->len = 0;
+}
+
+// Последний этап: удаление NUL и приведение к нижнему регистру
+static void out_put(norm_out_t *out, unsigned char b)
+{
+  if (!b)
+    return;
+  if (b >= 'A' && b <= 'Z')
+    b += 'a' - 'A';
+
+  out->buf[out->len++] = b;
+  if (out->len == NORM_BUF)
+    out_flush(out);
+}
+
+// Передает байт на уровень декодирования k. Выход уровня k поступает на уровень k + 1,
+// выход последнего уровня - в буфер приемника
+static void stage_put(norm_state_t *ns, norm_out_t *out, int k, unsigned char b)
+{
+  if (k >= ns->depth)
+    {
+    out_put(out, b);
+    return;
+    }
+
+  switch (ns->npending[k])
+    {
+    case 0:
+      if (b == '%')
+        ns->npending[k] = 1;
+      else
+        stage_put(ns, out, k + 1, b == '+' ? ' ' : b);
+      break;
+    case 1:
+      if (hex_value(b) >= 0)
+        {
+        ns->pending[k] = b;
+        ns->npending[k] = 2;
+        break;
+        }
+      // '%' без цифры передаем как есть, а текущий байт обрабатываем заново
+      ns->npending[k] = 0;
+      stage_put(ns, out, k + 1, '%');
+      stage_put(ns, out, k, b);
+      break;
+    default:
+      ns->npending[k] = 0;
+      if (hex_value(b) >= 0)
+        {
+        stage_put(ns, out, k + 1, (unsigned char)(hex_value(ns->pending[k]) << 4 | hex_value(b)));
+        break;
+        }
+      stage_put(ns, out, k + 1, '%');
+      stage_put(ns, out, k + 1, ns->pending[k]);
+      stage_put(ns, out, k, b);
+      break;
+    }
+}
+
+static int is_idle(const norm_state_t *ns)
+{
+  for (int k = 0; k < ns->depth; k++)
+    if (ns->npending[k])
+      return 0;
+  return 1;
+}
+
+void norm_init(norm_state_t *ns, int depth)
+{
+  memset(ns, 0, sizeof(norm_state_t));
+  ns->depth = depth < 0 ? 0 : depth > NORM_MAX_DEPTH ? NORM_MAX_DEPTH : depth;
+}
+
+int norm_feed(norm_state_t *ns, const char *data, apr_size_t len, norm_sink_fn sink, void *ctx)
+{
+  if (!ns || !data || !sink)
+    return 0;
+
+  norm_out_t out;
+  out.len = 0;
+  out.sink = sink;
+  out.ctx = ctx;
+  out.rc = 0;
+
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + len;
+
+  while (p < end && !out.rc)
+    {
+    // Пока нет незаконченных %-последовательностей, обычные байты проходят без изменений
+    if (is_idle(ns))
+      {
+      const unsigned char *q = p;
+      while (q < end && !is_special(*q))
+        q++;
+
+      apr_size_t span = q - p;
+      if (span >= NORM_DIRECT)
+        {
+        out_flush(&out);
+        if (!out.rc)
+          out.rc = sink(ctx, (const char *)p, span);
+        }
+      else if (span)
+        {
+        if (out.len + span > NORM_BUF)
+          out_flush(&out);
+        memcpy(out.buf + out.len, p, span);
+        out.len += span;
+        }
+      p = q;
+      if (p == end)
+        break;
+      }
+
+    stage_put(ns, &out, 0, *p++);
+    }
+
+  out_flush(&out);
+  return out.rc;
+}
+
+int norm_finish(norm_state_t *ns, norm_sink_fn sink, void *ctx)
+{
+  if (!ns || !sink)
+    return 0;
+
+  norm_out_t out;
+  out.len = 0;
+  out.sink = sink;
+  out.ctx = ctx;
+  out.rc = 0;
+
+  // Незаконченные последовательности уровня k уходят на уровень k + 1 и могут там
+  // оставить свою незаконченную последовательность, поэтому обходим уровни по порядку
+  for (int k = 0; k < ns->depth; k++)
+    {
+    int n = ns->npending[k];
+    ns->npending[k] = 0;
+    if (n >= 1)
+      stage_put(ns, &out, k + 1, '%');
+    if (n == 2)
+      stage_put(ns, &out, k + 1, ns->pending[k]);
+    }
+
+  out_flush(&out);
+  return out.rc;
+}
+
+typedef struct {
+  char *dst;
+  apr_size_t len;
+} norm_string_t;
+
+static int string_sink(void *ctx, const char *data, apr_size_t len)
+{
+  norm_string_t *s = (norm_string_t *)ctx;
+  memcpy(s->dst + s->len, data, len);
+  s->len += len;
+  return 0;
+}
+
+char *norm_string(apr_pool_t *pool, const char *str, int depth)
+{
+  if (!pool || !str)
+    return NULL;
+
+  // Нормализация не увеличивает длину строки
+  apr_size_t len = strlen(str);
+  norm_string_t s;
+  s.dst = (char *)apr_palloc(pool, len + 1);
+  s.len = 0;
+
+  norm_state_t ns;
+  norm_init(&ns, depth);
+  norm_feed(&ns, str, len, string_sink, &s);
+  norm_finish(&ns, string_sink, &s);
+  s.dst[s.len] = 0;
+
+  return s.dst;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "apr_pools.h"
+
+// Потоковый нормализатор проверяемых данных перед поиском плохих строк:
+// %XX-декодирование (повторное, до depth раз), '+' в пробел, приведение ASCII к нижнему регистру
+// и удаление байтов NUL. Данные обрабатываются за один проход, результат отдается частями
+// через функцию-приемник, без копирования всей строки на каждом уровне декодирования.
+
+#define NORM_MAX_DEPTH 4
+#define NORM_DEFAULT_DEPTH 2
+
+typedef struct {
+  int depth;                                  // сколько раз выполнять %XX-декодирование
+  unsigned char npending[NORM_MAX_DEPTH];     // уровень k: 0 - ничего, 1 - прочитан '%', 2 - '%' и цифра
+  unsigned char pending[NORM_MAX_DEPTH];      // первая шестнадцатеричная цифра на уровне k
+} norm_state_t;
+
+// Приемник нормализованных данных. Ненулевой результат прекращает обработку и возвращается вызывающему
+typedef int (*norm_sink_fn)(void *ctx, const char *data, apr_size_t len);
+
+void norm_init(norm_state_t *ns, int depth);
+
+// Нормализует очередную порцию данных. Незаконченная %-последовательность сохраняется в ns
+// до следующего вызова. Возвращает первый ненулевой результат приемника либо 0.
+int norm_feed(norm_state_t *ns, const char *data, apr_size_t len, norm_sink_fn sink, void *ctx);
+
+// Завершает поток: незаконченные %-последовательности передаются дальше как обычные символы
+int norm_finish(norm_state_t *ns, norm_sink_fn sink, void *ctx);
+
+// Нормализует строку целиком (для строк из конфигурации)
+char *norm_string(apr_pool_t *pool, const char *str, int depth);
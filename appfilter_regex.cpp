@@ -0,0 +1,937 @@
+#include "appfilter_regex.h"
+
+#include "apr_strings.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Ограничения, защищающие от выражений, разворачивающихся в огромный НКА
+#define RE_MAX_NODES 200000
+#define RE_MAX_REPEAT 1000
+#define RE_MAX_DEPTH 200
+
+// Узлы НКА
+enum {
+  N_CHAR,                 // переход по байту из множества sets[arg] в out
+  N_SPLIT,                // пустые переходы в out и out2
+  N_MATCH,                // выражение arg совпало
+  N_END                   // "$": переход в out только в конце данных
+};
+
+typedef struct {
+  apr_int32_t out;
+  apr_int32_t out2;
+  apr_int32_t arg;
+  unsigned char type;
+} re_node_t;
+
+typedef struct {
+  unsigned char bits[32];
+} re_bits_t;
+
+// Дерево разбора одного выражения
+enum {
+  A_SET,
+  A_CAT,
+  A_ALT,
+  A_REPEAT,
+  A_EMPTY,
+  A_END
+};
+
+typedef struct re_ast_t {
+  int type;
+  int set;                // для A_SET - номер множества байтов
+  int min, max;           // для A_REPEAT, max = -1 - без ограничения
+  struct re_ast_t *left, *right;
+} re_ast_t;
+
+typedef struct {
+  const unsigned char *p;
+  apr_pool_t *pool;
+  apr_array_header_t *sets;
+  const char *error;
+  int depth;
+} re_parser_t;
+
+// Состояние ДКА: упорядоченный список "значимых" узлов НКА (N_CHAR, N_MATCH, N_END)
+typedef struct {
+  apr_int32_t *next;      // переходы по классам байтов, -1 - еще не вычислен
+  apr_int32_t *nodes;
+  int nn;
+  apr_int32_t match;      // выражение, совпавшее в этом состоянии, либо -1
+  apr_int32_t end_match;  // выражение, совпадающее, если данные здесь заканчиваются, либо -1
+  apr_uint32_t hash;
+} re_dstate_t;
+
+struct re_set_t {
+  re_node_t *nodes;
+  int nnodes;
+  re_bits_t *sets;
+  apr_int32_t *starts;          // начальные узлы всех выражений
+  int nstarts;
+  apr_int32_t *ustarts;         // начальные узлы выражений без "^", добавляются после каждого байта
+  int nustarts;
+  unsigned char classes[256];   // класс эквивалентности каждого байта
+  unsigned char rep[256];       // представитель каждого класса
+  int nclasses;
+
+  // Кеш ДКА. Вся память кеша выделяется из cache_pool и освобождается разом при переполнении
+  apr_pool_t *cache_pool;
+  apr_size_t cache_limit;
+  apr_size_t cache_used;
+  re_dstate_t **states;
+  int nstates;
+  int states_cap;
+  apr_int32_t *table;           // хеш-таблица: множество узлов -> номер состояния
+  apr_uint32_t table_mask;
+  apr_int32_t initial;          // начальное состояние в текущем поколении либо -1
+  apr_uint32_t gen;             // поколение кеша, увеличивается при каждой очистке
+  apr_size_t flushes;
+
+  // Рабочие массивы для вычисления замыканий
+  apr_uint32_t *mark;
+  apr_uint32_t mark_gen;
+  apr_int32_t *stack;
+  apr_int32_t *list;
+};
+
+#define BIT_SET(b, c) ((b)->bits[(c) >> 3] |= 1 << ((c) & 7))
+#define BIT_GET(b, c) ((b)->bits[(c) >> 3] & (1 << ((c) & 7)))
+
+// ---------- Разбор выражения ----------
+
+static re_ast_t *ast_make(re_parser_t *ps, int type, re_ast_t *left, re_ast_t *right)
+{
+  re_ast_t *a = (re_ast_t *)apr_pcalloc(ps->pool, sizeof(re_ast_t));
+  a->type = type;
+  a->left = left;
+  a->right = right;
+  return a;
+}
+
+static re_bits_t *set_make(re_parser_t *ps, int *index)
+{
+  re_bits_t *b = (re_bits_t *)apr_array_push(ps->sets);
+  memset(b, 0, sizeof(re_bits_t));
+  *index = ps->sets->nelts - 1;
+  return b;
+}
+
+static re_ast_t *ast_set(re_parser_t *ps, const re_bits_t *bits)
+{
+  re_ast_t *a = ast_make(ps, A_SET, NULL, NULL);
+  *set_make(ps, &a->set) = *bits;
+  return a;
+}
+
+// Добавляет строчные буквы ко всем заглавным: входные данные приходят в нижнем регистре
+static void set_fold(re_bits_t *b)
+{
+  for (int c = 'A'; c <= 'Z'; c++)
+    if (BIT_GET(b, c))
+      BIT_SET(b, c + 'a' - 'A');
+}
+
+static void set_range(re_bits_t *b, int lo, int hi)
+{
+  for (int c = lo; c <= hi; c++)
+    BIT_SET(b, c);
+}
+
+static void set_invert(re_bits_t *b)
+{
+  for (int i = 0; i < 32; i++)
+    b->bits[i] = ~b->bits[i];
+}
+
+static int hex_digit(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Разбирает escape-последовательность после "\". Классы \d \w \s добавляются в set и возвращается -1,
+// иначе возвращается код байта
+static int parse_escape(re_parser_t *ps, re_bits_t *set)
+{
+  int c = *ps->p;
+  if (!c)
+    {
+    ps->error = "trailing backslash";
+    return -2;
+    }
+  ps->p++;
+
+  re_bits_t cls;
+  memset(&cls, 0, sizeof(cls));
+  switch (c)
+    {
+    case 'd': case 'D':
+      set_range(&cls, '0', '9');
+      break;
+    case 'w': case 'W':
+      set_range(&cls, '0', '9');
+      set_range(&cls, 'a', 'z');
+      set_range(&cls, 'A', 'Z');
+      BIT_SET(&cls, '_');
+      break;
+    case 's': case 'S':
+      BIT_SET(&cls, ' ');
+      set_range(&cls, '\t', '\r');
+      break;
+    case 't':
+      return '\t';
+    case 'n':
+      return '\n';
+    case 'r':
+      return '\r';
+    case 'f':
+      return '\f';
+    case 'v':
+      return '\v';
+    case 'x':
+      {
+      int hi = hex_digit(ps->p[0]);
+      int lo = hi >= 0 ? hex_digit(ps->p[1]) : -1;
+      if (lo < 0)
+        {
+        ps->error = "\\x must be followed by two hex digits";
+        return -2;
+        }
+      ps->p += 2;
+      return hi << 4 | lo;
+      }
+    default:
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+        {
+        ps->error = "unsupported escape sequence";
+        return -2;
+        }
+      return c;
+    }
+
+  if (c >= 'A' && c <= 'Z')
+    set_invert(&cls);
+  for (int i = 0; i < 32; i++)
+    set->bits[i] |= cls.bits[i];
+  return -1;
+}
+
+// Разбирает класс [...] после "["
+static re_ast_t *parse_class(re_parser_t *ps)
+{
+  re_bits_t set;
+  memset(&set, 0, sizeof(set));
+
+  int negate = *ps->p == '^';
+  if (negate)
+    ps->p++;
+
+  int first = true;
+  while (*ps->p && (*ps->p != ']' || first))
+    {
+    first = false;
+    int lo;
+    if (*ps->p == '\\')
+      {
+      ps->p++;
+      lo = parse_escape(ps, &set);
+      if (lo == -2)
+        return NULL;
+      if (lo == -1)
+        continue;
+      }
+    else
+      lo = *ps->p++;
+
+    // Диапазон a-z; "-" перед "]" - обычный символ
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']')
+      {
+      ps->p++;
+      int hi;
+      if (*ps->p == '\\')
+        {
+        ps->p++;
+        hi = parse_escape(ps, &set);
+        if (hi < 0)
+          {
+          if (hi == -1)
+            ps->error = "class escape cannot end a range";
+          return NULL;
+          }
+        }
+      else
+        hi = *ps->p++;
+      if (hi < lo)
+        {
+        ps->error = "invalid range in character class";
+        return NULL;
+        }
+      set_range(&set, lo, hi);
+      }
+    else
+      BIT_SET(&set, lo);
+    }
+
+  if (*ps->p != ']')
+    {
+    ps->error = "missing ]";
+    return NULL;
+    }
+  ps->p++;
+
+  set_fold(&set);
+  if (negate)
+    set_invert(&set);
+
+  return ast_set(ps, &set);
+}
+
+static re_ast_t *parse_alt(re_parser_t *ps);
+
+static re_ast_t *parse_atom(re_parser_t *ps)
+{
+  re_bits_t set;
+  memset(&set, 0, sizeof(set));
+
+  int c = *ps->p++;
+  switch (c)
+    {
+    case '(':
+      {
+      if (ps->p[0] == '?' && ps->p[1] == ':')
+        ps->p += 2;
+      if (++ps->depth > RE_MAX_DEPTH)
+        {
+        ps->error = "groups nested too deep";
+        return NULL;
+        }
+      re_ast_t *a = parse_alt(ps);
+      ps->depth--;
+      if (!a)
+        return NULL;
+      if (*ps->p != ')')
+        {
+        ps->error = "missing )";
+        return NULL;
+        }
+      ps->p++;
+      return a;
+      }
+    case '[':
+      return parse_class(ps);
+    case '.':
+      set_range(&set, 0, 255);
+      return ast_set(ps, &set);
+    case '$':
+      return ast_make(ps, A_END, NULL, NULL);
+    case '^':
+      ps->error = "^ is supported only at the start of an expression";
+      return NULL;
+    case '*': case '+': case '?':
+      ps->error = "nothing to repeat";
+      return NULL;
+    case '\\':
+      c = parse_escape(ps, &set);
+      if (c == -2)
+        return NULL;
+      if (c == -1)
+        return ast_set(ps, &set);
+      break;
+    }
+
+  BIT_SET(&set, c);
+  set_fold(&set);
+  return ast_set(ps, &set);
+}
+
+// Разбирает "{n}", "{n,}" или "{n,m}". Если это не квантификатор, возвращает false, и "{" считается литералом
+static int parse_braces(re_parser_t *ps, int *min, int *max)
+{
+  const unsigned char *p = ps->p + 1;
+  if (*p < '0' || *p > '9')
+    return false;
+
+  long n = 0, m;
+  while (*p >= '0' && *p <= '9' && n <= RE_MAX_REPEAT)
+    n = n * 10 + *p++ - '0';
+  m = n;
+  if (*p == ',')
+    {
+    p++;
+    if (*p >= '0' && *p <= '9')
+      {
+      m = 0;
+      while (*p >= '0' && *p <= '9' && m <= RE_MAX_REPEAT)
+        m = m * 10 + *p++ - '0';
+      }
+    else
+      m = -1;
+    }
+  if (*p != '}')
+    return false;
+
+  ps->p = p + 1;
+  *min = n;
+  *max = m;
+  return true;
+}
+
+static re_ast_t *parse_repeat(re_parser_t *ps)
+{
+  re_ast_t *a = parse_atom(ps);
+  if (!a)
+    return NULL;
+
+  for (;;)
+    {
+    int min, max;
+    if (*ps->p == '*')
+      min = 0, max = -1, ps->p++;
+    else if (*ps->p == '+')
+      min = 1, max = -1, ps->p++;
+    else if (*ps->p == '?')
+      min = 0, max = 1, ps->p++;
+    else if (*ps->p == '{' && parse_braces(ps, &min, &max))
+      {
+      if (min > RE_MAX_REPEAT || max > RE_MAX_REPEAT || (max >= 0 && max < min))
+        {
+        ps->error = "invalid repetition count";
+        return NULL;
+        }
+      }
+    else
+      return a;
+
+    // Ленивые квантификаторы при поиске совпадения ничем не отличаются от жадных
+    if (*ps->p == '?')
+      ps->p++;
+
+    re_ast_t *r = ast_make(ps, A_REPEAT, a, NULL);
+    r->min = min;
+    r->max = max;
+    a = r;
+    }
+}
+
+static re_ast_t *parse_concat(re_parser_t *ps)
+{
+  re_ast_t *result = NULL;
+  while (*ps->p && *ps->p != '|' && *ps->p != ')')
+    {
+    re_ast_t *a = parse_repeat(ps);
+    if (!a)
+      return NULL;
+    result = result ? ast_make(ps, A_CAT, result, a) : a;
+    }
+
+  return result ? result : ast_make(ps, A_EMPTY, NULL, NULL);
+}
+
+static re_ast_t *parse_alt(re_parser_t *ps)
+{
+  re_ast_t *a = parse_concat(ps);
+  while (a && *ps->p == '|')
+    {
+    ps->p++;
+    re_ast_t *b = parse_concat(ps);
+    a = b ? ast_make(ps, A_ALT, a, b) : NULL;
+    }
+
+  return a;
+}
+
+// ---------- Построение НКА ----------
+
+typedef struct {
+  apr_array_header_t *nodes;
+  const char *error;
+} re_builder_t;
+
+static apr_int32_t node_add(re_builder_t *b, int type, apr_int32_t out, apr_int32_t out2, apr_int32_t arg)
+{
+  if (b->nodes->nelts >= RE_MAX_NODES)
+    {
+    b->error = "expressions are too large";
+    return -1;
+    }
+
+  re_node_t *n = (re_node_t *)apr_array_push(b->nodes);
+  n->type = type;
+  n->out = out;
+  n->out2 = out2;
+  n->arg = arg;
+  return b->nodes->nelts - 1;
+}
+
+// Строит узлы для дерева a, после которых следует узел next. Возвращает начальный узел либо -1
+static apr_int32_t emit(re_builder_t *b, const re_ast_t *a, apr_int32_t next)
+{
+  if (next < 0)
+    return -1;
+
+  switch (a->type)
+    {
+    case A_SET:
+      return node_add(b, N_CHAR, next, -1, a->set);
+    case A_END:
+      return node_add(b, N_END, next, -1, 0);
+    case A_EMPTY:
+      return next;
+    case A_CAT:
+      return emit(b, a->left, emit(b, a->right, next));
+    case A_ALT:
+      {
+      apr_int32_t l = emit(b, a->left, next);
+      apr_int32_t r = emit(b, a->right, next);
+      return l < 0 || r < 0 ? -1 : node_add(b, N_SPLIT, l, r, 0);
+      }
+    default:
+      break;
+    }
+
+  // A_REPEAT: сначала необязательная часть, затем min обязательных копий перед ней
+  apr_int32_t tail = next;
+  if (a->max < 0)
+    {
+    // Цикл: узел выбора ведет либо в тело, либо дальше; тело возвращается в узел выбора
+    apr_int32_t loop = node_add(b, N_SPLIT, -1, next, 0);
+    apr_int32_t body = emit(b, a->left, loop);
+    if (loop < 0 || body < 0)
+      return -1;
+    APR_ARRAY_IDX(b->nodes, loop, re_node_t).out = body;
+    tail = loop;
+    }
+  else
+    {
+    for (int i = a->min; i < a->max && tail >= 0; i++)
+      {
+      apr_int32_t body = emit(b, a->left, tail);
+      tail = body < 0 ? -1 : node_add(b, N_SPLIT, body, next, 0);
+      }
+    }
+
+  for (int i = 0; i < a->min && tail >= 0; i++)
+    tail = emit(b, a->left, tail);
+
+  return tail;
+}
+
+// ---------- Ленивый ДКА ----------
+
+// Добавляет в re->list узел n и все узлы, достижимые из него пустыми переходами
+static void closure_add(re_set_t *re, apr_int32_t n, int *count)
+{
+  int sp = 0;
+  re->stack[sp++] = n;
+  while (sp)
+    {
+    apr_int32_t x = re->stack[--sp];
+    if (re->mark[x] == re->mark_gen)
+      continue;
+    re->mark[x] = re->mark_gen;
+
+    const re_node_t *node = &re->nodes[x];
+    if (node->type == N_SPLIT)
+      {
+      re->stack[sp++] = node->out2;
+      re->stack[sp++] = node->out;
+      }
+    else
+      re->list[(*count)++] = x;
+    }
+}
+
+static void mark_next(re_set_t *re)
+{
+  if (++re->mark_gen == 0)
+    {
+    memset(re->mark, 0, re->nnodes * sizeof(apr_uint32_t));
+    re->mark_gen = 1;
+    }
+}
+
+// Наименьший номер выражения, которое совпадает, если данные заканчиваются в состоянии со списком nodes
+static apr_int32_t end_match(re_set_t *re, const apr_int32_t *nodes, int nn)
+{
+  apr_int32_t best = -1;
+  mark_next(re);
+
+  int sp = 0;
+  for (int i = 0; i < nn; i++)
+    if (re->nodes[nodes[i]].type == N_END)
+      re->stack[sp++] = re->nodes[nodes[i]].out;
+
+  while (sp)
+    {
+    apr_int32_t x = re->stack[--sp];
+    if (re->mark[x] == re->mark_gen)
+      continue;
+    re->mark[x] = re->mark_gen;
+
+    const re_node_t *node = &re->nodes[x];
+    if (node->type == N_SPLIT)
+      {
+      re->stack[sp++] = node->out2;
+      re->stack[sp++] = node->out;
+      }
+    else if (node->type == N_END)
+      re->stack[sp++] = node->out;
+    else if (node->type == N_MATCH && (best < 0 || node->arg < best))
+      best = node->arg;
+    }
+
+  return best;
+}
+
+static void *cache_alloc(re_set_t *re, apr_size_t size)
+{
+  re->cache_used += size;
+  return apr_palloc(re->cache_pool, size);
+}
+
+// Очищает кеш ДКА целиком. Номера состояний из прошлого поколения становятся недействительными
+static void cache_flush(re_set_t *re)
+{
+  apr_pool_clear(re->cache_pool);
+  re->cache_used = 0;
+  re->nstates = 0;
+  re->states_cap = 64;
+  re->states = (re_dstate_t **)cache_alloc(re, re->states_cap * sizeof(re_dstate_t *));
+  re->table_mask = 127;
+  re->table = (apr_int32_t *)cache_alloc(re, (re->table_mask + 1) * sizeof(apr_int32_t));
+  memset(re->table, 0xff, (re->table_mask + 1) * sizeof(apr_int32_t));
+  re->initial = -1;
+  re->gen++;
+}
+
+static int cmp_int32(const void *a, const void *b)
+{
+  apr_int32_t x = *(const apr_int32_t *)a, y = *(const apr_int32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Находит или создает состояние ДКА по списку узлов re->list. Может очистить кеш
+static apr_int32_t state_get(re_set_t *re, int nn)
+{
+  qsort(re->list, nn, sizeof(apr_int32_t), cmp_int32);
+
+  apr_uint32_t hash = 2166136261u;
+  for (int i = 0; i < nn; i++)
+    hash = (hash ^ (apr_uint32_t)re->list[i]) * 16777619u;
+
+  for (apr_uint32_t h = hash & re->table_mask; re->table[h] >= 0; h = (h + 1) & re->table_mask)
+    {
+    re_dstate_t *ds = re->states[re->table[h]];
+    if (ds->hash == hash && ds->nn == nn && memcmp(ds->nodes, re->list, nn * sizeof(apr_int32_t)) == 0)
+      return re->table[h];
+    }
+
+  apr_size_t size = sizeof(re_dstate_t) + (nn + re->nclasses) * sizeof(apr_int32_t);
+  if (re->nstates && re->cache_used + size > re->cache_limit)
+    {
+    cache_flush(re);
+    re->flushes++;
+    }
+
+  // Таблица заполняется не более чем наполовину
+  if ((apr_uint32_t)(re->nstates + 1) * 2 > re->table_mask)
+    {
+    apr_uint32_t mask = re->table_mask * 2 + 1;
+    apr_int32_t *table = (apr_int32_t *)cache_alloc(re, (mask + 1) * sizeof(apr_int32_t));
+    memset(table, 0xff, (mask + 1) * sizeof(apr_int32_t));
+    for (int i = 0; i < re->nstates; i++)
+      {
+      apr_uint32_t h = re->states[i]->hash & mask;
+      while (table[h] >= 0)
+        h = (h + 1) & mask;
+      table[h] = i;
+      }
+    re->table = table;
+    re->table_mask = mask;
+    }
+
+  if (re->nstates == re->states_cap)
+    {
+    re_dstate_t **states = (re_dstate_t **)cache_alloc(re, re->states_cap * 2 * sizeof(re_dstate_t *));
+    memcpy(states, re->states, re->nstates * sizeof(re_dstate_t *));
+    re->states = states;
+    re->states_cap *= 2;
+    }
+
+  re_dstate_t *ds = (re_dstate_t *)cache_alloc(re, size);
+  ds->next = (apr_int32_t *)(ds + 1);
+  ds->nodes = ds->next + re->nclasses;
+  ds->nn = nn;
+  ds->hash = hash;
+  memset(ds->next, 0xff, re->nclasses * sizeof(apr_int32_t));
+  memcpy(ds->nodes, re->list, nn * sizeof(apr_int32_t));
+
+  ds->match = -1;
+  for (int i = 0; i < nn; i++)
+    {
+    const re_node_t *node = &re->nodes[ds->nodes[i]];
+    if (node->type == N_MATCH && (ds->match < 0 || node->arg < ds->match))
+      ds->match = node->arg;
+    }
+  ds->end_match = end_match(re, ds->nodes, nn);
+
+  apr_int32_t index = re->nstates++;
+  re->states[index] = ds;
+
+  apr_uint32_t h = hash & re->table_mask;
+  while (re->table[h] >= 0)
+    h = (h + 1) & re->table_mask;
+  re->table[h] = index;
+
+  return index;
+}
+
+static apr_int32_t initial_state(re_set_t *re)
+{
+  if (re->initial < 0)
+    {
+    int count = 0;
+    mark_next(re);
+    for (int i = 0; i < re->nstarts; i++)
+      closure_add(re, re->starts[i], &count);
+    // Если при создании кеш был очищен, новое состояние уже принадлежит новому поколению
+    re->initial = state_get(re, count);
+    }
+
+  return re->initial;
+}
+
+// Вычисляет переход из состояния s по классу байтов cls
+static apr_int32_t step(re_set_t *re, apr_int32_t s, int cls)
+{
+  re_dstate_t *ds = re->states[s];
+  unsigned char c = re->rep[cls];
+
+  int count = 0;
+  mark_next(re);
+  for (int i = 0; i < ds->nn; i++)
+    {
+    const re_node_t *node = &re->nodes[ds->nodes[i]];
+    if (node->type == N_CHAR && BIT_GET(&re->sets[node->arg], c))
+      closure_add(re, node->out, &count);
+    }
+  // Поиск ведется с любой позиции: после каждого байта снова добавляются начала выражений без "^"
+  for (int i = 0; i < re->nustarts; i++)
+    closure_add(re, re->ustarts[i], &count);
+
+  apr_uint32_t gen = re->gen;
+  apr_int32_t next = state_get(re, count);
+  if (gen == re->gen)
+    ds->next[cls] = next;
+
+  return next;
+}
+
+// ---------- Интерфейс ----------
+
+apr_status_t re_compile(apr_pool_t *pool, const apr_array_header_t *patterns, apr_size_t cache_limit,
+                        re_set_t **result, const char **error)
+{
+  if (!pool || !patterns || !result || !error)
+    return APR_EGENERAL;
+  *error = NULL;
+
+  apr_pool_t *tmp;
+  if (apr_pool_create(&tmp, pool) != APR_SUCCESS)
+    return APR_ENOMEM;
+
+  re_parser_t ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.pool = tmp;
+  ps.sets = apr_array_make(tmp, 64, sizeof(re_bits_t));
+
+  re_builder_t b;
+  b.nodes = apr_array_make(tmp, 256, sizeof(re_node_t));
+  b.error = NULL;
+
+  apr_array_header_t *starts = apr_array_make(tmp, patterns->nelts, sizeof(apr_int32_t));
+  apr_array_header_t *ustarts = apr_array_make(tmp, patterns->nelts, sizeof(apr_int32_t));
+
+  for (int i = 0; i < patterns->nelts; i++)
+    {
+    const char *str = APR_ARRAY_IDX(patterns, i, const char *);
+    ps.p = (const unsigned char *)str;
+    ps.depth = 0;
+
+    int anchored = *ps.p == '^';
+    if (anchored)
+      ps.p++;
+
+    re_ast_t *a = parse_alt(&ps);
+    if (a && *ps.p)
+      ps.error = "unmatched )";
+    if (!a || ps.error)
+      {
+      *error = apr_psprintf(pool, "regex %d (%s): %s at offset %d", i + 1, str, ps.error,
+                            (int)((const char *)ps.p - str));
+      apr_pool_destroy(tmp);
+      return APR_EINVAL;
+      }
+
+    apr_int32_t match = node_add(&b, N_MATCH, -1, -1, i);
+    apr_int32_t start = emit(&b, a, match);
+    if (start < 0)
+      {
+      *error = apr_psprintf(pool, "regex %d (%s): %s", i + 1, str, b.error);
+      apr_pool_destroy(tmp);
+      return APR_EINVAL;
+      }
+
+    APR_ARRAY_PUSH(starts, apr_int32_t) = start;
+    if (!anchored)
+      APR_ARRAY_PUSH(ustarts, apr_int32_t) = start;
+    }
+
+  re_set_t *re = (re_set_t *)apr_pcalloc(pool, sizeof(re_set_t));
+  re->nnodes = b.nodes->nelts;
+  re->nodes = (re_node_t *)apr_pmemdup(pool, b.nodes->elts, re->nnodes * sizeof(re_node_t) + 1);
+  re->sets = (re_bits_t *)apr_pmemdup(pool, ps.sets->elts, ps.sets->nelts * sizeof(re_bits_t) + 1);
+  re->nstarts = starts->nelts;
+  re->starts = (apr_int32_t *)apr_pmemdup(pool, starts->elts, starts->nelts * sizeof(apr_int32_t) + 1);
+  re->nustarts = ustarts->nelts;
+  re->ustarts = (apr_int32_t *)apr_pmemdup(pool, ustarts->elts, ustarts->nelts * sizeof(apr_int32_t) + 1);
+
+  // Разобьем байты на классы эквивалентности: байты одного класса входят в одни и те же множества,
+  // поэтому переходы ДКА хранятся по классам, а не по всем 256 байтам
+  int nclasses = 1;
+  memset(re->classes, 0, sizeof(re->classes));
+  for (int i = 0; i < ps.sets->nelts && nclasses < 256; i++)
+    {
+    const re_bits_t *set = &APR_ARRAY_IDX(ps.sets, i, re_bits_t);
+    // Новый класс байта определяется парой (старый класс, входит ли байт в множество)
+    short renum[512];
+    memset(renum, 0xff, sizeof(renum));
+    nclasses = 0;
+    for (int c = 0; c < 256; c++)
+      {
+      int key = (BIT_GET(set, c) ? 256 : 0) + re->classes[c];
+      if (renum[key] < 0)
+        renum[key] = nclasses++;
+      re->classes[c] = renum[key];
+      }
+    }
+  re->nclasses = nclasses;
+  for (int c = 255; c >= 0; c--)
+    re->rep[re->classes[c]] = c;
+
+  re->mark = (apr_uint32_t *)apr_pcalloc(pool, (re->nnodes + 1) * sizeof(apr_uint32_t));
+  re->stack = (apr_int32_t *)apr_palloc(pool, (re->nnodes * 3 + 4) * sizeof(apr_int32_t));
+  re->list = (apr_int32_t *)apr_palloc(pool, (re->nnodes + 1) * sizeof(apr_int32_t));
+
+  re->cache_limit = cache_limit < RE_MIN_CACHE ? RE_MIN_CACHE : cache_limit;
+  if (apr_pool_create(&re->cache_pool, pool) != APR_SUCCESS)
+    {
+    apr_pool_destroy(tmp);
+    return APR_ENOMEM;
+    }
+  cache_flush(re);
+
+  // Выражение, совпадающее с пустой строкой, сработало бы на любом запросе
+  const re_dstate_t *init = re->states[initial_state(re)];
+  int empty = init->match >= 0 ? init->match : init->end_match;
+  if (empty >= 0)
+    {
+    *error = apr_psprintf(pool, "regex %d (%s) matches an empty string", empty + 1,
+                          APR_ARRAY_IDX(patterns, empty, const char *));
+    apr_pool_destroy(tmp);
+    return APR_EINVAL;
+    }
+
+  apr_pool_destroy(tmp);
+  *result = re;
+  return APR_SUCCESS;
+}
+
+re_set_t *re_clone(apr_pool_t *pool, const re_set_t *re)
+{
+  re_set_t *copy = (re_set_t *)apr_pmemdup(pool, re, sizeof(re_set_t));
+  copy->mark = (apr_uint32_t *)apr_pcalloc(pool, (re->nnodes + 1) * sizeof(apr_uint32_t));
+  copy->mark_gen = 0;
+  copy->stack = (apr_int32_t *)apr_palloc(pool, (re->nnodes * 3 + 4) * sizeof(apr_int32_t));
+  copy->list = (apr_int32_t *)apr_palloc(pool, (re->nnodes + 1) * sizeof(apr_int32_t));
+  copy->flushes = 0;
+  if (apr_pool_create(&copy->cache_pool, pool) != APR_SUCCESS)
+    return NULL;
+  cache_flush(copy);
+
+  return copy;
+}
+
+void re_start(re_state_t *st)
+{
+  st->state = -1;
+  st->gen = 0;
+}
+
+int re_scan(re_set_t *re, re_state_t *st, const char *data, apr_size_t len)
+{
+  if (!re || !st || !data)
+    return -1;
+
+  // Если кеш был очищен после предыдущего вызова, продолжаем с начального состояния.
+  // В одном процессе кеш очищается только во время текущего сканирования, так что это редкий случай
+  apr_int32_t s = st->state;
+  if (s < 0 || st->gen != re->gen)
+    s = initial_state(re);
+
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + len;
+  int found = -1;
+
+  while (p < end)
+    {
+    int cls = re->classes[*p++];
+    apr_int32_t next = re->states[s]->next[cls];
+    if (next < 0)
+      next = step(re, s, cls);
+    s = next;
+
+    if (re->states[s]->match >= 0)
+      {
+      found = re->states[s]->match;
+      break;
+      }
+    }
+
+  st->state = s;
+  st->gen = re->gen;
+  return found;
+}
+
+int re_finish(re_set_t *re, re_state_t *st)
+{
+  if (!re || !st)
+    return -1;
+
+  apr_int32_t s = st->state;
+  if (s < 0 || st->gen != re->gen)
+    s = initial_state(re);
+
+  return re->states[s]->end_match;
+}
+
+apr_size_t re_nfa_nodes(const re_set_t *re)
+{
+  return re ? re->nnodes : 0;
+}
+
+apr_size_t re_cache_states(const re_set_t *re)
+{
+  return re ? re->nstates : 0;
+}
+
+apr_size_t re_cache_flushes(const re_set_t *re)
+{
+  return re ? re->flushes : 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "apr_pools.h"
+#include "apr_tables.h"
+
+// Набор регулярных выражений appfilter_regex, объединенных в один НКА (конструкция Томпсона).
+// При сканировании по НКА лениво строится ДКА: состояние ДКА - множество состояний НКА,
+// переходы вычисляются при первом проходе и кешируются. Возвратов нет, поэтому время проверки
+// зависит только от длины данных. Когда кеш ДКА превышает лимит, он очищается и строится заново.
+//
+// Поддерживаются: литералы, ".", классы [a-z] и [^...], \d \w \s \D \W \S, \xHH, группы (...) и (?:...),
+// альтернатива |, повторения * + ? {n} {n,} {n,m}, "^" в начале выражения и "$".
+// Входные данные приходят приведенными к нижнему регистру, поэтому выражения тоже нечувствительны к регистру.
+typedef struct re_set_t re_set_t;
+
+#define RE_DEFAULT_CACHE (1024 * 1024)
+#define RE_MIN_CACHE (16 * 1024)
+
+// Состояние сканирования между вызовами re_scan (например, между бакетами тела запроса)
+typedef struct {
+  apr_int32_t state;      // номер состояния ДКА либо -1 до начала сканирования
+  apr_uint32_t gen;       // поколение кеша, в котором действителен номер состояния
+} re_state_t;
+
+// Компилирует массив выражений (const char *) в один набор. При ошибке в *error
+// записывается описание с номером выражения
+apr_status_t re_compile(apr_pool_t *pool, const apr_array_header_t *patterns, apr_size_t cache_limit,
+                        re_set_t **result, const char **error);
+
+// Копия набора с собственным кешем ДКА: разобранные выражения общие, а кеш и рабочие массивы свои.
+// re_scan изменяет кеш, поэтому каждый поток сканирует своей копией. NULL - не удалось создать пул кеша
+re_set_t *re_clone(apr_pool_t *pool, const re_set_t *re);
+
+void re_start(re_state_t *st);
+
+// Возвращает номер сработавшего выражения либо -1
+int re_scan(re_set_t *re, re_state_t *st, const char *data, apr_size_t len);
+
+// Завершает поток: проверяет выражения, заканчивающиеся на "$"
+int re_finish(re_set_t *re, re_state_t *st);
+
+// Статистика для журнала
+apr_size_t re_nfa_nodes(const re_set_t *re);
+apr_size_t re_cache_states(const re_set_t *re);
+apr_size_t re_cache_flushes(const re_set_t *re);
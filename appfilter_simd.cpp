@@ -0,0 +1,173 @@
+#include "appfilter_simd.h"
+
+#include "string.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "immintrin.h"
+#define PF_X86 1
+#endif
+
+void pf_init(pf_set_t *set, const unsigned char *member)
+{
+  memset(set, 0, sizeof(pf_set_t));
+  set->empty = 1;
+
+  // Байт b входит в множество, если в маске по младшей тетраде b установлен бит номер (b >> 4) & 7.
+  // Байты со старшим битом 0 и 1 описываются разными таблицами, т.к. pshufb обнуляет результат
+  // для индексов со старшим битом.
+  for (int b = 0; b < 256; b++)
+    {
+    if (!member[b])
+      continue;
+    set->member[b] = 1;
+    set->empty = 0;
+    if (b < 0x80)
+      set->lo[b & 0x0f] |= 1 << (b >> 4);
+    else
+      set->hi[b & 0x0f] |= 1 << ((b >> 4) & 7);
+    }
+}
+
+static const unsigned char *find_scalar(const pf_set_t *set, const unsigned char *p, const unsigned char *end)
+{
+  if (set->empty)
+    return end;
+
+  while (p < end && !set->member[*p])
+    p++;
+
+  return p;
+}
+
+#ifdef PF_X86
+
+// 128-битная версия. pshufb относится к SSSE3, который есть у всех процессоров с SSE4.2
+__attribute__((target("sse4.2")))
+static const unsigned char *find_sse42(const pf_set_t *set, const unsigned char *p, const unsigned char *end)
+{
+  if (set->empty)
+    return end;
+
+  const __m128i lo = _mm_loadu_si128((const __m128i *)set->lo);
+  const __m128i hi = _mm_loadu_si128((const __m128i *)set->hi);
+  const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  const __m128i high_bit = _mm_set1_epi8(-128);
+  const __m128i nibble = _mm_set1_epi8(0x07);
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; p + 16 <= end; p += 16)
+    {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i t = _mm_or_si128(_mm_shuffle_epi8(lo, v), _mm_shuffle_epi8(hi, _mm_xor_si128(v, high_bit)));
+    __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(t, bit), zero)) & 0xffff;
+    if (mask)
+      return p + __builtin_ctz(mask);
+    }
+
+  return find_scalar(set, p, end);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *find_avx2(const pf_set_t *set, const unsigned char *p, const unsigned char *end)
+{
+  if (set->empty)
+    return end;
+
+  // vpshufb работает в пределах 128-битных половин, поэтому таблицы дублируются в обе половины
+  const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lo));
+  const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->hi));
+  const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  const __m256i high_bit = _mm256_set1_epi8(-128);
+  const __m256i nibble = _mm256_set1_epi8(0x07);
+  const __m256i zero = _mm256_setzero_si256();
+
+  for (; p + 32 <= end; p += 32)
+    {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i t = _mm256_or_si256(_mm256_shuffle_epi8(lo, v), _mm256_shuffle_epi8(hi, _mm256_xor_si256(v, high_bit)));
+    __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(t, bit), zero));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    }
+
+  // Хвост проверяем здесь же: вызов SSE-версии после работы с ymm-регистрами дал бы штраф за смену состояния AVX
+  while (p < end && !set->member[*p])
+    p++;
+
+  return p;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const unsigned char *find_avx512(const pf_set_t *set, const unsigned char *p, const unsigned char *end)
+{
+  if (set->empty)
+    return end;
+
+  const __m512i lo = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)set->lo));
+  const __m512i hi = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)set->hi));
+  const __m512i bits = _mm512_broadcast_i32x4(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128));
+  const __m512i high_bit = _mm512_set1_epi8(-128);
+  const __m512i nibble = _mm512_set1_epi8(0x07);
+
+  while (p < end)
+    {
+    // Хвост короче 64 байт читается маскированной загрузкой, без выхода за границу данных
+    apr_size_t left = end - p;
+    __mmask64 load = left >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << left) - 1);
+    __m512i v = _mm512_maskz_loadu_epi8(load, p);
+    __m512i t = _mm512_or_si512(_mm512_shuffle_epi8(lo, v), _mm512_shuffle_epi8(hi, _mm512_xor_si512(v, high_bit)));
+    __m512i bit = _mm512_shuffle_epi8(bits, _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble));
+    __mmask64 mask = _mm512_test_epi8_mask(t, bit) & load;
+    if (mask)
+      return p + __builtin_ctzll(mask);
+    p += left >= 64 ? 64 : left;
+    }
+
+  return end;
+}
+
+#endif
+
+int pf_best_level(void)
+{
+#ifdef PF_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw"))
+    return PF_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return PF_AVX2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return PF_SSE42;
+#endif
+  return PF_SCALAR;
+}
+
+pf_find_fn pf_select(int level)
+{
+  if (level < PF_SCALAR || level > pf_best_level())
+    return NULL;
+
+  switch (level)
+    {
+#ifdef PF_X86
+    case PF_AVX512:
+      return find_avx512;
+    case PF_AVX2:
+      return find_avx2;
+    case PF_SSE42:
+      return find_sse42;
+#endif
+    default:
+      return find_scalar;
+    }
+}
+
+const char *pf_level_name(int level)
+{
+  static const char *names[PF_LEVELS] = {"scalar", "sse4.2", "avx2", "avx512bw"};
+
+  return level >= 0 && level < PF_LEVELS ? names[level] : "unknown";
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "apr.h"
+
+// Предварительный поиск: находит в данных первую позицию, байт в которой входит в заданное
+// множество (первые байты всех плохих строк). Участки без таких байтов автомат не просматривает.
+typedef struct {
+  unsigned char member[256];  // 1, если байт входит в множество (для скалярной версии и хвостов)
+  unsigned char lo[16];       // битовые маски для байтов 0x00-0x7f по младшей тетраде
+  unsigned char hi[16];       // битовые маски для байтов 0x80-0xff по младшей тетраде
+  int empty;                  // множество пусто
+} pf_set_t;
+
+typedef const unsigned char *(*pf_find_fn)(const pf_set_t *set, const unsigned char *p, const unsigned char *end);
+
+// Варианты реализации в порядке возрастания ширины векторов
+enum {
+  PF_SCALAR = 0,
+  PF_SSE42,
+  PF_AVX2,
+  PF_AVX512,
+  PF_LEVELS
+};
+
+// Заполняет множество по массиву признаков member[256]
+void pf_init(pf_set_t *set, const unsigned char *member);
+
+// Лучший вариант, поддерживаемый процессором (определяется через cpuid)
+int pf_best_level(void);
+
+// Возвращает функцию поиска указанного варианта либо NULL, если процессор его не поддерживает
+pf_find_fn pf_select(int level);
+
+const char *pf_level_name(int level);
@@ -0,0 +1,621 @@
+#include "appfilter_sqli.h"
+
+#include "apr_strings.h"
+#include "string.h"
+
+// Что разбирается в текущий момент
+enum {
+  LX_NONE,                // между токенами
+  LX_WORD,                // слово: ключевое слово или имя
+  LX_NUMBER,
+  LX_STRING,              // строка в кавычках
+  LX_STRING_ESC,          // в строке после "\"
+  LX_STRING_QUOTE,        // в строке после кавычки: конец строки либо удвоенная кавычка
+  LX_BACKTICK,            // имя в обратных кавычках
+  LX_VAR,                 // переменная @x или @@x
+  LX_OP,                  // оператор из символов = < > ! | & :
+  LX_DASH,                // "-": минус или начало комментария "--"
+  LX_SLASH,               // "/": деление или начало комментария "/*"
+  LX_BLOCK_OPEN,          // сразу после "/*"
+  LX_BLOCK_VERSION,       // после "/*!": номер версии MySQL
+  LX_BLOCK,               // внутри комментария /* */
+  LX_BLOCK_STAR,          // внутри комментария после "*"
+  LX_EXEC_STAR,           // "*" внутри /*! ... */: умножение или конец комментария
+  LX_LINE                 // комментарий до конца строки
+};
+
+// Встроенные отпечатки атак. Контекст ' или " дает отпечатки, начинающиеся с s (строка закрыта атакующим),
+// контекст "как есть" - начинающиеся с числа или имени
+static const char *builtin[] = {
+  // admin'--   admin'#   x'; drop table t
+  "sc", "s;c", "s;E*",
+  // ' or 1=1   ' or 'a'='a   ' or x=   ' or sleep(5)   ' or @@version   '||(select
+  "s&1*", "s&s*", "s&n*", "s&f*", "s&v*", "s&(*",
+  // '='   x'=1   '=sleep(
+  "sos*", "so1*", "sof*", "sov*",
+  // ' union select   ' order by 1   ' into outfile
+  "sUE*", "sU(*", "sB*", "skk*",
+  // ') or ('1'='1   '); drop   ') union select
+  "s)&*", "s);*", "s)UE*", "s)B*", "s)c", "s))&*",
+  // 1 or 1=1   1 and 'a'='a   1 and sleep(5)   1 and (select   1 and @@version
+  "1&1o*", "1&so*", "1&s*", "1&f*", "1&(*", "1&v*",
+  // 1 union select   1; drop   1 order by 5
+  "1UE*", "1U(*", "1;E*", "1B*",
+  // 1) or (1=1   1)) or ((1=1   1) union select   1); drop
+  "1)&*", "1))&*", "1)UE*", "1);E*",
+  // x or 1=1   x union select   x; drop
+  "n&1o*", "n&so*", "n&f(*", "nUE*", "n)UE*", "n;E*",
+  // union select ...   ; drop ...
+  "UE*", ";E*",
+};
+
+typedef struct {
+  const char *word;
+  char type;
+} keyword_t;
+
+// Ключевые слова, отсортированные по strcmp
+static const keyword_t keywords[] = {
+  {"all", 'k'}, {"alter", 'E'}, {"and", '&'}, {"as", 'k'}, {"asc", 'k'}, {"between", 'k'}, {"by", 'k'},
+  {"case", 'k'}, {"collate", 'k'}, {"create", 'E'}, {"declare", 'E'}, {"delete", 'E'}, {"desc", 'k'},
+  {"distinct", 'k'}, {"div", 'o'}, {"drop", 'E'}, {"dumpfile", 'k'}, {"else", 'k'}, {"end", 'k'},
+  {"escape", 'k'}, {"except", 'U'}, {"exec", 'E'}, {"execute", 'E'}, {"exists", 'k'}, {"false", '1'},
+  {"from", 'k'}, {"grant", 'E'}, {"group", 'B'}, {"having", 'B'}, {"in", 'k'}, {"insert", 'E'},
+  {"intersect", 'U'}, {"into", 'k'}, {"is", 'o'}, {"join", 'k'}, {"like", 'o'}, {"limit", 'B'},
+  {"mod", 'o'}, {"not", 'o'}, {"null", '1'}, {"offset", 'k'}, {"on", 'k'}, {"or", '&'}, {"order", 'B'},
+  {"outfile", 'k'}, {"procedure", 'B'}, {"regexp", 'o'}, {"rename", 'E'}, {"revoke", 'E'}, {"rlike", 'o'},
+  {"select", 'E'}, {"set", 'k'}, {"shutdown", 'E'}, {"sounds", 'o'}, {"table", 'k'}, {"then", 'k'},
+  {"top", 'k'}, {"true", '1'}, {"truncate", 'E'}, {"union", 'U'}, {"update", 'E'}, {"values", 'k'},
+  {"waitfor", 'E'}, {"when", 'k'}, {"where", 'k'}, {"xor", '&'},
+};
+
+// Символы токенов в отпечатке
+#define SQLI_ALPHABET 16
+static const char token_chars[] = "s1nfvkEUB&oc(),;";
+
+// Набор отпечатков в виде префиксного дерева: проверка отпечатка - не более SQLI_MAX_TOKENS переходов
+#define FP_EXACT 1        // отпечаток, заканчивающийся в этом узле, есть в наборе
+#define FP_PREFIX 2       // в наборе есть отпечаток этого узла с "*": совпадает все, что с него начинается
+
+struct sqli_set_t {
+  apr_uint16_t (*next)[SQLI_ALPHABET];   // переходы по номеру символа токена, 0 - нет перехода
+  unsigned char *flags;
+  signed char index[256];               // номер символа токена либо -1
+  int nnodes;
+  apr_size_t count;
+};
+
+static int is_word_start(unsigned char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '$' || c >= 0x80;
+}
+
+static int is_word_char(unsigned char c)
+{
+  return is_word_start(c) || (c >= '0' && c <= '9') || c == '.';
+}
+
+static int is_op_char(unsigned char c)
+{
+  return c == '=' || c == '<' || c == '>' || c == '!' || c == '|' || c == '&' || c == ':';
+}
+
+static char keyword_type(const char *word, int len)
+{
+  // Все ключевые слова длиной от 2 до 9 букв, остальные слова сразу считаются именами
+  if (len < 2 || len > 9)
+    return 'n';
+
+  int lo = 0, hi = sizeof(keywords) / sizeof(keywords[0]) - 1;
+  while (lo <= hi)
+    {
+    int mid = (lo + hi) / 2;
+    int cmp = strcmp(word, keywords[mid].word);
+    if (cmp == 0)
+      return keywords[mid].type;
+    if (cmp < 0)
+      hi = mid - 1;
+    else
+      lo = mid + 1;
+    }
+  return 'n';
+}
+
+// Добавляет токен к отпечатку с учетом свертки
+static void emit(sqli_lexer_t *lx, char type, const char *text)
+{
+  if (lx->done)
+    return;
+
+  char last = lx->ntok ? lx->fp[lx->ntok - 1] : 0;
+  // Комментарий /* */ между токенами ничего не значит, важен только комментарий в конце
+  if (type != 'c')
+    lx->pending_comment = false;
+
+  switch (type)
+    {
+    case 's':
+      // Соседние строки 'a' 'b' в SQL склеиваются в одну
+      if (last == 's')
+        return;
+      break;
+    case 'c':
+      if (last == 'c')
+        return;
+      break;
+    case '(':
+      // Имя перед скобкой - вызов функции: sleep(5), char(39)
+      if (last == 'n')
+        lx->fp[lx->ntok - 1] = 'f';
+      break;
+    case 'o':
+      // Унарные операторы (-1, !x) и цепочки операторов сворачиваются
+      if (last == 'o')
+        return;
+      if (text && text[0] && !text[1] && strchr("+-!~", text[0]) && (!last || strchr("&(,;kEUB", last)))
+        return;
+      break;
+    }
+
+  if (lx->ntok == SQLI_MAX_TOKENS)
+    {
+    lx->done = true;
+    return;
+    }
+
+  lx->fp[lx->ntok++] = type;
+  lx->fp[lx->ntok] = 0;
+}
+
+static void word_end(sqli_lexer_t *lx)
+{
+  char last = lx->ntok ? lx->fp[lx->ntok - 1] : 0;
+  if (lx->wlen == SQLI_WORD_MAX)
+    {
+    emit(lx, 'n', NULL);
+    return;
+    }
+  lx->word[lx->wlen] = 0;
+
+  // group by, order by, union all, union distinct - один токен
+  if (last == 'B' && strcmp(lx->word, "by") == 0)
+    return;
+  if (last == 'U' && (strcmp(lx->word, "all") == 0 || strcmp(lx->word, "distinct") == 0))
+    return;
+
+  emit(lx, keyword_type(lx->word, lx->wlen), NULL);
+}
+
+static void op_end(sqli_lexer_t *lx)
+{
+  lx->op[lx->nop] = 0;
+  if (strcmp(lx->op, "&&") == 0 || strcmp(lx->op, "||") == 0)
+    emit(lx, '&', NULL);
+  else
+    emit(lx, 'o', lx->op);
+}
+
+static void lexer_init(sqli_lexer_t *lx, unsigned char quote)
+{
+  memset(lx, 0, sizeof(sqli_lexer_t));
+  if (quote)
+    {
+    lx->mode = LX_STRING;
+    lx->quote = quote;
+    }
+}
+
+static void lexer_feed(sqli_lexer_t *lx, const unsigned char *p, const unsigned char *end)
+{
+  while (p < end && !lx->done)
+    {
+    unsigned char c = *p;
+    switch (lx->mode)
+      {
+      case LX_STRING:
+        while (p < end && *p != lx->quote && *p != '\\')
+          p++;
+        if (p < end)
+          lx->mode = *p++ == '\\' ? LX_STRING_ESC : LX_STRING_QUOTE;
+        continue;
+      case LX_STRING_ESC:
+        lx->mode = LX_STRING;
+        p++;
+        continue;
+      case LX_STRING_QUOTE:
+        // Удвоенная кавычка продолжает строку, иначе строка закончилась, а текущий байт разбирается заново
+        if (c == lx->quote)
+          {
+          lx->mode = LX_STRING;
+          p++;
+          continue;
+          }
+        lx->mode = LX_NONE;
+        emit(lx, 's', NULL);
+        continue;
+      case LX_BACKTICK:
+        {
+        const unsigned char *q = (const unsigned char *)memchr(p, '`', end - p);
+        if (!q)
+          return;
+        p = q + 1;
+        lx->mode = LX_NONE;
+        emit(lx, 'n', NULL);
+        continue;
+        }
+      case LX_WORD:
+        {
+        // Слово читается во внутреннем цикле, без возврата в switch на каждом байте
+        unsigned wlen = lx->wlen;
+        char *word = lx->word;
+        for (; p < end && is_word_char(*p); p++)
+          if (wlen < SQLI_WORD_MAX)
+            word[wlen++] = *p >= 'A' && *p <= 'Z' ? *p + 'a' - 'A' : *p;
+        lx->wlen = wlen;
+        if (p == end)
+          return;
+        lx->mode = LX_NONE;
+        word_end(lx);
+        continue;
+        }
+      case LX_NUMBER:
+        while (p < end && is_word_char(*p))
+          p++;
+        if (p == end)
+          return;
+        lx->mode = LX_NONE;
+        emit(lx, '1', NULL);
+        continue;
+      case LX_VAR:
+        if (is_word_char(c) || c == '@')
+          {
+          p++;
+          continue;
+          }
+        lx->mode = LX_NONE;
+        emit(lx, 'v', NULL);
+        continue;
+      case LX_OP:
+        if (is_op_char(c) && lx->nop < 3)
+          {
+          lx->op[lx->nop++] = c;
+          p++;
+          continue;
+          }
+        lx->mode = LX_NONE;
+        op_end(lx);
+        continue;
+      case LX_DASH:
+        lx->mode = LX_NONE;
+        if (c == '-')
+          {
+          emit(lx, 'c', NULL);
+          lx->mode = LX_LINE;
+          p++;
+          continue;
+          }
+        emit(lx, 'o', "-");
+        continue;
+      case LX_SLASH:
+        lx->mode = LX_NONE;
+        if (c == '*')
+          {
+          lx->mode = LX_BLOCK_OPEN;
+          p++;
+          continue;
+          }
+        emit(lx, 'o', "/");
+        continue;
+      case LX_BLOCK_OPEN:
+        // /*!50000 union */ - MySQL выполняет содержимое такого комментария
+        if (c == '!')
+          {
+          lx->exec_comment = true;
+          lx->mode = LX_BLOCK_VERSION;
+          p++;
+          continue;
+          }
+        lx->mode = LX_BLOCK;
+        continue;
+      case LX_BLOCK_VERSION:
+        if (c >= '0' && c <= '9')
+          {
+          p++;
+          continue;
+          }
+        lx->mode = LX_NONE;
+        continue;
+      case LX_BLOCK:
+        {
+        const unsigned char *q = (const unsigned char *)memchr(p, '*', end - p);
+        if (!q)
+          return;
+        p = q + 1;
+        lx->mode = LX_BLOCK_STAR;
+        continue;
+        }
+      case LX_BLOCK_STAR:
+        p++;
+        if (c == '/')
+          {
+          lx->mode = LX_NONE;
+          lx->pending_comment = true;
+          }
+        else if (c != '*')
+          lx->mode = LX_BLOCK;
+        continue;
+      case LX_EXEC_STAR:
+        lx->mode = LX_NONE;
+        if (c == '/')
+          {
+          lx->exec_comment = false;
+          p++;
+          continue;
+          }
+        emit(lx, 'o', "*");
+        continue;
+      case LX_LINE:
+        {
+        const unsigned char *q = (const unsigned char *)memchr(p, '\n', end - p);
+        if (!q)
+          return;
+        p = q + 1;
+        lx->mode = LX_NONE;
+        continue;
+        }
+      default:
+        break;
+      }
+
+    // LX_NONE: начало нового токена
+    p++;
+    if (c <= ' ' || c == '.')
+      continue;
+
+    if (is_word_start(c))
+      {
+      lx->mode = LX_WORD;
+      lx->word[0] = c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+      lx->wlen = 1;
+      }
+    else if (c >= '0' && c <= '9')
+      lx->mode = LX_NUMBER;
+    else if (c == '\'' || c == '"')
+      {
+      lx->mode = LX_STRING;
+      lx->quote = c;
+      }
+    else if (c == '`')
+      lx->mode = LX_BACKTICK;
+    else if (c == '@')
+      lx->mode = LX_VAR;
+    else if (c == '#')
+      {
+      emit(lx, 'c', NULL);
+      lx->mode = LX_LINE;
+      }
+    else if (c == '-')
+      lx->mode = LX_DASH;
+    else if (c == '/')
+      lx->mode = LX_SLASH;
+    else if (c == '*' && lx->exec_comment)
+      lx->mode = LX_EXEC_STAR;
+    else if (c == '(' || c == ')' || c == ',' || c == ';')
+      emit(lx, c, NULL);
+    else if (is_op_char(c))
+      {
+      lx->mode = LX_OP;
+      lx->op[0] = c;
+      lx->nop = 1;
+      }
+    else
+      {
+      char text[2] = {(char)c, 0};
+      emit(lx, 'o', text);
+      }
+    }
+}
+
+static void lexer_finish(sqli_lexer_t *lx)
+{
+  switch (lx->mode)
+    {
+    case LX_WORD:
+      word_end(lx);
+      break;
+    case LX_NUMBER:
+      emit(lx, '1', NULL);
+      break;
+    case LX_STRING:
+    case LX_STRING_ESC:
+    case LX_STRING_QUOTE:
+      emit(lx, 's', NULL);
+      break;
+    case LX_BACKTICK:
+      emit(lx, 'n', NULL);
+      break;
+    case LX_VAR:
+      emit(lx, 'v', NULL);
+      break;
+    case LX_OP:
+      op_end(lx);
+      break;
+    case LX_DASH:
+      emit(lx, 'o', "-");
+      break;
+    case LX_SLASH:
+      emit(lx, 'o', "/");
+      break;
+    case LX_EXEC_STAR:
+      emit(lx, 'o', "*");
+      break;
+    case LX_BLOCK_OPEN:
+    case LX_BLOCK:
+    case LX_BLOCK_STAR:
+      // Незакрытый комментарий отбрасывает остаток запроса
+      emit(lx, 'c', NULL);
+      break;
+    }
+  lx->mode = LX_NONE;
+
+  if (lx->pending_comment)
+    emit(lx, 'c', NULL);
+}
+
+static int token_index(char c)
+{
+  const char *p = c ? strchr(token_chars, c) : NULL;
+  return p ? p - token_chars : -1;
+}
+
+static void set_add(sqli_set_t *set, const char *fp)
+{
+  int node = 0;
+  for (; *fp && *fp != '*'; fp++)
+    {
+    int i = token_index(*fp);
+    if (!set->next[node][i])
+      set->next[node][i] = set->nnodes++;
+    node = set->next[node][i];
+    }
+
+  unsigned char flag = *fp == '*' ? FP_PREFIX : FP_EXACT;
+  if (!(set->flags[node] & flag))
+    set->count++;
+  set->flags[node] |= flag;
+}
+
+// Отпечаток есть в наборе сам по себе или начинается с одного из отпечатков с "*"
+static int set_match(const sqli_set_t *set, const char *fp)
+{
+  if (!*fp)
+    return false;
+
+  int node = 0;
+  for (; *fp; fp++)
+    {
+    int i = set->index[(unsigned char)*fp];
+    if (i < 0 || !(node = set->next[node][i]))
+      return false;
+    if (set->flags[node] & FP_PREFIX)
+      return true;
+    }
+
+  return set->flags[node] & FP_EXACT;
+}
+
+int sqli_fingerprint_valid(const char *fp)
+{
+  if (!fp)
+    return false;
+
+  int n = strlen(fp);
+  if (n && fp[n - 1] == '*')
+    n--;
+  if (n < 1 || n > SQLI_MAX_TOKENS)
+    return false;
+
+  for (int i = 0; i < n; i++)
+    if (token_index(fp[i]) < 0)
+      return false;
+  return true;
+}
+
+apr_status_t sqli_compile(apr_pool_t *pool, const apr_array_header_t *extra, sqli_set_t **result)
+{
+  if (!pool || !result)
+    return APR_EGENERAL;
+
+  int nbuiltin = sizeof(builtin) / sizeof(builtin[0]);
+  int nextra = extra ? extra->nelts : 0;
+  for (int i = 0; i < nextra; i++)
+    if (!sqli_fingerprint_valid(APR_ARRAY_IDX(extra, i, const char *)))
+      return APR_EINVAL;
+
+  // Каждый отпечаток добавляет в дерево не больше SQLI_MAX_TOKENS узлов
+  int size = (nbuiltin + nextra) * SQLI_MAX_TOKENS + 1;
+  if (size > 65535)
+    return APR_EINVAL;
+
+  sqli_set_t *set = (sqli_set_t *)apr_pcalloc(pool, sizeof(sqli_set_t));
+  set->next = (apr_uint16_t (*)[SQLI_ALPHABET])apr_pcalloc(pool, size * sizeof(*set->next));
+  set->flags = (unsigned char *)apr_pcalloc(pool, size);
+  set->nnodes = 1;
+  for (int c = 0; c < 256; c++)
+    set->index[c] = token_index(c);
+
+  for (int i = 0; i < nbuiltin; i++)
+    set_add(set, builtin[i]);
+  for (int i = 0; i < nextra; i++)
+    set_add(set, APR_ARRAY_IDX(extra, i, const char *));
+
+  *result = set;
+  return APR_SUCCESS;
+}
+
+apr_size_t sqli_set_size(const sqli_set_t *set)
+{
+  return set ? set->count : 0;
+}
+
+void sqli_init(sqli_state_t *st)
+{
+  lexer_init(&st->ctx[0], 0);
+  lexer_init(&st->ctx[1], '\'');
+  lexer_init(&st->ctx[2], '"');
+}
+
+void sqli_feed(sqli_state_t *st, const char *data, apr_size_t len)
+{
+  if (!st || !data)
+    return;
+
+  const unsigned char *p = (const unsigned char *)data;
+  for (int k = 0; k < SQLI_CONTEXTS; k++)
+    lexer_feed(&st->ctx[k], p, p + len);
+}
+
+int sqli_done(const sqli_state_t *st)
+{
+  for (int k = 0; k < SQLI_CONTEXTS; k++)
+    if (!st->ctx[k].done)
+      return false;
+  return true;
+}
+
+int sqli_finish(const sqli_set_t *set, sqli_state_t *st, char *fp)
+{
+  if (!set || !st)
+    return false;
+
+  for (int k = 0; k < SQLI_CONTEXTS; k++)
+    {
+    sqli_lexer_t *lx = &st->ctx[k];
+    lexer_finish(lx);
+    if (set_match(set, lx->fp))
+      {
+      if (fp)
+        memcpy(fp, lx->fp, SQLI_FP_SIZE);
+      return true;
+      }
+    }
+
+  return false;
+}
+
+int sqli_check(const sqli_set_t *set, const char *data, apr_size_t len, char *fp)
+{
+  sqli_state_t st;
+  sqli_init(&st);
+  sqli_feed(&st, data, len);
+  return sqli_finish(set, &st, fp);
+}
+
+void sqli_fingerprint(const char *data, apr_size_t len, int k, char *fp)
+{
+  sqli_lexer_t lx;
+  lexer_init(&lx, k == 1 ? '\'' : k == 2 ? '"' : 0);
+  lexer_feed(&lx, (const unsigned char *)data, (const unsigned char *)data + len);
+  lexer_finish(&lx);
+  memcpy(fp, lx.fp, SQLI_FP_SIZE);
+}
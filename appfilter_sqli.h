@@ -0,0 +1,72 @@
+#pragma once
+
+#include "apr_pools.h"
+#include "apr_tables.h"
+
+// Поиск SQL-инъекций по отпечатку токенов (в духе libinjection).
+// Значение параметра разбирается как фрагмент SQL, первые SQLI_MAX_TOKENS токенов после свертки
+// записываются по одному символу, и полученная строка-отпечаток ищется в наборе отпечатков атак.
+// Значение разбирается в трех контекстах: как есть, как продолжение строки в ' и как продолжение строки в ".
+// Разбор потоковый: данные можно подавать частями, память не выделяется, каждый байт просматривается
+// не более трех раз (по разу в каждом контексте).
+//
+// Типы токенов:
+//   s - строка, 1 - число или null/true/false, n - имя, f - функция (имя перед "("), v - переменная @x,
+//   k - ключевое слово, E - начало команды (select, drop...), U - union, B - group by/order by/having/limit,
+//   & - and/or/xor/&&/||, o - оператор, c - комментарий, ( ) , ; - сами символы
+//
+// Отпечаток в наборе может оканчиваться на "*": тогда он совпадает с любым отпечатком, который с него начинается.
+
+#define SQLI_MAX_TOKENS 5
+#define SQLI_CONTEXTS 3
+#define SQLI_WORD_MAX 32
+// Размер буфера для отпечатка с завершающим нулем
+#define SQLI_FP_SIZE (SQLI_MAX_TOKENS + 1)
+
+typedef struct sqli_set_t sqli_set_t;
+
+// Состояние разбора в одном контексте
+typedef struct {
+  unsigned char mode;             // что сейчас разбирается: строка, слово, комментарий...
+  unsigned char quote;            // кавычка текущей строки
+  unsigned char exec_comment;     // внутри MySQL-комментария /*! ... */, содержимое которого выполняется
+  unsigned char pending_comment;  // был комментарий /* */; если за ним ничего нет, он станет токеном c
+  unsigned char ntok;
+  unsigned char done;             // отпечаток больше не изменится
+  unsigned char wlen;
+  unsigned char nop;
+  char word[SQLI_WORD_MAX];       // текущее слово в нижнем регистре
+  char op[4];                     // текущий многосимвольный оператор
+  char fp[SQLI_FP_SIZE];
+} sqli_lexer_t;
+
+typedef struct {
+  sqli_lexer_t ctx[SQLI_CONTEXTS];
+} sqli_state_t;
+
+// Строит набор из встроенных отпечатков и дополнительных (массив const char *, может быть NULL).
+// Неверный отпечаток - APR_EINVAL
+apr_status_t sqli_compile(apr_pool_t *pool, const apr_array_header_t *extra, sqli_set_t **result);
+
+// Проверяет строку отпечатка: 1-5 допустимых символов токенов и необязательная "*" в конце
+int sqli_fingerprint_valid(const char *fp);
+
+apr_size_t sqli_set_size(const sqli_set_t *set);
+
+void sqli_init(sqli_state_t *st);
+
+// Разбирает очередную порцию значения
+void sqli_feed(sqli_state_t *st, const char *data, apr_size_t len);
+
+// Все контексты уже разобрали достаточно токенов, дальнейшие данные на результат не влияют
+int sqli_done(const sqli_state_t *st);
+
+// Завершает разбор. Возвращает true, если отпечаток одного из контекстов есть в наборе,
+// и записывает его в fp (буфер SQLI_FP_SIZE байт, может быть NULL)
+int sqli_finish(const sqli_set_t *set, sqli_state_t *st, char *fp);
+
+// Проверяет значение целиком
+int sqli_check(const sqli_set_t *set, const char *data, apr_size_t len, char *fp);
+
+// Отпечаток значения в контексте k (0 - как есть, 1 - после ', 2 - после ") для тестов и отладки
+void sqli_fingerprint(const char *data, apr_size_t len, int k, char *fp);
@@ -4,214 +4,1961 @@
 #include "http_log.h"
 #include "ap_config.h"
 #include "apr_dbd.h"
+#include "apr_hash.h"
 #include "apr_strings.h"
+#include "apr_lib.h"
 #include "mod_dbd.h"
-#include "apreq.h"
-#include "apreq_parser.h"
-#include "apreq_param.h"
-#include "apreq_util.h"
-#include "openssl/sha.h"
+#include "ap_socache.h"
+#include "ap_provider.h"
+#include "util_mutex.h"
+#include "apr_global_mutex.h"
+#include "apr_shm.h"
+#include "apr_thread_rwlock.h"
+#include "ap_mpm.h"
+#include "openssl/crypto.h"
+#include "unistd.h"
+#include "errno.h"
+#include "app_cuckoo.h"
+#include "app_snapshot.h"
+#include "app_session.h"
+#include "app_hash.h"
+#include "app_kdf.h"
+#include "app_params.h"
+#include "util_cookies.h"
 
-static APR_OPTIONAL_FN_TYPE(ap_dbd_acquire) *mod_dbd_acquire_fn = NULL;
+static APR_OPTIONAL_FN_TYPE(ap_dbd_open) *mod_dbd_open_fn = NULL;
+static APR_OPTIONAL_FN_TYPE(ap_dbd_close) *mod_dbd_close_fn = NULL;
+static APR_OPTIONAL_FN_TYPE(ap_dbd_prepare) *mod_dbd_prepare_fn = NULL;
+
+// Запрос записей пользователя по логину. mod_dbd подготавливает его один раз на каждом соединении пула,
+// а обработчик только передает значения параметров (%s - параметры apr_dbd).
+// Пароль хранится как SHA-256 в bytea, и хеш сравнивается в модуле за постоянное время
+#define LOGIN_LABEL "app_login"
+#define LOGIN_SQL "SELECT name, password FROM users WHERE login=%s"
+#define DIGEST_LEN HASH_LEN
+
+// Кеш успешных аутентификаций в общем для всех процессов хранилище mod_socache (опция app_auth_cache):
+// ключ - SHA-256 от случайного секрета и логина, значение - SHA-256 от секрета и хеша пароля, за ним имя пользователя
+#define AUTH_CACHE_MUTEX "app-auth-cache"
+#define AUTH_CACHE_KEY_LEN HASH_LEN
+#define AUTH_CACHE_VERIFIER_LEN HASH_LEN
+#define AUTH_CACHE_NAME_MAX 256
+#define AUTH_CACHE_DEFAULT_TTL 60
+
+// Обработчик состояния модуля: кеш аутентификаций и фильтр логинов
+#define STATUS_HANDLER "app-status"
+
+// Пакетная проверка логинов (обработчик app-batch): POST-запрос с парами user=...&pass=... в теле.
+// Логины, не найденные в снимке таблицы users и в кеше, проверяются одним запросом к базе данных,
+// массив логинов передается одним параметром. Хеши паролей сравниваются в модуле, т.к. логины в users не уникальны
+#define BATCH_HANDLER "app-batch"
+#define BATCH_MAX 1000
+#define BATCH_LABEL "app_login_batch"
+#define BATCH_SQL "SELECT login, password, name FROM users WHERE login = ANY(%s::text[])"
+
+// Политика вытеснения: fifo - запись живет TTL после входа через базу данных,
+// lru - каждое попадание продлевает запись и переносит ее в конец очереди вытеснения
+enum {
+  AUTH_CACHE_FIFO = 0,
+  AUTH_CACHE_LRU
+};
+
+// Фильтр известных логинов (опция app_login_filter): фильтр кукушки со всеми users.login в разделяемой памяти.
+// Логин, которого точно нет в фильтре, отклоняется без обращения к базе данных.
+// Фильтр строится первым запросом после запуска и заново раз в app_login_filter_rebuild секунд, а между
+// построениями раз в app_login_filter_refresh секунд дополняется записями журнала users_log,
+// который ведет триггер таблицы users (I - логин добавлен, D - удален)
+#define LOGIN_FILTER_MUTEX "app-login-filter"
+#define LOGIN_FILTER_DEFAULT_REFRESH 5
+#define LOGIN_FILTER_DEFAULT_REBUILD 3600
+// Номера записей users_log выдаются до фиксации транзакций, поэтому запись с меньшим номером может стать видна
+// позже записи с большим. Журнал перечитывается с отступом LOGIN_LOG_WINDOW номеров назад, а уже примененные
+// номера запоминаются, чтобы не применить запись дважды. Если номер ушел из окна непримененным, запись могла
+// опоздать сильнее: до построения заново, которое начнется при следующем обновлении, фильтр не отклоняет логины
+#define LOGIN_LOG_WINDOW 4096
+// Ответ фильтра "нет" проверяется еще раз после внепланового обновления, если с последнего обращения к users_log
+// прошло больше LOGIN_FILTER_RECHECK: только что зарегистрированный логин не отклоняется до планового обновления.
+// Так перечитывается журнал не чаще раза за LOGIN_FILTER_RECHECK на все процессы
+#define LOGIN_FILTER_RECHECK apr_time_from_msec(100)
+// Все логины (I) и номера последних записей журнала (A) одним запросом, то есть из одного снимка базы
+#define LOGINS_LABEL "app_logins"
+#define LOGINS_SQL "SELECT 'I', login FROM users WHERE login IS NOT NULL UNION ALL SELECT 'A', id::text FROM users_log " \
+                   "WHERE id > (SELECT coalesce(max(id), 0) FROM users_log) - " APR_STRINGIFY(LOGIN_LOG_WINDOW)
+#define LOGIN_LOG_LABEL "app_login_log"
+#define LOGIN_LOG_SQL "SELECT id::text, op, login FROM users_log WHERE id > %s::bigint ORDER BY id"
+
+// Cookie сессии (опция app_session): после успешного входа клиент получает подписанный cookie,
+// и запросы без логина и пароля с действующим cookie проходят без хеширования пароля и базы данных
+#define SESSION_COOKIE "app_session"
+#define SESSION_COOKIE_ATTRS "Path=/;HttpOnly;SameSite=Strict"
+
+// Снимок таблицы users (опция app_user_snapshot): файл, построенный программой app_snapshot_build,
+// отображается в память каждого процесса, и логины проверяются без базы данных. Раз в
+// USER_SNAPSHOT_CHECK секунд процесс проверяет, не заменен ли файл, и открывает новый снимок
+#define USER_SNAPSHOT_CHECK 1
+
+// Медленное хеширование паролей (опция app_kdf). Запись, проверенная по прежнему SHA-256 или по scrypt с другими
+// параметрами, при входе пересчитывается и заменяется; условие на старое значение не дает затереть пароль,
+// измененный тем временем в базе. Пересчет необязателен и выполняется, только если в пуле есть свободный слот
+#define REHASH_LABEL "app_login_rehash"
+#define REHASH_SQL "UPDATE users SET password = decode(%s, 'hex') WHERE login = %s AND password = decode(%s, 'hex')"
+#define KDF_DEFAULT_QUEUE 16
+#define KDF_DEFAULT_TIMEOUT 2
+// Через сколько секунд клиенту предлагается повторить запрос, отклоненный из-за полной очереди
+#define KDF_RETRY_AFTER "1"
+
+// Заголовок фильтра в разделяемой памяти, за ним лежит сам фильтр кукушки.
+// Фильтр меняет один процесс, захвативший блокировку app-login-filter; читатели не блокируются,
+// а по счетчику seq узнают, что фильтр менялся во время чтения, и тогда идут в базу данных
+typedef struct {
+  apr_uint32_t seq;             // нечетный, пока фильтр изменяется
+  int ready;                    // фильтр построен и не переполнен, им можно отклонять логины
+  int gap;                      // номер записи users_log ушел из окна непримененным, нужно построение заново
+  apr_int64_t last_id;          // последняя примененная запись users_log
+  apr_time_t synced;            // время последнего обращения к users_log
+  apr_time_t built;             // время последнего полного построения
+  apr_uint64_t lookups;         // проверено логинов
+  apr_uint64_t rejected;        // отклонено без обращения к базе данных
+  apr_uint64_t passed;          // пропущено фильтром, но не найдено в базе: ложные совпадения и неверные пароли
+  apr_int64_t applied[LOGIN_LOG_WINDOW];  // примененные номера записей users_log, номер id хранится в applied[id % LOGIN_LOG_WINDOW]
+} login_filter_t;
+
+typedef struct {
+  const ap_socache_provider_t *provider;  // хранилище кеша, NULL - кеш выключен
+  ap_socache_instance_t *cache;
+  apr_interval_time_t ttl;                // время жизни записи (опция app_auth_cache_ttl)
+  int policy;                             // опция app_auth_cache_policy
+  unsigned char secret[32];               // выбирается при запуске, поэтому ключи нельзя вычислить заранее
+  apr_size_t filter_capacity;             // число логинов в фильтре (опция app_login_filter), 0 - фильтр выключен
+  apr_interval_time_t filter_refresh;     // опция app_login_filter_refresh
+  apr_interval_time_t filter_rebuild;     // опция app_login_filter_rebuild
+  const char *snapshot;                   // файл снимка таблицы users (опция app_user_snapshot), NULL - снимок не используется
+  apr_interval_time_t session_ttl;        // время жизни cookie сессии (опция app_session), 0 - сессии выключены
+  session_key_t session_key;              // ключ подписи, выбирается при запуске: перезапуск завершает все сессии
+  int kdf_enabled;                        // новые записи паролей - scrypt (опция app_kdf), иначе только SHA-256
+  kdf_params_t kdf;                       // параметры scrypt для новых записей
+  int kdf_workers;                        // одновременных вычислений scrypt (опция app_kdf_workers), 0 - без ограничения,
+                                          // -1 - по числу процессоров
+  int kdf_queue;                          // мест в очереди ожидания слота (опция app_kdf_queue)
+  apr_interval_time_t kdf_timeout;        // наибольшее время ожидания слота (опция app_kdf_timeout)
+  apr_off_t body_limit;                   // наибольшая длина тела POST (опция app_body_limit)
+} app_config_t;
+
+// Блокировка хранилища, которое само не защищено от одновременного доступа процессов, иначе NULL
+static apr_global_mutex_t *auth_cache_mutex = NULL;
+
+// Фильтр логинов в разделяемой памяти и блокировка для его изменения, NULL - фильтр выключен
+static login_filter_t *login_filter = NULL;
+static cf_filter_t *login_cf = NULL;
+static apr_global_mutex_t *login_filter_mutex = NULL;
+
+// Снимок таблицы users, открытый в этом процессе, и пул, при очистке которого снимается отображение файла
+static apr_pool_t *child_pool = NULL;
+static snap_t *user_snap = NULL;
+static apr_pool_t *user_snap_pool = NULL;
+static const char *user_snap_path = NULL;
+static apr_time_t user_snap_checked = 0;
+// Блокировка снимка между потоками процесса, NULL - MPM однопоточный
+static apr_thread_rwlock_t *user_snap_lock = NULL;
+
+// Пул вычислений scrypt в анонимной разделяемой памяти, общий для всех процессов; NULL - число вычислений не ограничено
+static kdf_pool_t *kdf_pool = NULL;
+
+#define STAT_ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define STAT_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+// опция C требуется, т.к. Apache требует оформления наименований по стандарту C
+extern "C" module AP_MODULE_DECLARE_DATA app_module;
+
+static const char *option_auth_cache(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_auth_cache_ttl(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_auth_cache_policy(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_login_filter(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_login_filter_refresh(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_login_filter_rebuild(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_user_snapshot(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_session(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_kdf(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_kdf_workers(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_kdf_queue(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_kdf_timeout(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_body_limit(cmd_parms *cmd, void *doof, const char *value);
 
 static int app_handler(request_rec *r);
+static int status_handler(request_rec *r);
+static int batch_handler(request_rec *r);
+static int login_filter_sync(request_rec *r, const app_config_t *config, apr_interval_time_t refresh);
+static int login_filter_maybe(const char *user);
+static int login_filter_check(request_rec *r, const app_config_t *config, const char *user);
+static int snapshot_login(request_rec *r, const app_config_t *config, const char *user, const unsigned char *digest, const char **name);
+static const char *session_user(request_rec *r, const app_config_t *config);
+static void session_issue(request_rec *r, const app_config_t *config, const char *user, const char *name);
+static apr_status_t db_login(request_rec *r, const app_config_t *config, const char *user, const char *pass,
+                             const unsigned char *digest, const char **name);
 
-#define CONTENT_TYPE_URLENCODED "application/x-www-form-urlencoded"
+// Наибольшая длина тела POST по умолчанию (опция app_body_limit)
+#define BODY_DEFAULT_LIMIT (1024 * 1024)
 
-apr_status_t get_params(request_rec *r, apr_table_t *params)
+// Находит в параметрах запроса - строке URL и теле POST - параметры spec. Если в строке URL нашлось все нужное, тело не читается.
+// Тело (форма, JSON или multipart/form-data) читается порциями в одну и ту же цепочку и разбирается по мере чтения, на диск ничего
+// не записывается. APR_ENOSPC - тело длиннее app_body_limit (ответ 413), APR_EINVAL - тело неверного формата (ответ 400)
+apr_status_t get_params(request_rec *r, const param_spec_t *spec)
 {
-  if (!r || !params)
+  if (!r || !spec)
     return APR_EGENERAL;
 
-  apreq_initialize(r->pool);
+  // Строка URL разбирается на месте: декодируются только значения искомых параметров
+  if (r->args && params_query(r->pool, r->args, spec))
+    return APR_SUCCESS;
+
+  // В HTTP-методе POST данные также могут передаваться как тело запроса: в виде формы или JSON. Обработаем и его тоже
+  const char *content_type = apr_table_get(r->headers_in, "Content-Type");
+  if (r->method_number != M_POST || !content_type)
+    return APR_SUCCESS;
 
-  // Создадим структуру, в которую парсер библиотеки apreq помещает распарсенные данные в своем формате
-  apr_table_t *ap = apr_table_make(r->pool, 25);
+  int format = params_body_format(content_type);
+  if (format < 0)
+    return APR_SUCCESS;
 
-  // Если есть параметры, переданные в URL-строке, распарсим их
-  if (r->args)
-    apreq_parse_query_string(r->pool, ap, r->args);
+  // Без границы части multipart не разделить
+  const char *boundary = NULL;
+  if (format == PARAMS_MULTIPART && !(boundary = params_multipart_boundary(r->pool, content_type)))
+    {
+    ap_log_rerror(APLOG_MARK, LOG_INFO, APR_EINVAL, r, "No valid boundary in Content-Type: %s", content_type);
+    return APR_EINVAL;
+    }
 
-  // В HTTP-методе POST данные также могут передаваться как тело запроса. Обработаем и его тоже
-  const char *content_type = apr_table_get(r->headers_in, "Content-Type");
-  if (r->method_number == M_POST && content_type &&
-      strncasecmp(content_type, CONTENT_TYPE_URLENCODED, strlen(CONTENT_TYPE_URLENCODED)) == 0)
-    {
-    apreq_parser_t *parser = apreq_parser_make(r->pool, r->connection->bucket_alloc, content_type, apreq_parse_urlencoded, 65000, "/tmp", NULL, NULL);
-    // Создадим структуру, в которой парсер библиотеки apreq будет обрабатывает содержимое тела POST-запроса
-    apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
-
-    int end = false;
-    do
-      {
-      // Последовательно будем читать входные данные и помещать их в цепочку apr_bucket_brigade
-      ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, 65000);
-      // Распарсим порцию входных данных
-      apreq_parser_run(parser, ap, bb);
-      // Проверим, содержит ли цепочка признак завершения входных данных
-      for (apr_bucket *b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = APR_BUCKET_NEXT(b))
+  // Слишком длинное тело с известной длиной отклоняется до чтения
+  app_config_t *config = ap_get_module_config(r->server->module_config, &app_module);
+  const char *length = apr_table_get(r->headers_in, "Content-Length");
+  apr_off_t declared;
+  char *end;
+  if (length && apr_strtoff(&declared, length, &end, 10) == APR_SUCCESS && !*end && declared > config->body_limit)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_ENOSPC, r, "Request body of %s bytes exceeds app_body_limit %" APR_OFF_T_FMT,
+                  length, config->body_limit);
+    return APR_ENOSPC;
+    }
+
+  params_body_t pb;
+  params_body_init(&pb, format, r->pool, spec, config->body_limit, boundary);
+  apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+  apr_status_t parsed = APR_SUCCESS;
+  apr_off_t total = 0;
+
+  int eos = false;
+  while (!eos)
+    {
+    // Ошибку чтения (например, отказ фильтра mod_appfilter) возвращаем вызывающему
+    apr_status_t rv = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, HUGE_STRING_LEN);
+    if (rv != APR_SUCCESS)
+      return rv;
+
+    for (apr_bucket *b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb) && !eos; b = APR_BUCKET_NEXT(b))
+      {
+      if (APR_BUCKET_IS_EOS(b))
+        {
+        eos = true;
+        break;
+        }
+      if (APR_BUCKET_IS_METADATA(b))
+        continue;
+
+      const char *data;
+      apr_size_t len;
+      rv = apr_bucket_read(b, &data, &len, APR_BLOCK_READ);
+      if (rv != APR_SUCCESS)
+        return rv;
+
+      // Длина тела без Content-Length (chunked) проверяется по мере чтения
+      total += len;
+      if (total > config->body_limit)
         {
-        if (APR_BUCKET_IS_EOS(b))
-          { // если входных данных больше нет, завершаем цикл
-          end = true;
-          break;
+        apr_brigade_cleanup(bb);
+        // Нужное уже найдено: остаток не читается, а соединение закрывается после ответа
+        if (parsed == APR_EOF)
+          {
+          r->connection->keepalive = AP_CONN_CLOSE;
+          return APR_SUCCESS;
           }
+        ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_ENOSPC, r, "Request body exceeds app_body_limit %" APR_OFF_T_FMT,
+                      config->body_limit);
+        return APR_ENOSPC;
+        }
+
+      // После того как все нужное найдено, остаток тела только дочитывается до конца и не разбирается
+      if (parsed == APR_SUCCESS)
+        parsed = params_body_feed(&pb, data, len);
+      if (parsed != APR_SUCCESS && parsed != APR_EOF)
+        {
+        apr_brigade_cleanup(bb);
+        ap_log_rerror(APLOG_MARK, LOG_INFO, parsed, r, "Failed to parse request body");
+        return parsed;
         }
       }
-    while (!end);
-    }
 
-  if (apr_is_empty_table(ap))
-    return APR_SUCCESS; // входных параметров нет
+    // Цепочка используется повторно: прочитанные порции освобождаются сразу
+    apr_brigade_cleanup(bb);
+    }
 
-  // Преобазуем входные параметры из внутренней структуры библиотеки apreq в структуру типа apr_table_t
-  const apr_array_header_t *a = apr_table_elts(ap);
-  apr_table_entry_t *elts = (apr_table_entry_t *) a->elts;
-  for (int i = 0; i < a->nelts; i++)
+  // Незаконченный JSON или multipart без завершающей границы - ошибка запроса (ответ 400)
+  if (parsed == APR_SUCCESS && params_body_end(&pb) == APR_EINVAL)
     {
-    apreq_param_t *p = apreq_value_to_param(elts[i].val);
-    const char *value = p->v.data;
-    if (!value)
-      value = "";
-    apr_table_addn(params, p->v.name, value);
+    ap_log_rerror(APLOG_MARK, LOG_INFO, APR_EINVAL, r, "Malformed request body");
+    return APR_EINVAL;
     }
 
   return APR_SUCCESS;
 }
 
-apr_status_t sha256(apr_pool_t *pool, const char *str, char **result)
+// Запись пароля из столбца password: bytea в текстовом виде \x<HEX-цифры> - SHA-256 (32 байта) или запись scrypt
+// (KDF_RECORD_LEN байт, см. app_kdf.h). До перевода столбца в bytea там лежит HEX-строка SHA-256 без префикса,
+// она тоже принимается. Возвращает длину записи, 0 - значение не распознано
+static apr_size_t db_record(const char *value, unsigned char *record)
 {
-  if (!pool || !str || !result)
-    return APR_EGENERAL;
+  if (!value)
+    return 0;
+  if (value[0] == '\\' && value[1] == 'x')
+    value += 2;
+  apr_size_t len = strlen(value) / 2;
+  if (strlen(value) % 2 || (len != DIGEST_LEN && len != KDF_RECORD_LEN))
+    return 0;
+
+  for (apr_size_t i = 0; i < len * 2; i++)
+    {
+    char c = apr_tolower(value[i]);
+    int v;
+    if (c >= '0' && c <= '9')
+      v = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v = c - 'a' + 10;
+    else
+      return 0;
+
+    if (i % 2)
+      record[i / 2] |= v;
+    else
+      record[i / 2] = v << 4;
+    }
 
-  // Вычислим SHA256-хеш от строки str
-  unsigned char hash[SHA256_DIGEST_LENGTH];
-  SHA256((const unsigned char *)str, strlen(str), hash);
+  if (len == KDF_RECORD_LEN && !kdf_is_record(record, len))
+    return 0;
 
-  // Преобразуем двоичное значение в hash в HEX-строку вида AB2481EF...
-  char *s = (char *)apr_pcalloc(pool, SHA256_DIGEST_LENGTH * 2 + 1);
-  *result = s;
+  return len;
+}
 
-  for (int i=0; i < SHA256_DIGEST_LENGTH; i++)
+// HEX-строка из len байт data для параметра decode(%s, 'hex')
+static const char *hex_string(apr_pool_t *pool, const unsigned char *data, apr_size_t len)
+{
+  static const char digits[] = "0123456789abcdef";
+  char *out = (char *)apr_palloc(pool, len * 2 + 1);
+  for (apr_size_t i = 0; i < len; i++)
     {
-    char b = hash[i];
-    char c = (b >> 4) & 0x0f;
-    *(s++) = c > 9 ? c + ('a' - 10) : c + '0';
-    c = b & 0x0f;
-    *(s++) = c > 9 ? c + ('a' - 10) : c + '0';
+    out[i * 2] = digits[data[i] >> 4];
+    out[i * 2 + 1] = digits[data[i] & 15];
     }
-  *s = 0;
+  out[len * 2] = 0;
 
-  return APR_SUCCESS;
+  return out;
 }
 
 extern "C" {
 // Код, который должен быть оформлен с extern C, т.к. apache этого требует
 
-static int app_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+// Выделяет память для хранения параметров модуля
+static void *create_server_conf(apr_pool_t *pool, server_rec *s)
+{
+  app_config_t *config = (app_config_t *)apr_pcalloc(pool, sizeof(app_config_t));
+  config->ttl = apr_time_from_sec(AUTH_CACHE_DEFAULT_TTL);
+  config->policy = AUTH_CACHE_LRU;
+  config->filter_refresh = apr_time_from_sec(LOGIN_FILTER_DEFAULT_REFRESH);
+  config->filter_rebuild = apr_time_from_sec(LOGIN_FILTER_DEFAULT_REBUILD);
+  config->kdf_workers = -1;
+  config->kdf_queue = KDF_DEFAULT_QUEUE;
+  config->kdf_timeout = apr_time_from_sec(KDF_DEFAULT_TIMEOUT);
+  config->body_limit = BODY_DEFAULT_LIMIT;
+
+  return config;
+}
+
+static int app_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+  // Тип блокировок можно переопределить опциями Mutex app-auth-cache и Mutex app-login-filter
+  if (ap_mutex_register(pconf, AUTH_CACHE_MUTEX, NULL, APR_LOCK_DEFAULT, 0) != APR_SUCCESS ||
+      ap_mutex_register(pconf, LOGIN_FILTER_MUTEX, NULL, APR_LOCK_DEFAULT, 0) != APR_SUCCESS)
+    return HTTP_INTERNAL_SERVER_ERROR;
+
+  return OK;
+}
+
+static apr_status_t auth_cache_destroy(void *data)
+{
+  server_rec *s = (server_rec *)data;
+  app_config_t *config = ap_get_module_config(s->module_config, &app_module);
+  config->provider->destroy(config->cache, s);
+  auth_cache_mutex = NULL;
+
+  return APR_SUCCESS;
+}
+
+// Инициализирует хранилище кеша аутентификаций до запуска дочерних процессов
+static int auth_cache_init(apr_pool_t *pconf, server_rec *s)
 {
-  mod_dbd_acquire_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_acquire);
+  app_config_t *config = ap_get_module_config(s->module_config, &app_module);
+  if (!config->provider)
+    return OK;
+
+  apr_status_t rv;
+  if (config->provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE)
+    {
+    rv = ap_global_mutex_create(&auth_cache_mutex, NULL, AUTH_CACHE_MUTEX, NULL, s, pconf, 0);
+    if (rv != APR_SUCCESS)
+      {
+      ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to create app_auth_cache mutex");
+      return HTTP_INTERNAL_SERVER_ERROR;
+      }
+    }
+
+  struct ap_socache_hints hints = {AUTH_CACHE_KEY_LEN, AUTH_CACHE_VERIFIER_LEN + 32, config->ttl};
+  rv = config->provider->init(config->cache, AUTH_CACHE_MUTEX, &hints, s, pconf);
+  if (rv != APR_SUCCESS)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to initialise app_auth_cache %s", config->provider->name);
+    return HTTP_INTERNAL_SERVER_ERROR;
+    }
+  apr_pool_cleanup_register(pconf, s, auth_cache_destroy, apr_pool_cleanup_null);
+
+  rv = apr_generate_random_bytes(config->secret, sizeof(config->secret));
+  if (rv != APR_SUCCESS)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to generate app_auth_cache secret");
+    return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+  return OK;
+}
+
+// Выбирает случайный ключ подписи cookie сессии
+static int session_init(apr_pool_t *pconf, server_rec *s)
+{
+  app_config_t *config = ap_get_module_config(s->module_config, &app_module);
+  if (!config->session_ttl)
+    return OK;
+
+  unsigned char secret[32];
+  apr_status_t rv = apr_generate_random_bytes(secret, sizeof(secret));
+  if (rv != APR_SUCCESS)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to generate app_session key");
+    return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+  rv = session_key_init(&config->session_key, pconf, secret, sizeof(secret));
+  OPENSSL_cleanse(secret, sizeof(secret));
+  if (rv != APR_SUCCESS)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to prepare app_session key");
+    return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+  return OK;
+}
+
+static apr_status_t login_filter_destroy(void *data)
+{
+  login_filter = NULL;
+  login_cf = NULL;
+  login_filter_mutex = NULL;
+
+  return APR_SUCCESS;
+}
+
+// Выделяет фильтр логинов в анонимной разделяемой памяти, которую наследуют дочерние процессы.
+// Сам фильтр заполняется позже, в дочернем процессе, когда доступны соединения mod_dbd
+static int login_filter_init(apr_pool_t *pconf, server_rec *s)
+{
+  app_config_t *config = ap_get_module_config(s->module_config, &app_module);
+  if (!config->filter_capacity)
+    return OK;
+
+  apr_status_t rv = ap_global_mutex_create(&login_filter_mutex, NULL, LOGIN_FILTER_MUTEX, NULL, s, pconf, 0);
+  if (rv != APR_SUCCESS)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to create app_login_filter mutex");
+    return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+  apr_size_t size = sizeof(login_filter_t) + cf_size(config->filter_capacity);
+  apr_shm_t *shm;
+  rv = apr_shm_create(&shm, size, NULL, pconf);
+  if (rv != APR_SUCCESS)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to create %lu bytes of shared memory for app_login_filter", (unsigned long)size);
+    return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+  login_filter = (login_filter_t *)apr_shm_baseaddr_get(shm);
+  memset(login_filter, 0, sizeof(login_filter_t));
+  login_cf = cf_init(login_filter + 1, config->filter_capacity);
+  apr_pool_cleanup_register(pconf, NULL, login_filter_destroy, apr_pool_cleanup_null);
+
+  // Запросы журнала нужны только с фильтром: без таблицы users_log их подготовка не удалась бы
+  for (server_rec *sp = s; sp; sp = sp->next)
+    {
+    mod_dbd_prepare_fn(sp, LOGINS_SQL, LOGINS_LABEL);
+    mod_dbd_prepare_fn(sp, LOGIN_LOG_SQL, LOGIN_LOG_LABEL);
+    }
+
+  ap_log_error(APLOG_MARK, LOG_INFO, APR_SUCCESS, s, "Login filter: %lu slots, %lu bytes of shared memory",
+               (unsigned long)cf_slots(login_cf), (unsigned long)size);
+  return OK;
+}
+
+static apr_status_t kdf_pool_destroy(void *data)
+{
+  kdf_pool = NULL;
+
+  return APR_SUCCESS;
+}
+
+// Выделяет пул вычислений scrypt в анонимной разделяемой памяти: слоты общие для всех дочерних процессов,
+// поэтому число одновременных вычислений ограничено и при prefork, где каждый запрос обрабатывает свой процесс
+static int kdf_init(apr_pool_t *pconf, server_rec *s)
+{
+  app_config_t *config = ap_get_module_config(s->module_config, &app_module);
+  if (!config->kdf_enabled)
+    return OK;
+
+  // В снимке хранится только SHA-256, и записи scrypt по нему не проверить
+  if (config->snapshot)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, APR_EINVAL, s, "app_kdf cannot be used together with app_user_snapshot");
+    return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+  for (server_rec *sp = s; sp; sp = sp->next)
+    mod_dbd_prepare_fn(sp, REHASH_SQL, REHASH_LABEL);
+
+  int workers = config->kdf_workers;
+  if (workers < 0)
+    {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cpus > 0 ? cpus : 1;
+    }
+  if (!workers)
+    {
+    ap_log_error(APLOG_MARK, LOG_INFO, APR_SUCCESS, s, "KDF scrypt:%d:%d:%d without a pool", config->kdf.log_n,
+                 config->kdf.r, config->kdf.p);
+    return OK;
+    }
+
+  apr_shm_t *shm;
+  apr_status_t rv = apr_shm_create(&shm, kdf_pool_size(), NULL, pconf);
+  if (rv != APR_SUCCESS)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to create shared memory for app_kdf pool");
+    return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+  kdf_pool = kdf_pool_init(apr_shm_baseaddr_get(shm), workers, config->kdf_queue);
+  if (!kdf_pool)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, errno, s, "Failed to create app_kdf pool semaphore");
+    return HTTP_INTERNAL_SERVER_ERROR;
+    }
+  apr_pool_cleanup_register(pconf, NULL, kdf_pool_destroy, apr_pool_cleanup_null);
 
+  ap_log_error(APLOG_MARK, LOG_INFO, APR_SUCCESS, s, "KDF scrypt:%d:%d:%d, pool of %d workers, queue %d, timeout %lds",
+               config->kdf.log_n, config->kdf.r, config->kdf.p, workers, config->kdf_queue,
+               (long)apr_time_sec(config->kdf_timeout));
   return OK;
 }
 
+static void app_child_init(apr_pool_t *pchild, server_rec *s)
+{
+  child_pool = pchild;
+
+  // В многопоточном MPM снимок таблицы users открывается заново одним потоком, пока другие его не читают
+  apr_status_t rv;
+  int threaded = AP_MPMQ_NOT_SUPPORTED;
+  user_snap_lock = NULL;
+  if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) == APR_SUCCESS && threaded != AP_MPMQ_NOT_SUPPORTED)
+    {
+    rv = apr_thread_rwlock_create(&user_snap_lock, pchild);
+    if (rv != APR_SUCCESS)
+      {
+      ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to create app_user_snapshot lock");
+      user_snap_lock = NULL;
+      }
+    }
+
+  if (auth_cache_mutex)
+    {
+    rv = apr_global_mutex_child_init(&auth_cache_mutex, apr_global_mutex_lockfile(auth_cache_mutex), pchild);
+    if (rv != APR_SUCCESS)
+      ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to attach to app_auth_cache mutex");
+    }
+
+  if (login_filter_mutex)
+    {
+    rv = apr_global_mutex_child_init(&login_filter_mutex, apr_global_mutex_lockfile(login_filter_mutex), pchild);
+    if (rv != APR_SUCCESS)
+      ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to attach to app_login_filter mutex");
+    }
+}
+
+static int app_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+{
+  apr_status_t rv;
+  mod_dbd_open_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_open);
+  mod_dbd_close_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_close);
+  mod_dbd_prepare_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_prepare);
+  if (!mod_dbd_open_fn || !mod_dbd_close_fn || !mod_dbd_prepare_fn)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, APR_EGENERAL, s, "mod_dbd is not loaded");
+    return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+  // Запрос регистрируется для каждого сервера: у виртуальных серверов свои настройки mod_dbd
+  for (server_rec *sp = s; sp; sp = sp->next)
+    {
+    mod_dbd_prepare_fn(sp, LOGIN_SQL, LOGIN_LABEL);
+    mod_dbd_prepare_fn(sp, BATCH_SQL, BATCH_LABEL);
+    }
+
+  // Алгоритм SHA-256 получается у провайдера OpenSSL один раз, а не при каждом хешировании пароля
+  rv = hash_init(pconf);
+  if (rv != APR_SUCCESS)
+    ap_log_error(APLOG_MARK, LOG_WARNING, rv, s, "Failed to prepare SHA-256, one-shot hashing is used");
+  else
+    ap_log_error(APLOG_MARK, LOG_DEBUG, APR_SUCCESS, s, "SHA-256: %s, batches: %s", hash_backend(),
+                 hash_mb_level_name(hash_mb_best_level()));
+
+  int rc = auth_cache_init(pconf, s);
+  if (rc == OK)
+    rc = session_init(pconf, s);
+  if (rc == OK)
+    rc = kdf_init(pconf, s);
+  if (rc != OK)
+    return rc;
+
+  return login_filter_init(pconf, s);
+}
+
 static void app_register_hooks(apr_pool_t *p)
 {
   ap_hook_handler(app_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_handler(status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_handler(batch_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_pre_config(app_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_post_config(app_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_child_init(app_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
+static const command_rec app_options[] =
+{
+  AP_INIT_TAKE1("app_auth_cache", option_auth_cache, NULL, RSRC_CONF, "Shared cache of successful logins: socache provider[:args] or none"),
+  AP_INIT_TAKE1("app_auth_cache_ttl", option_auth_cache_ttl, NULL, RSRC_CONF, "Lifetime of a cached login in seconds"),
+  AP_INIT_TAKE1("app_auth_cache_policy", option_auth_cache_policy, NULL, RSRC_CONF, "Cache eviction policy: fifo or lru"),
+  AP_INIT_TAKE1("app_login_filter", option_login_filter, NULL, RSRC_CONF, "Number of logins in the shared filter of known logins, or none"),
+  AP_INIT_TAKE1("app_login_filter_refresh", option_login_filter_refresh, NULL, RSRC_CONF, "How often in seconds to apply users_log changes to the login filter"),
+  AP_INIT_TAKE1("app_login_filter_rebuild", option_login_filter_rebuild, NULL, RSRC_CONF, "How often in seconds to rebuild the login filter from the users table"),
+  AP_INIT_TAKE1("app_user_snapshot", option_user_snapshot, NULL, RSRC_CONF, "Users table snapshot file built by app_snapshot_build, or none"),
+  AP_INIT_TAKE1("app_session", option_session, NULL, RSRC_CONF, "Lifetime in seconds of the signed session cookie issued after login, or none"),
+  AP_INIT_TAKE1("app_kdf", option_kdf, NULL, RSRC_CONF, "Password KDF for new records: scrypt:<log2 N>:<r>:<p>, or none for SHA-256 only"),
+  AP_INIT_TAKE1("app_kdf_workers", option_kdf_workers, NULL, RSRC_CONF, "Concurrent scrypt computations across all processes, 0 for no limit, auto for the CPU count"),
+  AP_INIT_TAKE1("app_kdf_queue", option_kdf_queue, NULL, RSRC_CONF, "Logins that may wait for a free scrypt slot before new ones get 503"),
+  AP_INIT_TAKE1("app_kdf_timeout", option_kdf_timeout, NULL, RSRC_CONF, "Longest wait in seconds for a free scrypt slot"),
+  AP_INIT_TAKE1("app_body_limit", option_body_limit, NULL, RSRC_CONF, "Largest accepted POST body in bytes, larger bodies get 413"),
+  {NULL}
+};
+
 AP_DECLARE_MODULE(app) = {
     STANDARD20_MODULE_STUFF,
     NULL,                  /* create per-dir    config structures */
     NULL,                  /* merge  per-dir    config structures */
-    NULL,                  /* create per-server config structures */
+    create_server_conf,    /* create per-server config structures */
     NULL,                  /* merge  per-server config structures */
-    NULL,                  /* table of config file commands       */
+    app_options,           /* table of config file commands       */
     app_register_hooks  /* register hooks                      */
 };
 };
 
-// функция отправки SQL-запроса в базу данных
-apr_status_t dbd_select(request_rec *r, ap_dbd_t *dbd, apr_dbd_results_t **res, const char *sql)
+// Обработчик опции app_auth_cache конфигурационного файла Apache, например shmcb:/run/httpd/app_auth(512000)
+static const char *option_auth_cache(cmd_parms *cmd, void *doof, const char *value)
 {
-  if (!r || !dbd || !res || !sql || !sql[0])
-    return APR_EGENERAL;
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
 
-  *res = NULL;
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
 
-  int sql_err = 0;
+  config->provider = NULL;
+  if (strcasecmp(value, "none") == 0)
+    return NULL;
 
-  apr_dbd_prepared_t *st = NULL;
-  sql_err = apr_dbd_prepare(dbd->driver, r->pool, dbd->handle, sql, NULL, &st);
-  if (!sql_err)
-    sql_err = apr_dbd_pselect(dbd->driver, r->pool, dbd->handle, res, st, 1, 0, NULL);
+  const char *sep = strchr(value, ':');
+  const char *name = sep ? apr_pstrmemdup(cmd->temp_pool, value, sep - value) : value;
+  config->provider = (const ap_socache_provider_t *)ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name, AP_SOCACHE_PROVIDER_VERSION);
+  if (!config->provider)
+    return apr_psprintf(cmd->pool, "Unknown app_auth_cache provider %s, is mod_socache_%s loaded?", name, name);
 
-  if (sql_err)
+  error = config->provider->create(&config->cache, sep ? sep + 1 : NULL, cmd->temp_pool, cmd->pool);
+  if (error)
+    return apr_psprintf(cmd->pool, "app_auth_cache: %s", error);
+
+  return NULL;
+}
+
+// Разбирает значение опции - положительное число секунд
+static const char *parse_seconds(cmd_parms *cmd, const char *value, apr_interval_time_t *result)
+{
+  char *end;
+  apr_int64_t seconds = apr_strtoi64(value, &end, 10);
+  if (*end || seconds <= 0)
+    return apr_psprintf(cmd->pool, "%s must be a positive number of seconds", cmd->cmd->name);
+
+  *result = apr_time_from_sec(seconds);
+
+  return NULL;
+}
+
+// Обработчик опции app_auth_cache_ttl конфигурационного файла Apache
+static const char *option_auth_cache_ttl(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
+
+  return parse_seconds(cmd, value, &config->ttl);
+}
+
+// Обработчик опции app_auth_cache_policy конфигурационного файла Apache
+static const char *option_auth_cache_policy(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
+
+  if (strcasecmp(value, "fifo") == 0)
+    config->policy = AUTH_CACHE_FIFO;
+  else if (strcasecmp(value, "lru") == 0)
+    config->policy = AUTH_CACHE_LRU;
+  else
+    return "Possible values for app_auth_cache_policy option are fifo or lru";
+
+  return NULL;
+}
+
+// Обработчик опции app_login_filter конфигурационного файла Apache
+static const char *option_login_filter(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
+
+  if (strcasecmp(value, "none") == 0)
     {
-    ap_log_rerror(APLOG_MARK, LOG_ERR, APR_EGENERAL, r, "DBD error for sql '%s': %s", sql,
-                  apr_dbd_error(dbd->driver, dbd->handle, sql_err));
-    return APR_EGENERAL;
+    config->filter_capacity = 0;
+    return NULL;
     }
 
-  return APR_SUCCESS;
+  char *end;
+  apr_int64_t capacity = apr_strtoi64(value, &end, 10);
+  if (*end || capacity <= 0)
+    return "app_login_filter must be a positive number of logins or none";
+
+  config->filter_capacity = capacity;
+
+  return NULL;
 }
 
-// основной обработчик запросов Apache
-static int app_handler(request_rec *r)
+// Обработчик опции app_login_filter_refresh конфигурационного файла Apache
+static const char *option_login_filter_refresh(cmd_parms *cmd, void *doof, const char *value)
 {
-  if (strcmp(r->handler, "app_handler") != 0)
-    return DECLINED;
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
 
-  r->content_type = "text/html; charset=UTF-8";
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
 
-  if (r->header_only)
-    return OK;
+  return parse_seconds(cmd, value, &config->filter_refresh);
+}
 
-  ap_dbd_t *dbd = mod_dbd_acquire_fn(r);
-  if (!dbd)
-    return HTTP_INTERNAL_SERVER_ERROR;
+// Обработчик опции app_login_filter_rebuild конфигурационного файла Apache
+static const char *option_login_filter_rebuild(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
 
-  apr_table_t *params = apr_table_make(r->pool, 25);
-  if (get_params(r, params) != APR_SUCCESS)
-    return HTTP_INTERNAL_SERVER_ERROR;
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
 
-  const char *user = apr_table_get(params, "user");
-  const char *pass = apr_table_get(params, "pass");
+  return parse_seconds(cmd, value, &config->filter_rebuild);
+}
 
-  ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "user=%s pass=%s", user, pass);
+// Обработчик опции app_user_snapshot конфигурационного файла Apache
+static const char *option_user_snapshot(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
 
-  char *pass_hash;
-  if (sha256(r->pool, pass, &pass_hash) != APR_SUCCESS)
-    return HTTP_INTERNAL_SERVER_ERROR;
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
 
-  apr_dbd_results_t *res;
-  apr_dbd_row_t *row = NULL;
+  config->snapshot = strcasecmp(value, "none") == 0 ? NULL : ap_server_root_relative(cmd->pool, value);
 
-  // Сформируем SQL-запрос для проверки корректности логина и пароля
-  const char *sql = apr_pstrcat(r->pool, "SELECT name FROM users WHERE login='", user, "' AND password='", pass_hash, "'", NULL);
-  ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "SQL=%s", sql);
+  return NULL;
+}
 
-  // Получим имя пользователя с указанным логином и паролем. Если name останется NULL, значит, логин или пароль некорректны
-  const char *name = NULL;
+// Обработчик опции app_session конфигурационного файла Apache
+static const char *option_session(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
 
-  if (dbd_select(r, dbd, &res, sql) != APR_SUCCESS)
-    return HTTP_INTERNAL_SERVER_ERROR;
-  while(res && apr_dbd_get_row(dbd->driver, r->pool, res, &row, -1) == 0 && row)
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
+
+  if (strcasecmp(value, "none") == 0)
     {
-    name = apr_pstrdup(r->pool, apr_dbd_get_entry(dbd->driver, row, 0));
+    config->session_ttl = 0;
+    return NULL;
     }
 
+  return parse_seconds(cmd, value, &config->session_ttl);
+}
+
+// Обработчик опции app_kdf конфигурационного файла Apache, например scrypt:14:8:1
+static const char *option_kdf(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
 
-  if (!name)
+  config->kdf_enabled = false;
+  if (strcasecmp(value, "none") == 0)
+    return NULL;
+
+  error = kdf_parse(value, &config->kdf);
+  if (error)
+    return apr_psprintf(cmd->pool, "app_kdf: %s", error);
+
+  config->kdf_enabled = true;
+  return NULL;
+}
+
+// Разбирает значение опции - неотрицательное целое число
+static const char *parse_count(cmd_parms *cmd, const char *value, int *result)
+{
+  char *end;
+  apr_int64_t count = apr_strtoi64(value, &end, 10);
+  if (*end || end == value || count < 0 || count > 65535)
+    return apr_psprintf(cmd->pool, "%s must be a number from 0 to 65535", cmd->cmd->name);
+
+  *result = count;
+
+  return NULL;
+}
+
+// Обработчик опции app_kdf_workers конфигурационного файла Apache
+static const char *option_kdf_workers(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
+
+  if (strcasecmp(value, "auto") == 0)
     {
-    ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_SUCCESS, r, "Name not found");
-    return HTTP_FORBIDDEN;
+    config->kdf_workers = -1;
+    return NULL;
     }
-  else
-    ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "Name=%s", name);
 
-  ap_rprintf(r, "<p>Добро пожаловать, %s</p>\n\n", name);
+  return parse_count(cmd, value, &config->kdf_workers);
+}
 
-  return OK;
+// Обработчик опции app_kdf_queue конфигурационного файла Apache
+static const char *option_kdf_queue(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
+
+  return parse_count(cmd, value, &config->kdf_queue);
+}
+
+// Обработчик опции app_kdf_timeout конфигурационного файла Apache
+static const char *option_kdf_timeout(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
+
+  return parse_seconds(cmd, value, &config->kdf_timeout);
+}
+
+// Обработчик опции app_body_limit конфигурационного файла Apache
+static const char *option_body_limit(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  app_config_t *config = ap_get_module_config(cmd->server->module_config, &app_module);
+
+  char *end;
+  if (apr_strtoff(&config->body_limit, value, &end, 10) != APR_SUCCESS || *end || config->body_limit <= 0)
+    return "app_body_limit must be a positive number of bytes";
+
+  return NULL;
+}
+
+// Ключ кеша аутентификаций: одна запись на логин
+static void auth_cache_key(const app_config_t *config, const char *user, unsigned char *key)
+{
+  hash_sha256_prefixed(config->secret, sizeof(config->secret), user, strlen(user), key);
+}
+
+// Проверочное значение записи кеша. Хеш пароля из базы данных в кеше не хранится, а без секрета
+// по проверочному значению нельзя перебирать пароли
+static void auth_cache_verifier(const app_config_t *config, const unsigned char *digest, unsigned char *verifier)
+{
+  hash_sha256_prefixed(config->secret, sizeof(config->secret), digest, DIGEST_LEN, verifier);
+}
+
+// Ищет имя пользователя в кеше аутентификаций. Возвращает NULL, если записи нет или пароль не совпал
+// с запомненным: тогда пароль проверяется по базе данных, т.к. он мог смениться
+static const char *auth_cache_get(request_rec *r, const app_config_t *config, const unsigned char *key, const unsigned char *digest)
+{
+  unsigned char value[AUTH_CACHE_VERIFIER_LEN + AUTH_CACHE_NAME_MAX];
+  unsigned int len = sizeof(value);
+
+  if (auth_cache_mutex && apr_global_mutex_lock(auth_cache_mutex) != APR_SUCCESS)
+    return NULL;
+
+  apr_status_t rv = config->provider->retrieve(config->cache, r->server, key, AUTH_CACHE_KEY_LEN, value, &len, r->pool);
+  unsigned char verifier[AUTH_CACHE_VERIFIER_LEN];
+  auth_cache_verifier(config, digest, verifier);
+  int found = rv == APR_SUCCESS && len >= AUTH_CACHE_VERIFIER_LEN && CRYPTO_memcmp(value, verifier, AUTH_CACHE_VERIFIER_LEN) == 0;
+
+  // Повторное сохранение продлевает запись и переносит ее в конец очереди вытеснения хранилища
+  if (found && config->policy == AUTH_CACHE_LRU)
+    config->provider->store(config->cache, r->server, key, AUTH_CACHE_KEY_LEN, apr_time_now() + config->ttl, value, len, r->pool);
+
+  if (auth_cache_mutex)
+    apr_global_mutex_unlock(auth_cache_mutex);
+
+  return found ? apr_pstrmemdup(r->pool, (const char *)value + AUTH_CACHE_VERIFIER_LEN, len - AUTH_CACHE_VERIFIER_LEN) : NULL;
+}
+
+// Запоминает имя пользователя после успешной проверки через базу данных. Запись с прежним паролем заменяется
+static void auth_cache_put(request_rec *r, const app_config_t *config, const unsigned char *key, const unsigned char *digest,
+                           const char *name)
+{
+  apr_size_t len = strlen(name);
+  if (len > AUTH_CACHE_NAME_MAX)
+    return;
+
+  unsigned char value[AUTH_CACHE_VERIFIER_LEN + AUTH_CACHE_NAME_MAX];
+  auth_cache_verifier(config, digest, value);
+  memcpy(value + AUTH_CACHE_VERIFIER_LEN, name, len);
+
+  if (auth_cache_mutex && apr_global_mutex_lock(auth_cache_mutex) != APR_SUCCESS)
+    return;
+
+  apr_status_t rv = config->provider->store(config->cache, r->server, key, AUTH_CACHE_KEY_LEN, apr_time_now() + config->ttl,
+                                            value, AUTH_CACHE_VERIFIER_LEN + len, r->pool);
+  if (rv != APR_SUCCESS)
+    ap_log_rerror(APLOG_MARK, LOG_WARNING, rv, r, "Failed to store login in app_auth_cache");
+
+  if (auth_cache_mutex)
+    apr_global_mutex_unlock(auth_cache_mutex);
+}
+
+// Соединение из пула mod_dbd на время одного обращения к базе данных. В отличие от ap_dbd_acquire, оно не держится
+// до конца запроса HTTP: вызывающий возвращает его dbd_close сразу после чтения результата, и проверка пароля,
+// ответ клиенту и остальная обработка запроса соединение не занимают
+static ap_dbd_t *dbd_open(request_rec *r)
+{
+  ap_dbd_t *dbd = mod_dbd_open_fn(r->pool, r->server);
+  if (!dbd)
+    ap_log_rerror(APLOG_MARK, LOG_ERR, APR_EGENERAL, r, "Failed to acquire database connection");
+  return dbd;
+}
+
+static void dbd_close(request_rec *r, ap_dbd_t *dbd)
+{
+  mod_dbd_close_fn(r->server, dbd);
+}
+
+// функция выполнения SQL-запроса, подготовленного mod_dbd под меткой label, с nargs строковыми параметрами
+apr_status_t dbd_select(request_rec *r, ap_dbd_t *dbd, apr_dbd_results_t **res, const char *label, int nargs, const char **args)
+{
+  if (!r || !dbd || !res || !label)
+    return APR_EGENERAL;
+
+  *res = NULL;
+
+  // Запрос подготавливается при открытии соединения; если это не удалось, его нет в dbd->prepared
+  apr_dbd_prepared_t *st = (apr_dbd_prepared_t *)apr_hash_get(dbd->prepared, label, APR_HASH_KEY_STRING);
+  if (!st)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_ERR, APR_EGENERAL, r, "DBD prepared statement %s not found", label);
+    return APR_EGENERAL;
+    }
+
+  int sql_err = apr_dbd_pselect(dbd->driver, r->pool, dbd->handle, res, st, 1, nargs, args);
+  if (sql_err)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_ERR, APR_EGENERAL, r, "DBD error for statement %s: %s", label,
+                  apr_dbd_error(dbd->driver, dbd->handle, sql_err));
+    return APR_EGENERAL;
+    }
+
+  return APR_SUCCESS;
+}
+
+// функция выполнения SQL-запроса, изменяющего данные, подготовленного mod_dbd под меткой label; число измененных строк в *nrows
+static apr_status_t dbd_update(request_rec *r, ap_dbd_t *dbd, int *nrows, const char *label, int nargs, const char **args)
+{
+  apr_dbd_prepared_t *st = (apr_dbd_prepared_t *)apr_hash_get(dbd->prepared, label, APR_HASH_KEY_STRING);
+  if (!st)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_ERR, APR_EGENERAL, r, "DBD prepared statement %s not found", label);
+    return APR_EGENERAL;
+    }
+
+  int sql_err = apr_dbd_pquery(dbd->driver, r->pool, dbd->handle, nrows, st, nargs, args);
+  if (sql_err)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_ERR, APR_EGENERAL, r, "DBD error for statement %s: %s", label,
+                  apr_dbd_error(dbd->driver, dbd->handle, sql_err));
+    return APR_EGENERAL;
+    }
+
+  return APR_SUCCESS;
+}
+
+// основной обработчик запросов Apache
+static int app_handler(request_rec *r)
+{
+  if (strcmp(r->handler, "app_handler") != 0)
+    return DECLINED;
+
+  r->content_type = "text/html; charset=UTF-8";
+
+  if (r->header_only)
+    return OK;
+
+  // Обработчику нужны только user и pass: остальные параметры не декодируются
+  static const char *const names[] = {"user", "pass"};
+  const char *values[2] = {NULL, NULL};
+  param_spec_t spec = {names, 2, NULL, values, NULL};
+  apr_status_t rv = get_params(r, &spec);
+  if (rv != APR_SUCCESS)
+    return ap_map_http_request_error(rv, HTTP_BAD_REQUEST);
+
+  const char *user = values[0];
+  const char *pass = values[1];
+
+  ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "user=%s pass=%s", user, pass);
+
+  // Получим имя пользователя с указанным логином и паролем. Если name останется NULL, значит, логин или пароль некорректны
+  const char *name = NULL;
+
+  app_config_t *config = ap_get_module_config(r->server->module_config, &app_module);
+
+  // Запрос без логина и пароля проходит по действующему cookie сессии, и дальше ничего не проверяется
+  int session = config->session_ttl && !(user && pass);
+  if (session)
+    name = session_user(r, config);
+
+  if (!name && !(user && pass))
+    {
+    ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "No login and password");
+    return HTTP_FORBIDDEN;
+    }
+
+  // Пароль хешируется один раз, дальше везде сравнивается двоичный хеш
+  unsigned char digest[DIGEST_LEN];
+  if (!name)
+    hash_sha256(pass, strlen(pass), digest);
+
+  // Если снимок таблицы users открыт, логин и пароль проверяются только по нему
+  int snap = !name && snapshot_login(r, config, user, digest, &name);
+
+  // При попадании в кеш аутентификаций соединение с базой данных не запрашивается
+  int cache = !snap && !name && config->provider;
+  unsigned char key[AUTH_CACHE_KEY_LEN];
+  if (cache)
+    {
+    auth_cache_key(config, user, key);
+    name = auth_cache_get(r, config, key, digest);
+    }
+
+  // Логин, которого точно нет в таблице users, отклоняется без обращения к базе данных
+  int filtered = !snap && !name && login_filter;
+  if (filtered)
+    {
+    login_filter_sync(r, config, config->filter_refresh);
+    STAT_ADD(login_filter->lookups, 1);
+    if (!login_filter_check(r, config, user))
+      {
+      STAT_ADD(login_filter->rejected, 1);
+      ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "Login %s is not registered", user);
+      return HTTP_FORBIDDEN;
+      }
+    }
+
+  if (!snap && !name)
+    {
+    rv = db_login(r, config, user, pass, digest, &name);
+    // Очередь пула scrypt полна: клиент сразу получает отказ и может повторить запрос позже
+    if (rv == APR_EBUSY || rv == APR_TIMEUP)
+      {
+      apr_table_setn(r->err_headers_out, "Retry-After", KDF_RETRY_AFTER);
+      return HTTP_SERVICE_UNAVAILABLE;
+      }
+    if (rv != APR_SUCCESS)
+      return HTTP_INTERNAL_SERVER_ERROR;
+    if (name && cache)
+      auth_cache_put(r, config, key, digest, name);
+    if (!name && filtered)
+      STAT_ADD(login_filter->passed, 1);
+    }
+
+  if (!name)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_SUCCESS, r, "Name not found");
+    return HTTP_FORBIDDEN;
+    }
+  else
+    ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "Name=%s", name);
+
+  if (config->session_ttl && !session)
+    session_issue(r, config, user, name);
+
+  ap_rprintf(r, "<p>Добро пожаловать, %s</p>\n\n", name);
+
+  return OK;
+}
+
+// Сверяет пароль с записью из столбца password длины len. Запись scrypt проверяется в слоте пула; если слот
+// не получен, возвращается APR_EBUSY (очередь полна) или APR_TIMEUP, и пароль остается непроверенным
+static apr_status_t verify_record(request_rec *r, const app_config_t *config, const unsigned char *record, apr_size_t len,
+                                  const char *pass, const unsigned char *digest, int *match)
+{
+  if (len == DIGEST_LEN)
+    {
+    *match = CRYPTO_memcmp(record, digest, DIGEST_LEN) == 0;
+    return APR_SUCCESS;
+    }
+
+  *match = false;
+  if (kdf_pool)
+    {
+    apr_status_t rv = kdf_pool_enter(kdf_pool, config->kdf_timeout);
+    if (rv != APR_SUCCESS)
+      {
+      ap_log_rerror(APLOG_MARK, LOG_WARNING, rv, r, "No free scrypt slot: %s",
+                    rv == APR_EBUSY ? "queue is full" : "wait timed out");
+      return rv;
+      }
+    }
+
+  *match = kdf_verify(record, pass, strlen(pass));
+
+  if (kdf_pool)
+    kdf_pool_leave(kdf_pool);
+  return APR_SUCCESS;
+}
+
+// true - запись, с которой совпал пароль, нужно заменить записью scrypt с текущими параметрами
+static int record_outdated(const app_config_t *config, const unsigned char *record, apr_size_t len)
+{
+  if (!config->kdf_enabled)
+    return false;
+  if (len != KDF_RECORD_LEN)
+    return true;
+
+  return record[1] != config->kdf.log_n || record[2] != config->kdf.r || record[3] != config->kdf.p;
+}
+
+// Заменяет в базе запись пароля old записью scrypt. Замена необязательна: если свободного слота в пуле нет,
+// она откладывается до следующего входа и не занимает место в очереди проверок. Соединение с базой данных
+// берется только для UPDATE, после вычисления записи
+static void kdf_rehash(request_rec *r, const app_config_t *config, const char *user, const char *pass,
+                       const unsigned char *old, apr_size_t old_len)
+{
+  if (kdf_pool && !kdf_pool_try_enter(kdf_pool))
+    {
+    ap_log_rerror(APLOG_MARK, LOG_DEBUG, APR_SUCCESS, r, "Rehash of %s postponed: no free scrypt slot", user);
+    return;
+    }
+
+  unsigned char record[KDF_RECORD_LEN];
+  apr_status_t rv = kdf_record(&config->kdf, pass, strlen(pass), record);
+
+  if (kdf_pool)
+    kdf_pool_leave(kdf_pool);
+
+  if (rv != APR_SUCCESS)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_ERR, rv, r, "Failed to compute scrypt record for %s", user);
+    return;
+    }
+
+  ap_dbd_t *dbd = dbd_open(r);
+  if (!dbd)
+    return;
+
+  int nrows = 0;
+  const char *args[3] = {hex_string(r->pool, record, KDF_RECORD_LEN), user, hex_string(r->pool, old, old_len)};
+  rv = dbd_update(r, dbd, &nrows, REHASH_LABEL, 3, args);
+  dbd_close(r, dbd);
+  if (rv == APR_SUCCESS)
+    ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "Password of %s rehashed with scrypt:%d:%d:%d, %d rows",
+                  user, config->kdf.log_n, config->kdf.r, config->kdf.p, nrows);
+}
+
+// Запись пароля из таблицы users, прочитанная до проверки
+typedef struct {
+  const char *login;                      // только для пакетной проверки
+  const char *name;
+  unsigned char record[KDF_RECORD_LEN];
+  apr_size_t len;
+} login_row_t;
+
+// Выполняет подготовленный запрос label и читает все строки (логин, имя, пароль в столбцах login, name и password;
+// -1 - столбца нет) в массив login_row_t. Строки с нераспознанным паролем пропускаются. Соединение с базой данных
+// берется только на время запроса и чтения строк
+static apr_status_t db_rows(request_rec *r, const char *label, const char *arg, int login, int name, int password,
+                            apr_array_header_t **rows)
+{
+  *rows = apr_array_make(r->pool, 1, sizeof(login_row_t));
+
+  ap_dbd_t *dbd = dbd_open(r);
+  if (!dbd)
+    return APR_EGENERAL;
+
+  // Значение передается параметром подготовленного запроса, а не подставляется в текст SQL
+  apr_dbd_results_t *res;
+  apr_dbd_row_t *row = NULL;
+  const char *args[1] = {arg};
+  apr_status_t rv = dbd_select(r, dbd, &res, label, 1, args);
+
+  // Строки дочитываются до конца, чтобы соединение было готово к следующему запросу
+  while (rv == APR_SUCCESS && res && apr_dbd_get_row(dbd->driver, r->pool, res, &row, -1) == 0 && row)
+    {
+    login_row_t item;
+    item.len = db_record(apr_dbd_get_entry(dbd->driver, row, password), item.record);
+    if (!item.len)
+      continue;
+    item.login = login >= 0 ? apr_pstrdup(r->pool, apr_dbd_get_entry(dbd->driver, row, login)) : NULL;
+    item.name = apr_pstrdup(r->pool, apr_dbd_get_entry(dbd->driver, row, name));
+    APR_ARRAY_PUSH(*rows, login_row_t) = item;
+    }
+
+  dbd_close(r, dbd);
+  return rv;
+}
+
+// Проверяет логин и пароль по базе данных. Имя пользователя записывается в *name, если они верны.
+// APR_EBUSY или APR_TIMEUP - пароль не удалось сверить с записью scrypt, потому что пул вычислений занят.
+// Соединение с базой данных возвращается в пул до проверки паролей: проверка scrypt занимает десятки миллисекунд
+static apr_status_t db_login(request_rec *r, const app_config_t *config, const char *user, const char *pass,
+                             const unsigned char *digest, const char **name)
+{
+  *name = NULL;
+
+  apr_array_header_t *rows;
+  if (db_rows(r, LOGIN_LABEL, user, -1, 0, 1, &rows) != APR_SUCCESS)
+    return APR_EGENERAL;
+
+  // Логины в users не уникальны: подходит любая запись с этим паролем
+  apr_status_t busy = APR_SUCCESS;
+  const login_row_t *matched = NULL;
+  for (int i = 0; i < rows->nelts && !matched; i++)
+    {
+    // После отказа пула остальные записи scrypt не проверяются: слот снова ждать бесполезно
+    const login_row_t *row = &APR_ARRAY_IDX(rows, i, login_row_t);
+    if (busy && row->len != DIGEST_LEN)
+      continue;
+
+    int match;
+    apr_status_t rv = verify_record(r, config, row->record, row->len, pass, digest, &match);
+    if (rv != APR_SUCCESS)
+      busy = rv;
+    if (match)
+      matched = row;
+    }
+
+  if (!matched)
+    return busy;
+
+  *name = matched->name;
+  if (record_outdated(config, matched->record, matched->len))
+    kdf_rehash(r, config, user, pass, matched->record, matched->len);
+
+  return APR_SUCCESS;
+}
+
+// Запись пакетной проверки логинов
+typedef struct {
+  const char *user;
+  const char *pass;                       // NULL - пароль не передан, запись не проверяется
+  const char *name;                       // имя пользователя, NULL - логин или пароль неверны
+  unsigned char digest[DIGEST_LEN];       // SHA-256 пароля
+  int filtered;                           // логин пропущен фильтром логинов
+  unsigned char key[AUTH_CACHE_KEY_LEN];  // ключ кеша аутентификаций
+  const unsigned char *outdated;          // совпавшая запись пароля, которую нужно пересчитать scrypt, иначе NULL
+  apr_size_t outdated_len;
+} batch_entry_t;
+
+// Литерал массива PostgreSQL {"a","b\"c"} из логинов записей; в элементах экранируются " и обратная косая черта
+static const char *pg_text_array(apr_pool_t *pool, apr_array_header_t *logins)
+{
+  apr_size_t size = 3;
+  for (int i = 0; i < logins->nelts; i++)
+    size += strlen(APR_ARRAY_IDX(logins, i, const char *)) * 2 + 3;
+
+  char *out = (char *)apr_palloc(pool, size);
+  char *dst = out;
+  *dst++ = '{';
+  for (int i = 0; i < logins->nelts; i++)
+    {
+    if (i)
+      *dst++ = ',';
+    *dst++ = '"';
+    for (const char *src = APR_ARRAY_IDX(logins, i, const char *); *src; src++)
+      {
+      if (*src == '"' || *src == '\\')
+        *dst++ = '\\';
+      *dst++ = *src;
+      }
+    *dst++ = '"';
+    }
+  *dst++ = '}';
+  *dst = 0;
+
+  return out;
+}
+
+// Проверяет по базе данных логины и пароли записей одним запросом: соединение запрашивается один раз на весь пакет
+// и возвращается в пул до проверки паролей. Имя пользователя записывается в те записи, где логин и пароль верны.
+// APR_EBUSY или APR_TIMEUP - хотя бы один пароль не удалось сверить с записью scrypt, потому что пул вычислений занят
+static apr_status_t db_login_batch(request_rec *r, const app_config_t *config, apr_array_header_t *entries)
+{
+  // Записи по логину: один логин может встретиться в пакете несколько раз с разными паролями
+  apr_hash_t *by_login = apr_hash_make(r->pool);
+  apr_array_header_t *logins = apr_array_make(r->pool, entries->nelts, sizeof(const char *));
+  for (int i = 0; i < entries->nelts; i++)
+    {
+    batch_entry_t *entry = APR_ARRAY_IDX(entries, i, batch_entry_t *);
+    apr_array_header_t *same = (apr_array_header_t *)apr_hash_get(by_login, entry->user, APR_HASH_KEY_STRING);
+    if (!same)
+      {
+      same = apr_array_make(r->pool, 1, sizeof(batch_entry_t *));
+      apr_hash_set(by_login, entry->user, APR_HASH_KEY_STRING, same);
+      APR_ARRAY_PUSH(logins, const char *) = entry->user;
+      }
+    APR_ARRAY_PUSH(same, batch_entry_t *) = entry;
+    }
+
+  apr_array_header_t *rows;
+  if (db_rows(r, BATCH_LABEL, pg_text_array(r->pool, logins), 0, 2, 1, &rows) != APR_SUCCESS)
+    return APR_EGENERAL;
+
+  // После первого отказа пула записи scrypt больше не проверяются: весь пакет все равно получит отказ
+  apr_status_t busy = APR_SUCCESS;
+  for (int k = 0; k < rows->nelts; k++)
+    {
+    const login_row_t *row = &APR_ARRAY_IDX(rows, k, login_row_t);
+    apr_array_header_t *same = row->login ? (apr_array_header_t *)apr_hash_get(by_login, row->login, APR_HASH_KEY_STRING) : NULL;
+    if (!same || (busy && row->len != DIGEST_LEN))
+      continue;
+
+    for (int i = 0; i < same->nelts && !(busy && row->len != DIGEST_LEN); i++)
+      {
+      batch_entry_t *entry = APR_ARRAY_IDX(same, i, batch_entry_t *);
+      if (entry->name)
+        continue;
+
+      int match;
+      apr_status_t rv = verify_record(r, config, row->record, row->len, entry->pass, entry->digest, &match);
+      if (rv != APR_SUCCESS)
+        busy = rv;
+      if (!match)
+        continue;
+
+      entry->name = row->name;
+      if (record_outdated(config, row->record, row->len))
+        {
+        entry->outdated = row->record;
+        entry->outdated_len = row->len;
+        }
+      }
+    }
+
+  if (busy)
+    return busy;
+
+  for (int i = 0; i < entries->nelts; i++)
+    {
+    batch_entry_t *entry = APR_ARRAY_IDX(entries, i, batch_entry_t *);
+    if (entry->outdated)
+      kdf_rehash(r, config, entry->user, entry->pass, entry->outdated, entry->outdated_len);
+    }
+
+  return APR_SUCCESS;
+}
+
+// Обработчик app-batch: проверяет все пары user и pass из запроса и отвечает одной строкой на пару в том же порядке:
+// "1<TAB>имя" - логин и пароль верны, "0" - нет. Управляющие символы в имени экранируются
+static int batch_handler(request_rec *r)
+{
+  if (strcmp(r->handler, BATCH_HANDLER) != 0)
+    return DECLINED;
+
+  r->allowed |= AP_METHOD_BIT << M_POST;
+  if (r->method_number != M_POST)
+    return HTTP_METHOD_NOT_ALLOWED;
+
+  // Пары собираются в порядке параметров: pass относится к ближайшему предыдущему user, а в JSON - к user того же объекта
+  static const char *const names[] = {"user", "pass"};
+  param_pairs_t pairs;
+  params_pairs_init(&pairs, r->pool, BATCH_MAX);
+  param_spec_t spec = {names, 2, params_pairs_fn, NULL, &pairs};
+  apr_status_t rv = get_params(r, &spec);
+  if (rv != APR_SUCCESS)
+    return ap_map_http_request_error(rv, HTTP_BAD_REQUEST);
+  if (pairs.too_many)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_SUCCESS, r, "More than %d logins in a batch", BATCH_MAX);
+    return HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+  apr_array_header_t *entries = apr_array_make(r->pool, pairs.pairs->nelts, sizeof(batch_entry_t));
+  batch_entry_t *entry = NULL;
+  for (int i = 0; i < pairs.pairs->nelts; i++)
+    {
+    entry = (batch_entry_t *)apr_array_push(entries);
+    memset(entry, 0, sizeof(batch_entry_t));
+    entry->user = APR_ARRAY_IDX(pairs.pairs, i, param_pair_t).first;
+    entry->pass = APR_ARRAY_IDX(pairs.pairs, i, param_pair_t).second;
+    }
+
+  app_config_t *config = ap_get_module_config(r->server->module_config, &app_module);
+  if (login_filter)
+    login_filter_sync(r, config, config->filter_refresh);
+
+  // Пароли всего пакета хешируются вместе: несколько паролей сразу в дорожках векторных регистров
+  hash_input_t *inputs = (hash_input_t *)apr_palloc(r->pool, entries->nelts * sizeof(hash_input_t) + 1);
+  unsigned char *digests = (unsigned char *)apr_palloc(r->pool, entries->nelts * DIGEST_LEN + 1);
+  int hashed = 0;
+  for (int i = 0; i < entries->nelts; i++)
+    {
+    entry = &APR_ARRAY_IDX(entries, i, batch_entry_t);
+    if (entry->pass)
+      {
+      inputs[hashed].data = entry->pass;
+      inputs[hashed++].len = strlen(entry->pass);
+      }
+    }
+  hash_sha256_many(inputs, hashed, digests);
+
+  // Снимок таблицы users, кеш и фильтр логинов проверяются для каждой записи, как в app_handler,
+  // а оставшиеся записи - одним запросом к базе данных
+  apr_array_header_t *pending = apr_array_make(r->pool, entries->nelts, sizeof(batch_entry_t *));
+  hashed = 0;
+  for (int i = 0; i < entries->nelts; i++)
+    {
+    entry = &APR_ARRAY_IDX(entries, i, batch_entry_t);
+    if (!entry->pass)
+      continue;
+
+    memcpy(entry->digest, digests + hashed++ * DIGEST_LEN, DIGEST_LEN);
+    if (snapshot_login(r, config, entry->user, entry->digest, &entry->name))
+      continue;
+
+    if (config->provider)
+      {
+      auth_cache_key(config, entry->user, entry->key);
+      entry->name = auth_cache_get(r, config, entry->key, entry->digest);
+      if (entry->name)
+        continue;
+      }
+
+    if (login_filter)
+      {
+      STAT_ADD(login_filter->lookups, 1);
+      if (!login_filter_check(r, config, entry->user))
+        {
+        STAT_ADD(login_filter->rejected, 1);
+        continue;
+        }
+      entry->filtered = true;
+      }
+
+    APR_ARRAY_PUSH(pending, batch_entry_t *) = entry;
+    }
+
+  if (pending->nelts)
+    {
+    rv = db_login_batch(r, config, pending);
+    if (rv == APR_EBUSY || rv == APR_TIMEUP)
+      {
+      apr_table_setn(r->err_headers_out, "Retry-After", KDF_RETRY_AFTER);
+      return HTTP_SERVICE_UNAVAILABLE;
+      }
+    if (rv != APR_SUCCESS)
+      return HTTP_INTERNAL_SERVER_ERROR;
+
+    for (int i = 0; i < pending->nelts; i++)
+      {
+      entry = APR_ARRAY_IDX(pending, i, batch_entry_t *);
+      if (entry->name && config->provider)
+        auth_cache_put(r, config, entry->key, entry->digest, entry->name);
+      if (!entry->name && entry->filtered)
+        STAT_ADD(login_filter->passed, 1);
+      }
+    }
+
+  r->content_type = "text/plain; charset=UTF-8";
+
+  int valid = 0;
+  for (int i = 0; i < entries->nelts; i++)
+    {
+    entry = &APR_ARRAY_IDX(entries, i, batch_entry_t);
+    if (entry->name)
+      {
+      valid++;
+      ap_rvputs(r, "1\t", ap_escape_logitem(r->pool, entry->name), "\n", NULL);
+      }
+    else
+      ap_rputs("0\n", r);
+    }
+
+  ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "Batch of %d logins: %d checked in database, %d valid",
+                entries->nelts, pending->nelts, valid);
+  return OK;
+}
+
+// Начало и конец изменения фильтра логинов: пока seq нечетный, читатели фильтру не доверяют
+static void login_filter_write_begin()
+{
+  __atomic_store_n(&login_filter->seq, login_filter->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void login_filter_write_end()
+{
+  __atomic_store_n(&login_filter->seq, login_filter->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Добавляет логин в фильтр. При переполнении фильтр перестает отклонять логины до следующего построения
+static void login_filter_add(request_rec *r, const app_config_t *config, const char *login)
+{
+  if (cf_insert(login_cf, login, strlen(login)) || !login_filter->ready)
+    return;
+
+  login_filter->ready = false;
+  ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_SUCCESS, r, "Login filter is full (%lu logins), increase app_login_filter %lu",
+                (unsigned long)cf_count(login_cf), (unsigned long)config->filter_capacity);
+}
+
+// Строит фильтр заново по таблице users
+static apr_status_t login_filter_build(request_rec *r, const app_config_t *config, ap_dbd_t *dbd, apr_pool_t *pool)
+{
+  apr_dbd_results_t *res;
+  apr_dbd_row_t *row = NULL;
+  if (dbd_select(r, dbd, &res, LOGINS_LABEL, 0, NULL) != APR_SUCCESS)
+    return APR_EGENERAL;
+
+  // Сначала читаем все строки, чтобы фильтр был недоступен читателям только на время заполнения
+  apr_array_header_t *logins = apr_array_make(pool, 1024, sizeof(const char *));
+  apr_array_header_t *ids = apr_array_make(pool, 16, sizeof(apr_int64_t));
+  while (res && apr_dbd_get_row(dbd->driver, pool, res, &row, -1) == 0 && row)
+    {
+    const char *op = apr_dbd_get_entry(dbd->driver, row, 0);
+    const char *value = apr_dbd_get_entry(dbd->driver, row, 1);
+    if (*op == 'I')
+      APR_ARRAY_PUSH(logins, const char *) = value;
+    else
+      APR_ARRAY_PUSH(ids, apr_int64_t) = apr_atoi64(value);
+    }
+
+  login_filter_write_begin();
+  cf_clear(login_cf);
+  login_filter->ready = true;
+  login_filter->gap = false;
+  for (int i = 0; i < logins->nelts; i++)
+    login_filter_add(r, config, APR_ARRAY_IDX(logins, i, const char *));
+
+  // Записи журнала, видимые в снимке, уже учтены в таблице users
+  memset(login_filter->applied, 0, sizeof(login_filter->applied));
+  login_filter->last_id = 0;
+  for (int i = 0; i < ids->nelts; i++)
+    {
+    apr_int64_t id = APR_ARRAY_IDX(ids, i, apr_int64_t);
+    login_filter->applied[id % LOGIN_LOG_WINDOW] = id;
+    if (id > login_filter->last_id)
+      login_filter->last_id = id;
+    }
+  login_filter->built = apr_time_now();
+  login_filter_write_end();
+
+  ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "Login filter built: %d logins, users_log id %" APR_INT64_T_FMT,
+                logins->nelts, login_filter->last_id);
+  return APR_SUCCESS;
+}
+
+// Применяет к фильтру новые записи журнала users_log
+static apr_status_t login_filter_apply_log(request_rec *r, const app_config_t *config, ap_dbd_t *dbd, apr_pool_t *pool)
+{
+  apr_dbd_results_t *res;
+  apr_dbd_row_t *row = NULL;
+  const char *args[1] = {apr_psprintf(pool, "%" APR_INT64_T_FMT, login_filter->last_id - LOGIN_LOG_WINDOW)};
+  if (dbd_select(r, dbd, &res, LOGIN_LOG_LABEL, 1, args) != APR_SUCCESS)
+    return APR_EGENERAL;
+
+  typedef struct {
+    apr_int64_t id;
+    char op;
+    const char *login;
+  } log_row_t;
+
+  apr_array_header_t *rows = apr_array_make(pool, 16, sizeof(log_row_t));
+  while (res && apr_dbd_get_row(dbd->driver, pool, res, &row, -1) == 0 && row)
+    {
+    apr_int64_t id = apr_atoi64(apr_dbd_get_entry(dbd->driver, row, 0));
+    if (login_filter->applied[id % LOGIN_LOG_WINDOW] == id)
+      continue;
+
+    log_row_t *lr = (log_row_t *)apr_array_push(rows);
+    lr->id = id;
+    lr->op = *apr_dbd_get_entry(dbd->driver, row, 1);
+    lr->login = apr_dbd_get_entry(dbd->driver, row, 2);
+    }
+
+  if (!rows->nelts)
+    return APR_SUCCESS;
+
+  // Номера до last_id - LOGIN_LOG_WINDOW больше не перечитываются: непримененный номер среди уходящих из окна -
+  // запись, которая еще может появиться (транзакция не зафиксирована) или откачена
+  apr_int64_t last_id = APR_ARRAY_IDX(rows, rows->nelts - 1, log_row_t).id;
+  if (last_id > login_filter->last_id && !login_filter->gap)
+    {
+    apr_int64_t from = login_filter->last_id - LOGIN_LOG_WINDOW, to = last_id - LOGIN_LOG_WINDOW;
+    int i = 0;
+    for (apr_int64_t id = from > 0 ? from + 1 : 1; id <= to && !login_filter->gap; id++)
+      {
+      while (i < rows->nelts && APR_ARRAY_IDX(rows, i, log_row_t).id < id)
+        i++;
+      if (login_filter->applied[id % LOGIN_LOG_WINDOW] != id && (i == rows->nelts || APR_ARRAY_IDX(rows, i, log_row_t).id != id))
+        {
+        login_filter->gap = true;
+        ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "Login filter: users_log id %" APR_INT64_T_FMT
+                      " left the window unapplied, the filter will be rebuilt", id);
+        }
+      }
+    }
+
+  login_filter_write_begin();
+  for (int i = 0; i < rows->nelts; i++)
+    {
+    const log_row_t *lr = &APR_ARRAY_IDX(rows, i, log_row_t);
+    if (lr->op == 'I')
+      login_filter_add(r, config, lr->login);
+    else
+      cf_remove(login_cf, lr->login, strlen(lr->login));
+
+    login_filter->applied[lr->id % LOGIN_LOG_WINDOW] = lr->id;
+    if (lr->id > login_filter->last_id)
+      login_filter->last_id = lr->id;
+    }
+  login_filter_write_end();
+
+  ap_log_rerror(APLOG_MARK, LOG_DEBUG, APR_SUCCESS, r, "Login filter: %d users_log records applied", rows->nelts);
+  return APR_SUCCESS;
+}
+
+// Обновляет фильтр логинов, если с последнего обращения к users_log прошло refresh. Обновляет один процесс,
+// остальные в это время не ждут блокировку, а пользуются фильтром как есть.
+// false - фильтр устарел, но его сейчас обновляет другой процесс
+static int login_filter_sync(request_rec *r, const app_config_t *config, apr_interval_time_t refresh)
+{
+  apr_time_t now = apr_time_now();
+  if (now - __atomic_load_n(&login_filter->synced, __ATOMIC_RELAXED) < refresh)
+    return true;
+
+  if (apr_global_mutex_trylock(login_filter_mutex) != APR_SUCCESS)
+    return false;
+
+  // Пока ждали блокировку, фильтр мог обновить другой процесс
+  if (now - login_filter->synced >= refresh)
+    {
+    __atomic_store_n(&login_filter->synced, now, __ATOMIC_RELAXED);
+
+    ap_dbd_t *dbd = dbd_open(r);
+    apr_pool_t *pool;
+    if (dbd && apr_pool_create(&pool, r->pool) == APR_SUCCESS)
+      {
+      // Переполненный фильтр строится заново не чаще, чем раз в app_login_filter_rebuild секунд
+      if (!login_filter->built || now - login_filter->built >= config->filter_rebuild || login_filter->gap)
+        login_filter_build(r, config, dbd, pool);
+      else if (login_filter->ready)
+        login_filter_apply_log(r, config, dbd, pool);
+      apr_pool_destroy(pool);
+      }
+    if (dbd)
+      dbd_close(r, dbd);
+    }
+
+  apr_global_mutex_unlock(login_filter_mutex);
+  return true;
+}
+
+// false - логина точно нет в таблице users; true - логин, возможно, есть, или фильтр сейчас не готов
+static int login_filter_maybe(const char *user)
+{
+  apr_uint32_t seq = __atomic_load_n(&login_filter->seq, __ATOMIC_ACQUIRE);
+  if ((seq & 1) || !login_filter->ready || login_filter->gap)
+    return true;
+
+  int found = cf_contains(login_cf, user, strlen(user));
+
+  // Если фильтр менялся во время проверки, ответу "нет" верить нельзя
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return found || __atomic_load_n(&login_filter->seq, __ATOMIC_RELAXED) != seq;
+}
+
+// Проверяет логин фильтром. Ответ "нет" фильтра, обновленного больше LOGIN_FILTER_RECHECK назад, проверяется еще
+// раз после обновления; если обновить фильтр не удалось (его обновляет другой процесс), логин проверяется в базе
+static int login_filter_check(request_rec *r, const app_config_t *config, const char *user)
+{
+  if (login_filter_maybe(user))
+    return true;
+
+  return !login_filter_sync(r, config, LOGIN_FILTER_RECHECK) || login_filter_maybe(user);
+}
+
+// Обработчик app-status: состояние фильтра логинов, пула scrypt и параметры кеша аутентификаций.
+// По умолчанию текст, с параметром ?json - JSON
+static int status_handler(request_rec *r)
+{
+  if (strcmp(r->handler, STATUS_HANDLER) != 0)
+    return DECLINED;
+
+  int json = r->args && strcmp(r->args, "json") == 0;
+  r->content_type = json ? "application/json" : "text/plain; charset=UTF-8";
+
+  if (r->header_only)
+    return OK;
+
+  app_config_t *config = ap_get_module_config(r->server->module_config, &app_module);
+
+  if (json)
+    ap_rprintf(r, "{\"auth_cache\":{\"enabled\":%s,\"ttl\":%" APR_TIME_T_FMT ",\"policy\":\"%s\"}", config->provider ? "true" : "false",
+               apr_time_sec(config->ttl), config->policy == AUTH_CACHE_LRU ? "lru" : "fifo");
+  else
+    ap_rprintf(r, "Auth cache: %s, ttl %" APR_TIME_T_FMT " s, policy %s\n", config->provider ? "on" : "off",
+               apr_time_sec(config->ttl), config->policy == AUTH_CACHE_LRU ? "lru" : "fifo");
+
+  // 0 - сессии выключены
+  ap_rprintf(r, json ? ",\"session_ttl\":%" APR_TIME_T_FMT : "Session cookie ttl: %" APR_TIME_T_FMT " s\n", apr_time_sec(config->session_ttl));
+  ap_rprintf(r, json ? ",\"hash\":{\"backend\":\"%s\",\"batch\":\"%s\"}" : "SHA-256: %s, batches %s\n", hash_backend(),
+             hash_mb_level_name(hash_mb_best_level()));
+
+  if (!config->kdf_enabled)
+    ap_rputs(json ? ",\"kdf\":null" : "KDF: off\n", r);
+  else if (json)
+    ap_rprintf(r, ",\"kdf\":{\"log_n\":%d,\"r\":%d,\"p\":%d}", config->kdf.log_n, config->kdf.r, config->kdf.p);
+  else
+    ap_rprintf(r, "KDF: scrypt:%d:%d:%d\n", config->kdf.log_n, config->kdf.r, config->kdf.p);
+
+  if (!kdf_pool)
+    ap_rputs(json ? ",\"kdf_pool\":null" : "KDF pool: off\n", r);
+  else
+    {
+    kdf_pool_stats_t st;
+    kdf_pool_stats(kdf_pool, &st);
+    if (json)
+      ap_rprintf(r, ",\"kdf_pool\":{\"workers\":%d,\"queue\":%d,\"running\":%d,\"waiting\":%d,\"admitted\":%" APR_UINT64_T_FMT
+                 ",\"queued\":%" APR_UINT64_T_FMT ",\"rejected\":%" APR_UINT64_T_FMT ",\"timeouts\":%" APR_UINT64_T_FMT "}",
+                 st.workers, st.queue, st.running, st.waiting, st.admitted, st.queued, st.rejected, st.timeouts);
+    else
+      ap_rprintf(r, "KDF pool: %d of %d workers busy, %d of %d waiting, admitted %" APR_UINT64_T_FMT " (%" APR_UINT64_T_FMT
+                 " after waiting), rejected %" APR_UINT64_T_FMT ", timed out %" APR_UINT64_T_FMT "\n",
+                 st.running, st.workers, st.waiting, st.queue, st.admitted, st.queued, st.rejected, st.timeouts);
+    }
+
+  if (user_snap_lock)
+    apr_thread_rwlock_rdlock(user_snap_lock);
+  if (!user_snap)
+    ap_rprintf(r, json ? ",\"snapshot\":null" : "Users snapshot: %s\n", config->snapshot ? "not loaded" : "off");
+  else if (json)
+    ap_rprintf(r, ",\"snapshot\":{\"pid\":%d,\"path\":\"%s\",\"users\":%lu,\"mtime\":%" APR_TIME_T_FMT "}", (int)getpid(),
+               ap_escape_quotes(r->pool, user_snap_path), (unsigned long)snap_count(user_snap), apr_time_sec(snap_mtime(user_snap)));
+  else
+    ap_rprintf(r, "Users snapshot in process %d: %s, %lu users, modified %" APR_TIME_T_FMT "\n", (int)getpid(), user_snap_path,
+               (unsigned long)snap_count(user_snap), apr_time_sec(snap_mtime(user_snap)));
+  if (user_snap_lock)
+    apr_thread_rwlock_unlock(user_snap_lock);
+
+  if (!login_filter)
+    {
+    ap_rputs(json ? ",\"login_filter\":null}\n" : "Login filter: off\n", r);
+    return OK;
+    }
+
+  apr_size_t count = cf_count(login_cf), slots = cf_slots(login_cf);
+  apr_size_t bytes = sizeof(login_filter_t) + cf_size(config->filter_capacity);
+  apr_uint64_t lookups = STAT_GET(login_filter->lookups), rejected = STAT_GET(login_filter->rejected);
+  apr_uint64_t passed = STAT_GET(login_filter->passed);
+  if (json)
+    ap_rprintf(r, ",\"login_filter\":{\"ready\":%s,\"logins\":%lu,\"capacity\":%lu,\"slots\":%lu,\"bytes\":%lu,\"load\":%.4f"
+               ",\"fp_rate\":%.6f,\"lookups\":%" APR_UINT64_T_FMT ",\"rejected\":%" APR_UINT64_T_FMT ",\"passed\":%" APR_UINT64_T_FMT
+               ",\"last_id\":%" APR_INT64_T_FMT "}}\n", login_filter->ready ? "true" : "false", (unsigned long)count,
+               (unsigned long)config->filter_capacity, (unsigned long)slots, (unsigned long)bytes, (double)count / slots,
+               cf_fp_rate(login_cf), lookups, rejected, passed, login_filter->last_id);
+  else
+    ap_rprintf(r, "Login filter: %s, %lu logins of %lu, %lu slots, %lu bytes, load %.2f%%, false positive rate %.4f%%\n"
+               "Lookups %" APR_UINT64_T_FMT ", rejected %" APR_UINT64_T_FMT ", passed but not found %" APR_UINT64_T_FMT
+               ", users_log id %" APR_INT64_T_FMT "\n", login_filter->ready ? "ready" : "not ready", (unsigned long)count,
+               (unsigned long)config->filter_capacity, (unsigned long)slots, (unsigned long)bytes, 100.0 * count / slots,
+               100.0 * cf_fp_rate(login_cf), lookups, rejected, passed, login_filter->last_id);
+
+  return OK;
+}
+
+// Открывает снимок таблицы users заново, если файл заменен, а прежнее отображение снимает.
+// Если новый файл поврежден, остается прежний снимок. Запросы, читающие снимок, держат блокировку
+// чтения, поэтому отображение не снимается, пока другой поток ищет в нем логин
+static void user_snapshot_refresh(request_rec *r, const app_config_t *config)
+{
+  apr_time_t now = apr_time_now();
+  if (now - __atomic_load_n(&user_snap_checked, __ATOMIC_RELAXED) < apr_time_from_sec(USER_SNAPSHOT_CHECK))
+    return;
+
+  if (user_snap_lock)
+    apr_thread_rwlock_wrlock(user_snap_lock);
+
+  // Пока ждали блокировку, снимок мог проверить другой поток
+  int same = user_snap && strcmp(user_snap_path, config->snapshot) == 0;
+  if (now - user_snap_checked >= apr_time_from_sec(USER_SNAPSHOT_CHECK) && !(same && !snap_changed(user_snap, config->snapshot)))
+    {
+    apr_pool_t *pool;
+    snap_t *snap;
+    apr_status_t rv = apr_pool_create(&pool, child_pool);
+    if (rv == APR_SUCCESS)
+      {
+      rv = snap_open(pool, config->snapshot, &snap);
+      if (rv != APR_SUCCESS)
+        apr_pool_destroy(pool);
+      }
+
+    if (rv != APR_SUCCESS)
+      ap_log_rerror(APLOG_MARK, LOG_ERR, rv, r, "Failed to open users snapshot %s", config->snapshot);
+    else
+      {
+      if (user_snap_pool)
+        apr_pool_destroy(user_snap_pool);
+      user_snap = snap;
+      user_snap_pool = pool;
+      user_snap_path = apr_pstrdup(pool, config->snapshot);
+
+      ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "Users snapshot %s loaded: %lu users", user_snap_path,
+                    (unsigned long)snap_count(user_snap));
+      }
+    }
+  __atomic_store_n(&user_snap_checked, now, __ATOMIC_RELAXED);
+
+  if (user_snap_lock)
+    apr_thread_rwlock_unlock(user_snap_lock);
+}
+
+// Проверяет логин и хеш пароля по снимку таблицы users: *name - имя пользователя либо NULL.
+// false - снимок не задан или не открывается, тогда логин проверяется по базе данных
+static int snapshot_login(request_rec *r, const app_config_t *config, const char *user, const unsigned char *digest, const char **name)
+{
+  if (!config->snapshot)
+    return false;
+
+  user_snapshot_refresh(r, config);
+
+  if (user_snap_lock)
+    apr_thread_rwlock_rdlock(user_snap_lock);
+
+  int found = user_snap && strcmp(user_snap_path, config->snapshot) == 0;
+  if (found)
+    {
+    // Имя лежит в отображении файла, которое может быть снято после снятия блокировки
+    const char *snap_name = snap_lookup(user_snap, user, digest);
+    *name = snap_name ? apr_pstrdup(r->pool, snap_name) : NULL;
+    }
+
+  if (user_snap_lock)
+    apr_thread_rwlock_unlock(user_snap_lock);
+
+  return found;
+}
+
+// Имя пользователя из действующего cookie сессии, NULL - cookie нет, он подделан или просрочен
+static const char *session_user(request_rec *r, const app_config_t *config)
+{
+  const char *value = NULL;
+  if (ap_cookie_read(r, SESSION_COOKIE, &value, 0) != APR_SUCCESS || !value)
+    return NULL;
+
+  const char *login, *name;
+  if (session_verify(r->pool, &config->session_key, value, r->request_time, &login, &name) != APR_SUCCESS)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "Session cookie is invalid or expired");
+    return NULL;
+    }
+
+  ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "Session of user %s", login);
+  return name;
+}
+
+// Выдает cookie сессии после входа по логину и паролю
+static void session_issue(request_rec *r, const app_config_t *config, const char *user, const char *name)
+{
+  const char *value = session_sign(r->pool, &config->session_key, r->request_time + config->session_ttl, user, name);
+  if (!value)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_ERR, APR_EGENERAL, r, "Failed to sign session cookie");
+    return;
+    }
+  const char *attrs = strcmp(ap_http_scheme(r), "https") == 0 ? SESSION_COOKIE_ATTRS ";Secure" : SESSION_COOKIE_ATTRS;
+
+  ap_cookie_write(r, SESSION_COOKIE, value, attrs, apr_time_sec(config->session_ttl), r->headers_out, NULL);
 }
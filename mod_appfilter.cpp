@@ -3,42 +3,269 @@
 #include "http_protocol.h"
 #include "http_log.h"
 #include "http_request.h"
+#include "util_filter.h"
 #include "ap_config.h"
 #include "apr_dbd.h"
 #include "apr_strings.h"
+#include "apr_shm.h"
+#include "apr_thread_proc.h"
+#include "ap_mpm.h"
 #include "mod_dbd.h"
 #include "apreq.h"
 #include "apreq_parser.h"
 #include "apreq_param.h"
 #include "apreq_util.h"
 #include "openssl/sha.h"
+#include "appfilter_ac.h"
+#include "appfilter_simd.h"
+#include "appfilter_decode.h"
+#include "appfilter_regex.h"
+#include "appfilter_sqli.h"
+#include "appfilter_cache.h"
+#include "app_params.h"
+#include "time.h"
+#include "unistd.h"
+
+// Части запроса, которые проверяются на наличие плохих строк (опция appfilter_target)
+enum {
+  TARGET_ARGS = 0,        // параметры URL
+  TARGET_PATH,            // путь URI
+  TARGET_HEADER,          // заголовки, перечисленные в виде header:Имя
+  TARGET_COOKIE,          // значения из заголовка Cookie
+  TARGET_BODY,            // тело запроса
+  TARGET_COUNT
+};
+
+static const char *target_names[TARGET_COUNT] = {"args", "path", "header", "cookie", "body"};
+
+#define TARGET_BIT(t) (1u << (t))
+// Если опция appfilter_target не указана, проверяются параметры URL и тело запроса
+#define TARGETS_DEFAULT (TARGET_BIT(TARGET_ARGS) | TARGET_BIT(TARGET_BODY))
+
+// Плохая строка из опции appfilter_str либо регулярное выражение из опции appfilter_regex
+typedef struct {
+  const char *str;
+  unsigned targets;       // в каких частях запроса искать строку, 0 - во всех выбранных
+  int regex;              // true - str является регулярным выражением
+} rule_t;
+
+// Плохие строки, скомпилированные для одной части запроса
+typedef struct {
+  apr_array_header_t *patterns; // исходные строки, затем регулярные выражения; номер совпадения - индекс в этом массиве
+  int nstr;                     // сколько в patterns строк appfilter_str, номер выражения смещен на это число
+  ac_automaton_t *matcher;      // автомат для поиска всех строк за один проход, NULL - строк нет
+  re_set_t *regex;              // ДКА всех регулярных выражений, NULL - выражений нет
+  int regex_id;                 // номер regex среди всех наборов правил, индекс копии ДКА потока
+  int *rule;                    // номер правила в config_t.rules для каждого элемента patterns
+} target_t;
+
+// Счетчики одной части запроса для набора правил. Хранятся в разделяемой памяти и увеличиваются
+// всеми процессами атомарно, без блокировок
+typedef struct {
+  apr_uint64_t values;          // проверено значений (для тела - тел запросов)
+  apr_uint64_t bytes;           // просмотрено байт
+  apr_uint64_t nsec;            // время проверки в наносекундах
+  apr_uint64_t blocked;         // отклонено строками appfilter_str и выражениями appfilter_regex
+  apr_uint64_t sqli;            // отклонено проверкой appfilter_sqli
+  apr_uint64_t cached;          // решение взято из кеша решений
+} target_stats_t;
 
 typedef struct {
   int enabled;            // true, если модуль активирован опцией appfilter_enable true
-  apr_table_t *badstr;    // apache таблица со списком плохих строк
+  apr_array_header_t *rules;    // строки из опций appfilter_str
+  unsigned targets;             // проверяемые части запроса
+  int targets_set;              // опция appfilter_target указана
+  apr_array_header_t *headers;  // имена проверяемых заголовков
+  target_t target[TARGET_COUNT];
+  int compiled;                 // автоматы уже построены
+  int decode_depth;             // сколько раз декодировать %XX перед поиском (опция appfilter_decode_depth)
+  apr_size_t regex_cache;       // лимит памяти кеша ДКА регулярных выражений (опция appfilter_regex_cache)
+  apr_array_header_t *sqli_params;        // параметры, проверяемые на SQL-инъекции (опция appfilter_sqli)
+  int sqli_all;                           // проверять все параметры (appfilter_sqli *)
+  apr_array_header_t *sqli_fingerprints;  // дополнительные отпечатки (опция appfilter_sqli_fingerprint)
+  sqli_set_t *sqli;                       // набор отпечатков, NULL - проверка на SQL-инъекции выключена
+  apr_size_t cache_entries;     // размер кеша решений в каждом процессе (опция appfilter_cache), 0 - кеш выключен
+  apr_uint32_t generation;      // поколение правил: номер построения автоматов, решения из кеша привязаны к нему
+  const char *name;             // имя набора правил для appfilter-status: сервер или путь раздела
+  target_stats_t *stats;        // счетчики частей запроса в разделяемой памяти
+  apr_uint64_t *hits;           // срабатывания каждого правила из rules в разделяемой памяти
 } config_t;
 
+// Параметры раздела Directory или Location. Правила раздела добавляются к правилам основного сервера;
+// набор правил раздела строится один раз после чтения конфигурации и используется всеми запросами
+typedef struct dir_config_t {
+  const char *path;             // раздел конфигурации, NULL - параметры по умолчанию
+  int enabled;                  // опция appfilter_enable раздела, -1 - не указана
+  apr_array_header_t *adds;     // правила appfilter_str и appfilter_regex раздела
+  apr_array_header_t *removes;  // строки и выражения основного сервера, отключенные опцией appfilter_remove
+  config_t *ruleset;            // построенный набор правил раздела
+  const struct dir_config_t *section; // после слияния: раздел, чьи правила действуют, NULL - правила сервера
+} dir_config_t;
+
+// Часть запроса проверяется, если для нее есть строки или выражения
+#define TARGET_ACTIVE(config, t) ((config)->target[t].matcher || (config)->target[t].regex)
+
+// Состояние поиска плохих строк в нормализованных данных
+typedef struct {
+  const target_t *target;
+  re_set_t *regex;              // ДКА текущего потока, NULL - выражений нет
+  ac_state_t state;
+  re_state_t re;
+  int found;                    // номер найденной строки либо -1
+} scan_t;
+
+// Длина имени параметра, которая учитывается при сравнении с именами из appfilter_sqli
+#define SQLI_PARAM_NAME_MAX 64
+
+// Разбор строки параметров "имя=значение&имя=значение" (или Cookie с разделителем ';')
+// для проверки значений на SQL-инъекции. Данные можно подавать частями
+typedef struct {
+  char sep;                     // разделитель параметров
+  int in_value;                 // разбирается значение, иначе имя
+  char name[SQLI_PARAM_NAME_MAX];    // имя текущего параметра до декодирования
+  apr_size_t nlen;
+  int selected;                 // значение текущего параметра проверяется
+  norm_state_t ns;
+  sqli_state_t sq;
+  int found;                    // найдена SQL-инъекция
+  char fp[SQLI_FP_SIZE];        // ее отпечаток
+} params_t;
+
+// Значения тела JSON или multipart/form-data: экранирование \uXXXX и кодировки частей не видны нормализатору
+// исходного тела, поэтому декодированные значения проверяются еще раз по отдельности
+typedef struct {
+  params_body_t parser;
+  param_spec_t spec;
+  int open;                     // значение начато
+  int stopped;                  // разбор закончен или тело неверного формата
+  scan_t scan;                  // плохие строки в текущем значении
+  norm_state_t ns;
+} body_values_t;
+
+// Состояние проверки тела запроса, сохраняемое между вызовами входного фильтра
+typedef struct {
+  const config_t *config;
+  scan_t scan;
+  norm_state_t ns;
+  params_t *params;             // проверка параметров тела для appfilter_sqli, NULL - не выполняется
+  body_values_t *values;        // разбор тела JSON или multipart/form-data, NULL - тело другого формата
+  int blocked;                  // плохая строка найдена, запрос отклонен
+  int counted;                  // тело учтено в статистике: проверен первый бакет с данными
+} body_ctx_t;
+
+#define BODY_FILTER_NAME "APPFILTER_BODY"
+
+// Решения, которые хранятся в кеше: 0 - значение чистое, VERDICT_SQLI - найдена SQL-инъекция,
+// иначе номер найденной плохой строки + 1
+#define VERDICT_CLEAN 0
+#define VERDICT_SQLI 0xffffff
+// Наибольший размер кеша решений
+#define CACHE_MAX_ENTRIES (1 << 24)
+
+// Разделы с собственными правилами, для которых после чтения конфигурации строятся наборы правил
+static apr_array_header_t *sections;
+
+// Кеш решений текущего процесса, NULL - кеш выключен
+static vc_cache_t *verdict_cache;
+// Счетчик построений правил; каждый набор правил получает свое поколение
+static apr_uint32_t last_generation;
+
+// Все построенные наборы правил: для них выделяются счетчики, их показывает appfilter-status
+static apr_array_header_t *rulesets;
+
+// Кеш ДКА изменяется при сканировании, поэтому в многопоточном MPM каждый поток сканирует своими
+// копиями ДКА (re_clone), созданными при первом использовании. regex_count - число всех ДКА,
+// regex_key - массив копий потока, NULL - MPM однопоточный, и копии не нужны
+static int regex_count;
+static apr_threadkey_t *regex_key;
+
+// Копии ДКА одного потока и пул, из которого они выделены
+typedef struct {
+  apr_pool_t *pool;
+  re_set_t **regex;             // индекс - target_t.regex_id
+} thread_regex_t;
+
+#define STATUS_HANDLER "appfilter-status"
+
+#define STAT_ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#define STAT_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
 // опция C требуется, т.к. Apache требует оформления наименований по стандарту C
 extern "C" module AP_MODULE_DECLARE_DATA appfilter_module;
 
 // Заголовки описаний функций, описанных после AP_DECLARE_MODULE, чтобы скомпилировался код
 static const char *option_enable(cmd_parms *cmd, void *doof, const char *value);
-static const char *option_str(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_str(cmd_parms *cmd, void *doof, const char *value, const char *targets);
+static const char *option_target(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_decode_depth(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_regex(cmd_parms *cmd, void *doof, const char *value, const char *targets);
+static const char *option_regex_cache(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_sqli(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_sqli_fingerprint(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_cache(cmd_parms *cmd, void *doof, const char *value);
+static const char *option_remove(cmd_parms *cmd, void *doof, const char *value);
 static int input_fixup(request_rec *r);
+static void insert_body_filter(request_rec *r);
+static apr_status_t body_filter(ap_filter_t *f, apr_bucket_brigade *bb, ap_input_mode_t mode, apr_read_type_e block, apr_off_t readbytes);
+static int appfilter_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp);
+static int appfilter_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s);
+static void appfilter_child_init(apr_pool_t *pchild, server_rec *s);
+static int status_handler(request_rec *r);
 
 // Выделяет память для хранения параметров модуля
 static void *create_server_conf(apr_pool_t *pool, server_rec *s)
 {
   config_t *config = (config_t *)apr_pcalloc(pool, sizeof(config_t));
-  config->badstr = apr_table_make(pool, 5);
+  config->rules = apr_array_make(pool, 5, sizeof(rule_t));
+  config->headers = apr_array_make(pool, 5, sizeof(const char *));
+  config->targets = TARGETS_DEFAULT;
+  config->decode_depth = NORM_DEFAULT_DEPTH;
+  config->regex_cache = RE_DEFAULT_CACHE;
+  config->sqli_params = apr_array_make(pool, 5, sizeof(const char *));
+  config->sqli_fingerprints = apr_array_make(pool, 5, sizeof(const char *));
 
   return config;
 }
 
+// Выделяет память для хранения параметров раздела Directory или Location
+static void *create_dir_conf(apr_pool_t *pool, char *path)
+{
+  dir_config_t *dir = (dir_config_t *)apr_pcalloc(pool, sizeof(dir_config_t));
+  dir->path = path;
+  dir->enabled = -1;
+  dir->adds = apr_array_make(pool, 2, sizeof(rule_t));
+  dir->removes = apr_array_make(pool, 2, sizeof(const char *));
+
+  return dir;
+}
+
+// Слияние параметров вложенных разделов при обработке запроса. Наборы правил уже построены,
+// поэтому выбирается только указатель: действуют правила последнего раздела, в котором они заданы
+static void *merge_dir_conf(apr_pool_t *pool, void *basev, void *addv)
+{
+  const dir_config_t *base = (const dir_config_t *)basev;
+  const dir_config_t *add = (const dir_config_t *)addv;
+  dir_config_t *dir = (dir_config_t *)apr_pcalloc(pool, sizeof(dir_config_t));
+
+  dir->path = add->path;
+  dir->enabled = add->enabled >= 0 ? add->enabled : base->enabled;
+  dir->section = add->adds->nelts || add->removes->nelts ? add : base->section;
+  dir->adds = add->adds;
+  dir->removes = add->removes;
+
+  return dir;
+}
+
 // Регистрация обработчиков модуля Apache
 static void appfilter_register_hooks(apr_pool_t *p)
 {
   ap_hook_fixups(input_fixup, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_handler(status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_pre_config(appfilter_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_post_config(appfilter_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_child_init(appfilter_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_insert_filter(insert_body_filter, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_register_input_filter(BODY_FILTER_NAME, body_filter, NULL, AP_FTYPE_RESOURCE);
 }
 
 extern "C" {
@@ -46,15 +273,23 @@ extern "C" {
 
 static const command_rec appfilter_options[] =
 {
-  AP_INIT_TAKE1("appfilter_enable", option_enable, NULL, RSRC_CONF, "Enable/disable filtering"),
-  AP_INIT_TAKE1("appfilter_str", option_str, NULL, RSRC_CONF, "String to filter"),
+  AP_INIT_TAKE1("appfilter_enable", option_enable, NULL, RSRC_CONF | ACCESS_CONF, "Enable/disable filtering"),
+  AP_INIT_TAKE12("appfilter_str", option_str, NULL, RSRC_CONF | ACCESS_CONF, "String to filter and optional comma-separated list of targets"),
+  AP_INIT_ITERATE("appfilter_target", option_target, NULL, RSRC_CONF, "Request parts to filter: args, path, cookie, body, header:Name"),
+  AP_INIT_TAKE1("appfilter_decode_depth", option_decode_depth, NULL, RSRC_CONF, "How many times to percent-decode input before matching"),
+  AP_INIT_TAKE12("appfilter_regex", option_regex, NULL, RSRC_CONF | ACCESS_CONF, "Regular expression to filter and optional comma-separated list of targets"),
+  AP_INIT_TAKE1("appfilter_regex_cache", option_regex_cache, NULL, RSRC_CONF, "Memory limit in bytes for the regex DFA cache"),
+  AP_INIT_ITERATE("appfilter_sqli", option_sqli, NULL, RSRC_CONF, "Parameters to check for SQL injection by token fingerprint, * for all"),
+  AP_INIT_ITERATE("appfilter_sqli_fingerprint", option_sqli_fingerprint, NULL, RSRC_CONF, "Additional SQL injection token fingerprints"),
+  AP_INIT_TAKE1("appfilter_cache", option_cache, NULL, RSRC_CONF, "Number of entries in the per-process verdict cache, 0 to disable"),
+  AP_INIT_ITERATE("appfilter_remove", option_remove, NULL, ACCESS_CONF, "Server strings or regular expressions not checked in this section"),
   {NULL}
 };
 
 AP_DECLARE_MODULE(appfilter) = {
     STANDARD20_MODULE_STUFF,
-    NULL,                  /* create per-dir    config structures */
-    NULL,                  /* merge  per-dir    config structures */
+    create_dir_conf,       /* create per-dir    config structures */
+    merge_dir_conf,        /* merge  per-dir    config structures */
     create_server_conf,    /* create per-server config structures */
     NULL,                  /* merge  per-server config structures */
     appfilter_options,             /* table of config file commands       */
@@ -64,7 +299,113 @@ AP_DECLARE_MODULE(appfilter) = {
 
 
 // Обработчик опции appfilter_enable конфигурационного файла Apache
+// Внутри Directory или Location включает или выключает проверку для раздела
 static const char *option_enable(cmd_parms *cmd, void *doof, const char *value)
+{
+  int enabled;
+  if (strcasecmp(value, "true") == 0)
+    enabled = true;
+  else if (strcasecmp(value, "false") == 0)
+    enabled = false;
+  else
+    return "Possible values for appfilter_enable option are true or false";
+
+  if (cmd->path)
+    {
+    ((dir_config_t *)doof)->enabled = enabled;
+    return NULL;
+    }
+
+  // Вне разделов опция допустима только в основной конфигурации, не внутри VirtualHost
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  config_t *config = ap_get_module_config(cmd->server->module_config, &appfilter_module);
+  config->enabled = enabled;
+
+  return NULL;
+}
+
+static int target_index(const char *name)
+{
+  for (int t = 0; t < TARGET_COUNT; t++)
+    if (strcasecmp(name, target_names[t]) == 0)
+      return t;
+  return -1;
+}
+
+// Раздел, в котором меняются правила, запоминается, чтобы после чтения конфигурации построить его набор правил
+static dir_config_t *section_delta(cmd_parms *cmd, dir_config_t *dir)
+{
+  if (!dir->adds->nelts && !dir->removes->nelts)
+    APR_ARRAY_PUSH(sections, dir_config_t *) = dir;
+  return dir;
+}
+
+// Добавляет правило appfilter_str или appfilter_regex к правилам сервера либо, внутри Directory
+// или Location, к правилам раздела doof. targets - список частей запроса через запятую либо NULL
+static const char *add_rule(cmd_parms *cmd, void *doof, const char *value, const char *targets, int regex)
+{
+  apr_array_header_t *rules;
+  if (cmd->path)
+    rules = section_delta(cmd, (dir_config_t *)doof)->adds;
+  else
+    {
+    // Вне разделов опция допустима только в основной конфигурации, не внутри VirtualHost
+    const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (error)
+      return error;
+
+    config_t *config = ap_get_module_config(cmd->server->module_config, &appfilter_module);
+    rules = config->rules;
+    }
+
+  rule_t *rule = (rule_t *)apr_array_push(rules);
+  rule->str = value;
+  rule->targets = 0;
+  rule->regex = regex;
+
+  if (targets)
+    {
+    char *last;
+    char *list = apr_pstrdup(cmd->temp_pool, targets);
+    for (char *name = apr_strtok(list, ",", &last); name; name = apr_strtok(NULL, ",", &last))
+      {
+      int t = target_index(name);
+      if (t < 0)
+        return apr_psprintf(cmd->pool, "Unknown %s target %s, possible values are args, path, header, cookie, body",
+                            cmd->cmd->name, name);
+      rule->targets |= TARGET_BIT(t);
+      }
+    }
+
+  return NULL;
+}
+
+// Обработчик опции appfilter_str конфигурационного файла Apache.
+// Второй необязательный аргумент - список частей запроса через запятую, например args,cookie
+static const char *option_str(cmd_parms *cmd, void *doof, const char *value, const char *targets)
+{
+  return add_rule(cmd, doof, value, targets, false);
+}
+
+// Обработчик опции appfilter_regex конфигурационного файла Apache. Аргументы те же, что у appfilter_str
+static const char *option_regex(cmd_parms *cmd, void *doof, const char *value, const char *targets)
+{
+  // Выражение компилируется сразу, чтобы ошибка была показана со строкой конфигурационного файла
+  const char *error = NULL;
+  apr_array_header_t *one = apr_array_make(cmd->temp_pool, 1, sizeof(const char *));
+  APR_ARRAY_PUSH(one, const char *) = value;
+  re_set_t *re;
+  if (re_compile(cmd->temp_pool, one, RE_MIN_CACHE, &re, &error) != APR_SUCCESS)
+    return apr_psprintf(cmd->pool, "Invalid appfilter_regex: %s", error ? error : value);
+
+  return add_rule(cmd, doof, value, targets, true);
+}
+
+// Обработчик опции appfilter_target конфигурационного файла Apache
+static const char *option_target(cmd_parms *cmd, void *doof, const char *value)
 {
   // Убедимся, что данная опция указана не внутри опции Directory
   const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
@@ -73,18 +414,89 @@ static const char *option_enable(cmd_parms *cmd, void *doof, const char *value)
 
   config_t *config = ap_get_module_config(cmd->server->module_config, &appfilter_module);
 
-  if (strcasecmp(value, "true") == 0)
-    config->enabled = true;
-  else if (strcasecmp(value, "false") == 0)
-    config->enabled = false;
+  // Первое указание опции заменяет набор частей запроса по умолчанию
+  if (!config->targets_set)
+    {
+    config->targets = 0;
+    config->targets_set = true;
+    }
+
+  if (strncasecmp(value, "header:", 7) == 0 && value[7])
+    {
+    config->targets |= TARGET_BIT(TARGET_HEADER);
+    APR_ARRAY_PUSH(config->headers, const char *) = value + 7;
+    return NULL;
+    }
+
+  int t = target_index(value);
+  if (t < 0 || t == TARGET_HEADER)
+    return "Possible values for appfilter_target option are args, path, cookie, body or header:Name";
+
+  config->targets |= TARGET_BIT(t);
+
+  return NULL;
+}
+
+// Обработчик опции appfilter_decode_depth конфигурационного файла Apache
+static const char *option_decode_depth(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  config_t *config = ap_get_module_config(cmd->server->module_config, &appfilter_module);
+
+  char *end;
+  apr_int64_t depth = apr_strtoi64(value, &end, 10);
+  if (*end || depth < 0 || depth > NORM_MAX_DEPTH)
+    return apr_psprintf(cmd->pool, "appfilter_decode_depth must be a number from 0 to %d", NORM_MAX_DEPTH);
+
+  config->decode_depth = depth;
+
+  return NULL;
+}
+
+// Обработчик опции appfilter_regex_cache конфигурационного файла Apache
+static const char *option_regex_cache(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  config_t *config = ap_get_module_config(cmd->server->module_config, &appfilter_module);
+
+  char *end;
+  apr_int64_t size = apr_strtoi64(value, &end, 10);
+  if (*end || size < RE_MIN_CACHE)
+    return apr_psprintf(cmd->pool, "appfilter_regex_cache must be a number of bytes, at least %d", RE_MIN_CACHE);
+
+  config->regex_cache = size;
+
+  return NULL;
+}
+
+// Обработчик опции appfilter_sqli конфигурационного файла Apache
+static const char *option_sqli(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  config_t *config = ap_get_module_config(cmd->server->module_config, &appfilter_module);
+
+  if (strcmp(value, "*") == 0)
+    config->sqli_all = true;
   else
-    return "Possible values for appfilter_enable option are true or false";
+    APR_ARRAY_PUSH(config->sqli_params, const char *) = value;
 
   return NULL;
 }
 
-// Обработчик опции appfilter_str конфигурационного файла Apache
-static const char *option_str(cmd_parms *cmd, void *doof, const char *value)
+// Обработчик опции appfilter_sqli_fingerprint конфигурационного файла Apache
+static const char *option_sqli_fingerprint(cmd_parms *cmd, void *doof, const char *value)
 {
   // Убедимся, что данная опция указана не внутри опции Directory
   const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
@@ -93,43 +505,991 @@ static const char *option_str(cmd_parms *cmd, void *doof, const char *value)
 
   config_t *config = ap_get_module_config(cmd->server->module_config, &appfilter_module);
 
-  apr_table_addn(config->badstr, "1", value);
+  if (!sqli_fingerprint_valid(value))
+    return apr_psprintf(cmd->pool, "Invalid appfilter_sqli_fingerprint %s: expected 1-%d of the token letters s1nfvkEUB&oc(),; and an optional trailing *",
+                        value, SQLI_MAX_TOKENS);
+  APR_ARRAY_PUSH(config->sqli_fingerprints, const char *) = value;
 
   return NULL;
 }
 
+// Обработчик опции appfilter_cache конфигурационного файла Apache
+static const char *option_cache(cmd_parms *cmd, void *doof, const char *value)
+{
+  // Убедимся, что данная опция указана не внутри опции Directory
+  const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (error)
+    return error;
+
+  config_t *config = ap_get_module_config(cmd->server->module_config, &appfilter_module);
+
+  char *end;
+  apr_int64_t entries = apr_strtoi64(value, &end, 10);
+  if (*end || entries < 0 || entries > CACHE_MAX_ENTRIES)
+    return apr_psprintf(cmd->pool, "appfilter_cache must be a number of entries from 0 to %d", CACHE_MAX_ENTRIES);
+
+  config->cache_entries = entries;
+
+  return NULL;
+}
+
+// Обработчик опции appfilter_remove: внутри Directory или Location отключает строки appfilter_str
+// и выражения appfilter_regex основного сервера с указанным текстом
+static const char *option_remove(cmd_parms *cmd, void *doof, const char *value)
+{
+  if (!cmd->path)
+    return "appfilter_remove is only allowed inside Directory or Location";
+
+  APR_ARRAY_PUSH(section_delta(cmd, (dir_config_t *)doof)->removes, const char *) = value;
+
+  return NULL;
+}
+
+// ДКА части запроса для текущего потока
+static re_set_t *thread_regex(const target_t *target)
+{
+  if (!target->regex || !regex_key)
+    return target->regex;
+
+  thread_regex_t *tr = NULL;
+  apr_threadkey_private_get((void **)&tr, regex_key);
+  if (!tr)
+    {
+    apr_pool_t *pool;
+    // Пул потока не связан с пулами запросов и освобождается при завершении потока
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+      return NULL;
+    tr = (thread_regex_t *)apr_pcalloc(pool, sizeof(thread_regex_t));
+    tr->pool = pool;
+    tr->regex = (re_set_t **)apr_pcalloc(pool, regex_count * sizeof(re_set_t *));
+    apr_threadkey_private_set(tr, regex_key);
+    }
+
+  if (!tr->regex[target->regex_id])
+    tr->regex[target->regex_id] = re_clone(tr->pool, target->regex);
+  return tr->regex[target->regex_id];
+}
+
+// Вызывается при завершении потока
+static void thread_regex_free(void *data)
+{
+  thread_regex_t *tr = (thread_regex_t *)data;
+  apr_pool_destroy(tr->pool);
+}
+
+static void scan_init(scan_t *scan, const target_t *target)
+{
+  scan->target = target;
+  scan->regex = thread_regex(target);
+  scan->state = AC_STATE_ROOT;
+  re_start(&scan->re);
+  scan->found = -1;
+}
+
+// Передает очередную порцию нормализованных данных автомату и ДКА регулярных выражений
+static int scan_sink(void *ctx, const char *data, apr_size_t len)
+{
+  scan_t *scan = (scan_t *)ctx;
+  const target_t *target = scan->target;
+
+  if (target->matcher)
+    scan->found = ac_scan(target->matcher, &scan->state, data, len);
+  if (scan->found < 0 && scan->regex)
+    {
+    int found = re_scan(scan->regex, &scan->re, data, len);
+    if (found >= 0)
+      scan->found = target->nstr + found;
+    }
+
+  return scan->found >= 0;
+}
+
+// Завершает поиск после norm_finish: проверяет выражения, привязанные к концу данных ("$")
+static int scan_end(scan_t *scan)
+{
+  if (scan->found < 0 && scan->regex)
+    {
+    int found = re_finish(scan->regex, &scan->re);
+    if (found >= 0)
+      scan->found = scan->target->nstr + found;
+    }
+
+  return scan->found;
+}
+
+// Нормализует значение и ищет в нем плохие строки части запроса t. Возвращает номер строки либо -1
+static int scan_value(const config_t *config, int t, const char *data, apr_size_t len)
+{
+  scan_t scan;
+  scan_init(&scan, &config->target[t]);
+  norm_state_t ns;
+  norm_init(&ns, config->decode_depth);
+  if (!norm_feed(&ns, data, len, scan_sink, &scan) && !norm_finish(&ns, scan_sink, &scan))
+    scan_end(&scan);
+
+  return scan.found;
+}
+
+// Часть запроса t проверяется на SQL-инъекции
+static int sqli_target(const config_t *config, int t)
+{
+  return config->sqli && (config->targets & TARGET_BIT(t));
+}
+
+static void params_init(params_t *ps, char sep)
+{
+  memset(ps, 0, sizeof(params_t));
+  ps->sep = sep;
+}
+
+static int name_sink(void *ctx, const char *data, apr_size_t len)
+{
+  char **dst = (char **)ctx;
+  memcpy(*dst, data, len);
+  *dst += len;
+  return 0;
+}
+
+// Имя параметра после декодирования входит в список appfilter_sqli
+static int param_selected(const config_t *config, params_t *ps)
+{
+  if (config->sqli_all)
+    return true;
+  // Имя длиннее буфера не может совпасть ни с одним из коротких имен в списке
+  if (ps->nlen >= SQLI_PARAM_NAME_MAX)
+    return false;
+
+  // Нормализация не удлиняет строку, поэтому декодированное имя помещается в тот же размер
+  char name[SQLI_PARAM_NAME_MAX];
+  char *dst = name;
+  norm_state_t ns;
+  norm_init(&ns, config->decode_depth);
+  norm_feed(&ns, ps->name, ps->nlen, name_sink, &dst);
+  norm_finish(&ns, name_sink, &dst);
+  *dst = 0;
+
+  for (int i = 0; i < config->sqli_params->nelts; i++)
+    if (strcasecmp(name, APR_ARRAY_IDX(config->sqli_params, i, const char *)) == 0)
+      return true;
+  return false;
+}
+
+static int sqli_sink(void *ctx, const char *data, apr_size_t len)
+{
+  sqli_state_t *sq = (sqli_state_t *)ctx;
+  sqli_feed(sq, data, len);
+
+  // Отпечатки всех контекстов уже известны, остаток значения можно не декодировать
+  return sqli_done(sq);
+}
+
+// Значение текущего параметра закончилось
+static void param_end(const config_t *config, params_t *ps)
+{
+  if (ps->in_value && ps->selected)
+    {
+    if (!sqli_done(&ps->sq))
+      norm_finish(&ps->ns, sqli_sink, &ps->sq);
+    // Имя параметра с найденной инъекцией сохраняется для журнала
+    if ((ps->found = sqli_finish(config->sqli, &ps->sq, ps->fp)))
+      return;
+    }
+
+  ps->in_value = false;
+  ps->selected = false;
+  ps->nlen = 0;
+}
+
+// Разбирает очередную порцию параметров. Возвращает true, если найдена SQL-инъекция;
+// имя параметра остается в ps->name
+static int params_feed(const config_t *config, params_t *ps, const char *data, apr_size_t len)
+{
+  const char *p = data;
+  const char *end = data + len;
+
+  while (p < end && !ps->found)
+    {
+    if (!ps->in_value)
+      {
+      char c = *p++;
+      if (c == ps->sep)
+        ps->nlen = 0;
+      else if (c == '=')
+        {
+        ps->in_value = true;
+        ps->selected = param_selected(config, ps);
+        if (ps->selected)
+          {
+          norm_init(&ps->ns, config->decode_depth);
+          sqli_init(&ps->sq);
+          }
+        }
+      // Пробелы перед именем Cookie не входят в имя
+      else if (ps->nlen < SQLI_PARAM_NAME_MAX && !(c == ' ' && !ps->nlen))
+        ps->name[ps->nlen++] = c;
+      else if (ps->nlen == SQLI_PARAM_NAME_MAX)
+        ps->nlen++;
+      continue;
+      }
+
+    const char *q = (const char *)memchr(p, ps->sep, end - p);
+    if (ps->selected && !sqli_done(&ps->sq))
+      norm_feed(&ps->ns, p, (q ? q : end) - p, sqli_sink, &ps->sq);
+    if (!q)
+      break;
+
+    param_end(config, ps);
+    p = q + 1;
+    }
+
+  return ps->found;
+}
+
+static int params_finish(const config_t *config, params_t *ps)
+{
+  if (!ps->found)
+    param_end(config, ps);
+
+  return ps->found;
+}
+
+// Отклоняет запрос, в параметре которого найдена SQL-инъекция
+static int reject_sqli(request_rec *r, int t, const params_t *ps)
+{
+  ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_SUCCESS, r, "SQL injection (fingerprint %s) found in %s parameter %.*s",
+                ps->fp, target_names[t], (int)(ps->nlen < SQLI_PARAM_NAME_MAX ? ps->nlen : SQLI_PARAM_NAME_MAX), ps->name);
+
+  return HTTP_FORBIDDEN;
+}
+
+// Проверяет каждое значение из заголовка Cookie вида "имя=значение; имя=значение"
+static int scan_cookie(const config_t *config, const char *cookie)
+{
+  const char *p = cookie;
+  while (*p)
+    {
+    const char *end = strchr(p, ';');
+    if (!end)
+      end = p + strlen(p);
+
+    const char *eq = (const char *)memchr(p, '=', end - p);
+    const char *value = eq ? eq + 1 : p;
+    int found = scan_value(config, TARGET_COOKIE, value, end - value);
+    if (found >= 0)
+      return found;
+
+    p = *end ? end + 1 : end;
+    }
+
+  return -1;
+}
+
+// Заголовок входит в список appfilter_target header:Имя
+static int header_selected(const config_t *config, const char *name)
+{
+  for (int i = 0; i < config->headers->nelts; i++)
+    if (strcasecmp(name, APR_ARRAY_IDX(config->headers, i, const char *)) == 0)
+      return true;
+  return false;
+}
+
+// Монотонное время в наносекундах для счетчиков времени проверки
+static apr_uint64_t now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (apr_uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Учитывает срабатывание плохой строки номер found в части запроса t
+static void count_hit(const config_t *config, int t, int found)
+{
+  STAT_ADD(config->stats[t].blocked, 1);
+  STAT_ADD(config->hits[config->target[t].rule[found]], 1);
+}
+
+// Отклоняет запрос, в части t которого найдена плохая строка номер found
+static int reject(request_rec *r, const config_t *config, int t, int found, const char *value)
+{
+  count_hit(config, t, found);
+  const char *str = APR_ARRAY_IDX(config->target[t].patterns, found, const char *);
+  ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_SUCCESS, r, "Bad string %s found in %s %s", str, target_names[t], value);
+
+  return HTTP_FORBIDDEN;
+}
+
+// Проверяет значение части запроса t: плохие строки и выражения, затем SQL-инъекции в параметрах.
+// Для заголовка name - его имя, для остальных частей NULL.
+// Кеш решений хранит результат по хешу исходного значения, поэтому при попадании пропускается
+// и нормализация, и поиск
+static int inspect(request_rec *r, const config_t *config, int t, const char *name, const char *value)
+{
+  apr_size_t len = strlen(value);
+  target_stats_t *stats = &config->stats[t];
+  apr_uint64_t hash = 0;
+  apr_uint32_t verdict;
+  if (verdict_cache)
+    {
+    hash = vc_hash(verdict_cache, (apr_uint64_t)config->generation << 8 | t, value, len);
+    if (vc_get(verdict_cache, hash, config->generation, &verdict))
+      {
+      STAT_ADD(stats->cached, 1);
+      if (verdict == VERDICT_CLEAN)
+        return OK;
+      if (verdict == VERDICT_SQLI)
+        {
+        STAT_ADD(stats->sqli, 1);
+        ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_SUCCESS, r, "SQL injection found in %s %s (cached verdict)", target_names[t], value);
+        return HTTP_FORBIDDEN;
+        }
+      return reject(r, config, t, verdict - 1, name ? apr_pstrcat(r->pool, name, ": ", value, NULL) : value);
+      }
+    }
+
+  apr_uint64_t start = now_nsec();
+  int found = -1;
+  if (TARGET_ACTIVE(config, t))
+    found = t == TARGET_COOKIE ? scan_cookie(config, value) : scan_value(config, t, value, len);
+
+  // Параметры разбираются только в строке запроса и Cookie
+  params_t ps;
+  int sqli = false;
+  if (found < 0 && sqli_target(config, t) && (t == TARGET_ARGS || t == TARGET_COOKIE))
+    {
+    params_init(&ps, t == TARGET_COOKIE ? ';' : '&');
+    sqli = params_feed(config, &ps, value, len) || params_finish(config, &ps);
+    }
+
+  STAT_ADD(stats->values, 1);
+  STAT_ADD(stats->bytes, len);
+  STAT_ADD(stats->nsec, now_nsec() - start);
+
+  verdict = found >= 0 ? found + 1 : sqli ? VERDICT_SQLI : VERDICT_CLEAN;
+  // Номер строки, не помещающийся в 24 бита решения, не кешируется
+  if (verdict_cache && found < VERDICT_SQLI - 1)
+    vc_put(verdict_cache, hash, config->generation, verdict);
+
+  if (found >= 0)
+    return reject(r, config, t, found, name ? apr_pstrcat(r->pool, name, ": ", value, NULL) : value);
+  if (sqli)
+    {
+    STAT_ADD(stats->sqli, 1);
+    return reject_sqli(r, t, &ps);
+    }
+  return OK;
+}
+
+// Строит автоматы для всех выбранных частей запроса одного сервера
+static apr_status_t compile_config(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s, config_t *config)
+{
+  for (int t = 0; t < TARGET_COUNT; t++)
+    {
+    target_t *target = &config->target[t];
+    if (!(config->targets & TARGET_BIT(t)))
+      continue;
+
+    // Строки нормализуются так же, как входные данные, поэтому "%27" и "'" становятся одной строкой.
+    // Регулярные выражения не нормализуются: данные приходят уже декодированными и в нижнем регистре
+    target->patterns = apr_array_make(pconf, config->rules->nelts, sizeof(const char *));
+    target->rule = (int *)apr_palloc(pconf, (config->rules->nelts + 1) * sizeof(int));
+    apr_array_header_t *normalized = apr_array_make(ptemp, config->rules->nelts, sizeof(const char *));
+    apr_array_header_t *regexes = apr_array_make(ptemp, config->rules->nelts, sizeof(int));
+    for (int i = 0; i < config->rules->nelts; i++)
+      {
+      const rule_t *rule = &APR_ARRAY_IDX(config->rules, i, rule_t);
+      if (rule->targets && !(rule->targets & TARGET_BIT(t)))
+        continue;
+      if (rule->regex)
+        APR_ARRAY_PUSH(regexes, int) = i;
+      else
+        {
+        target->rule[target->patterns->nelts] = i;
+        APR_ARRAY_PUSH(target->patterns, const char *) = rule->str;
+        APR_ARRAY_PUSH(normalized, const char *) = norm_string(ptemp, rule->str, config->decode_depth);
+        }
+      }
+    target->nstr = normalized->nelts;
+    apr_array_header_t *regex_strs = apr_array_make(ptemp, regexes->nelts, sizeof(const char *));
+    for (int i = 0; i < regexes->nelts; i++)
+      {
+      int rule = APR_ARRAY_IDX(regexes, i, int);
+      target->rule[target->patterns->nelts] = rule;
+      APR_ARRAY_PUSH(target->patterns, const char *) = APR_ARRAY_IDX(config->rules, rule, rule_t).str;
+      APR_ARRAY_PUSH(regex_strs, const char *) = APR_ARRAY_IDX(config->rules, rule, rule_t).str;
+      }
+
+    if (normalized->nelts)
+      {
+      if (ac_compile(pconf, normalized, &target->matcher) != APR_SUCCESS)
+        {
+        ap_log_error(APLOG_MARK, LOG_ERR, APR_EGENERAL, s, "Failed to compile appfilter_str patterns for %s", target_names[t]);
+        return APR_EGENERAL;
+        }
+
+      int level = ac_prefilter(target->matcher);
+      ap_log_error(APLOG_MARK, LOG_INFO, APR_SUCCESS, s, "Compiled %d appfilter_str patterns for %s into %lu states, prefilter %s",
+                   normalized->nelts, target_names[t], (unsigned long)ac_states(target->matcher),
+                   level < 0 ? "off" : pf_level_name(level));
+      }
+
+    if (regexes->nelts)
+      {
+      const char *error = NULL;
+      if (re_compile(pconf, regex_strs, config->regex_cache, &target->regex, &error) != APR_SUCCESS)
+        {
+        ap_log_error(APLOG_MARK, LOG_ERR, APR_EGENERAL, s, "Failed to compile appfilter_regex patterns for %s: %s",
+                     target_names[t], error ? error : "unknown error");
+        return APR_EGENERAL;
+        }
+      target->regex_id = regex_count++;
+
+      ap_log_error(APLOG_MARK, LOG_INFO, APR_SUCCESS, s, "Compiled %d appfilter_regex patterns for %s into %lu NFA nodes, DFA cache limit %lu bytes",
+                   regexes->nelts, target_names[t], (unsigned long)re_nfa_nodes(target->regex), (unsigned long)config->regex_cache);
+      }
+    }
+
+  // Разделы используют набор отпечатков сервера
+  if (!config->sqli && (config->sqli_all || config->sqli_params->nelts))
+    {
+    if (sqli_compile(pconf, config->sqli_fingerprints, &config->sqli) != APR_SUCCESS)
+      {
+      ap_log_error(APLOG_MARK, LOG_ERR, APR_EGENERAL, s, "Failed to compile appfilter_sqli fingerprints");
+      return APR_EGENERAL;
+      }
+    ap_log_error(APLOG_MARK, LOG_INFO, APR_SUCCESS, s, "SQL injection check enabled for %s, %lu fingerprints",
+                 config->sqli_all ? "all parameters" : apr_array_pstrcat(ptemp, config->sqli_params, ','),
+                 (unsigned long)sqli_set_size(config->sqli));
+    }
+
+  // Решения, принятые по прежним правилам, перестают находиться в кеше
+  config->generation = ++last_generation;
+  APR_ARRAY_PUSH(rulesets, config_t *) = config;
+
+  return APR_SUCCESS;
+}
+
+// Выделяет счетчики всех наборов правил в анонимной разделяемой памяти. Она создается до запуска
+// дочерних процессов и наследуется ими, поэтому все процессы увеличивают одни и те же счетчики.
+// Память освобождается вместе с pconf, при перезапуске счетчики начинаются с нуля
+static apr_status_t alloc_stats(apr_pool_t *pconf, server_rec *s)
+{
+  apr_size_t size = 0;
+  for (int i = 0; i < rulesets->nelts; i++)
+    {
+    const config_t *config = APR_ARRAY_IDX(rulesets, i, config_t *);
+    size += TARGET_COUNT * sizeof(target_stats_t) + config->rules->nelts * sizeof(apr_uint64_t);
+    }
+
+  apr_shm_t *shm;
+  apr_status_t rv = apr_shm_create(&shm, size, NULL, pconf);
+  if (rv != APR_SUCCESS)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to create %lu bytes of shared memory for appfilter counters", (unsigned long)size);
+    return rv;
+    }
+
+  char *p = (char *)apr_shm_baseaddr_get(shm);
+  memset(p, 0, size);
+  for (int i = 0; i < rulesets->nelts; i++)
+    {
+    config_t *config = APR_ARRAY_IDX(rulesets, i, config_t *);
+    config->stats = (target_stats_t *)p;
+    p += TARGET_COUNT * sizeof(target_stats_t);
+    config->hits = (apr_uint64_t *)p;
+    p += config->rules->nelts * sizeof(apr_uint64_t);
+    }
+
+  return APR_SUCCESS;
+}
+
+// Перед каждым чтением конфигурации списки разделов и наборов правил начинаются заново
+static int appfilter_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+  sections = apr_array_make(pconf, 5, sizeof(dir_config_t *));
+  rulesets = apr_array_make(pconf, 5, sizeof(config_t *));
+  regex_count = 0;
+  return OK;
+}
+
+// Строит набор правил раздела: правила основного сервера без отключенных appfilter_remove и правила раздела
+static apr_status_t compile_section(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s, const config_t *server, dir_config_t *dir)
+{
+  config_t *config = (config_t *)apr_pmemdup(pconf, server, sizeof(config_t));
+  memset(config->target, 0, sizeof(config->target));
+  config->rules = apr_array_make(pconf, server->rules->nelts + dir->adds->nelts, sizeof(rule_t));
+
+  for (int i = 0; i < server->rules->nelts; i++)
+    {
+    const rule_t *rule = &APR_ARRAY_IDX(server->rules, i, rule_t);
+    int removed = false;
+    for (int j = 0; j < dir->removes->nelts && !removed; j++)
+      removed = strcmp(rule->str, APR_ARRAY_IDX(dir->removes, j, const char *)) == 0;
+    if (!removed)
+      *(rule_t *)apr_array_push(config->rules) = *rule;
+    }
+  apr_array_cat(config->rules, dir->adds);
+
+  for (int j = 0; j < dir->removes->nelts; j++)
+    {
+    const char *str = APR_ARRAY_IDX(dir->removes, j, const char *);
+    int known = false;
+    for (int i = 0; i < server->rules->nelts && !known; i++)
+      known = strcmp(str, APR_ARRAY_IDX(server->rules, i, rule_t).str) == 0;
+    if (!known)
+      ap_log_error(APLOG_MARK, LOG_WARNING, APR_SUCCESS, s, "appfilter_remove %s in %s: no such server rule", str, dir->path);
+    }
+
+  config->name = dir->path;
+  ap_log_error(APLOG_MARK, LOG_INFO, APR_SUCCESS, s, "Compiling %d appfilter rules for %s", config->rules->nelts, dir->path);
+  apr_status_t rv = compile_config(pconf, ptemp, s, config);
+  if (rv != APR_SUCCESS)
+    return rv;
+
+  dir->ruleset = config;
+  return APR_SUCCESS;
+}
+
+// После чтения конфигурации построим для каждого сервера и каждого раздела с собственными правилами
+// автоматы по строкам appfilter_str и ДКА выражений appfilter_regex
+static int appfilter_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+{
+  for (server_rec *sp = s; sp; sp = sp->next)
+    {
+    config_t *config = ap_get_module_config(sp->module_config, &appfilter_module);
+    if (!config || config->compiled)
+      continue;
+
+    config->name = sp->is_virtual ? apr_pstrcat(pconf, "virtual host ", sp->server_hostname, NULL) : "server";
+    if (compile_config(pconf, ptemp, sp, config) != APR_SUCCESS)
+      return HTTP_INTERNAL_SERVER_ERROR;
+    config->compiled = true;
+    }
+
+  // Правила сервера задаются только в основной конфигурации, поэтому разделы и внутри VirtualHost
+  // наследуют правила основного сервера
+  const config_t *server = ap_get_module_config(s->module_config, &appfilter_module);
+  for (int i = 0; i < sections->nelts; i++)
+    if (compile_section(pconf, ptemp, s, server, APR_ARRAY_IDX(sections, i, dir_config_t *)) != APR_SUCCESS)
+      return HTTP_INTERNAL_SERVER_ERROR;
+
+  return alloc_stats(pconf, s) == APR_SUCCESS ? OK : HTTP_INTERNAL_SERVER_ERROR;
+}
+
+// Набор правил, по которым проверяется запрос, либо NULL, если проверка для него выключена
+static const config_t *request_config(request_rec *r)
+{
+  const config_t *config = ap_get_module_config(r->server->module_config, &appfilter_module);
+  const dir_config_t *dir = ap_get_module_config(r->per_dir_config, &appfilter_module);
+  if (!config)
+    return NULL;
+
+  int enabled = dir && dir->enabled >= 0 ? dir->enabled : config->enabled;
+  if (!enabled)
+    return NULL;
+
+  return dir && dir->section ? dir->section->ruleset : config;
+}
+
+// Выводит в журнал счетчики кеша решений при завершении процесса
+static apr_status_t cache_cleanup(void *data)
+{
+  server_rec *s = (server_rec *)data;
+  vc_stats_t st;
+  vc_stats(verdict_cache, &st);
+  ap_log_error(APLOG_MARK, LOG_INFO, APR_SUCCESS, s, "Verdict cache: %lu hits, %lu misses, %lu inserts, %lu evictions, %lu entries",
+               (unsigned long)st.hits, (unsigned long)st.misses, (unsigned long)st.inserts, (unsigned long)st.evictions,
+               (unsigned long)st.entries);
+  verdict_cache = NULL;
+
+  return APR_SUCCESS;
+}
+
+// Каждый процесс создает свой кеш решений размером из опции appfilter_cache основного сервера.
+// Кеш решений и счетчики рассчитаны на одновременное использование потоками, а ДКА у каждого потока свои
+static void appfilter_child_init(apr_pool_t *pchild, server_rec *s)
+{
+  int threaded = AP_MPMQ_NOT_SUPPORTED;
+  regex_key = NULL;
+  if (regex_count && ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) == APR_SUCCESS && threaded != AP_MPMQ_NOT_SUPPORTED)
+    {
+    apr_status_t rv = apr_threadkey_private_create(&regex_key, thread_regex_free, pchild);
+    if (rv != APR_SUCCESS)
+      {
+      ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to create thread key, appfilter_regex is not safe in this process");
+      regex_key = NULL;
+      }
+    }
+
+  config_t *config = ap_get_module_config(s->module_config, &appfilter_module);
+  if (!config || !config->cache_entries)
+    return;
+
+  apr_status_t rv = vc_create(pchild, config->cache_entries, &verdict_cache);
+  if (rv != APR_SUCCESS)
+    {
+    ap_log_error(APLOG_MARK, LOG_ERR, rv, s, "Failed to create verdict cache, filtering without it");
+    verdict_cache = NULL;
+    return;
+    }
+
+  apr_pool_cleanup_register(pchild, s, cache_cleanup, apr_pool_cleanup_null);
+}
+
 // Фильтр входного запроса
 static int input_fixup(request_rec *r)
 {
-  config_t *config = ap_get_module_config(r->server->module_config, &appfilter_module);
+  // Если опция appfilter_enable сервера или раздела не true, выходим
+  const config_t *config = request_config(r);
   if (!config)
-    return HTTP_INTERNAL_SERVER_ERROR;
-
-  // Если опция appfilter_enable не true, выходим
-  if (!config->enabled)
     return OK;
 
-  // Если не указана ни одна опция appfilter_str, выходим
-  if (apr_is_empty_table(config->badstr))
-    return OK;
+  // Каждая часть запроса нормализуется и за один проход автомата и ДКА проверяется на наличие
+  // любой из своих плохих строк и выражений. Части без appfilter_str и appfilter_regex не проверяются
+  int rc;
+  if ((TARGET_ACTIVE(config, TARGET_ARGS) || sqli_target(config, TARGET_ARGS)) && r->args)
+    {
+    ap_log_rerror(APLOG_MARK, LOG_DEBUG, APR_SUCCESS, r, "testing args %s", r->args);
+    if ((rc = inspect(r, config, TARGET_ARGS, NULL, r->args)) != OK)
+      return rc;
+    }
+
+  if (TARGET_ACTIVE(config, TARGET_PATH) && r->uri)
+    {
+    if ((rc = inspect(r, config, TARGET_PATH, NULL, r->uri)) != OK)
+      return rc;
+    }
 
-  // Если нет параметров, выходим
-  if (!r->args)
+  // Заголовки и Cookie проверяются за один проход по r->headers_in
+  int check_cookie = TARGET_ACTIVE(config, TARGET_COOKIE) || sqli_target(config, TARGET_COOKIE);
+  if (!TARGET_ACTIVE(config, TARGET_HEADER) && !check_cookie)
     return OK;
 
-  // В цикле проверим наличие в URL плохой строки
-  const apr_array_header_t *a = apr_table_elts(config->badstr);
+  const apr_array_header_t *a = apr_table_elts(r->headers_in);
   apr_table_entry_t *elts = (apr_table_entry_t *) a->elts;
   for (int i = 0; i < a->nelts; i++)
     {
-    const char *str = elts[i].val;
-    ap_log_rerror(APLOG_MARK, LOG_INFO, APR_SUCCESS, r, "testing string %s in args %s", str, r->args);
-    if (strstr(r->args, str))
+    const char *name = elts[i].key;
+    const char *value = elts[i].val;
+    if (!name || !value)
+      continue;
+
+    if (check_cookie && strcasecmp(name, "Cookie") == 0)
+      {
+      if ((rc = inspect(r, config, TARGET_COOKIE, NULL, value)) != OK)
+        return rc;
+      }
+    else if (TARGET_ACTIVE(config, TARGET_HEADER) && header_selected(config, name))
+      {
+      if ((rc = inspect(r, config, TARGET_HEADER, name, value)) != OK)
+        return rc;
+      }
+    }
+
+  return OK;
+}
+
+// Очередная порция декодированного значения из тела JSON или multipart/form-data (param_chunk_fn).
+// Значение проверяется на плохие строки и, если имя входит в appfilter_sqli, на SQL-инъекции
+static int body_value(const param_spec_t *spec, const char *name, apr_size_t name_len, const char *data, apr_size_t len,
+                      int last)
+{
+  body_ctx_t *ctx = (body_ctx_t *)spec->ctx;
+  body_values_t *bv = ctx->values;
+  params_t *ps = ctx->params;
+  const config_t *config = ctx->config;
+  int check = TARGET_ACTIVE(config, TARGET_BODY);
+  if (ctx->scan.found >= 0 || (ps && ps->found))
+    return true;
+
+  if (!bv->open)
+    {
+    bv->open = true;
+    scan_init(&bv->scan, &config->target[TARGET_BODY]);
+    norm_init(&bv->ns, config->decode_depth);
+    if (ps)
+      {
+      ps->nlen = name_len;
+      memcpy(ps->name, name, name_len < SQLI_PARAM_NAME_MAX ? name_len : SQLI_PARAM_NAME_MAX);
+      ps->in_value = true;
+      ps->selected = param_selected(config, ps);
+      if (ps->selected)
+        {
+        norm_init(&ps->ns, config->decode_depth);
+        sqli_init(&ps->sq);
+        }
+      }
+    }
+
+  if (check && bv->scan.found < 0)
+    norm_feed(&bv->ns, data, len, scan_sink, &bv->scan);
+  if (ps && ps->selected && !sqli_done(&ps->sq))
+    norm_feed(&ps->ns, data, len, sqli_sink, &ps->sq);
+  if (!last)
+    return false;
+
+  bv->open = false;
+  if (check && bv->scan.found < 0 && !norm_finish(&bv->ns, scan_sink, &bv->scan))
+    scan_end(&bv->scan);
+  ctx->scan.found = bv->scan.found;
+  if (ps && ctx->scan.found < 0)
+    param_end(config, ps);
+
+  return ctx->scan.found >= 0 || (ps && ps->found);
+}
+
+// Если у запроса есть тело, добавим входной фильтр, проверяющий его по мере чтения обработчиком
+static void insert_body_filter(request_rec *r)
+{
+  const config_t *config = request_config(r);
+  if (!config)
+    return;
+
+  // Параметры тела разбираются для формы, JSON и multipart/form-data - тех же форматов, что принимает mod_app
+  const char *type = apr_table_get(r->headers_in, "Content-Type");
+  int format = params_body_format(type);
+  const char *boundary = format == PARAMS_MULTIPART ? params_multipart_boundary(r->pool, type) : NULL;
+  // multipart без границы mod_app отклоняет, не разбирая
+  if (format == PARAMS_MULTIPART && !boundary)
+    format = -1;
+  int sqli = sqli_target(config, TARGET_BODY) && format >= 0;
+  if (!TARGET_ACTIVE(config, TARGET_BODY) && !sqli)
+    return;
+
+  if (!apr_table_get(r->headers_in, "Content-Length") && !apr_table_get(r->headers_in, "Transfer-Encoding"))
+    return;
+
+  // Подзапросы тело не читают, а при переходе на ErrorDocument тело уже отклонено
+  if (r->main || (r->prev && ap_is_HTTP_ERROR(r->prev->status)))
+    return;
+
+  body_ctx_t *ctx = (body_ctx_t *)apr_pcalloc(r->pool, sizeof(body_ctx_t));
+  ctx->config = config;
+  scan_init(&ctx->scan, &config->target[TARGET_BODY]);
+  norm_init(&ctx->ns, config->decode_depth);
+  if (sqli)
+    {
+    ctx->params = (params_t *)apr_palloc(r->pool, sizeof(params_t));
+    params_init(ctx->params, '&');
+    }
+  if (format == PARAMS_JSON || format == PARAMS_MULTIPART)
+    {
+    // Значения не накапливаются: парсер передает их порциями в body_value
+    ctx->values = (body_values_t *)apr_pcalloc(r->pool, sizeof(body_values_t));
+    ctx->values->spec.ctx = ctx;
+    ctx->values->spec.chunk = body_value;
+    params_body_init(&ctx->values->parser, format, r->pool, &ctx->values->spec, 0, boundary);
+    }
+
+  ap_add_input_filter(BODY_FILTER_NAME, ctx, r, r->connection);
+}
+
+// Входной фильтр тела запроса. Каждый бакет сразу проходит через нормализатор, автомат и ДКА,
+// состояние которых сохраняется между бакетами, поэтому тело нигде не накапливается.
+// При совпадении запрос отклоняется с кодом 403, и обработчик больше не получает данных
+static apr_status_t body_filter(ap_filter_t *f, apr_bucket_brigade *bb, ap_input_mode_t mode, apr_read_type_e block, apr_off_t readbytes)
+{
+  body_ctx_t *ctx = (body_ctx_t *)f->ctx;
+  if (ctx->blocked)
+    return AP_FILTER_ERROR;
+
+  apr_status_t rv = ap_get_brigade(f->next, bb, mode, block, readbytes);
+  // Данные, прочитанные в режиме AP_MODE_SPECULATIVE, будут прочитаны повторно, их пропускаем
+  if (rv != APR_SUCCESS || mode == AP_MODE_SPECULATIVE)
+    return rv;
+
+  int check = TARGET_ACTIVE(ctx->config, TARGET_BODY);
+  params_t *ps = ctx->params;
+  target_stats_t *stats = &ctx->config->stats[TARGET_BODY];
+  apr_uint64_t start = now_nsec();
+  for (apr_bucket *b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb) && ctx->scan.found < 0 && !(ps && ps->found);
+       b = APR_BUCKET_NEXT(b))
+    {
+    if (APR_BUCKET_IS_EOS(b))
+      {
+      if (check && !norm_finish(&ctx->ns, scan_sink, &ctx->scan))
+        scan_end(&ctx->scan);
+      if (ctx->values)
+        {
+        if (!ctx->values->stopped && ctx->scan.found < 0)
+          params_body_end(&ctx->values->parser);
+        }
+      else if (ps && ctx->scan.found < 0)
+        params_finish(ctx->config, ps);
+      break;
+      }
+    if (APR_BUCKET_IS_METADATA(b))
+      continue;
+
+    const char *data;
+    apr_size_t len;
+    rv = apr_bucket_read(b, &data, &len, APR_BLOCK_READ);
+    if (rv != APR_SUCCESS)
+      return rv;
+    STAT_ADD(stats->bytes, len);
+    // Тело считается проверенным, только когда фильтр получил данные: обработчик может не читать тело вовсе
+    if (len && !ctx->counted)
+      {
+      ctx->counted = true;
+      STAT_ADD(stats->values, 1);
+      }
+
+    if (check)
+      norm_feed(&ctx->ns, data, len, scan_sink, &ctx->scan);
+    // Тело неверного формата дальше не разбирается: mod_app отклонит его сам (ответ 400)
+    if (ctx->values)
+      {
+      if (!ctx->values->stopped && ctx->scan.found < 0 && params_body_feed(&ctx->values->parser, data, len) != APR_SUCCESS)
+        ctx->values->stopped = true;
+      }
+    else if (ps && ctx->scan.found < 0)
+      params_feed(ctx->config, ps, data, len);
+    }
+
+  STAT_ADD(stats->nsec, now_nsec() - start);
+
+  if (ctx->scan.found >= 0)
+    {
+    count_hit(ctx->config, TARGET_BODY, ctx->scan.found);
+    const char *str = APR_ARRAY_IDX(ctx->config->target[TARGET_BODY].patterns, ctx->scan.found, const char *);
+    ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_SUCCESS, f->r, "Bad string %s found in request body", str);
+    }
+  else if (ps && ps->found)
+    {
+    STAT_ADD(stats->sqli, 1);
+    reject_sqli(f->r, TARGET_BODY, ps);
+    }
+  else
+    return APR_SUCCESS;
+
+  ctx->blocked = true;
+
+  // Так же, как это делает фильтр протокола HTTP при ошибке: отдаем бакет с кодом ошибки
+  // выходным фильтрам, а обработчику возвращаем AP_FILTER_ERROR. Остаток тела не читается,
+  // поэтому соединение после ответа закрывается
+  apr_brigade_cleanup(bb);
+  apr_bucket_brigade *out = apr_brigade_create(f->r->pool, f->c->bucket_alloc);
+  APR_BRIGADE_INSERT_TAIL(out, ap_bucket_error_create(HTTP_FORBIDDEN, NULL, f->r->pool, f->c->bucket_alloc));
+  APR_BRIGADE_INSERT_TAIL(out, apr_bucket_eos_create(f->c->bucket_alloc));
+  f->c->keepalive = AP_CONN_CLOSE;
+
+  rv = ap_pass_brigade(f->r->output_filters, out);
+  return rv == APR_SUCCESS ? AP_FILTER_ERROR : rv;
+}
+
+// Строка в кавычках для JSON
+static const char *json_string(apr_pool_t *pool, const char *str)
+{
+  char *out = (char *)apr_palloc(pool, strlen(str) * 6 + 3);
+  char *dst = out;
+  *dst++ = '"';
+  for (const unsigned char *p = (const unsigned char *)str; *p; p++)
+    {
+    if (*p == '"' || *p == '\\')
       {
-      ap_log_rerror(APLOG_MARK, LOG_WARNING, APR_SUCCESS, r, "Bad string %s found in URI %s", str, r->args);
-      return HTTP_FORBIDDEN;
+      *dst++ = '\\';
+      *dst++ = *p;
       }
+    else if (*p < 0x20)
+      dst += apr_snprintf(dst, 7, "\\u%04x", *p);
+    else
+      *dst++ = *p;
     }
+  *dst++ = '"';
+  *dst = 0;
+
+  return out;
+}
+
+// Части запроса правила через запятую, "all" - все выбранные опцией appfilter_target
+static const char *rule_targets(apr_pool_t *pool, const rule_t *rule)
+{
+  if (!rule->targets)
+    return "all";
+
+  const char *list = NULL;
+  for (int t = 0; t < TARGET_COUNT; t++)
+    if (rule->targets & TARGET_BIT(t))
+      list = list ? apr_pstrcat(pool, list, ",", target_names[t], NULL) : target_names[t];
+  return list;
+}
+
+// Обработчик appfilter-status: счетчики всех наборов правил из разделяемой памяти и кеш решений
+// процесса, обработавшего запрос. По умолчанию текст, с параметром ?json - JSON
+static int status_handler(request_rec *r)
+{
+  if (strcmp(r->handler, STATUS_HANDLER) != 0)
+    return DECLINED;
+
+  int json = r->args && strcmp(r->args, "json") == 0;
+  r->content_type = json ? "application/json" : "text/plain; charset=UTF-8";
+
+  if (r->header_only)
+    return OK;
+
+  vc_stats_t cache;
+  vc_stats(verdict_cache, &cache);
+
+  if (json)
+    ap_rprintf(r, "{\"pid\":%d,\"cache\":{\"entries\":%lu,\"hits\":%" APR_UINT64_T_FMT ",\"misses\":%" APR_UINT64_T_FMT
+               ",\"inserts\":%" APR_UINT64_T_FMT ",\"evictions\":%" APR_UINT64_T_FMT "},\"rulesets\":[",
+               (int)getpid(), (unsigned long)cache.entries, cache.hits, cache.misses, cache.inserts, cache.evictions);
+  else
+    ap_rprintf(r, "Process %d verdict cache: %lu entries, %" APR_UINT64_T_FMT " hits, %" APR_UINT64_T_FMT " misses, %"
+               APR_UINT64_T_FMT " inserts, %" APR_UINT64_T_FMT " evictions\n",
+               (int)getpid(), (unsigned long)cache.entries, cache.hits, cache.misses, cache.inserts, cache.evictions);
+
+  for (int i = 0; i < rulesets->nelts; i++)
+    {
+    const config_t *config = APR_ARRAY_IDX(rulesets, i, config_t *);
+    if (json)
+      ap_rprintf(r, "%s{\"name\":%s,\"generation\":%u,\"targets\":{", i ? "," : "", json_string(r->pool, config->name),
+                 (unsigned)config->generation);
+    else
+      ap_rprintf(r, "\nRuleset %s, generation %u\n%-8s %12s %14s %14s %10s %10s %10s\n", config->name, (unsigned)config->generation,
+                 "target", "values", "bytes", "nsec", "blocked", "sqli", "cached");
+
+    int first = true;
+    for (int t = 0; t < TARGET_COUNT; t++)
+      {
+      if (!(config->targets & TARGET_BIT(t)))
+        continue;
+
+      const target_stats_t *st = &config->stats[t];
+      apr_uint64_t values = STAT_GET(st->values), bytes = STAT_GET(st->bytes), nsec = STAT_GET(st->nsec);
+      apr_uint64_t blocked = STAT_GET(st->blocked), sqli = STAT_GET(st->sqli), cached = STAT_GET(st->cached);
+      if (json)
+        ap_rprintf(r, "%s\"%s\":{\"values\":%" APR_UINT64_T_FMT ",\"bytes\":%" APR_UINT64_T_FMT ",\"nsec\":%" APR_UINT64_T_FMT
+                   ",\"blocked\":%" APR_UINT64_T_FMT ",\"sqli\":%" APR_UINT64_T_FMT ",\"cached\":%" APR_UINT64_T_FMT "}",
+                   first ? "" : ",", target_names[t], values, bytes, nsec, blocked, sqli, cached);
+      else
+        ap_rprintf(r, "%-8s %12" APR_UINT64_T_FMT " %14" APR_UINT64_T_FMT " %14" APR_UINT64_T_FMT " %10" APR_UINT64_T_FMT
+                   " %10" APR_UINT64_T_FMT " %10" APR_UINT64_T_FMT "\n", target_names[t], values, bytes, nsec, blocked, sqli, cached);
+      first = false;
+      }
+
+    if (json)
+      ap_rputs("},\"rules\":[", r);
+    else if (config->rules->nelts)
+      ap_rprintf(r, "%12s %-5s %-24s %s\n", "hits", "type", "targets", "rule");
+
+    for (int j = 0; j < config->rules->nelts; j++)
+      {
+      const rule_t *rule = &APR_ARRAY_IDX(config->rules, j, rule_t);
+      apr_uint64_t hits = STAT_GET(config->hits[j]);
+      if (json)
+        ap_rprintf(r, "%s{\"type\":\"%s\",\"rule\":%s,\"targets\":\"%s\",\"hits\":%" APR_UINT64_T_FMT "}", j ? "," : "",
+                   rule->regex ? "regex" : "str", json_string(r->pool, rule->str), rule_targets(r->pool, rule), hits);
+      else
+        ap_rprintf(r, "%12" APR_UINT64_T_FMT " %-5s %-24s %s\n", hits, rule->regex ? "regex" : "str",
+                   rule_targets(r->pool, rule), rule->str);
+      }
+
+    if (json)
+      ap_rputs("]}", r);
+    }
+
+  if (json)
+    ap_rputs("]}\n", r);
 
   return OK;
 }
@@ -0,0 +1,99 @@
+// Бенчмарк поиска плохих строк: автомат Ахо-Корасик против цикла strstr из старого input_fixup.
+// Для 10, 1000 и 50000 строк выводится пропускная способность на типичных строках запроса.
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "apr_strings.h"
+#include "../appfilter_ac.h"
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Случайная "фраза" из строчных букв и пробелов длиной 6-20 символов
+static char *random_phrase(apr_pool_t *pool)
+{
+  int len = 6 + rand() % 15;
+  char *s = (char *)apr_palloc(pool, len + 1);
+  for (int i = 0; i < len; i++)
+    s[i] = (i % 7 == 6) ? ' ' : 'a' + rand() % 26;
+  s[len] = 0;
+  return s;
+}
+
+static const char *queries[] = {
+  "user=admin&pass=VeryStrongSuperPassword",
+  "user=tanya&pass=12345&remember=1&lang=ru&return_to=%2Fapp%2Fprofile%3Ftab%3Dsettings",
+  "q=apache+module+sql+injection+filter&page=3&sort=date&order=desc&per_page=50&utm_source=newsletter&utm_medium=email",
+  "id=184467&session=5f4dcc3b5aa765d61d8327deb882cf99&ts=1718611200&callback=jQuery3600123456789_1718611200000&_=1718611200001",
+};
+
+int main()
+{
+  apr_initialize();
+  apr_pool_t *pool;
+  apr_pool_create(&pool, NULL);
+  srand(42);
+
+  const int counts[] = {10, 1000, 50000};
+  const int nqueries = sizeof(queries) / sizeof(queries[0]);
+  apr_size_t total = 0;
+  for (int q = 0; q < nqueries; q++)
+    total += strlen(queries[q]);
+
+  printf("%8s %10s %14s %14s\n", "patterns", "states", "ac MB/s", "strstr MB/s");
+  for (unsigned c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+    apr_array_header_t *patterns = apr_array_make(pool, counts[c], sizeof(const char *));
+    for (int i = 0; i < counts[c]; i++)
+      APR_ARRAY_PUSH(patterns, const char *) = random_phrase(pool);
+
+    ac_automaton_t *ac;
+    if (ac_compile(pool, patterns, &ac) != APR_SUCCESS)
+      {
+      printf("Ошибка построения автомата\n");
+      return 1;
+      }
+
+    // Автомат: повторяем проход по всем строкам запроса не менее 0.5 секунды
+    long iters = 0;
+    int hits = 0;
+    double start = now_sec(), elapsed;
+    do
+      {
+      for (int k = 0; k < 1000; k++, iters++)
+        for (int q = 0; q < nqueries; q++)
+          {
+          ac_state_t state = AC_STATE_ROOT;
+          hits += ac_scan(ac, &state, queries[q], strlen(queries[q])) >= 0;
+          }
+      elapsed = now_sec() - start;
+      }
+    while (elapsed < 0.5);
+    double ac_mbs = total * (double)iters / elapsed / 1e6;
+
+    // strstr: тот же объем работы, что выполнял старый input_fixup
+    long siters = 0;
+    start = now_sec();
+    do
+      {
+      for (int q = 0; q < nqueries; q++)
+        for (int i = 0; i < patterns->nelts; i++)
+          hits += strstr(queries[q], APR_ARRAY_IDX(patterns, i, const char *)) != NULL;
+      siters++;
+      elapsed = now_sec() - start;
+      }
+    while (elapsed < 0.5);
+    double strstr_mbs = total * (double)siters / elapsed / 1e6;
+
+    printf("%8d %10lu %14.1f %14.3f%s\n", counts[c], (unsigned long)ac_states(ac), ac_mbs, strstr_mbs,
+           hits ? "  (есть совпадения)" : "");
+    }
+
+  apr_pool_destroy(pool);
+  return 0;
+}
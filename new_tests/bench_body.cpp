@@ -0,0 +1,131 @@
+// Бенчмарк потокового разбора тела POST: форма (application/x-www-form-urlencoded) и JSON одинаковой длины.
+// Тело подается порциями по 8000 байт, как корзины ввода Apache; user и pass стоят в конце тела, поэтому
+// разбирается все тело. Два вида тела: много коротких полей и одно длинное поле перед user и pass
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "apr_general.h"
+#include "apr_strings.h"
+#include "../app_params.h"
+
+#define CHUNK 8000
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned sink = 0;
+
+// Тело длиной size в формате format: поля field<i> с значением длины field_len, затем user и pass
+static char *make_body(apr_pool_t *pool, int format, apr_size_t size, apr_size_t field_len)
+{
+  const char *tail = format == PARAMS_JSON ? ",\"user\":\"admin\",\"pass\":\"p@ss w\\\"ord\"}" : "&user=admin&pass=p%40ss+w%22ord";
+  char *body = (char *)apr_palloc(pool, size + 1);
+  char *p = body, *end = body + size - strlen(tail);
+  if (format == PARAMS_JSON)
+    *p++ = '{';
+
+  for (int i = 0; p < end; i++)
+    {
+    char field[64];
+    const char *sep = i ? (format == PARAMS_JSON ? "," : "&") : "";
+    int n = snprintf(field, sizeof(field), format == PARAMS_JSON ? "%s\"field%d\":\"" : "%sfield%d=", sep, i);
+    // Последнее поле дополняется до конца тела, чтобы тела обоих форматов были одной длины
+    apr_size_t room = end - p;
+    apr_size_t len = field_len;
+    apr_size_t overhead = n + (format == PARAMS_JSON);
+    if (overhead + len + 32 > room)
+      len = room - overhead;
+    memcpy(p, field, n);
+    p += n;
+    memset(p, 'a' + i % 26, len);
+    p += len;
+    if (format == PARAMS_JSON)
+      *p++ = '"';
+    }
+
+  strcpy(p, tail);
+  return body;
+}
+
+// Нс на разбор тела, не менее 0.2 секунды на замер
+static double measure(apr_pool_t *pool, int format, const char *body)
+{
+  static const char *const names[] = {"user", "pass"};
+  apr_size_t len = strlen(body);
+  long iters = 0;
+  double start = now_sec(), elapsed;
+  do
+    {
+    for (int k = 0; k < 20; k++, iters++)
+      {
+      const char *values[2] = {NULL, NULL};
+      param_spec_t spec = {names, 2, NULL, values, NULL};
+      params_body_t pb;
+      params_body_init(&pb, format, pool, &spec, len);
+      apr_status_t rv = APR_SUCCESS;
+      for (apr_size_t i = 0; i < len && rv == APR_SUCCESS; i += CHUNK)
+        rv = params_body_feed(&pb, body + i, len - i < CHUNK ? len - i : CHUNK);
+      if (rv == APR_SUCCESS)
+        rv = params_body_end(&pb);
+      if (rv != APR_EOF || strcmp(values[1], "p@ss w\"ord") != 0)
+        {
+        printf("Ошибка разбора тела\n");
+        exit(1);
+        }
+      sink += values[0][0];
+      apr_pool_clear(pool);
+      }
+    elapsed = now_sec() - start;
+    }
+  while (elapsed < 0.2);
+
+  return elapsed / iters * 1e9;
+}
+
+int main()
+{
+  apr_initialize();
+  apr_pool_t *pool, *request;
+  apr_pool_create(&pool, NULL);
+  apr_pool_create(&request, NULL);
+
+  static const apr_size_t sizes[] = {256, 4096, 65536, 1048576};
+  static const struct {
+    const char *name;
+    apr_size_t field_len;
+  } shapes[] = {
+    {"поля по 8 байт", 8},
+    {"одно длинное поле", 1 << 30},
+  };
+
+  printf("Нс на разбор тела (МБ/с)\n\n%-26s", "");
+  for (int s = 0; s < 4; s++)
+    printf("%20lu", (unsigned long)sizes[s]);
+  printf("  байт\n");
+
+  for (unsigned sh = 0; sh < sizeof(shapes) / sizeof(shapes[0]); sh++)
+    {
+    printf("%s\n", shapes[sh].name);
+    for (int format = PARAMS_URLENCODED; format <= PARAMS_JSON; format++)
+      {
+      printf("  %-24s", format == PARAMS_JSON ? "json" : "urlencoded");
+      for (int s = 0; s < 4; s++)
+        {
+        char *body = make_body(pool, format, sizes[s], shapes[sh].field_len);
+        double ns = measure(request, format, body);
+        char cell[32];
+        snprintf(cell, sizeof(cell), "%.0f (%.0f)", ns, sizes[s] / ns * 1e3);
+        printf("%20s", cell);
+        }
+      printf("\n");
+      }
+    }
+
+  apr_pool_destroy(pool);
+  return sink == 0xffffffff;
+}
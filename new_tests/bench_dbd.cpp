@@ -0,0 +1,178 @@
+// Бенчмарк пула соединений с базой данных под насыщением: потоков MPM (ThreadsPerChild 64) намного больше,
+// чем соединений (DBDMax 10). Запрос входа проходит этапы: чтение тела от клиента, разбор и SHA-256 пароля,
+// SELECT по логину, сверка хеша и отправка ответа клиенту; сеть и база данных заменены паузами. Сравнивается,
+// сколько соединение занято на запрос: с начала обработки до конца запроса (ap_dbd_acquire до разбора),
+// с db_login до конца запроса (ap_dbd_acquire в db_login) и только на время SELECT (ap_dbd_open/ap_dbd_close)
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "apr_general.h"
+#include "../app_hash.h"
+
+#define THREADS 64
+#define CONNECTIONS 10
+#define SECONDS 3
+#define MAX_SAMPLES 200000
+// Длительность этапов, мкс: тело запроса приходит от клиента, ответ уходит клиенту, SELECT выполняется в базе
+#define READ_US 2000
+#define SELECT_US 1000
+#define WRITE_US 2000
+
+// Когда берется соединение
+enum {
+  HOLD_REQUEST,                 // в начале обработки, до разбора параметров; возвращается в конце запроса
+  HOLD_LOGIN,                   // перед SELECT; возвращается в конце запроса
+  HOLD_SELECT                   // перед SELECT; возвращается сразу после чтения строк
+};
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Пул соединений: ожидание свободного, как в apr_reslist_acquire
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static int pool_free;
+
+static void conn_acquire()
+{
+  pthread_mutex_lock(&pool_mutex);
+  while (!pool_free)
+    pthread_cond_wait(&pool_cond, &pool_mutex);
+  pool_free--;
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+static void conn_release()
+{
+  pthread_mutex_lock(&pool_mutex);
+  pool_free++;
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+static int mode;
+static double stop_at;
+static unsigned char stored[HASH_LEN];
+
+typedef struct {
+  double latency[MAX_SAMPLES];  // время запроса, с
+  int count;
+  double wait;                  // суммарное ожидание соединения, с
+} worker_t;
+
+static worker_t workers[THREADS];
+
+static void *worker_run(void *arg)
+{
+  worker_t *worker = (worker_t *)arg;
+  while (now_sec() < stop_at)
+    {
+    double start = now_sec(), wait = start;
+    if (mode == HOLD_REQUEST)
+      conn_acquire();
+
+    usleep(READ_US);
+    unsigned char digest[HASH_LEN];
+    hash_sha256("user=admin&pass=secret", 22, digest);
+
+    if (mode != HOLD_REQUEST)
+      {
+      wait = now_sec();
+      conn_acquire();
+      }
+    worker->wait += now_sec() - wait;
+    usleep(SELECT_US);
+    if (mode == HOLD_SELECT)
+      conn_release();
+
+    int ok = memcmp(digest, stored, HASH_LEN) == 0;
+    usleep(WRITE_US);
+    if (mode != HOLD_SELECT)
+      conn_release();
+
+    if (ok && worker->count < MAX_SAMPLES)
+      worker->latency[worker->count++] = now_sec() - start;
+    }
+
+  return NULL;
+}
+
+static int compare(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Печатает название в столбце шириной width символов (не байт: названия в UTF-8)
+static void print_name(const char *name, int width, int right = false)
+{
+  int chars = 0;
+  for (const char *c = name; *c; c++)
+    chars += (*c & 0xc0) != 0x80;
+  int pad = width > chars ? width - chars : 0;
+  if (right)
+    printf("%*s%s", pad, "", name);
+  else
+    printf("%s%*s", name, pad, "");
+}
+
+static void run(const char *name, int hold)
+{
+  mode = hold;
+  pool_free = CONNECTIONS;
+  memset(workers, 0, sizeof(workers));
+  pthread_t threads[THREADS];
+  stop_at = now_sec() + SECONDS;
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], NULL, worker_run, &workers[i]);
+  for (int i = 0; i < THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  static double all[THREADS * MAX_SAMPLES];
+  int n = 0;
+  double wait = 0;
+  for (int i = 0; i < THREADS; i++)
+    {
+    memcpy(all + n, workers[i].latency, workers[i].count * sizeof(double));
+    n += workers[i].count;
+    wait += workers[i].wait;
+    }
+  qsort(all, n, sizeof(double), compare);
+
+  print_name(name, 34);
+  if (!n)
+    {
+    printf("нет запросов\n");
+    return;
+    }
+  printf("%12.0f%10.1f%10.1f%14.1f\n", n / (double)SECONDS, all[n / 2] * 1e3, all[(int)(n * 0.99)] * 1e3, wait / n * 1e3);
+}
+
+int main()
+{
+  apr_initialize();
+  hash_sha256("user=admin&pass=secret", 22, stored);
+
+  printf("Потоков %d, соединений %d, по %d с на замер; чтение тела %d мкс, SELECT %d мкс, ответ %d мкс\n\n", THREADS,
+         CONNECTIONS, SECONDS, READ_US, SELECT_US, WRITE_US);
+
+  print_name("", 34);
+  static const char *columns[] = {"запросов/с", "p50 мс", "p99 мс", "ожидание мс"};
+  static const int widths[] = {12, 10, 10, 14};
+  for (int i = 0; i < 4; i++)
+    print_name(columns[i], widths[i], true);
+  printf("\n");
+
+  run("ap_dbd_acquire до разбора", HOLD_REQUEST);
+  run("ap_dbd_acquire в db_login", HOLD_LOGIN);
+  run("ap_dbd_open/ap_dbd_close", HOLD_SELECT);
+
+  return 0;
+}
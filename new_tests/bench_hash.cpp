@@ -0,0 +1,161 @@
+// Бенчмарк SHA-256 паролей: одноразовый SHA256(), одноразовый EVP_Digest, EVP с контекстом потока (hash_sha256)
+// и пакетное хеширование по 64 сообщения через EVP и в дорожках AVX2/AVX-512 при разных длинах сообщений
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "openssl/evp.h"
+#include "openssl/sha.h"
+#include "apr_general.h"
+#include "../app_hash.h"
+
+#define BATCH 64
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char data[BATCH + 1024];
+static unsigned char digests[BATCH * HASH_LEN];
+static unsigned sink = 0;
+
+// Путь хеширования: BATCH сообщений длины len, начинающихся с соседних байт data
+typedef void (*bench_fn)(apr_size_t len);
+
+static void run_sha256(apr_size_t len)
+{
+  for (int i = 0; i < BATCH; i++)
+    SHA256(data + i, len, digests + i * HASH_LEN);
+}
+
+static void run_evp_digest(apr_size_t len)
+{
+  unsigned int n;
+  for (int i = 0; i < BATCH; i++)
+    EVP_Digest(data + i, len, digests + i * HASH_LEN, &n, EVP_sha256(), NULL);
+}
+
+static void run_sha256_ctx(apr_size_t len)
+{
+  for (int i = 0; i < BATCH; i++)
+    {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, data + i, len);
+    SHA256_Final(digests + i * HASH_LEN, &ctx);
+    }
+}
+
+static void run_hash_sha256(apr_size_t len)
+{
+  for (int i = 0; i < BATCH; i++)
+    hash_sha256(data + i, len, digests + i * HASH_LEN);
+}
+
+static hash_many_fn many = NULL;
+
+static void run_many(apr_size_t len)
+{
+  hash_input_t inputs[BATCH];
+  for (int i = 0; i < BATCH; i++)
+    {
+    inputs[i].data = data + i;
+    inputs[i].len = len;
+    }
+  many(inputs, BATCH, digests);
+}
+
+// Печатает название в столбце шириной width символов (не байт: названия в UTF-8)
+static void print_name(const char *name, int width)
+{
+  int chars = 0;
+  for (const char *c = name; *c; c++)
+    chars += (*c & 0xc0) != 0x80;
+  printf("%s%*s", name, width > chars ? width - chars : 0, "");
+}
+
+// Нс на одно сообщение, не менее 0.2 секунды на замер
+static double measure(bench_fn fn, apr_size_t len)
+{
+  long iters = 0;
+  double start = now_sec(), elapsed;
+  do
+    {
+    for (int k = 0; k < 100; k++, iters++)
+      {
+      data[0]++;
+      fn(len);
+      sink += digests[0];
+      }
+    elapsed = now_sec() - start;
+    }
+  while (elapsed < 0.2);
+
+  return elapsed / iters / BATCH * 1e9;
+}
+
+int main()
+{
+  apr_initialize();
+  apr_pool_t *pool;
+  apr_pool_create(&pool, NULL);
+  if (hash_init(pool) != APR_SUCCESS)
+    {
+    printf("Ошибка hash_init\n");
+    return 1;
+    }
+
+  for (apr_size_t i = 0; i < sizeof(data); i++)
+    data[i] = 'a' + i % 26;
+
+  printf("SHA-256 в OpenSSL: %s, пакетное хеширование по умолчанию: %s\n", hash_backend(), hash_mb_level_name(hash_mb_best_level()));
+
+  static const apr_size_t lens[] = {8, 16, 32, 55, 64, 256, 1024};
+  static const int nlens = sizeof(lens) / sizeof(lens[0]);
+
+  printf("\n");
+  print_name("Нс на сообщение", 31);
+  for (int l = 0; l < nlens; l++)
+    printf("%8lu", (unsigned long)lens[l]);
+  printf("  байт\n");
+
+  struct {
+    const char *name;
+    bench_fn fn;
+  } single[] = {
+    {"SHA256() одноразовый", run_sha256},
+    {"EVP_Digest одноразовый", run_evp_digest},
+    {"SHA256_Init (устаревший)", run_sha256_ctx},
+    {"hash_sha256 (EVP потока)", run_hash_sha256},
+  };
+  for (unsigned k = 0; k < sizeof(single) / sizeof(single[0]); k++)
+    {
+    print_name(single[k].name, 31);
+    for (int l = 0; l < nlens; l++)
+      printf("%8.1f", measure(single[k].fn, lens[l]));
+    printf("\n");
+    }
+
+  for (int level = HASH_MB_EVP; level < HASH_MB_LEVELS; level++)
+    {
+    many = hash_mb_select(level);
+    char name[64];
+    snprintf(name, sizeof(name), "пакет по %d: %s", BATCH, hash_mb_level_name(level));
+    print_name(name, 31);
+    if (!many)
+      {
+      printf("не поддерживается процессором\n");
+      continue;
+      }
+
+    for (int l = 0; l < nlens; l++)
+      printf("%8.1f", measure(run_many, lens[l]));
+    printf("\n");
+    }
+
+  apr_pool_destroy(pool);
+  return sink == 0xffffffff;
+}
@@ -0,0 +1,157 @@
+// Бенчмарк проверки паролей scrypt под перегрузкой: клиентов (потоков) намного больше, чем процессоров,
+// и каждый сразу после ответа отправляет следующий вход. Без пула все проверки делят процессор, и задержка
+// каждой растет с числом клиентов; с пулом одновременно считается не больше workers проверок, остальные
+// ждут в короткой очереди или сразу получают отказ (503), и задержка принятых входов остается ограниченной
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "apr_general.h"
+#include "../app_kdf.h"
+
+#define CLIENTS 32
+#define SECONDS 3
+#define MAX_SAMPLES 100000
+// Пауза клиента после отказа, мс: повтор без паузы только нагружал бы очередь
+#define RETRY_MS 5
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static kdf_params_t params = {12, 8, 1};
+static unsigned char record[KDF_RECORD_LEN];
+static kdf_pool_t *pool = NULL;
+static double stop_at;
+
+typedef struct {
+  double latency[MAX_SAMPLES];  // задержки успешных проверок, с
+  int count;
+  long rejected;
+} client_t;
+
+static client_t clients[CLIENTS];
+
+static void *client_run(void *arg)
+{
+  client_t *client = (client_t *)arg;
+  while (now_sec() < stop_at)
+    {
+    double start = now_sec();
+    if (pool && kdf_pool_enter(pool, apr_time_from_sec(2)) != APR_SUCCESS)
+      {
+      client->rejected++;
+      usleep(RETRY_MS * 1000);
+      continue;
+      }
+
+    int ok = kdf_verify(record, "password", 8);
+    if (pool)
+      kdf_pool_leave(pool);
+
+    if (ok && client->count < MAX_SAMPLES)
+      client->latency[client->count++] = now_sec() - start;
+    }
+
+  return NULL;
+}
+
+static int compare(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Число символов (не байт) в строке UTF-8
+static int utf8_chars(const char *text)
+{
+  int chars = 0;
+  for (const char *c = text; *c; c++)
+    chars += (*c & 0xc0) != 0x80;
+  return chars;
+}
+
+// Печатает название в столбце шириной width символов: по левому краю, а при right - по правому
+static void print_name(const char *name, int width, int right = false)
+{
+  int pad = width - utf8_chars(name);
+  if (pad < 0)
+    pad = 0;
+  if (right)
+    printf("%*s%s", pad, "", name);
+  else
+    printf("%s%*s", name, pad, "");
+}
+
+static void run(const char *name, int workers, int queue)
+{
+  static char mem[4096];
+  pool = workers ? kdf_pool_init(mem, workers, queue) : NULL;
+
+  memset(clients, 0, sizeof(clients));
+  pthread_t threads[CLIENTS];
+  stop_at = now_sec() + SECONDS;
+  for (int i = 0; i < CLIENTS; i++)
+    pthread_create(&threads[i], NULL, client_run, &clients[i]);
+  for (int i = 0; i < CLIENTS; i++)
+    pthread_join(threads[i], NULL);
+
+  static double all[CLIENTS * MAX_SAMPLES];
+  int n = 0;
+  long rejected = 0;
+  for (int i = 0; i < CLIENTS; i++)
+    {
+    memcpy(all + n, clients[i].latency, clients[i].count * sizeof(double));
+    n += clients[i].count;
+    rejected += clients[i].rejected;
+    }
+  qsort(all, n, sizeof(double), compare);
+
+  print_name(name, 26);
+  if (!n)
+    {
+    printf("нет успешных проверок\n");
+    return;
+    }
+  printf("%10.1f%10.1f%10.1f%10.1f%10ld\n", n / (double)SECONDS, all[n / 2] * 1e3, all[(int)(n * 0.99)] * 1e3,
+         all[n - 1] * 1e3, rejected);
+}
+
+int main()
+{
+  apr_initialize();
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = cpus > 0 ? cpus : 1;
+
+  if (kdf_record(&params, "password", 8, record) != APR_SUCCESS)
+    {
+    printf("Ошибка kdf_record\n");
+    return 1;
+    }
+
+  double start = now_sec();
+  kdf_verify(record, "password", 8);
+  printf("scrypt:%d:%d:%d, одна проверка %.1f мс, процессоров %d, клиентов %d, по %d с на замер\n\n", params.log_n, params.r,
+         params.p, (now_sec() - start) * 1e3, workers, CLIENTS, SECONDS);
+
+  print_name("", 26);
+  static const char *columns[] = {"входов/с", "p50 мс", "p99 мс", "max мс", "503"};
+  for (int i = 0; i < 5; i++)
+    print_name(columns[i], 10, true);
+  printf("\n");
+
+  run("без пула", 0, 0);
+  char name[64];
+  snprintf(name, sizeof(name), "пул %d, очередь %d", workers, workers);
+  run(name, workers, workers);
+  snprintf(name, sizeof(name), "пул %d, очередь %d", workers, 4 * workers);
+  run(name, workers, 4 * workers);
+
+  return 0;
+}
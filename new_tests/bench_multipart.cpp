@@ -0,0 +1,135 @@
+// Бенчмарк разбора multipart/form-data: форма входа, перед полями user и pass которой стоит файл размером
+// 64 КБ - 16 МБ (случайные байты или текст со строками CRLF). Тело подается порциями по 8000 байт, как корзины
+// ввода Apache. Скорость пропуска файла сравнивается с memcpy тех же порций, то есть с нижней оценкой любого
+// разбора, который копирует части (в память или во временный файл)
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "apr_general.h"
+#include "apr_strings.h"
+#include "../app_params.h"
+
+#define CHUNK 8000
+#define BOUNDARY "----WebKitFormBoundary7MA4YWxkTrZu0gW"
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned sink = 0;
+
+// Тело: файл длины size, затем user и pass
+static char *make_body(apr_pool_t *pool, apr_size_t size, int text, apr_size_t *len)
+{
+  const char *head = "--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"file\"; filename=\"upload.bin\"\r\n"
+                     "Content-Type: application/octet-stream\r\n\r\n";
+  const char *tail = "\r\n--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"user\"\r\n\r\nadmin\r\n"
+                     "--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"pass\"\r\n\r\nsecret\r\n--" BOUNDARY "--\r\n";
+  *len = strlen(head) + size + strlen(tail);
+  char *body = (char *)apr_palloc(pool, *len + 1);
+  char *p = body;
+  p += strlen(strcpy(p, head));
+
+  srand(1);
+  for (apr_size_t i = 0; i < size; i++)
+    {
+    if (text)
+      *p++ = i % 64 == 62 ? '\r' : i % 64 == 63 ? '\n' : 'a' + rand() % 26;
+    else
+      *p++ = rand();
+    }
+
+  strcpy(p, tail);
+  return body;
+}
+
+// Нс на разбор тела, не менее 0.2 секунды на замер
+static double measure_parse(apr_pool_t *pool, const char *body, apr_size_t len)
+{
+  static const char *const names[] = {"user", "pass"};
+  long iters = 0;
+  double start = now_sec(), elapsed;
+  do
+    {
+    const char *values[2] = {NULL, NULL};
+    param_spec_t spec = {names, 2, NULL, values, NULL};
+    params_body_t pb;
+    params_body_init(&pb, PARAMS_MULTIPART, pool, &spec, 4096, BOUNDARY);
+    apr_status_t rv = APR_SUCCESS;
+    for (apr_size_t i = 0; i < len && rv == APR_SUCCESS; i += CHUNK)
+      rv = params_body_feed(&pb, body + i, len - i < CHUNK ? len - i : CHUNK);
+    if (rv != APR_EOF || strcmp(values[1], "secret") != 0)
+      {
+      printf("Ошибка разбора тела\n");
+      exit(1);
+      }
+    sink += values[0][0];
+    apr_pool_clear(pool);
+    iters++;
+    elapsed = now_sec() - start;
+    }
+  while (elapsed < 0.2);
+
+  return elapsed / iters * 1e9;
+}
+
+// Нс на копирование тела теми же порциями в буфер одной порции
+static double measure_memcpy(const char *body, apr_size_t len)
+{
+  static char buf[CHUNK];
+  long iters = 0;
+  double start = now_sec(), elapsed;
+  do
+    {
+    for (apr_size_t i = 0; i < len; i += CHUNK)
+      {
+      memcpy(buf, body + i, len - i < CHUNK ? len - i : CHUNK);
+      sink += buf[0];
+      }
+    iters++;
+    elapsed = now_sec() - start;
+    }
+  while (elapsed < 0.2);
+
+  return elapsed / iters * 1e9;
+}
+
+int main()
+{
+  apr_initialize();
+  apr_pool_t *pool, *request;
+  apr_pool_create(&pool, NULL);
+  apr_pool_create(&request, NULL);
+
+  static const apr_size_t sizes[] = {65536, 1048576, 16777216};
+  printf("Мкс на тело (ГБ/с)\n\n%-26s", "");
+  for (int s = 0; s < 3; s++)
+    printf("%20lu", (unsigned long)sizes[s]);
+  printf("  байт файла\n");
+
+  for (int text = 0; text <= 1; text++)
+    {
+    printf("%s\n", text ? "текст со строками по 64 байта" : "случайные байты");
+    for (int copy = 0; copy <= 1; copy++)
+      {
+      printf("  %-24s", copy ? "memcpy" : "params_multipart");
+      for (int s = 0; s < 3; s++)
+        {
+        apr_size_t len;
+        char *body = make_body(pool, sizes[s], text, &len);
+        double ns = copy ? measure_memcpy(body, len) : measure_parse(request, body, len);
+        char cell[32];
+        snprintf(cell, sizeof(cell), "%.1f (%.1f)", ns / 1e3, len / ns);
+        printf("%20s", cell);
+        }
+      printf("\n");
+      }
+    }
+
+  apr_pool_destroy(pool);
+  return sink == 0xffffffff;
+}
@@ -0,0 +1,128 @@
+// Бенчмарк разбора строки параметров URL: прежний путь get_params (apreq_parse_query_string в таблицу apreq
+// и копирование всех параметров во вторую таблицу) и params_query, который декодирует только user и pass и
+// прекращает разбор, когда оба найдены. Строки из 10-1000 параметров, user и pass в начале или в конце строки
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "apr_general.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+#include "apreq_util.h"
+#include "apreq_param.h"
+#include "../app_params.h"
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned sink = 0;
+
+// Путь разбора строки args; найденные user и pass учитываются в sink
+typedef void (*bench_fn)(apr_pool_t *pool, const char *args);
+
+static void run_apreq(apr_pool_t *pool, const char *args)
+{
+  apr_table_t *ap = apr_table_make(pool, 25);
+  apreq_parse_query_string(pool, ap, args);
+
+  apr_table_t *params = apr_table_make(pool, 25);
+  const apr_array_header_t *a = apr_table_elts(ap);
+  apr_table_entry_t *elts = (apr_table_entry_t *)a->elts;
+  for (int i = 0; i < a->nelts; i++)
+    {
+    apreq_param_t *p = apreq_value_to_param(elts[i].val);
+    apr_table_addn(params, p->v.name, p->v.data);
+    }
+
+  const char *user = apr_table_get(params, "user"), *pass = apr_table_get(params, "pass");
+  sink += (user ? user[0] : 0) + (pass ? pass[0] : 0);
+}
+
+static void run_params(apr_pool_t *pool, const char *args)
+{
+  static const char *const names[] = {"user", "pass"};
+  const char *values[2] = {NULL, NULL};
+  param_spec_t spec = {names, 2, NULL, values, NULL};
+  params_query(pool, args, &spec);
+  sink += (values[0] ? values[0][0] : 0) + (values[1] ? values[1][0] : 0);
+}
+
+// Строка из count параметров вида field17=value%2017; user и pass - первые (front) или последние
+static const char *make_args(apr_pool_t *pool, int count, int front)
+{
+  const char *args = front ? "user=admin&pass=p%40ssword" : "";
+  for (int i = 0; i < count - 2; i++)
+    args = apr_psprintf(pool, "%s%sfield%d=value%%20%d", args, *args ? "&" : "", i, i);
+  if (!front)
+    args = apr_pstrcat(pool, args, "&user=admin&pass=p%40ssword", NULL);
+  return args;
+}
+
+// Печатает название в столбце шириной width символов (не байт: названия в UTF-8)
+static void print_name(const char *name, int width)
+{
+  int chars = 0;
+  for (const char *c = name; *c; c++)
+    chars += (*c & 0xc0) != 0x80;
+  printf("%s%*s", name, width > chars ? width - chars : 0, "");
+}
+
+// Нс на один разбор, не менее 0.2 секунды на замер. Пул очищается после каждого разбора, как пул запроса
+static double measure(bench_fn fn, apr_pool_t *pool, const char *args)
+{
+  long iters = 0;
+  double start = now_sec(), elapsed;
+  do
+    {
+    for (int k = 0; k < 100; k++, iters++)
+      {
+      fn(pool, args);
+      apr_pool_clear(pool);
+      }
+    elapsed = now_sec() - start;
+    }
+  while (elapsed < 0.2);
+
+  return elapsed / iters * 1e9;
+}
+
+int main()
+{
+  apr_initialize();
+  apr_pool_t *pool, *request;
+  apr_pool_create(&pool, NULL);
+  apr_pool_create(&request, NULL);
+
+  static const int counts[] = {10, 100, 1000};
+  printf("Нс на разбор строки параметров URL\n\n");
+  print_name("", 34);
+  for (int c = 0; c < 3; c++)
+    printf("%10d", counts[c]);
+  printf("  параметров\n");
+
+  struct {
+    const char *name;
+    bench_fn fn;
+  } paths[] = {
+    {"  apreq и копирование в таблицу", run_apreq},
+    {"  params_query", run_params},
+  };
+  for (int front = 1; front >= 0; front--)
+    {
+    printf("user и pass %s строки\n", front ? "в начале" : "в конце");
+    for (unsigned k = 0; k < sizeof(paths) / sizeof(paths[0]); k++)
+      {
+      print_name(paths[k].name, 34);
+      for (int c = 0; c < 3; c++)
+        printf("%10.0f", measure(paths[k].fn, request, make_args(pool, counts[c], front)));
+      printf("\n");
+      }
+    }
+
+  apr_pool_destroy(pool);
+  return sink == 0xffffffff;
+}
@@ -0,0 +1,123 @@
+// Бенчмарк предварительного поиска первых байтов плохих строк.
+// Сравниваются скалярная версия и векторные версии SSE4.2/AVX2/AVX-512, доступные на данном процессоре,
+// а также полный проход автомата с предварительным поиском и без него.
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "apr_strings.h"
+#include "../appfilter_ac.h"
+#include "../appfilter_simd.h"
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Строки запроса без плохих байтов, похожие на реальный трафик
+static const char *queries[] = {
+  "user=admin&pass=VeryStrongSuperPassword",
+  "user=tanya&pass=12345&remember=1&lang=ru&return_to=/app/profile",
+  "q=apache+module+sql+injection+filter&page=3&sort=date&order=desc&per_page=50&utm_source=newsletter&utm_medium=email&utm_campaign=spring",
+  "id=184467&session=5f4dcc3b5aa765d61d8327deb882cf99&ts=1718611200&callback=jQuery3600123456789_1718611200000&_=1718611200001&fields=id,name,email,created_at,updated_at&include=roles,permissions",
+};
+
+static const int nqueries = sizeof(queries) / sizeof(queries[0]);
+
+// Прогоняет все строки запроса через автомат не менее 0.3 секунды, возвращает МБ/с
+static double measure(const ac_automaton_t *ac, apr_size_t total)
+{
+  long iters = 0;
+  int hits = 0;
+  double start = now_sec(), elapsed;
+  do
+    {
+    for (int k = 0; k < 1000; k++, iters++)
+      for (int q = 0; q < nqueries; q++)
+        {
+        ac_state_t state = AC_STATE_ROOT;
+        hits += ac_scan(ac, &state, queries[q], strlen(queries[q])) >= 0;
+        }
+    elapsed = now_sec() - start;
+    }
+  while (elapsed < 0.3);
+
+  if (hits)
+    printf("  (есть совпадения: %d)\n", hits);
+  return total * (double)iters / elapsed / 1e6;
+}
+
+int main()
+{
+  apr_initialize();
+  apr_pool_t *pool;
+  apr_pool_create(&pool, NULL);
+
+  apr_size_t total = 0;
+  for (int q = 0; q < nqueries; q++)
+    total += strlen(queries[q]);
+
+  // Только поиск первого байта на длинном буфере без совпадений
+  const char *set_bytes = "'\";";
+  unsigned char member[256] = {0};
+  for (const char *c = set_bytes; *c; c++)
+    member[(unsigned char)*c] = 1;
+  pf_set_t set;
+  pf_init(&set, member);
+
+  apr_size_t buflen = 4096;
+  unsigned char *buf = (unsigned char *)apr_palloc(pool, buflen);
+  for (apr_size_t i = 0; i < buflen; i++)
+    buf[i] = queries[3][i % strlen(queries[3])];
+
+  printf("Поиск байтов множества в буфере %lu байт без совпадений\n", (unsigned long)buflen);
+  for (int level = PF_SCALAR; level < PF_LEVELS; level++)
+    {
+    pf_find_fn find = pf_select(level);
+    if (!find)
+      {
+      printf("%10s  не поддерживается процессором\n", pf_level_name(level));
+      continue;
+      }
+    long iters = 0;
+    apr_size_t sum = 0;
+    double start = now_sec(), elapsed;
+    do
+      {
+      for (int k = 0; k < 1000; k++, iters++)
+        sum += find(&set, buf, buf + buflen) - buf;
+      elapsed = now_sec() - start;
+      }
+    while (elapsed < 0.3);
+    printf("%10s %10.1f МБ/с%s\n", pf_level_name(level), buflen * (double)iters / elapsed / 1e6,
+           sum == buflen * iters ? "" : "  ОШИБКА");
+    }
+
+  // Полный проход автомата по строкам запроса
+  const char *list[] = {"'", "%27", "\"", "%22", "--", "/*", ";"};
+  apr_array_header_t *patterns = apr_array_make(pool, 8, sizeof(const char *));
+  for (unsigned i = 0; i < sizeof(list) / sizeof(list[0]); i++)
+    APR_ARRAY_PUSH(patterns, const char *) = list[i];
+
+  ac_automaton_t *ac;
+  if (ac_compile(pool, patterns, &ac) != APR_SUCCESS)
+    {
+    printf("Ошибка построения автомата\n");
+    return 1;
+    }
+
+  printf("\nАвтомат на %d строках, строки запроса без совпадений\n", patterns->nelts);
+  ac_set_prefilter(ac, -1);
+  printf("%10s %10.1f МБ/с\n", "без фильтра", measure(ac, total));
+  for (int level = PF_SCALAR; level < PF_LEVELS; level++)
+    {
+    if (ac_set_prefilter(ac, level) != APR_SUCCESS)
+      continue;
+    printf("%10s %10.1f МБ/с\n", pf_level_name(level), measure(ac, total));
+    }
+
+  apr_pool_destroy(pool);
+  return 0;
+}
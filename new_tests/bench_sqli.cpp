@@ -0,0 +1,125 @@
+// Бенчмарк поиска SQL-инъекций: отпечатки токенов против старого цикла strstr по строкам "'" и "%27".
+// Для обоих способов выводится пропускная способность, доля найденных атак и доля ложных срабатываний
+// на обычных значениях параметров.
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "apr_strings.h"
+#include "../appfilter_sqli.h"
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *attacks[] = {
+  "admin'--", "admin' #", "admin'/*", "' or '1'='1", "' or 1=1--", "' or ''='", "1 or 1=1", "1 and 1=2",
+  "1' union select null,null--", "-1 union all select 1,2,3", "1 union select username,password from users",
+  "1; drop table users", "'; drop table users--", "1 and sleep(5)", "1' and sleep(5)#", "') or ('1'='1",
+  "1)) or ((1=1", "1 order by 5--", "x' and 1=convert(int,@@version)--", "1/*!50000union*/select 1",
+  "' union/**/select password from users", "admin\" or \"1\"=\"1", "1 and (select count(*) from users)>0",
+  "' || (select version()) || '", "1;waitfor delay '0:0:5'--", "' into outfile '/tmp/x'--",
+  "1 and @@version like '5%'", "' or x=x--", "\") or (\"a\"=\"a",
+};
+
+static const char *benign[] = {
+  "O'Brien", "Don't stop me now", "rock'n'roll", "it's 5 o'clock", "O'Reilly and Sons", "Tom & Jerry",
+  "select your plan", "drop-down menu", "john.smith@example.com", "Hello, world!", "12345", "VeryStrongSuperPassword",
+  "2+2=4", "order by date", "the 'best' one", "we're \"here\"", "D'Artagnan", "l'hôpital", "5' 11\" tall",
+  "apache module sql injection filter", "/app/profile?tab=settings", "jQuery3600123456789_1718611200000",
+  "5f4dcc3b5aa765d61d8327deb882cf99", "Mary-Jane O'Connor", "Rock and roll, 1950s", "user's guide (2nd edition)",
+  "Can't login - help!", "ru-RU,ru;q=0.9,en-US;q=0.8", "C:\\Program Files\\App", "x = y + 1",
+};
+
+#define NATTACKS (int)(sizeof(attacks) / sizeof(attacks[0]))
+#define NBENIGN (int)(sizeof(benign) / sizeof(benign[0]))
+
+// Старая проверка: значение отклоняется, если в нем есть одна из строк appfilter_str
+static int strstr_check(const char *value)
+{
+  static const char *patterns[] = {"'", "%27"};
+  for (int i = 0; i < 2; i++)
+    if (strstr(value, patterns[i]))
+      return true;
+  return false;
+}
+
+int main()
+{
+  apr_initialize();
+  apr_pool_t *pool;
+  apr_pool_create(&pool, NULL);
+
+  sqli_set_t *set;
+  if (sqli_compile(pool, NULL, &set) != APR_SUCCESS)
+    {
+    printf("Ошибка построения набора отпечатков\n");
+    return 1;
+    }
+
+  int sqli_tp = 0, sqli_fp = 0, strstr_tp = 0, strstr_fp = 0;
+  for (int i = 0; i < NATTACKS; i++)
+    {
+    sqli_tp += sqli_check(set, attacks[i], strlen(attacks[i]), NULL);
+    strstr_tp += strstr_check(attacks[i]);
+    }
+  for (int i = 0; i < NBENIGN; i++)
+    {
+    char fp[SQLI_FP_SIZE];
+    int hit = sqli_check(set, benign[i], strlen(benign[i]), fp);
+    if (hit)
+      printf("ложное срабатывание: %s (%s)\n", benign[i], fp);
+    sqli_fp += hit;
+    strstr_fp += strstr_check(benign[i]);
+    }
+
+  apr_size_t total = 0;
+  for (int i = 0; i < NATTACKS; i++)
+    total += strlen(attacks[i]);
+  for (int i = 0; i < NBENIGN; i++)
+    total += strlen(benign[i]);
+
+  // Повторяем проверку всех значений не менее 0.5 секунды
+  long iters = 0;
+  int hits = 0;
+  double start = now_sec(), elapsed;
+  do
+    {
+    for (int k = 0; k < 100; k++, iters++)
+      {
+      for (int i = 0; i < NATTACKS; i++)
+        hits += sqli_check(set, attacks[i], strlen(attacks[i]), NULL);
+      for (int i = 0; i < NBENIGN; i++)
+        hits += sqli_check(set, benign[i], strlen(benign[i]), NULL);
+      }
+    elapsed = now_sec() - start;
+    }
+  while (elapsed < 0.5);
+  double sqli_mbs = total * (double)iters / elapsed / 1e6;
+
+  long siters = 0;
+  start = now_sec();
+  do
+    {
+    for (int k = 0; k < 100; k++, siters++)
+      {
+      for (int i = 0; i < NATTACKS; i++)
+        hits += strstr_check(attacks[i]);
+      for (int i = 0; i < NBENIGN; i++)
+        hits += strstr_check(benign[i]);
+      }
+    elapsed = now_sec() - start;
+    }
+  while (elapsed < 0.5);
+  double strstr_mbs = total * (double)siters / elapsed / 1e6;
+
+  printf("                 MB/s     атаки       ложные\n");
+  printf("%-8s %10.1f %5d / %-3d %6d / %-3d\n", "sqli", sqli_mbs, sqli_tp, NATTACKS, sqli_fp, NBENIGN);
+  printf("%-8s %10.1f %5d / %-3d %6d / %-3d\n", "strstr", strstr_mbs, strstr_tp, NATTACKS, strstr_fp, NBENIGN);
+
+  apr_pool_destroy(pool);
+  return hits < 0;
+}
@@ -2,11 +2,26 @@
 #include "doctest.h"
 #include "stdlib.h"
 #include "stdio.h"
+#include "unistd.h"
+#include "sys/stat.h"
+#include "pthread.h"
 #include "ap_config.h"
 #include "apr_dbd.h"
 #include "apr_strings.h"
 #include "openssl/sha.h"
 #include "sha256.h"
+#include "../appfilter_ac.h"
+#include "../appfilter_simd.h"
+#include "../appfilter_decode.h"
+#include "../appfilter_regex.h"
+#include "../appfilter_sqli.h"
+#include "../appfilter_cache.h"
+#include "../app_cuckoo.h"
+#include "../app_snapshot.h"
+#include "../app_session.h"
+#include "../app_hash.h"
+#include "../app_kdf.h"
+#include "../app_params.h"
 
 
 TEST_CASE("only numbers"){
@@ -112,4 +127,1324 @@ const char *sql = apr_pstrcat(pool, "SELECT name FROM users WHERE login='", user
 const char *content_type = "Application/X-www-form-urlencoded";
 const char * CONTENT_TYPE_URLENCODED = "application/x-www-form-urlencoded";
 CHECK(strncasecmp(content_type, CONTENT_TYPE_URLENCODED, strlen(CONTENT_TYPE_URLENCODED)) == 0);
-}
\ No newline at end of file
+}
+
+
+static ac_automaton_t *compile_patterns(apr_pool_t *pool, const char **list, int n)
+{
+apr_array_header_t *patterns = apr_array_make(pool, n, sizeof(const char *));
+for (int i = 0; i < n; i++)
+  APR_ARRAY_PUSH(patterns, const char *) = list[i];
+ac_automaton_t *ac = NULL;
+REQUIRE(ac_compile(pool, patterns, &ac) == APR_SUCCESS);
+return ac;
+}
+
+TEST_CASE("aho-corasick finds every pattern"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *list[] = {"'", "%27", "union select", "--", "or 1=1"};
+ac_automaton_t *ac = compile_patterns(pool, list, 5);
+const char *args[] = {"user=admin'", "user=admin%27", "q=1 union select name", "user=admin--", "id=1 or 1=1"};
+for (int i = 0; i < 5; i++)
+  {
+  ac_state_t state = AC_STATE_ROOT;
+  CHECK(ac_scan(ac, &state, args[i], strlen(args[i])) == i);
+  }
+ac_state_t state = AC_STATE_ROOT;
+const char *clean = "user=admin&pass=12345";
+CHECK(ac_scan(ac, &state, clean, strlen(clean)) == -1);
+}
+
+TEST_CASE("aho-corasick overlapping patterns and suffix links"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *list[] = {"he", "she", "hers", "his"};
+ac_automaton_t *ac = compile_patterns(pool, list, 4);
+ac_state_t state = AC_STATE_ROOT;
+CHECK(ac_scan(ac, &state, "ushers", 6) == 1);
+state = AC_STATE_ROOT;
+CHECK(ac_scan(ac, &state, "ahishe", 6) == 3);
+state = AC_STATE_ROOT;
+CHECK(ac_scan(ac, &state, "hhhssh", 6) == -1);
+}
+
+TEST_CASE("aho-corasick keeps state between chunks"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *list[] = {"union select"};
+ac_automaton_t *ac = compile_patterns(pool, list, 1);
+ac_state_t state = AC_STATE_ROOT;
+CHECK(ac_scan(ac, &state, "q=1 uni", 7) == -1);
+CHECK(ac_scan(ac, &state, "on sel", 6) == -1);
+CHECK(ac_scan(ac, &state, "ect 1", 5) == 0);
+}
+
+TEST_CASE("aho-corasick empty pattern list"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+ac_automaton_t *ac = compile_patterns(pool, NULL, 0);
+ac_state_t state = AC_STATE_ROOT;
+CHECK(ac_scan(ac, &state, "user=admin'", 11) == -1);
+}
+
+TEST_CASE("prefilter variants agree with scalar search"){
+unsigned char member[256] = {0};
+member['\''] = member['%'] = member[0xd0] = member[0xff] = 1;
+pf_set_t set;
+pf_init(&set, member);
+unsigned char buf[300];
+srand(1);
+for (int round = 0; round < 200; round++)
+  {
+  for (unsigned i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + rand() % 26;
+  if (round % 4)
+    buf[rand() % sizeof(buf)] = round % 3 ? '%' : 0xd0;
+  int len = rand() % sizeof(buf);
+  const unsigned char *expected = pf_select(PF_SCALAR)(&set, buf, buf + len);
+  for (int level = PF_SSE42; level < PF_LEVELS; level++)
+    {
+    pf_find_fn find = pf_select(level);
+    if (find)
+      CHECK(find(&set, buf, buf + len) == expected);
+    }
+  }
+}
+
+TEST_CASE("aho-corasick gives the same result with every prefilter"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *list[] = {"'", "%27", "union select"};
+ac_automaton_t *ac = compile_patterns(pool, list, 3);
+const char *args = "q=apache+module&page=3&sort=date&order=desc&per_page=50&utm_source=newsletter&x=1 union select 2";
+for (int level = -1; level < PF_LEVELS; level++)
+  {
+  if (ac_set_prefilter(ac, level) != APR_SUCCESS)
+    continue;
+  ac_state_t state = AC_STATE_ROOT;
+  CHECK(ac_scan(ac, &state, args, strlen(args)) == 2);
+  state = AC_STATE_ROOT;
+  CHECK(ac_scan(ac, &state, args, strlen(args) - 3) == -1);
+  }
+}
+
+TEST_CASE("normalizer decodes, folds case and strips NUL"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+CHECK(strcmp(norm_string(pool, "admin%27--", 2), "admin'--") == 0);
+CHECK(strcmp(norm_string(pool, "admin%2527", 2), "admin'") == 0);
+CHECK(strcmp(norm_string(pool, "admin%2527", 1), "admin%27") == 0);
+CHECK(strcmp(norm_string(pool, "admin%252527", 2), "admin%27") == 0);
+CHECK(strcmp(norm_string(pool, "UNION+SELECT%2bName", 2), "union select name") == 0);
+CHECK(strcmp(norm_string(pool, "a%00b%2500c", 2), "abc") == 0);
+CHECK(strcmp(norm_string(pool, "%%41%zz%4", 2), "%a%zz%4") == 0);
+CHECK(strcmp(norm_string(pool, "UNION%20SELECT", 0), "union%20select") == 0);
+}
+
+static int collect_sink(void *ctx, const char *data, apr_size_t len)
+{
+char **dst = (char **)ctx;
+memcpy(*dst, data, len);
+*dst += len;
+return 0;
+}
+
+TEST_CASE("normalizer keeps state between chunks"){
+const char *chunks[] = {"q=1%2", "52", "7+UN", "ION%", "20", "SEL%2", "5"};
+char buf[64];
+char *dst = buf;
+norm_state_t ns;
+norm_init(&ns, 2);
+for (int i = 0; i < 7; i++)
+  norm_feed(&ns, chunks[i], strlen(chunks[i]), collect_sink, &dst);
+norm_finish(&ns, collect_sink, &dst);
+*dst = 0;
+CHECK(strcmp(buf, "q=1' union sel%") == 0);
+}
+
+TEST_CASE("normalizer passes long plain spans and stops on sink result"){
+char input[1000];
+for (int i = 0; i < 999; i++)
+  input[i] = 'a' + i % 26;
+input[999] = 0;
+input[500] = 'X';
+char buf[1000];
+char *dst = buf;
+norm_state_t ns;
+norm_init(&ns, 2);
+CHECK(norm_feed(&ns, input, 999, collect_sink, &dst) == 0);
+CHECK(dst - buf == 999);
+CHECK(buf[500] == 'x');
+CHECK(memcmp(buf, input, 500) == 0);
+}
+
+static re_set_t *compile_regex(apr_pool_t *pool, const char **list, int n, apr_size_t cache, const char **error)
+{
+apr_array_header_t *patterns = apr_array_make(pool, n, sizeof(const char *));
+for (int i = 0; i < n; i++)
+  APR_ARRAY_PUSH(patterns, const char *) = list[i];
+re_set_t *re = NULL;
+if (re_compile(pool, patterns, cache, &re, error) != APR_SUCCESS)
+  return NULL;
+return re;
+}
+
+static int regex_match(re_set_t *re, const char *str)
+{
+re_state_t st;
+re_start(&st);
+int found = re_scan(re, &st, str, strlen(str));
+return found >= 0 ? found : re_finish(re, &st);
+}
+
+TEST_CASE("regex rules match classes, alternation and repeats"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *list[] = {"union\\s+(all\\s+)?select", "\\bsleep\\(\\d+\\)", "or\\s+\\d+=\\d+", "[<]scr[^a-z]?ipt", "x{3,5}y"};
+const char *error = NULL;
+re_set_t *re = compile_regex(pool, list, 2, RE_DEFAULT_CACHE, &error);
+CHECK(re == NULL);
+CHECK(error != NULL);
+list[1] = "sleep\\(\\d+\\)";
+re = compile_regex(pool, list, 5, RE_DEFAULT_CACHE, &error);
+REQUIRE(re != NULL);
+CHECK(regex_match(re, "id=1 union  all \tselect name") == 0);
+CHECK(regex_match(re, "id=1 unionselect") == -1);
+CHECK(regex_match(re, "q=sleep(15)") == 1);
+CHECK(regex_match(re, "q=sleep()") == -1);
+CHECK(regex_match(re, "a' or 1=1") == 2);
+CHECK(regex_match(re, "<scr ipt>") == 3);
+CHECK(regex_match(re, "<scrxipt>") == -1);
+CHECK(regex_match(re, "xxy") == -1);
+CHECK(regex_match(re, "xxxxxxy") == 4);
+CHECK(regex_match(re, "hello") == -1);
+}
+
+TEST_CASE("regex rules support anchors and uppercase patterns"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *list[] = {"^/admin", "\\.PHP$", "^(?:drop|truncate) "};
+const char *error = NULL;
+re_set_t *re = compile_regex(pool, list, 3, RE_DEFAULT_CACHE, &error);
+REQUIRE(re != NULL);
+CHECK(regex_match(re, "/admin/panel") == 0);
+CHECK(regex_match(re, "/x/admin") == -1);
+CHECK(regex_match(re, "/shell.php") == 1);
+CHECK(regex_match(re, "/shell.php?x=1") == -1);
+CHECK(regex_match(re, "truncate users") == 2);
+CHECK(regex_match(re, "x truncate users") == -1);
+}
+
+TEST_CASE("regex compile errors and empty matches are rejected"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *bad[] = {"(abc", "abc)", "[abc", "*a", "a{5,2}", "\\q", "a*", "x|", "$"};
+for (int i = 0; i < 9; i++)
+  {
+  const char *error = NULL;
+  CHECK(compile_regex(pool, &bad[i], 1, RE_DEFAULT_CACHE, &error) == NULL);
+  CHECK(error != NULL);
+  }
+const char *ok[] = {"a{", "a{x}", "[]x]", "[z-]", "\\x41b"};
+const char *error = NULL;
+re_set_t *re = compile_regex(pool, ok, 5, RE_DEFAULT_CACHE, &error);
+REQUIRE(re != NULL);
+CHECK(regex_match(re, "a{") == 0);
+CHECK(regex_match(re, "a{x}") == 0);
+CHECK(regex_match(re, "]") == 2);
+CHECK(regex_match(re, "-") == 3);
+CHECK(regex_match(re, "ab") == 4);
+}
+
+TEST_CASE("regex keeps state between chunks and survives cache flushes"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *list[] = {"(a|b)*a(a|b){8}c", "union\\s+select"};
+const char *error = NULL;
+re_set_t *re = compile_regex(pool, list, 2, RE_MIN_CACHE, &error);
+REQUIRE(re != NULL);
+
+// Выражение 0 порождает сотни состояний ДКА, поэтому маленький кеш очищается много раз
+char input[20001];
+unsigned seed = 1;
+for (int i = 0; i < 20000; i++)
+  {
+  seed = seed * 1103515245 + 12345;
+  input[i] = seed >> 16 & 1 ? 'a' : 'b';
+  }
+input[20000] = 0;
+re_state_t st;
+re_start(&st);
+CHECK(re_scan(re, &st, input, 20000) == -1);
+CHECK(re_cache_flushes(re) > 0);
+CHECK(re_scan(re, &st, "union", 5) == -1);
+CHECK(re_scan(re, &st, " \t ", 3) == -1);
+CHECK(re_scan(re, &st, "select", 6) == 1);
+}
+
+// Поток сканирует строки своей копией ДКА и считает ошибки
+typedef struct {
+  re_set_t *re;
+  int errors;
+} regex_thread_t;
+
+static void *regex_thread(void *data)
+{
+regex_thread_t *rt = (regex_thread_t *)data;
+char buf[64];
+for (int i = 0; i < 20000; i++)
+  {
+  snprintf(buf, sizeof(buf), "id=%d%s", i, i % 3 ? " union  select x" : " or 1=2");
+  if (regex_match(rt->re, buf) != (i % 3 ? 0 : 1))
+    rt->errors++;
+  snprintf(buf, sizeof(buf), "name=user%d&q=%x", i, i * 7919);
+  if (regex_match(rt->re, buf) != -1)
+    rt->errors++;
+  }
+return NULL;
+}
+
+TEST_CASE("regex clones scan concurrently with their own DFA caches"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *error = NULL;
+const char *list[] = {"union\\s+(all\\s+)?select", "\\sor\\s+\\d+\\s*=\\s*\\d+"};
+re_set_t *re = compile_regex(pool, list, 2, RE_MIN_CACHE, &error);
+REQUIRE(re);
+
+// Маленький лимит кеша, чтобы копии очищали свои кеши во время работы других потоков
+const int n = 4;
+pthread_t threads[n];
+regex_thread_t rt[n];
+for (int i = 0; i < n; i++)
+  {
+  apr_pool_t *tp;
+  apr_pool_create(&tp, NULL);
+  rt[i].re = re_clone(tp, re);
+  rt[i].errors = 0;
+  REQUIRE(rt[i].re);
+  REQUIRE(pthread_create(&threads[i], NULL, regex_thread, &rt[i]) == 0);
+  }
+for (int i = 0; i < n; i++)
+  {
+  pthread_join(threads[i], NULL);
+  CHECK(rt[i].errors == 0);
+  }
+CHECK(re_cache_states(re) <= 2);
+}
+
+TEST_CASE("regex scan time does not blow up on nested repeats"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *list[] = {"(a+)+b", "(x*)*y(x|xx)*z"};
+const char *error = NULL;
+re_set_t *re = compile_regex(pool, list, 2, RE_DEFAULT_CACHE, &error);
+REQUIRE(re != NULL);
+static char input[100001];
+memset(input, 'a', 100000);
+input[100000] = 0;
+CHECK(regex_match(re, input) == -1);
+memset(input, 'x', 100000);
+input[50000] = 'y';
+CHECK(regex_match(re, input) == -1);
+CHECK(re_cache_states(re) < 100);
+}
+
+TEST_CASE("sqli fingerprints of typical injections"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+sqli_set_t *set;
+REQUIRE(sqli_compile(pool, NULL, &set) == APR_SUCCESS);
+const char *attacks[] = {"admin'--", "' or '1'='1", "' or 1=1--", "1 or 1=1", "1' union select null,null--",
+                         "-1 union all select 1,2", "1; drop table users", "'; drop table users--", "1 and sleep(5)",
+                         "') or ('1'='1", "admin' #", "1 order by 5--", "admin\"--", "1/*!50000union*/select 1",
+                         "' union/**/select password from users"};
+for (unsigned i = 0; i < sizeof(attacks) / sizeof(attacks[0]); i++)
+  CHECK_MESSAGE(sqli_check(set, attacks[i], strlen(attacks[i]), NULL), attacks[i]);
+char fp[SQLI_FP_SIZE];
+CHECK(sqli_check(set, "' or 1=1--", 10, fp));
+CHECK(strcmp(fp, "s&1o1") == 0);
+sqli_fingerprint("1 union all select 1,2", 22, 0, fp);
+CHECK(strcmp(fp, "1UE1,") == 0);
+sqli_fingerprint("x' and sleep(5)", 15, 1, fp);
+CHECK(strcmp(fp, "s&f(1") == 0);
+}
+
+TEST_CASE("sqli does not flag ordinary text"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+sqli_set_t *set;
+REQUIRE(sqli_compile(pool, NULL, &set) == APR_SUCCESS);
+const char *benign[] = {"O'Brien", "Don't stop", "rock'n'roll", "it's 5 o'clock", "O'Reilly and Sons", "Tom & Jerry",
+                        "select your plan", "drop-down menu", "john.smith@example.com", "Hello, world!", "12345",
+                        "VeryStrongSuperPassword", "2+2=4", "order by date", "the 'best' one", "we're \"here\"", "'"};
+for (unsigned i = 0; i < sizeof(benign) / sizeof(benign[0]); i++)
+  CHECK_MESSAGE(!sqli_check(set, benign[i], strlen(benign[i]), NULL), benign[i]);
+}
+
+TEST_CASE("sqli streaming gives the same result and extra fingerprints are validated"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const char *input = "1' UNION  ALL SELECT username, password FROM users--";
+sqli_set_t *set;
+REQUIRE(sqli_compile(pool, NULL, &set) == APR_SUCCESS);
+sqli_state_t st;
+sqli_init(&st);
+for (const char *p = input; *p; p++)
+  sqli_feed(&st, p, 1);
+char fp[SQLI_FP_SIZE];
+CHECK(sqli_finish(set, &st, fp));
+CHECK(strcmp(fp, "sUEn,") == 0);
+
+CHECK(sqli_fingerprint_valid("s&1"));
+CHECK(sqli_fingerprint_valid("Ef(*"));
+CHECK(!sqli_fingerprint_valid(""));
+CHECK(!sqli_fingerprint_valid("*"));
+CHECK(!sqli_fingerprint_valid("s&1o1o"));
+CHECK(!sqli_fingerprint_valid("sx"));
+apr_array_header_t *extra = apr_array_make(pool, 1, sizeof(const char *));
+APR_ARRAY_PUSH(extra, const char *) = "Enkn";
+CHECK(!sqli_check(set, "select a from b", 15, NULL));
+REQUIRE(sqli_compile(pool, extra, &set) == APR_SUCCESS);
+CHECK(sqli_check(set, "select a from b", 15, NULL));
+APR_ARRAY_PUSH(extra, const char *) = "bad!";
+CHECK(sqli_compile(pool, extra, &set) == APR_EINVAL);
+}
+
+TEST_CASE("verdict cache hash matches the SipHash-2-4 reference vector"){
+unsigned char key[16];
+char data[15];
+for (int i = 0; i < 16; i++)
+  key[i] = i;
+for (int i = 0; i < 15; i++)
+  data[i] = i;
+CHECK(vc_siphash(key, data, 15) == 0xa129ca6149be45e5ull);
+CHECK(vc_siphash(key, data, 0) == 0x726fdb47dd0e0e31ull);
+}
+
+TEST_CASE("verdict cache stores verdicts per rule generation"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+vc_cache_t *cache;
+CHECK(vc_create(pool, 0, &cache) != APR_SUCCESS);
+REQUIRE(vc_create(pool, 64, &cache) == APR_SUCCESS);
+
+apr_uint64_t h = vc_hash(cache, 1, "id=1", 4);
+CHECK(h != vc_hash(cache, 2, "id=1", 4));
+apr_uint32_t verdict = 77;
+CHECK(!vc_get(cache, h, 1, &verdict));
+vc_put(cache, h, 1, 5);
+CHECK(vc_get(cache, h, 1, &verdict));
+CHECK(verdict == 5);
+// После смены поколения правил старое решение не используется
+CHECK(!vc_get(cache, h, 2, &verdict));
+vc_put(cache, h, 2, 0);
+CHECK(vc_get(cache, h, 2, &verdict));
+CHECK(verdict == 0);
+
+vc_stats_t st;
+vc_stats(cache, &st);
+CHECK(st.hits == 2);
+CHECK(st.misses == 2);
+CHECK(st.inserts == 2);
+CHECK(st.evictions == 0);
+CHECK(st.entries == 64);
+}
+
+TEST_CASE("verdict cache evicts entries without recent hits first"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+vc_cache_t *cache;
+// Одна корзина из VC_WAYS записей
+REQUIRE(vc_create(pool, 1, &cache) == APR_SUCCESS);
+apr_uint32_t verdict;
+for (apr_uint64_t h = 1; h <= VC_WAYS; h++)
+  vc_put(cache, h, 1, (apr_uint32_t)h);
+for (apr_uint64_t h = 1; h <= VC_WAYS; h++)
+  CHECK(vc_get(cache, h, 1, &verdict));
+
+// Все записи использовались: стрелка сбрасывает биты и вытесняет первую
+vc_put(cache, 100, 1, 100);
+CHECK(!vc_get(cache, 1, 1, &verdict));
+// Используется только запись 3, поэтому следующими вытесняются 2 и 4
+CHECK(vc_get(cache, 3, 1, &verdict));
+vc_put(cache, 101, 1, 101);
+vc_put(cache, 102, 1, 102);
+CHECK(!vc_get(cache, 2, 1, &verdict));
+CHECK(!vc_get(cache, 4, 1, &verdict));
+CHECK(vc_get(cache, 3, 1, &verdict));
+CHECK(verdict == 3);
+CHECK(vc_get(cache, 100, 1, &verdict));
+CHECK(vc_get(cache, 102, 1, &verdict));
+
+vc_stats_t st;
+vc_stats(cache, &st);
+CHECK(st.evictions == 3);
+CHECK(st.entries == VC_WAYS);
+}
+
+TEST_CASE("cuckoo filter has no false negatives and a low false positive rate"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const int n = 20000;
+cf_filter_t *cf = cf_init(apr_palloc(pool, cf_size(n)), n);
+CHECK(cf_slots(cf) >= n);
+char key[32];
+for (int i = 0; i < n; i++)
+  {
+  int len = snprintf(key, sizeof(key), "user%d", i);
+  REQUIRE(cf_insert(cf, key, len));
+  }
+CHECK(cf_count(cf) == n);
+for (int i = 0; i < n; i++)
+  {
+  int len = snprintf(key, sizeof(key), "user%d", i);
+  REQUIRE(cf_contains(cf, key, len));
+  }
+
+int fp = 0;
+const int probes = 200000;
+for (int i = 0; i < probes; i++)
+  {
+  int len = snprintf(key, sizeof(key), "absent%d", i);
+  fp += cf_contains(cf, key, len);
+  }
+// Ожидаемая доля около cf_fp_rate, с запасом на разброс
+CHECK(cf_fp_rate(cf) > 0);
+CHECK(cf_fp_rate(cf) < 0.0002);
+CHECK((double)fp / probes < 3 * cf_fp_rate(cf) + 0.00005);
+}
+
+TEST_CASE("cuckoo filter removes logins and keeps duplicates"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+const int n = 5000;
+cf_filter_t *cf = cf_init(apr_palloc(pool, cf_size(n)), n);
+char key[32];
+for (int i = 0; i < n; i++)
+  REQUIRE(cf_insert(cf, key, snprintf(key, sizeof(key), "user%d", i)));
+for (int i = 0; i < n; i += 2)
+  CHECK(cf_remove(cf, key, snprintf(key, sizeof(key), "user%d", i)));
+CHECK(cf_count(cf) == n / 2);
+
+int still = 0;
+for (int i = 0; i < n; i++)
+  {
+  int len = snprintf(key, sizeof(key), "user%d", i);
+  if (i % 2)
+    REQUIRE(cf_contains(cf, key, len));
+  else
+    still += cf_contains(cf, key, len);
+  }
+CHECK(still < 5);
+
+CHECK(cf_insert(cf, "admin", 5));
+CHECK(cf_insert(cf, "admin", 5));
+CHECK(cf_remove(cf, "admin", 5));
+CHECK(cf_contains(cf, "admin", 5));
+CHECK(cf_remove(cf, "admin", 5));
+cf_clear(cf);
+CHECK(cf_count(cf) == 0);
+CHECK(!cf_contains(cf, "user1", 5));
+}
+
+TEST_CASE("cuckoo filter refuses inserts when full without losing logins"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+cf_filter_t *cf = cf_init(apr_palloc(pool, cf_size(64)), 64);
+char key[32];
+int added = 0;
+while (cf_insert(cf, key, snprintf(key, sizeof(key), "user%d", added)))
+  added++;
+CHECK(added >= 64);
+CHECK(added <= (int)cf_slots(cf) + 1);
+for (int i = 0; i < added; i++)
+  REQUIRE(cf_contains(cf, key, snprintf(key, sizeof(key), "user%d", i)));
+
+// После удаления отложенный отпечаток возвращается в корзину, и вставки снова возможны
+for (int i = 0; i < 8; i++)
+  CHECK(cf_remove(cf, key, snprintf(key, sizeof(key), "user%d", i)));
+for (int i = 8; i < added; i++)
+  REQUIRE(cf_contains(cf, key, snprintf(key, sizeof(key), "user%d", i)));
+CHECK(cf_insert(cf, "admin", 5));
+CHECK(cf_contains(cf, "admin", 5));
+}
+
+TEST_CASE("user snapshot finds logins with matching password"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+char path[] = "/tmp/app_snapshot_test.XXXXXX";
+close(mkstemp(path));
+
+const int n = 1000;
+snap_entry_t *entries = (snap_entry_t *)apr_pcalloc(pool, (n + 1) * sizeof(snap_entry_t));
+for (int i = 0; i < n; i++)
+  {
+  entries[i].login = apr_psprintf(pool, "user%d", i);
+  entries[i].name = apr_psprintf(pool, "User %d", i);
+  const char *pass = apr_psprintf(pool, "pass%d", i);
+  SHA256((const unsigned char *)pass, strlen(pass), entries[i].digest);
+  }
+// Логины в таблице users не уникальны: проверяются все записи с тем же логином
+entries[n].login = "user7";
+entries[n].name = "Second user 7";
+SHA256((const unsigned char *)"other", 5, entries[n].digest);
+REQUIRE(snap_write(pool, path, entries, n + 1) == APR_SUCCESS);
+
+snap_t *snap;
+REQUIRE(snap_open(pool, path, &snap) == APR_SUCCESS);
+CHECK(snap_count(snap) == n + 1);
+for (int i = 0; i < n; i++)
+  {
+  const char *name = snap_lookup(snap, entries[i].login, entries[i].digest);
+  REQUIRE(name);
+  CHECK(strcmp(name, entries[i].name) == 0);
+  }
+CHECK(strcmp(snap_lookup(snap, "user7", entries[n].digest), "Second user 7") == 0);
+CHECK(!snap_lookup(snap, "user1", entries[2].digest));
+CHECK(!snap_lookup(snap, "nobody", entries[2].digest));
+CHECK(!snap_lookup(snap, "", entries[2].digest));
+CHECK(!snap_changed(snap, path));
+
+// Новый снимок заменяет файл, открытый снимок продолжает читать прежний
+REQUIRE(snap_write(pool, path, entries, 10) == APR_SUCCESS);
+CHECK(snap_changed(snap, path));
+CHECK(snap_lookup(snap, "user500", entries[500].digest));
+snap_t *fresh;
+REQUIRE(snap_open(pool, path, &fresh) == APR_SUCCESS);
+CHECK(snap_count(fresh) == 10);
+CHECK(!snap_lookup(fresh, "user500", entries[500].digest));
+unlink(path);
+}
+
+TEST_CASE("user snapshot rejects damaged files"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+char path[] = "/tmp/app_snapshot_test.XXXXXX";
+close(mkstemp(path));
+snap_t *snap;
+CHECK(snap_open(pool, path, &snap) == APR_EINVAL);
+
+snap_entry_t entry = {"admin", {0}, "Super Administrator"};
+REQUIRE(snap_write(pool, path, &entry, 1) == APR_SUCCESS);
+REQUIRE(snap_open(pool, path, &snap) == APR_SUCCESS);
+struct stat st;
+REQUIRE(stat(path, &st) == 0);
+
+// Обрезанный файл
+REQUIRE(truncate(path, st.st_size - 1) == 0);
+CHECK(snap_open(pool, path, &snap) == APR_EINVAL);
+
+// Смещение имени за пределами файла: заголовок 32 байта, места по 48 байт
+REQUIRE(snap_write(pool, path, &entry, 1) == APR_SUCCESS);
+FILE *f = fopen(path, "r+b");
+REQUIRE(f);
+for (long offset = 32; offset < 32 + 2 * 48; offset += 48)
+  {
+  apr_uint32_t slot[4];
+  fseek(f, offset, SEEK_SET);
+  REQUIRE(fread(slot, sizeof(slot), 1, f) == 1);
+  if (!slot[0])
+    continue;
+  slot[3] = 0x7fffffff;
+  fseek(f, offset, SEEK_SET);
+  fwrite(slot, sizeof(slot), 1, f);
+  }
+fclose(f);
+CHECK(snap_open(pool, path, &snap) == APR_EINVAL);
+unlink(path);
+}
+
+TEST_CASE("session HMAC matches RFC 4231 vectors"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+unsigned char mac[SESSION_MAC_LEN];
+char hex[SESSION_MAC_LEN * 2 + 1];
+session_key_t key, long_key_mac;
+
+REQUIRE(session_key_init(&key, pool, (const unsigned char *)"Jefe", 4) == APR_SUCCESS);
+const char *data = "what do ya want for nothing?";
+REQUIRE(session_mac(&key, data, strlen(data), mac) == APR_SUCCESS);
+for (int i = 0; i < SESSION_MAC_LEN; i++)
+  sprintf(hex + i * 2, "%02x", mac[i]);
+CHECK(strcmp(hex, "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843") == 0);
+
+// Ключ длиннее блока SHA-256
+unsigned char long_key[131];
+memset(long_key, 0xaa, sizeof(long_key));
+REQUIRE(session_key_init(&long_key_mac, pool, long_key, sizeof(long_key)) == APR_SUCCESS);
+data = "Test Using Larger Than Block-Size Key - Hash Key First";
+REQUIRE(session_mac(&long_key_mac, data, strlen(data), mac) == APR_SUCCESS);
+for (int i = 0; i < SESSION_MAC_LEN; i++)
+  sprintf(hex + i * 2, "%02x", mac[i]);
+CHECK(strcmp(hex, "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54") == 0);
+apr_pool_destroy(pool);
+}
+
+typedef struct {
+  const session_key_t *key;
+  const unsigned char *expected;
+  int mismatches;
+} session_thread_t;
+
+// Подписывает в своем потоке одни и те же данные, подпись должна совпадать с полученной в главном потоке
+static void *session_thread(void *arg)
+{
+  session_thread_t *st = (session_thread_t *)arg;
+  unsigned char mac[SESSION_MAC_LEN];
+  const char *data = "what do ya want for nothing?";
+  for (int i = 0; i < 1000; i++)
+    if (session_mac(st->key, data, strlen(data), mac) != APR_SUCCESS || memcmp(mac, st->expected, SESSION_MAC_LEN) != 0)
+      st->mismatches++;
+  return NULL;
+}
+
+TEST_CASE("session HMAC keeps a separate EVP context per thread"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+session_key_t key;
+REQUIRE(session_key_init(&key, pool, (const unsigned char *)"Jefe", 4) == APR_SUCCESS);
+unsigned char expected[SESSION_MAC_LEN];
+const char *data = "what do ya want for nothing?";
+REQUIRE(session_mac(&key, data, strlen(data), expected) == APR_SUCCESS);
+
+pthread_t threads[8];
+session_thread_t st[8];
+for (int i = 0; i < 8; i++)
+  {
+  st[i].key = &key;
+  st[i].expected = expected;
+  st[i].mismatches = 0;
+  REQUIRE(pthread_create(&threads[i], NULL, session_thread, &st[i]) == 0);
+  }
+for (int i = 0; i < 8; i++)
+  {
+  pthread_join(threads[i], NULL);
+  CHECK(st[i].mismatches == 0);
+  }
+apr_pool_destroy(pool);
+}
+
+TEST_CASE("session cookie is accepted until it expires and only unmodified"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+session_key_t key, other;
+REQUIRE(session_key_init(&key, pool, (const unsigned char *)"0123456789abcdef0123456789abcdef", 32) == APR_SUCCESS);
+REQUIRE(session_key_init(&other, pool, (const unsigned char *)"0123456789abcdef0123456789abcdeF", 32) == APR_SUCCESS);
+
+apr_time_t now = apr_time_from_sec(1700000000);
+const char *login, *name;
+const char *logins[] = {"admin", "a", "ab", "abc", "O'Brien", "user.name"};
+for (int i = 0; i < 6; i++)
+  {
+  const char *value = session_sign(pool, &key, now + apr_time_from_sec(60), logins[i], "Таня Хафизова.");
+  REQUIRE(session_verify(pool, &key, value, now, &login, &name) == APR_SUCCESS);
+  CHECK(strcmp(login, logins[i]) == 0);
+  CHECK(strcmp(name, "Таня Хафизова.") == 0);
+  CHECK(strspn(value, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.") == strlen(value));
+  }
+
+const char *value = session_sign(pool, &key, now + apr_time_from_sec(60), "admin", "Super Administrator");
+CHECK(session_verify(pool, &key, value, now + apr_time_from_sec(60), &login, &name) == APR_EINVAL);
+CHECK(session_verify(pool, &other, value, now, &login, &name) == APR_EINVAL);
+CHECK(session_verify(pool, &key, "", now, &login, &name) == APR_EINVAL);
+CHECK(session_verify(pool, &key, "1.2.3", now, &login, &name) == APR_EINVAL);
+
+// Любой измененный символ, в том числе в сроке действия, делает значение недействительным
+for (size_t i = 0; value[i]; i++)
+  {
+  char *changed = apr_pstrdup(pool, value);
+  changed[i] = changed[i] == 'A' ? 'B' : 'A';
+  CHECK(session_verify(pool, &key, changed, now, &login, &name) == APR_EINVAL);
+  }
+CHECK(session_verify(pool, &key, apr_pstrcat(pool, "9", value, NULL), now, &login, &name) == APR_EINVAL);
+}
+
+TEST_CASE("hash_sha256 matches one-shot SHA256 with and without a thread context"){
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+unsigned char data[300], digest[HASH_LEN], expected[HASH_LEN];
+for (int i = 0; i < 300; i++)
+  data[i] = i * 31 + 7;
+
+for (int pass = 0; pass < 2; pass++)
+  {
+  for (int len = 0; len < 300; len += 13)
+    {
+    hash_sha256(data, len, digest);
+    SHA256(data, len, expected);
+    CHECK(memcmp(digest, expected, HASH_LEN) == 0);
+    // Та же строка, разделенная на префикс и остаток
+    hash_sha256_prefixed(data, len / 3, data + len / 3, len - len / 3, digest);
+    CHECK(memcmp(digest, expected, HASH_LEN) == 0);
+    }
+  REQUIRE(hash_init(pool) == APR_SUCCESS);
+  }
+apr_pool_destroy(pool);
+}
+
+TEST_CASE("batch hashing gives the same digests in every lane"){
+static unsigned char data[1024];
+for (int i = 0; i < 1024; i++)
+  data[i] = i * 7 + 1;
+
+// Длины вокруг границ блока: 55 байт - последняя длина с дополнением в одном блоке, 56 - уже в двух
+hash_input_t inputs[41];
+unsigned char digests[41 * HASH_LEN], expected[HASH_LEN];
+for (int level = HASH_MB_EVP; level < HASH_MB_LEVELS; level++)
+  {
+  hash_many_fn many = hash_mb_select(level);
+  if (!many)
+    continue;
+
+  for (int count = 0; count <= 41; count++)
+    {
+    for (int i = 0; i < count; i++)
+      {
+      static const int lens[] = {0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 700};
+      inputs[i].data = data + i;
+      inputs[i].len = i < 11 ? lens[(i + count) % 11] : (i * 53 + count * 11) % 300;
+      }
+    many(inputs, count, digests);
+    for (int i = 0; i < count; i++)
+      {
+      SHA256((const unsigned char *)inputs[i].data, inputs[i].len, expected);
+      CHECK_MESSAGE(memcmp(digests + i * HASH_LEN, expected, HASH_LEN) == 0, hash_mb_level_name(level), " count ", count, " lane ", i);
+      }
+    }
+  }
+
+hash_sha256_many(inputs, 41, digests);
+for (int i = 0; i < 41; i++)
+  {
+  SHA256((const unsigned char *)inputs[i].data, inputs[i].len, expected);
+  CHECK(memcmp(digests + i * HASH_LEN, expected, HASH_LEN) == 0);
+  }
+}
+
+TEST_CASE("scrypt parameters and records"){
+kdf_params_t params;
+CHECK(kdf_parse("scrypt:14:8:1", &params) == NULL);
+CHECK(params.log_n == 14);
+CHECK(params.r == 8);
+CHECK(params.p == 1);
+CHECK(kdf_parse("SCRYPT:10:1:2", &params) == NULL);
+CHECK(kdf_parse("argon2:14:8:1", &params) != NULL);
+CHECK(kdf_parse("scrypt:14:8", &params) != NULL);
+CHECK(kdf_parse("scrypt:14:8:1:", &params) != NULL);
+CHECK(kdf_parse("scrypt:0:8:1", &params) != NULL);
+CHECK(kdf_parse("scrypt:25:8:1", &params) != NULL);
+CHECK(kdf_parse("scrypt:24:8:1", &params) != NULL);
+CHECK(kdf_parse("scrypt:14:0:1", &params) != NULL);
+
+// Пример из RFC 7914: scrypt("password", "NaCl", N = 1024, r = 8, p = 16), первые 32 байта ключа
+kdf_params_t rfc = {10, 8, 16};
+unsigned char key[32];
+REQUIRE(kdf_derive(&rfc, "password", 8, (const unsigned char *)"NaCl", 4, key, sizeof(key)) == APR_SUCCESS);
+static const unsigned char expected[32] = {
+  0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00, 0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe,
+  0x7c, 0x6a, 0xd7, 0xcb, 0xc8, 0x23, 0x78, 0x30, 0xe7, 0x73, 0x76, 0x63, 0x4b, 0x37, 0x31, 0x62};
+CHECK(memcmp(key, expected, sizeof(key)) == 0);
+
+kdf_params_t fast = {8, 8, 1};
+unsigned char record[KDF_RECORD_LEN], other[KDF_RECORD_LEN];
+REQUIRE(kdf_record(&fast, "secret", 6, record) == APR_SUCCESS);
+REQUIRE(kdf_record(&fast, "secret", 6, other) == APR_SUCCESS);
+CHECK(record[0] == KDF_TAG_SCRYPT);
+CHECK(record[1] == 8);
+// Соль случайная: записи одного пароля различаются
+CHECK(memcmp(record + 4, other + 4, KDF_RECORD_LEN - 4) != 0);
+CHECK(kdf_is_record(record, KDF_RECORD_LEN));
+CHECK(kdf_verify(record, "secret", 6));
+CHECK(kdf_verify(other, "secret", 6));
+CHECK(!kdf_verify(record, "Secret", 6));
+CHECK(!kdf_verify(record, "secret", 5));
+
+CHECK(!kdf_is_record(record, 32));
+CHECK(!kdf_is_record(record, KDF_RECORD_LEN - 1));
+memcpy(other, record, KDF_RECORD_LEN);
+other[0] = 'x';
+CHECK(!kdf_is_record(other, KDF_RECORD_LEN));
+other[0] = KDF_TAG_SCRYPT;
+other[1] = 60;
+CHECK(!kdf_is_record(other, KDF_RECORD_LEN));
+other[1] = 8;
+other[2] = 0;
+CHECK(!kdf_is_record(other, KDF_RECORD_LEN));
+}
+
+static void *kdf_pool_waiter(void *arg)
+{
+  return (void *)(long)kdf_pool_enter((kdf_pool_t *)arg, apr_time_from_sec(5));
+}
+
+TEST_CASE("scrypt pool admits, queues and rejects"){
+static char mem[1024];
+REQUIRE(kdf_pool_size() <= sizeof(mem));
+kdf_pool_t *pool = kdf_pool_init(mem, 2, 1);
+REQUIRE(pool);
+
+kdf_pool_stats_t st;
+CHECK(kdf_pool_enter(pool, 0) == APR_SUCCESS);
+CHECK(kdf_pool_try_enter(pool));
+CHECK(!kdf_pool_try_enter(pool));
+kdf_pool_stats(pool, &st);
+CHECK(st.running == 2);
+CHECK(st.admitted == 2);
+
+// Слотов нет, место в очереди свободно: ожидание заканчивается по времени
+CHECK(kdf_pool_enter(pool, apr_time_from_msec(20)) == APR_TIMEUP);
+
+// Место в очереди занято ожидающим потоком: следующий запрос получает отказ сразу
+pthread_t waiter;
+REQUIRE(pthread_create(&waiter, NULL, kdf_pool_waiter, pool) == 0);
+for (int i = 0; i < 1000; i++)
+  {
+  kdf_pool_stats(pool, &st);
+  if (st.waiting)
+    break;
+  usleep(1000);
+  }
+CHECK(st.waiting == 1);
+CHECK(kdf_pool_enter(pool, apr_time_from_sec(5)) == APR_EBUSY);
+
+// Освобожденный слот достается ожидающему
+kdf_pool_leave(pool);
+void *result;
+pthread_join(waiter, &result);
+CHECK((apr_status_t)(long)result == APR_SUCCESS);
+
+kdf_pool_stats(pool, &st);
+CHECK(st.running == 2);
+CHECK(st.waiting == 0);
+CHECK(st.admitted == 3);
+CHECK(st.queued == 1);
+CHECK(st.rejected == 1);
+CHECK(st.timeouts == 1);
+
+kdf_pool_leave(pool);
+kdf_pool_leave(pool);
+kdf_pool_stats(pool, &st);
+CHECK(st.running == 0);
+}
+
+TEST_CASE("query string parser decodes only wanted parameters"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+static const char *const names[] = {"user", "pass"};
+const char *values[2];
+param_spec_t spec = {names, 2, NULL, values, NULL};
+
+values[0] = values[1] = NULL;
+CHECK(params_query(pool, "a=1&user=admin&b=2&pass=p%40ss+word&c=3", &spec));
+CHECK(strcmp(values[0], "admin") == 0);
+CHECK(strcmp(values[1], "p@ss word") == 0);
+
+// Первое значение остается, имена без учета регистра и закодированные, разделитель ;
+values[0] = values[1] = NULL;
+CHECK(!params_query(pool, "USER=first;user=second;x", &spec));
+CHECK(strcmp(values[0], "first") == 0);
+CHECK(values[1] == NULL);
+values[0] = values[1] = NULL;
+CHECK(params_query(pool, "%75ser=u&pa%73s&zz=%", &spec));
+CHECK(strcmp(values[0], "u") == 0);
+CHECK(strcmp(values[1], "") == 0);
+
+// Неверные %XX остаются как есть, в том числе в конце строки
+values[0] = values[1] = NULL;
+CHECK(!params_query(pool, "user=%zz%4&&=&usr=1&pass%=2", &spec));
+CHECK(strcmp(values[0], "%zz%4") == 0);
+CHECK(values[1] == NULL);
+values[0] = values[1] = NULL;
+CHECK(!params_query(pool, "", &spec));
+CHECK(!params_complete(&spec));
+
+// Декодированное имя из другого парсера
+values[0] = values[1] = NULL;
+CHECK(!params_put(&spec, "user", 4, "a", 1));
+CHECK(!params_put(&spec, "other", 5, "b", 1));
+CHECK(params_put(&spec, "Pass", 4, "c", 1));
+CHECK(strcmp(values[1], "c") == 0);
+apr_pool_destroy(pool);
+}
+
+static int count_params(const param_spec_t *spec, int key, const char *value, apr_size_t len)
+{
+  int *counts = (int *)spec->ctx;
+  counts[key]++;
+  counts[2] += len;
+  return counts[key] == 3;
+}
+
+TEST_CASE("query string parser stops when the callback is satisfied"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+static const char *const names[] = {"user", "pass"};
+int counts[3] = {0, 0, 0};
+param_spec_t spec = {names, 2, count_params, NULL, counts};
+CHECK(params_query(pool, "user=a&pass=bb&user=ccc&pass&user=d&user=e", &spec));
+CHECK(counts[0] == 3);
+CHECK(counts[1] == 2);
+CHECK(counts[2] == 1 + 2 + 3 + 0 + 1);
+apr_pool_destroy(pool);
+}
+
+// Разбирает body потоково порциями по step байт
+static apr_status_t stream_parse(apr_pool_t *pool, const char *body, apr_size_t step, const param_spec_t *spec, apr_size_t value_max)
+{
+  params_stream_t ps;
+  params_stream_init(&ps, pool, spec, value_max);
+  apr_size_t len = strlen(body);
+  for (apr_size_t i = 0; i < len; i += step)
+    {
+    apr_status_t rv = params_stream_feed(&ps, body + i, len - i < step ? len - i : step);
+    if (rv != APR_SUCCESS)
+      return rv;
+    }
+  return params_stream_end(&ps);
+}
+
+TEST_CASE("streaming body parser gives the same values for any chunking"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+static const char *const names[] = {"user", "pass"};
+const char *values[2], *expected[2];
+param_spec_t spec = {names, 2, NULL, values, NULL};
+
+static const char *bodies[] = {
+  "user=admin&pass=p%40ss+word",
+  "skip=a%26b&us%65r=x%zz&junk;pass",
+  "a=1&user=&pass=2&user=3",
+  "pass=only",
+  "&&=&user",
+  "",
+};
+for (unsigned b = 0; b < sizeof(bodies) / sizeof(bodies[0]); b++)
+  {
+  expected[0] = expected[1] = NULL;
+  param_spec_t query = {names, 2, NULL, expected, NULL};
+  params_query(pool, bodies[b], &query);
+  for (apr_size_t step = 1; step <= strlen(bodies[b]) + 1; step++)
+    {
+    values[0] = values[1] = NULL;
+    apr_status_t rv = stream_parse(pool, bodies[b], step, &spec, 1000);
+    CHECK(rv == (params_complete(&spec) ? APR_EOF : APR_SUCCESS));
+    for (int k = 0; k < 2; k++)
+      {
+      CHECK_MESSAGE((values[k] == NULL) == (expected[k] == NULL), bodies[b], " step ", step);
+      if (values[k] && expected[k])
+        CHECK_MESSAGE(strcmp(values[k], expected[k]) == 0, bodies[b], " step ", step);
+      }
+    }
+  }
+
+// Длинное значение ненужного параметра пропускается без ограничения, а искомого - ограничено
+values[0] = values[1] = NULL;
+char *body = apr_pstrcat(pool, "junk=", apr_pstrndup(pool, "................................................................", 64), "&user=12345678&pass=1", NULL);
+CHECK(stream_parse(pool, body, 7, &spec, 8) == APR_EOF);
+CHECK(strcmp(values[0], "12345678") == 0);
+values[0] = values[1] = NULL;
+CHECK(stream_parse(pool, body, 7, &spec, 7) == APR_ENOSPC);
+
+// Имя длиннее PARAM_NAME_MAX не может быть искомым и пропускается вместе со значением
+values[0] = values[1] = NULL;
+char name[PARAM_NAME_MAX + 10];
+memset(name, 'u', sizeof(name) - 1);
+name[sizeof(name) - 1] = 0;
+body = apr_pstrcat(pool, name, "=1&user=u&pass=p", NULL);
+CHECK(stream_parse(pool, body, 100, &spec, 100) == APR_EOF);
+CHECK(strcmp(values[0], "u") == 0);
+
+// После того как все найдено, разбор прекращается: остаток не смотрится
+values[0] = values[1] = NULL;
+params_stream_t ps;
+params_stream_init(&ps, pool, &spec, 100);
+CHECK(params_stream_feed(&ps, "user=a&pass=b&", 14) == APR_EOF);
+CHECK(params_stream_feed(&ps, "user=c", 6) == APR_EOF);
+CHECK(strcmp(values[0], "a") == 0);
+apr_pool_destroy(pool);
+}
+
+// Разбирает JSON порциями по step байт
+static apr_status_t json_parse(apr_pool_t *pool, const char *body, apr_size_t step, const param_spec_t *spec, apr_size_t value_max)
+{
+  params_body_t pb;
+  params_body_init(&pb, PARAMS_JSON, pool, spec, value_max);
+  apr_size_t len = strlen(body);
+  for (apr_size_t i = 0; i < len; i += step)
+    {
+    apr_status_t rv = params_body_feed(&pb, body + i, len - i < step ? len - i : step);
+    if (rv != APR_SUCCESS)
+      return rv;
+    }
+  return params_body_end(&pb);
+}
+
+TEST_CASE("JSON parser extracts top-level members for any chunking"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+static const char *const names[] = {"user", "pass"};
+const char *values[2];
+param_spec_t spec = {names, 2, NULL, values, NULL};
+
+struct {
+  const char *body;
+  apr_status_t rv;
+  const char *user;
+  const char *pass;
+} cases[] = {
+  {"{\"user\":\"admin\",\"pass\":\"secret\"}", APR_EOF, "admin", "secret"},
+  {" { \"skip\" : [1, {\"user\": \"no\"}, \"x\\\"y\"], \"user\" : \"a\\\"b\\\\c\\/\\n\" , \"pass\" : 12.5e+1 } ", APR_EOF, "a\"b\\c/\n", "12.5e+1"},
+  {"{\"us\\u0065r\":\"\\u00e9\\u4e2d\\ud83d\\ude00\\ud800x\",\"pass\":true}", APR_EOF, "\xc3\xa9\xe4\xb8\xad\xf0\x9f\x98\x80\xef\xbf\xbd" "x", "true"},
+  {"{\"user\":null,\"pass\":\"p\",\"user\":\"late\"}", APR_EOF, "late", "p"},
+  {"{\"user\":{\"pass\":\"nested\"},\"x\":[]}", APR_SUCCESS, NULL, NULL},
+  {"[{\"user\":\"u1\"},{\"pass\":\"p1\"}]", APR_EOF, "u1", "p1"},
+  {"[[{\"user\":\"deep\"}]]", APR_SUCCESS, NULL, NULL},
+  {"\"user\"", APR_SUCCESS, NULL, NULL},
+  {"{}", APR_SUCCESS, NULL, NULL},
+  {"{\"user\":\"a\"", APR_EINVAL, "a", NULL},
+  {"{\"user\" \"a\"}", APR_EINVAL, NULL, NULL},
+  {"{\"user\":\"a\",}", APR_EINVAL, "a", NULL},
+  {"{\"user\":tru}", APR_EINVAL, NULL, NULL},
+  {"{\"user\":\"a\\q\"}", APR_EINVAL, NULL, NULL},
+  {"{\"user\":\"a\tb\"}", APR_EINVAL, NULL, NULL},
+  {"{} {}", APR_EINVAL, NULL, NULL},
+  {"", APR_EINVAL, NULL, NULL},
+};
+for (unsigned c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+  {
+  for (apr_size_t step = 1; step <= strlen(cases[c].body) + 1; step++)
+    {
+    values[0] = values[1] = NULL;
+    CHECK_MESSAGE(json_parse(pool, cases[c].body, step, &spec, 100) == cases[c].rv, cases[c].body, " step ", step);
+    if (cases[c].rv == APR_EINVAL)
+      continue;
+    CHECK_MESSAGE((values[0] ? strcmp(values[0], cases[c].user) == 0 : !cases[c].user), cases[c].body, " step ", step);
+    CHECK_MESSAGE((values[1] ? strcmp(values[1], cases[c].pass) == 0 : !cases[c].pass), cases[c].body, " step ", step);
+    }
+  }
+
+// Вложенность больше PARAMS_JSON_DEPTH - ошибка, длинное значение искомого члена - APR_ENOSPC
+char deep[PARAMS_JSON_DEPTH + 2];
+memset(deep, '[', sizeof(deep) - 1);
+deep[sizeof(deep) - 1] = 0;
+CHECK(json_parse(pool, deep, 10, &spec, 100) == APR_EINVAL);
+CHECK(json_parse(pool, deep + 2, 10, &spec, 100) == APR_EINVAL);
+CHECK(json_parse(pool, "{\"user\":\"123456789\"}", 3, &spec, 8) == APR_ENOSPC);
+CHECK(json_parse(pool, "{\"junk\":\"123456789\",\"user\":\"12345678\",\"pass\":1}", 3, &spec, 8) == APR_EOF);
+apr_pool_destroy(pool);
+}
+
+// Записывает найденные параметры по порядку в строку вида user=a;pass=b;|, где | - конец записи
+static int json_pairs(const param_spec_t *spec, int key, const char *value, apr_size_t len)
+{
+  char *out = (char *)spec->ctx;
+  if (key == PARAM_RECORD_END)
+    snprintf(out + strlen(out), 256 - strlen(out), "|");
+  else
+    snprintf(out + strlen(out), 256 - strlen(out), "%s=%s;", spec->names[key], value);
+  return false;
+}
+
+TEST_CASE("JSON parser delivers batch members in order"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+static const char *const names[] = {"user", "pass"};
+char out[256] = "";
+param_spec_t spec = {names, 2, json_pairs, NULL, out};
+CHECK(json_parse(pool, "[{\"user\":\"a\",\"pass\":\"1\",\"x\":{\"user\":\"no\"}},{\"pass\":2,\"user\":\"b\"},7,\"s\"]", 5, &spec, 100) == APR_SUCCESS);
+CHECK(strcmp(out, "user=a;pass=1;|pass=2;user=b;|") == 0);
+out[0] = 0;
+CHECK(json_parse(pool, "{\"pass\":\"p\",\"user\":\"u\"}", 3, &spec, 100) == APR_SUCCESS);
+CHECK(strcmp(out, "pass=p;user=u;|") == 0);
+apr_pool_destroy(pool);
+}
+
+TEST_CASE("batch pairs keep user and pass of one JSON object together"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+static const char *const names[] = {"user", "pass"};
+
+struct {
+  const char *body;
+  const char *pairs;
+} cases[] = {
+  {"[{\"pass\":\"p1\",\"user\":\"a\"},{\"pass\":\"p2\",\"user\":\"b\"}]", "a=p1;b=p2;"},
+  {"[{\"user\":\"a\",\"pass\":\"p1\"},{\"pass\":\"p2\"},{\"user\":\"b\"},{\"x\":1,\"pass\":\"p3\",\"user\":\"c\"}]", "a=p1;b=-;c=p3;"},
+  {"[{\"user\":\"a\"},{\"pass\":\"p1\"}]", "a=-;"},
+  {"{\"pass\":\"p\",\"user\":\"u\"}", "u=p;"},
+};
+for (unsigned c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+  {
+  for (apr_size_t step = 1; step <= strlen(cases[c].body); step++)
+    {
+    param_pairs_t pairs;
+    params_pairs_init(&pairs, pool, 10);
+    param_spec_t spec = {names, 2, params_pairs_fn, NULL, &pairs};
+    CHECK(json_parse(pool, cases[c].body, step, &spec, 100) != APR_EINVAL);
+    char out[256] = "";
+    for (int i = 0; i < pairs.pairs->nelts; i++)
+      {
+      param_pair_t *pair = &APR_ARRAY_IDX(pairs.pairs, i, param_pair_t);
+      snprintf(out + strlen(out), sizeof(out) - strlen(out), "%s=%s;", pair->first, pair->second ? pair->second : "-");
+      }
+    CHECK_MESSAGE(strcmp(out, cases[c].pairs) == 0, cases[c].body, " step ", step, " got ", out);
+    }
+  }
+
+// В форме pass относится к ближайшему предыдущему user
+param_pairs_t pairs;
+params_pairs_init(&pairs, pool, 2);
+param_spec_t spec = {names, 2, params_pairs_fn, NULL, &pairs};
+params_query(pool, "user=a&pass=1&pass=2&user=b&pass=3&user=c", &spec);
+CHECK(pairs.too_many);
+CHECK(pairs.pairs->nelts == 2);
+CHECK(strcmp(APR_ARRAY_IDX(pairs.pairs, 0, param_pair_t).second, "1") == 0);
+CHECK(strcmp(APR_ARRAY_IDX(pairs.pairs, 1, param_pair_t).second, "3") == 0);
+apr_pool_destroy(pool);
+}
+
+// Разбирает multipart с границей boundary порциями по step байт
+static apr_status_t multipart_parse(apr_pool_t *pool, const char *body, const char *boundary, apr_size_t step,
+                                   const param_spec_t *spec, apr_size_t value_max)
+{
+  params_body_t pb;
+  params_body_init(&pb, PARAMS_MULTIPART, pool, spec, value_max, boundary);
+  apr_size_t len = strlen(body);
+  for (apr_size_t i = 0; i < len; i += step)
+    {
+    apr_status_t rv = params_body_feed(&pb, body + i, len - i < step ? len - i : step);
+    if (rv != APR_SUCCESS)
+      return rv;
+    }
+  return params_body_end(&pb);
+}
+
+TEST_CASE("multipart parser finds form fields across part and chunk boundaries"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+static const char *const names[] = {"user", "pass"};
+const char *values[2];
+param_spec_t spec = {names, 2, NULL, values, NULL};
+
+CHECK(strcmp(params_multipart_boundary(pool, "multipart/form-data; boundary=----WebKitFormBoundaryX7"), "----WebKitFormBoundaryX7") == 0);
+CHECK(strcmp(params_multipart_boundary(pool, "multipart/form-data;charset=utf-8; BOUNDARY=\"a b;c\""), "a b;c") == 0);
+CHECK(params_multipart_boundary(pool, "multipart/form-data") == NULL);
+CHECK(params_multipart_boundary(pool, "multipart/form-data; boundary=") == NULL);
+CHECK(params_multipart_boundary(pool, "multipart/form-data; boundary=\"unterminated") == NULL);
+
+struct {
+  const char *body;
+  apr_status_t rv;
+  const char *user;
+  const char *pass;
+} cases[] = {
+  {"--XyZ\r\nContent-Disposition: form-data; name=\"user\"\r\n\r\nadmin\r\n"
+   "--XyZ\r\nContent-Disposition: form-data; name=\"pass\"\r\nContent-Type: text/plain\r\n\r\nse\r\ncr\r\n--Xy\r\n--XyZ--\r\n",
+   APR_EOF, "admin", "se\r\ncr\r\n--Xy"},
+  // Преамбула, файл с именем user, поле с пустым значением, эпилог
+  {"preamble\r\n--XyZ \r\ncontent-disposition: form-data; name=user; filename=\"a;name=pass\"\r\n\r\n\r\r\n\r\n--XyZ\r\n"
+   "Content-Disposition: form-data; name=\"USER\"\r\n\r\nu\r\n--XyZ\r\nContent-Disposition: form-data; name=\"other\"\r\n\r\nx\r\n"
+   "--XyZ\r\nContent-Disposition: form-data; name=\"pass\"\r\n\r\n\r\n--XyZ--\r\nepilogue",
+   APR_EOF, "u", ""},
+  {"--XyZ\r\nContent-Disposition: form-data; name=\"user\"\r\n\r\nadmin\r\n--XyZ--", APR_SUCCESS, "admin", NULL},
+  {"--XyZ--", APR_SUCCESS, NULL, NULL},
+  {"--XyZ\r\nContent-Disposition: form-data; name=\"user\"\r\n\r\nadmin\r\n--XyZ", APR_EINVAL, NULL, NULL},
+  {"--XyZ\r\nContent-Disposition: form-data; name=\"user\"\r\n\r\nadmin", APR_EINVAL, NULL, NULL},
+  {"--XyZx\r\n\r\n--XyZ--", APR_EINVAL, NULL, NULL},
+  {"--XyZ-x", APR_EINVAL, NULL, NULL},
+  {"no boundary at all", APR_EINVAL, NULL, NULL},
+  {"", APR_EINVAL, NULL, NULL},
+};
+for (unsigned c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+  {
+  for (apr_size_t step = 1; step <= strlen(cases[c].body) + 1; step++)
+    {
+    values[0] = values[1] = NULL;
+    CHECK_MESSAGE(multipart_parse(pool, cases[c].body, "XyZ", step, &spec, 100) == cases[c].rv, cases[c].body, " step ", step);
+    if (cases[c].rv == APR_EINVAL)
+      continue;
+    CHECK_MESSAGE((values[0] ? strcmp(values[0], cases[c].user) == 0 : !cases[c].user), cases[c].body, " step ", step);
+    CHECK_MESSAGE((values[1] ? strcmp(values[1], cases[c].pass) == 0 : !cases[c].pass), cases[c].body, " step ", step);
+    }
+  }
+
+// Большой файл с обрывками разделителя пропускается, длинное значение искомого поля - APR_ENOSPC
+char *body = (char *)apr_palloc(pool, 70000);
+char *p = body + sprintf(body, "--XyZ\r\nContent-Disposition: form-data; name=\"f\"; filename=\"a.bin\"\r\n\r\n");
+static const char junk[] = "\r\n--Xy\r\n--XyQ\r\r\n-";
+for (int i = 0; i < 65536; i++)
+  *p++ = junk[i % (sizeof(junk) - 1)];
+strcpy(p, "\r\n--XyZ\r\nContent-Disposition: form-data; name=\"user\"\r\n\r\nu\r\n--XyZ\r\nContent-Disposition: form-data; name=\"pass\"\r\n\r\np\r\n--XyZ--");
+for (apr_size_t step = 1000; step < 9000; step += 997)
+  {
+  values[0] = values[1] = NULL;
+  CHECK(multipart_parse(pool, body, "XyZ", step, &spec, 100) == APR_EOF);
+  CHECK(strcmp(values[0], "u") == 0);
+  CHECK(strcmp(values[1], "p") == 0);
+  }
+CHECK(multipart_parse(pool, "--XyZ\r\nContent-Disposition: form-data; name=\"user\"\r\n\r\n123456789\r\n--XyZ--", "XyZ", 3, &spec, 8) == APR_ENOSPC);
+apr_pool_destroy(pool);
+}
+
+// Собирает значения, переданные по частям, в строку вида имя=значение;
+static int chunk_values(const param_spec_t *spec, const char *name, apr_size_t name_len, const char *data, apr_size_t len,
+                        int last)
+{
+  char *out = (char *)spec->ctx;
+  apr_size_t n = strlen(out);
+  if (last)
+    snprintf(out + n, 512 - n, ";");
+  else
+    {
+    // Имя пишется перед первой порцией значения
+    if (!n || out[n - 1] == ';')
+      n += snprintf(out + n, 512 - n, "%.*s=", (int)name_len, name);
+    snprintf(out + n, 512 - n, "%.*s", (int)len, data);
+    }
+  return false;
+}
+
+TEST_CASE("JSON and multipart parsers stream every decoded value in chunk mode"){
+apr_initialize();
+apr_pool_t *pool;
+apr_pool_create(&pool, NULL);
+char out[512];
+param_spec_t spec = {NULL, 0, NULL, NULL, out, chunk_values};
+
+// Экранирование \uXXXX декодируется, значения передаются на любой глубине; пустые строки и литералы тоже
+const char *json = "{\"user\":\"admin\\u0027--\",\"a\":{\"b\":[1,\"x\\ty\",null]},\"pass\":\"\"}";
+for (apr_size_t step = 1; step <= strlen(json); step++)
+  {
+  out[0] = 0;
+  CHECK(json_parse(pool, json, step, &spec, 0) == APR_SUCCESS);
+  CHECK_MESSAGE(strcmp(out, "user=admin'--;b=1;b=x\ty;b=null;;") == 0, "step ", step, " got ", out);
+  }
+
+// В multipart передаются все поля, кроме файлов
+const char *body = "--XyZ\r\nContent-Disposition: form-data; name=\"user\"\r\n\r\nad\r\nmin'--\r\n"
+                   "--XyZ\r\nContent-Disposition: form-data; name=\"f\"; filename=\"a\"\r\n\r\nfile' or 1=1\r\n"
+                   "--XyZ\r\nContent-Disposition: form-data; name=\"pass\"\r\n\r\np\r\n--XyZ--\r\n";
+for (apr_size_t step = 1; step <= strlen(body); step++)
+  {
+  out[0] = 0;
+  CHECK(multipart_parse(pool, body, "XyZ", step, &spec, 0) == APR_SUCCESS);
+  CHECK_MESSAGE(strcmp(out, "user=ad\r\nmin'--;pass=p;") == 0, "step ", step, " got ", out);
+  }
+apr_pool_destroy(pool);
+}